@@ -14,6 +14,15 @@
 #include <sys/types.h>
 #include <cerrno>
 #include <atomic>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <chrono>
+#include <memory>
+#include <set>
+#include <algorithm>
 
 #include <boost/uuid/uuid.hpp>
 #include <boost/uuid/uuid_generators.hpp>
@@ -21,25 +30,61 @@
 #include "utility/sha256_hash.hpp"
 #include "utility/file_util.hpp"
 #include "utility/system.hpp"
+#include "block_tier.hpp"
 
 class BlockStorage
 {
   public:
     BlockStorage(std::string base_directory);
     BlockStorage(std::string base_directory, size_t block_granularity);
+    BlockStorage(std::string base_directory, size_t block_granularity, std::vector<std::string> stripe_directories);
     BlockStorage(const BlockStorage &block_storage);
     ~BlockStorage();
 
     int create_temporary_unique_block(char* name_template, uint64_t file_index);
     int create_temporary_unique_block(char* name_template, const char* original_path, uint64_t file_index);
     bool store_block(int fd, void* buffer, bool write_file, uint64_t file_index);
+    // Same, for a buffer whose hash is already known
+    bool store_block(int fd, void* buffer, bool write_file, uint64_t file_index, const std::string &block_hash);
+    // Removes a temporary block that will not be stored, e.g. an aborted write
+    bool discard_temporary_block(int fd);
     int get_block_fd(const char* hash, uint64_t file_index);
     char* get_block_hash(int fd);
     size_t get_block_granularity();
     std::string get_blocks_subdirectory(uint64_t file_index);
+    size_t get_num_stripes();
+    void for_each_block(std::function<void(size_t subdir_index, const std::string &hash)> visit);
+    std::string get_block_path(size_t subdir_index, const std::string &hash);
+    size_t get_files_per_subdirectory();
+    std::string get_base_directory();
+
+    // Registry of the versions created or opened on this store, the roots scanned by garbage
+    // collection. Stores created before the registry existed hold versions it does not list:
+    // the registry is complete only once they were adopted (see GarbageCollector::adopt_versions)
+    bool register_version(std::string version_metadata_path);
+    std::vector<std::string> get_registered_versions();
+    bool is_registry_complete();
+    bool set_registry_complete();
+
+    // Node-local cache of blocks (e.g., on a RAM disk), looked up before the store when opening blocks
+    void set_read_cache(std::string cache_directory);
+    std::shared_ptr<BlockTier> get_read_cache();
+
+    // Temporary blocks are written with O_DIRECT, bypassing the page cache, where supported
+    void set_direct_io(bool direct_io);
+
+    // Tiering: new blocks land in the (fast) stripe directories and are demoted to the capacity tier
+    void set_capacity_tier(std::string tier_specification);
+    bool has_capacity_tier();
+    std::shared_ptr<BlockTier> get_capacity_tier();
+    size_t demote_blocks(size_t min_age_seconds);
+    void start_demotion(size_t min_age_seconds);
+    void stop_demotion();
 
   private:
     std::string base_directory;
+    // Root directories blocks are striped over, stripe_directories[0] is base_directory
+    std::vector<std::string> stripe_directories;
     size_t block_granularity;
     std::map<int, std::string> block_fd_hash;
     std::map<int, std::string> block_fd_temp_name;
@@ -49,6 +94,14 @@ class BlockStorage
     std::mutex create_block_directory_mutex;
     size_t files_per_subdirectory = 1024;
     // std::atomic<size_t> num_files = 0;
+    std::shared_ptr<BlockTier> capacity_tier;
+    std::shared_ptr<BlockTier> read_cache;
+    bool direct_io = false;
+    bool promote_block(size_t subdir_index, const std::string &hash, const std::string &fast_path);
+    std::thread demotion_thread;
+    std::mutex demotion_mutex;
+    std::condition_variable demotion_condition;
+    bool demotion_running = false;
 };
 
 BlockStorage::BlockStorage(std::string base_directory_path){
@@ -73,6 +126,32 @@ BlockStorage::BlockStorage(std::string base_directory_path){
     exit(-1);
   }
   block_granularity = std::stol(granularity_string);
+
+  // Read stripe directories, a store without a stripes file lives in base_directory only
+  stripe_directories.push_back(base_directory);
+  std::string stripes_file_name = base_directory + "/_stripes";
+  std::ifstream stripes_file;
+  stripes_file.open(stripes_file_name);
+  if (stripes_file.is_open()){
+    std::string stripe_directory;
+    while (std::getline(stripes_file, stripe_directory)){
+      if (!stripe_directory.empty()){
+        stripe_directories.push_back(stripe_directory);
+      }
+    }
+  }
+
+  // Read capacity tier specification if the store is tiered
+  std::string capacity_tier_file_name = base_directory + "/_capacity_tier";
+  std::ifstream capacity_tier_file;
+  capacity_tier_file.open(capacity_tier_file_name);
+  std::string capacity_tier_specification;
+  if (capacity_tier_file.is_open() && std::getline(capacity_tier_file, capacity_tier_specification)){
+    capacity_tier = make_block_tier(capacity_tier_specification);
+    if (capacity_tier == nullptr){
+      exit(-1);
+    }
+  }
   // store_block_mutex =  new std::mutex(); // bip::named_mutex(bip::open_or_create, "store_block_mutex");
   // std::cout << "BlockStorage: Base directory path = " << base_directory << std::endl;
 }
@@ -98,6 +177,8 @@ BlockStorage::BlockStorage(std::string base_directory_path, const size_t block_g
       granularity_file.open(granularity_file_name);
       granularity_file << block_granularity;
       granularity_file.close();
+      // A new store registers all its versions
+      set_registry_complete();
     }
     else{
       std::cerr << "BlockStorage: Error - Blocks directory already exists" << std::endl;
@@ -108,16 +189,43 @@ BlockStorage::BlockStorage(std::string base_directory_path, const size_t block_g
     std::cerr << "BlockStorage: Error -  Blocks directory already exists" << std::endl;
     exit(-1);
   } */
+  stripe_directories.push_back(base_directory);
   // store_block_mutex =  new std::mutex(); // bip::named_mutex(bip::open_or_create, "store_block_mutex");
 }
 
+BlockStorage::BlockStorage(std::string base_directory_path, const size_t block_granularity_arg, std::vector<std::string> stripe_directories_arg)
+  : BlockStorage(base_directory_path, block_granularity_arg){
+  // Create stripe roots and record them so that opening the store finds them again
+  std::string stripes_file_name = base_directory + "/_stripes";
+  std::ofstream stripes_file;
+  stripes_file.open(stripes_file_name);
+  for (std::string stripe_directory : stripe_directories_arg){
+    if (stripe_directory.empty() || stripe_directory.compare(base_directory) == 0){
+      continue;
+    }
+    if (!utility::directory_exists(stripe_directory.c_str())){
+      if (!utility::create_directory(stripe_directory.c_str())){
+        std::cerr << "BlockStorage: Error - Failed to create stripe directory " << stripe_directory << std::endl;
+        exit(-1);
+      }
+    }
+    stripe_directories.push_back(stripe_directory);
+    stripes_file << stripe_directory << std::endl;
+  }
+  stripes_file.close();
+}
+
 // Copy Constructor
 BlockStorage::BlockStorage(const BlockStorage &block_storage){
   // std::cout << "BlockStorage: Calling Copy Constructor" << std::endl;
   base_directory = block_storage.base_directory;
+  stripe_directories = block_storage.stripe_directories;
   block_granularity = block_storage.block_granularity;
   block_fd_hash = block_storage.block_fd_hash;
   block_fd_temp_name = block_storage.block_fd_temp_name;
+  capacity_tier = block_storage.capacity_tier;
+  read_cache = block_storage.read_cache;
+  direct_io = block_storage.direct_io;
   // store_block_mutex =  new std::mutex();// block_storage.store_block_mutex; // new bip::named_mutex(bip::open_or_create, "store_block_mutex");
   /* store_block_mutex = block_storage.store_block_mutex;
   create_block_directory_mutex = block_storage.create_block_directory_mutex; */
@@ -126,6 +234,7 @@ BlockStorage::BlockStorage(const BlockStorage &block_storage){
 
 
 BlockStorage::~BlockStorage(){
+  stop_demotion();
   // bip::named_mutex::remove("store_block_mutex");
   // delete store_block_mutex;
 }
@@ -148,6 +257,11 @@ int BlockStorage::create_temporary_unique_block(char* name_template, uint64_t fi
     std::cerr << "Block Storage: Error sizing file" << std::endl;
     return -1;
   }
+  if (direct_io){
+    // Blocks are written page-aligned from page-aligned memory; file systems without O_DIRECT
+    // (e.g., tmpfs) reject the flag and keep buffered writes
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT);
+  }
   if (block_fd_temp_name.find(fd) == block_fd_temp_name.end()){
     block_fd_temp_name.insert(std::pair<int, std::string>(fd, std::string(temporary_file_name_template)));
   }
@@ -193,6 +307,10 @@ int BlockStorage::create_temporary_unique_block(char* name_template, const char*
 }
 
 bool BlockStorage::store_block(int fd, void* buffer, bool write_to_file, uint64_t file_index){
+  return store_block(fd, buffer, write_to_file, file_index, utility::compute_hash((char*) buffer, block_granularity));
+}
+
+bool BlockStorage::store_block(int fd, void* buffer, bool write_to_file, uint64_t file_index, const std::string &block_hash){
   if (block_fd_temp_name.find(fd) == block_fd_temp_name.end()){
     std::cerr << "BlockStorage: Error - No open file descriptor for this block" << std::endl;
     std::cerr << "fd = " << fd << std::endl;
@@ -200,7 +318,6 @@ bool BlockStorage::store_block(int fd, void* buffer, bool write_to_file, uint64_
   }
 
   std::string subdirectory_name = get_blocks_subdirectory(file_index);
-  std::string block_hash = utility::compute_hash((char*) buffer, block_granularity);
   if ( block_fd_hash.find(fd) ==  block_fd_hash.end()){
     block_fd_hash.insert(std::pair<int, std::string>(fd, std::string(block_hash)));
   }
@@ -218,11 +335,22 @@ bool BlockStorage::store_block(int fd, void* buffer, bool write_to_file, uint64_
   // if (!utility::file_exists(final_filename.c_str())){
     // std::lock_guard<std::mutex> store_lock(*store_block_mutex);
     // bip::scoped_lock<bip::named_mutex> lock(*store_block_mutex);
-    if (!utility::file_exists(final_filename.c_str())){
+    // An existing block is touched before it is reused, so the garbage collector sees it as recently
+    // referenced; if it was collected (or demoted) meanwhile, store our own copy instead
+    int existing_fd = -1;
+    if (utility::file_exists(final_filename.c_str()) && utimensat(AT_FDCWD, final_filename.c_str(), nullptr, 0) == 0){
+      existing_fd = ::open(final_filename.c_str(), O_RDONLY);
+    }
+    if (existing_fd == -1){
       // Write
       if (write_to_file){
-        size_t written = pwrite(fd ,buffer, block_granularity, 0);
-        if (written == -1){
+        ssize_t written = pwrite(fd ,buffer, block_granularity, 0);
+        if (written == -1 && errno == EINVAL && direct_io){
+          // Unaligned buffer, not writable with O_DIRECT
+          fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+          written = pwrite(fd ,buffer, block_granularity, 0);
+        }
+        if (written != (ssize_t) block_granularity){
           std::cerr << "BlockStorage: Error writing to file" << std::endl;
           // store_block_mutex->unlock();
           return false;
@@ -233,18 +361,8 @@ bool BlockStorage::store_block(int fd, void* buffer, bool write_to_file, uint64_
       // std::cout << "final_filename = " << final_filename << std::endl;
       int rename_status = rename(temporary_filename.c_str(),final_filename.c_str());
       if (rename_status != 0){
-        if (utility::file_exists(final_filename.c_str())){
-          int remove_status = remove(temporary_filename.c_str());
-          if (remove_status != 0){
-            std::cerr << "BlockStorage: Error removing temporary file" << std::endl;
-            return false;
-          }
-          return true;
-        }
-        else{
-          std::cerr << "BlockStorage: Error renaming file " << strerror(errno) << std::endl;
-          std::cerr << "Temporary file name = " << temporary_filename << std::endl;
-        }
+        std::cerr << "BlockStorage: Error renaming file " << strerror(errno) << std::endl;
+        std::cerr << "Temporary file name = " << temporary_filename << std::endl;
         return false;
       }
     }
@@ -254,6 +372,13 @@ bool BlockStorage::store_block(int fd, void* buffer, bool write_to_file, uint64_
         std::cerr << "BlockStorage: Error removing temporary file" << std::endl;
         return false;
       }
+      // Point fd at the stored block so callers mapping fd see the block content
+      int dup_status = dup2(existing_fd, fd);
+      ::close(existing_fd);
+      if (dup_status == -1){
+        std::cerr << "BlockStorage: Error reusing existing block " << strerror(errno) << std::endl;
+        return false;
+      }
     }
   // }
   /* else{
@@ -266,13 +391,239 @@ bool BlockStorage::store_block(int fd, void* buffer, bool write_to_file, uint64_
   return true;
 }
 
+bool BlockStorage::discard_temporary_block(int fd){
+  if (block_fd_temp_name.find(fd) == block_fd_temp_name.end()){
+    std::cerr << "BlockStorage: Error - No open file descriptor for this block" << std::endl;
+    return false;
+  }
+  int remove_status = remove(block_fd_temp_name[fd].c_str());
+  block_fd_temp_name.erase(fd);
+  if (remove_status != 0){
+    std::cerr << "BlockStorage: Error removing temporary file " << strerror(errno) << std::endl;
+    return false;
+  }
+  return true;
+}
+
 int BlockStorage::get_block_fd(const char* hash, uint64_t file_index){
+  if (read_cache != nullptr){
+    int cached_block_fd = read_cache->open_block(file_index % files_per_subdirectory, std::string(hash));
+    if (cached_block_fd != -1){
+      return cached_block_fd;
+    }
+  }
   std::string subdirectory_name = get_blocks_subdirectory(file_index);
   std::string filename = subdirectory_name + "/" + std::string(hash);
   int block_fd = ::open(filename.c_str(), O_RDONLY, (mode_t) 0666);
+  if (block_fd == -1 && errno == ENOENT && capacity_tier != nullptr){
+    if (promote_block(file_index % files_per_subdirectory, std::string(hash), filename)){
+      block_fd = ::open(filename.c_str(), O_RDONLY, (mode_t) 0666);
+    }
+  }
   return block_fd;
 }
 
+bool BlockStorage::promote_block(size_t subdir_index, const std::string &hash, const std::string &fast_path){
+  int capacity_fd = capacity_tier->open_block(subdir_index, hash);
+  if (capacity_fd == -1){
+    errno = ENOENT;
+    return false;
+  }
+  bool status = publish_block_file(fast_path, capacity_fd, block_granularity);
+  ::close(capacity_fd);
+  return status;
+}
+
+void BlockStorage::for_each_block(std::function<void(size_t subdir_index, const std::string &hash)> visit){
+  for (std::string stripe_directory : stripe_directories){
+    DirectoryTier stripe(stripe_directory);
+    stripe.for_each_block(visit);
+  }
+}
+
+std::string BlockStorage::get_block_path(size_t subdir_index, const std::string &hash){
+  std::string stripe_directory = stripe_directories[subdir_index % stripe_directories.size()];
+  return stripe_directory + "/" + std::to_string(subdir_index) + "/" + hash;
+}
+
+size_t BlockStorage::get_files_per_subdirectory(){
+  return files_per_subdirectory;
+}
+
+std::string BlockStorage::get_base_directory(){
+  return base_directory;
+}
+
+bool BlockStorage::register_version(std::string version_metadata_path){
+  std::error_code ec;
+  std::string version_path = std::filesystem::absolute(version_metadata_path, ec).lexically_normal().string();
+  // Versions are registered each time they are opened, keep one entry per version
+  std::vector<std::string> registered_versions = get_registered_versions();
+  if (std::find(registered_versions.begin(), registered_versions.end(), version_path) != registered_versions.end()){
+    return true;
+  }
+  std::string entry = version_path + "\n";
+  std::string versions_file_name = base_directory + "/_versions";
+  // Single appending write, so concurrent writers never interleave entries
+  int fd = ::open(versions_file_name.c_str(), O_WRONLY | O_CREAT | O_APPEND, (mode_t) 0666);
+  if (fd == -1){
+    std::cerr << "BlockStorage: Error opening versions registry " << strerror(errno) << std::endl;
+    return false;
+  }
+  ssize_t written = ::write(fd, entry.c_str(), entry.length());
+  ::close(fd);
+  return written == (ssize_t) entry.length();
+}
+
+std::vector<std::string> BlockStorage::get_registered_versions(){
+  std::vector<std::string> versions;
+  std::set<std::string> seen;
+  std::ifstream versions_file(base_directory + "/_versions");
+  std::string version_path;
+  while (std::getline(versions_file, version_path)){
+    if (!version_path.empty() && seen.insert(version_path).second){
+      versions.push_back(version_path);
+    }
+  }
+  return versions;
+}
+
+bool BlockStorage::is_registry_complete(){
+  return utility::file_exists((base_directory + "/_versions_complete").c_str());
+}
+
+bool BlockStorage::set_registry_complete(){
+  int fd = ::open((base_directory + "/_versions_complete").c_str(), O_WRONLY | O_CREAT, (mode_t) 0666);
+  if (fd == -1){
+    std::cerr << "BlockStorage: Error marking the versions registry complete " << strerror(errno) << std::endl;
+    return false;
+  }
+  ::close(fd);
+  return true;
+}
+
+void BlockStorage::set_capacity_tier(std::string tier_specification){
+  capacity_tier = make_block_tier(tier_specification);
+  if (capacity_tier == nullptr){
+    exit(-1);
+  }
+  std::string capacity_tier_file_name = base_directory + "/_capacity_tier";
+  std::ofstream capacity_tier_file;
+  capacity_tier_file.open(capacity_tier_file_name);
+  capacity_tier_file << capacity_tier->description();
+  capacity_tier_file.close();
+}
+
+void BlockStorage::set_read_cache(std::string cache_directory){
+  read_cache = std::make_shared<DirectoryTier>(cache_directory);
+}
+
+std::shared_ptr<BlockTier> BlockStorage::get_read_cache(){
+  return read_cache;
+}
+
+void BlockStorage::set_direct_io(bool direct_io_arg){
+  direct_io = direct_io_arg;
+}
+
+bool BlockStorage::has_capacity_tier(){
+  return capacity_tier != nullptr;
+}
+
+std::shared_ptr<BlockTier> BlockStorage::get_capacity_tier(){
+  return capacity_tier;
+}
+
+// Moves blocks not accessed for min_age_seconds to the capacity tier. Blocks are copied before
+// they are removed from the fast tier, so a concurrent reader always finds the block in one tier,
+// and existing mappings keep the (unlinked) fast copy alive. Blocks reused by a writer meanwhile
+// keep their fast copy.
+size_t BlockStorage::demote_blocks(size_t min_age_seconds){
+  if (capacity_tier == nullptr){
+    return 0;
+  }
+  time_t now = time(nullptr);
+  size_t num_demoted = 0;
+  for (std::string stripe_directory : stripe_directories){
+    DirectoryTier stripe(stripe_directory);
+    stripe.for_each_block([&](size_t subdir_index, const std::string &hash){
+      std::string block_path = stripe_directory + "/" + std::to_string(subdir_index) + "/" + hash;
+      struct stat st;
+      if (stat(block_path.c_str(), &st) != 0){
+        return;
+      }
+      time_t last_access = std::max(st.st_atime, st.st_mtime);
+      if ((size_t) (now - last_access) < min_age_seconds){
+        return;
+      }
+      if (!capacity_tier->contains(subdir_index, hash)){
+        int fd = ::open(block_path.c_str(), O_RDONLY);
+        if (fd == -1){
+          return;
+        }
+        bool status = capacity_tier->put_block(subdir_index, hash, fd, st.st_size);
+        ::close(fd);
+        if (!status){
+          std::cerr << "BlockStorage: Error demoting block " << block_path << std::endl;
+          return;
+        }
+      }
+      // As in garbage collection: move the block aside, then check it was not reused (touched by
+      // store_block) since it was found old enough, otherwise the fast copy stays
+      std::string demoted_path = block_path + "_demoted";
+      if (rename(block_path.c_str(), demoted_path.c_str()) != 0){
+        return;
+      }
+      struct stat demoted_st;
+      bool touched = stat(demoted_path.c_str(), &demoted_st) != 0
+                     || demoted_st.st_mtim.tv_sec != st.st_mtim.tv_sec || demoted_st.st_mtim.tv_nsec != st.st_mtim.tv_nsec;
+      if (touched){
+        if (!utility::file_exists(block_path.c_str())){
+          rename(demoted_path.c_str(), block_path.c_str());
+        }
+        else{
+          remove(demoted_path.c_str());
+        }
+        return;
+      }
+      if (remove(demoted_path.c_str()) == 0){
+        num_demoted++;
+      }
+    });
+  }
+  return num_demoted;
+}
+
+void BlockStorage::start_demotion(size_t min_age_seconds){
+  if (capacity_tier == nullptr || demotion_running){
+    return;
+  }
+  demotion_running = true;
+  demotion_thread = std::thread([this, min_age_seconds](){
+    std::unique_lock<std::mutex> lock(demotion_mutex);
+    std::chrono::seconds interval(std::max((size_t) 1, min_age_seconds / 2));
+    while (demotion_running){
+      if (demotion_condition.wait_for(lock, interval, [this](){ return !demotion_running; })){
+        break;
+      }
+      lock.unlock();
+      demote_blocks(min_age_seconds);
+      lock.lock();
+    }
+  });
+}
+
+void BlockStorage::stop_demotion(){
+  {
+    std::lock_guard<std::mutex> lock(demotion_mutex);
+    demotion_running = false;
+  }
+  demotion_condition.notify_all();
+  if (demotion_thread.joinable()){
+    demotion_thread.join();
+  }
+}
+
 char* BlockStorage::get_block_hash(int fd){
   if (block_fd_hash.find(fd) == block_fd_hash.end()){
     std::string empty_string = "";
@@ -287,9 +638,18 @@ size_t BlockStorage::get_block_granularity(){
   return block_granularity;
 }
 
+size_t BlockStorage::get_num_stripes(){
+  return stripe_directories.size();
+}
+
 std::string BlockStorage::get_blocks_subdirectory(uint64_t file_index){
   size_t subdir_index = file_index % files_per_subdirectory;
-  std::string subdir_name = base_directory + "/" + std::to_string(subdir_index);
+  // Subdirectories are dealt round-robin over stripes, so neighbouring blocks (which msync
+  // and open process concurrently) land on different devices. Placement is keyed by file index
+  // rather than content hash since temporary blocks are renamed in place and must be created
+  // on the device that will hold the final block.
+  std::string stripe_directory = stripe_directories[subdir_index % stripe_directories.size()];
+  std::string subdir_name = stripe_directory + "/" + std::to_string(subdir_index);
   if (!utility::directory_exists(subdir_name.c_str())){
     if (!utility::create_directory(subdir_name.c_str())){
         std::cerr << "Error: Failed to create blocks subdirectory" << std::endl;
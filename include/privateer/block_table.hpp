@@ -0,0 +1,316 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <iostream>
+
+#include "utility/sha256_hash.hpp"
+#include "recipe.hpp"
+
+// Block digests of a region (its file recipe), as a sparse two-level radix table.
+//
+// Each leaf holds the digests of one recipe page and is only allocated once an entry in it is
+// set. Entries of unallocated leaves are read from the base recipe, the version's digests
+// mapped read-only, or are empty beyond it. Leaves record which entries changed since the
+// version was last written (dirty entries), so updating a recipe only writes changed pages
+// and a delta only holds changed entries.
+// Entries may be set concurrently from several threads.
+class BlockTable
+{
+  public:
+    static constexpr size_t LEAF_ENTRIES = 4096 / utility::DIGEST_SIZE;
+
+    BlockTable(size_t num_entries);
+    ~BlockTable();
+
+    // Uses num_base_entries digests at offset of an open file as base; they must stay unchanged
+    // except through write_dirty on this table
+    bool map_base(int fd, off_t offset, size_t num_base_entries, uint64_t base_checksum);
+    // Reads num_entries digests at offset of an open file into the table instead, for files
+    // that may change while in use
+    bool read_entries(int fd, off_t offset, size_t num_entries, uint64_t base_checksum);
+    const unsigned char* get(size_t index);
+    void set(size_t index, const unsigned char* digest);
+    bool is_empty(size_t index);
+    size_t num_entries();
+    // Recipe digests checksum (see Recipe::entry_checksum) of the current entries
+    uint64_t checksum();
+    // The same checksum, computed from the entries below num_entries
+    uint64_t recompute_checksum(size_t num_entries);
+
+    // Writes leaves with dirty entries below num_entries to a recipe file.
+    // With clear_dirty the entries are considered written back.
+    bool write_dirty(int recipe_fd, size_t num_entries, bool clear_dirty);
+    // Writes every entry below num_entries as packed digests starting at offset
+    bool write_all(int fd, size_t num_entries, off_t offset = Recipe::HEADER_SIZE);
+    size_t num_dirty(size_t num_entries);
+    void for_each_dirty(size_t num_entries, std::function<void(size_t index, const unsigned char* digest)> visit);
+    void clear_dirty();
+
+  private:
+    struct Leaf
+    {
+      unsigned char digests[LEAF_ENTRIES][utility::DIGEST_SIZE];
+      std::atomic<uint64_t> dirty[LEAF_ENTRIES / 64];
+    };
+
+    size_t m_num_entries;
+    size_t num_leaves;
+    std::atomic<Leaf*>* leaves;
+    const unsigned char* base;
+    void* base_mapping; // Page aligned start of the mapping holding base
+    size_t base_length;
+    size_t num_base_entries;
+    std::atomic<uint64_t> m_checksum;
+
+    Leaf* get_or_allocate_leaf(size_t leaf_index);
+    bool write_leaf(int fd, size_t leaf_index, size_t num_entries, off_t offset);
+};
+
+static const unsigned char EMPTY_DIGEST[utility::DIGEST_SIZE] = {0};
+
+inline BlockTable::BlockTable(size_t num_entries_arg){
+  m_num_entries = num_entries_arg;
+  num_leaves = (m_num_entries + LEAF_ENTRIES - 1) / LEAF_ENTRIES;
+  leaves = new std::atomic<Leaf*>[num_leaves];
+  for (size_t i = 0; i < num_leaves; i++){
+    leaves[i].store(nullptr, std::memory_order_relaxed);
+  }
+  base = nullptr;
+  base_mapping = nullptr;
+  base_length = 0;
+  num_base_entries = 0;
+  m_checksum = 0;
+}
+
+inline BlockTable::~BlockTable(){
+  for (size_t i = 0; i < num_leaves; i++){
+    delete leaves[i].load();
+  }
+  delete [] leaves;
+  if (base_mapping != nullptr){
+    munmap(base_mapping, base_length);
+  }
+}
+
+inline bool BlockTable::map_base(int fd, off_t offset, size_t num_base_entries_arg, uint64_t base_checksum){
+  m_checksum = base_checksum;
+  if (num_base_entries_arg == 0){
+    return true;
+  }
+  // Mapping offsets must be multiples of the system page size, which may exceed 4 KiB
+  size_t pagesize = sysconf(_SC_PAGE_SIZE);
+  off_t mapping_offset = offset - offset % pagesize;
+  size_t length = (offset - mapping_offset) + num_base_entries_arg*utility::DIGEST_SIZE;
+  base_length = ((length + pagesize - 1) / pagesize) * pagesize;
+  void* mapped = mmap(nullptr, base_length, PROT_READ, MAP_SHARED, fd, mapping_offset);
+  if (mapped == MAP_FAILED){
+    std::cerr << "BlockTable: mmap error - " << strerror(errno) << std::endl;
+    return false;
+  }
+  base_mapping = mapped;
+  base = (const unsigned char*) mapped + (offset - mapping_offset);
+  num_base_entries = std::min(num_base_entries_arg, m_num_entries);
+  return true;
+}
+
+inline bool BlockTable::read_entries(int fd, off_t offset, size_t num_entries_arg, uint64_t base_checksum){
+  m_checksum = base_checksum;
+  size_t num_read_leaves = (std::min(num_entries_arg, m_num_entries) + LEAF_ENTRIES - 1) / LEAF_ENTRIES;
+  unsigned char buffer[LEAF_ENTRIES*utility::DIGEST_SIZE];
+  for (size_t i = 0; i < num_read_leaves; i++){
+    size_t count = std::min(LEAF_ENTRIES, num_entries_arg - i*LEAF_ENTRIES);
+    size_t length = count*utility::DIGEST_SIZE;
+    if (::pread(fd, buffer, length, offset + i*LEAF_ENTRIES*utility::DIGEST_SIZE) != (ssize_t) length){
+      std::cerr << "BlockTable: Error reading digests - " << strerror(errno) << std::endl;
+      return false;
+    }
+    // Leaves of empty entries only are not allocated
+    bool all_empty = true;
+    for (size_t j = 0; j < length && all_empty; j++){
+      all_empty = (buffer[j] == 0);
+    }
+    if (!all_empty){
+      memcpy(get_or_allocate_leaf(i)->digests, buffer, length);
+    }
+  }
+  return true;
+}
+
+inline BlockTable::Leaf* BlockTable::get_or_allocate_leaf(size_t leaf_index){
+  Leaf* leaf = leaves[leaf_index].load(std::memory_order_acquire);
+  if (leaf != nullptr){
+    return leaf;
+  }
+  Leaf* new_leaf = new Leaf();
+  memset(new_leaf->digests, 0, sizeof(new_leaf->digests));
+  size_t first_entry = leaf_index*LEAF_ENTRIES;
+  if (first_entry < num_base_entries){
+    size_t count = std::min(LEAF_ENTRIES, num_base_entries - first_entry);
+    memcpy(new_leaf->digests, base + first_entry*utility::DIGEST_SIZE, count*utility::DIGEST_SIZE);
+  }
+  for (size_t i = 0; i < LEAF_ENTRIES / 64; i++){
+    new_leaf->dirty[i] = 0;
+  }
+  if (!leaves[leaf_index].compare_exchange_strong(leaf, new_leaf, std::memory_order_acq_rel)){
+    // Another thread allocated it first
+    delete new_leaf;
+    return leaf;
+  }
+  return new_leaf;
+}
+
+inline const unsigned char* BlockTable::get(size_t index){
+  Leaf* leaf = leaves[index / LEAF_ENTRIES].load(std::memory_order_acquire);
+  if (leaf != nullptr){
+    return leaf->digests[index % LEAF_ENTRIES];
+  }
+  if (index < num_base_entries){
+    return base + index*utility::DIGEST_SIZE;
+  }
+  return EMPTY_DIGEST;
+}
+
+inline void BlockTable::set(size_t index, const unsigned char* digest){
+  Leaf* leaf = get_or_allocate_leaf(index / LEAF_ENTRIES);
+  unsigned char* entry = leaf->digests[index % LEAF_ENTRIES];
+  if (memcmp(entry, digest, utility::DIGEST_SIZE) == 0){
+    return;
+  }
+  m_checksum.fetch_xor(Recipe::entry_checksum(index, entry) ^ Recipe::entry_checksum(index, digest));
+  memcpy(entry, digest, utility::DIGEST_SIZE);
+  size_t entry_index = index % LEAF_ENTRIES;
+  leaf->dirty[entry_index / 64].fetch_or(1ULL << (entry_index % 64));
+}
+
+inline bool BlockTable::is_empty(size_t index){
+  return utility::is_empty_digest(get(index));
+}
+
+inline size_t BlockTable::num_entries(){
+  return m_num_entries;
+}
+
+inline uint64_t BlockTable::checksum(){
+  return m_checksum.load();
+}
+
+inline uint64_t BlockTable::recompute_checksum(size_t num_entries){
+  uint64_t computed_checksum = 0;
+  for (size_t i = 0; i < std::min(num_entries, m_num_entries); i++){
+    computed_checksum ^= Recipe::entry_checksum(i, get(i));
+  }
+  return computed_checksum;
+}
+
+inline bool BlockTable::write_leaf(int fd, size_t leaf_index, size_t num_entries, off_t offset){
+  size_t first_entry = leaf_index*LEAF_ENTRIES;
+  size_t count = std::min(LEAF_ENTRIES, num_entries - first_entry);
+  Leaf* leaf = leaves[leaf_index].load(std::memory_order_acquire);
+  const unsigned char* source = leaf != nullptr ? leaf->digests[0] : get(first_entry);
+  static const unsigned char empty_leaf[LEAF_ENTRIES*utility::DIGEST_SIZE] = {0};
+  if (leaf == nullptr && first_entry >= num_base_entries){
+    source = empty_leaf;
+  }
+  else if (leaf == nullptr && first_entry + count > num_base_entries){
+    // Straddles the end of the base: write its part, then the empty rest
+    size_t base_count = num_base_entries - first_entry;
+    size_t base_length = base_count*utility::DIGEST_SIZE;
+    if (::pwrite(fd, source, base_length, offset + first_entry*utility::DIGEST_SIZE) != (ssize_t) base_length){
+      std::cerr << "BlockTable: Error writing digests - " << strerror(errno) << std::endl;
+      return false;
+    }
+    first_entry += base_count;
+    count -= base_count;
+    source = empty_leaf;
+  }
+  size_t length = count*utility::DIGEST_SIZE;
+  ssize_t written = ::pwrite(fd, source, length, offset + first_entry*utility::DIGEST_SIZE);
+  if (written != (ssize_t) length){
+    std::cerr << "BlockTable: Error writing digests - " << strerror(errno) << std::endl;
+    return false;
+  }
+  return true;
+}
+
+inline bool BlockTable::write_dirty(int recipe_fd, size_t num_entries, bool clear_dirty){
+  size_t num_used_leaves = (std::min(num_entries, m_num_entries) + LEAF_ENTRIES - 1) / LEAF_ENTRIES;
+  for (size_t i = 0; i < num_used_leaves; i++){
+    Leaf* leaf = leaves[i].load(std::memory_order_acquire);
+    if (leaf == nullptr){
+      continue;
+    }
+    // Clear before writing, so entries set while writing stay dirty
+    uint64_t dirty[LEAF_ENTRIES / 64];
+    bool any_dirty = false;
+    for (size_t j = 0; j < LEAF_ENTRIES / 64; j++){
+      dirty[j] = clear_dirty ? leaf->dirty[j].exchange(0) : leaf->dirty[j].load();
+      any_dirty |= (dirty[j] != 0);
+    }
+    if (any_dirty && !write_leaf(recipe_fd, i, num_entries, Recipe::HEADER_SIZE)){
+      for (size_t j = 0; j < LEAF_ENTRIES / 64 && clear_dirty; j++){
+        leaf->dirty[j].fetch_or(dirty[j]);
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+inline bool BlockTable::write_all(int fd, size_t num_entries, off_t offset){
+  size_t num_used_leaves = (std::min(num_entries, m_num_entries) + LEAF_ENTRIES - 1) / LEAF_ENTRIES;
+  for (size_t i = 0; i < num_used_leaves; i++){
+    if (!write_leaf(fd, i, num_entries, offset)){
+      return false;
+    }
+  }
+  return true;
+}
+
+inline size_t BlockTable::num_dirty(size_t num_entries){
+  size_t count = 0;
+  for_each_dirty(num_entries, [&](size_t, const unsigned char*){
+    count++;
+  });
+  return count;
+}
+
+inline void BlockTable::for_each_dirty(size_t num_entries, std::function<void(size_t index, const unsigned char* digest)> visit){
+  size_t num_used_leaves = (std::min(num_entries, m_num_entries) + LEAF_ENTRIES - 1) / LEAF_ENTRIES;
+  for (size_t i = 0; i < num_used_leaves; i++){
+    Leaf* leaf = leaves[i].load(std::memory_order_acquire);
+    if (leaf == nullptr){
+      continue;
+    }
+    for (size_t j = 0; j < LEAF_ENTRIES / 64; j++){
+      uint64_t dirty = leaf->dirty[j].load();
+      while (dirty != 0){
+        size_t entry_index = j*64 + __builtin_ctzll(dirty);
+        dirty &= dirty - 1;
+        size_t index = i*LEAF_ENTRIES + entry_index;
+        if (index < num_entries){
+          visit(index, leaf->digests[entry_index]);
+        }
+      }
+    }
+  }
+}
+
+inline void BlockTable::clear_dirty(){
+  for (size_t i = 0; i < num_leaves; i++){
+    Leaf* leaf = leaves[i].load(std::memory_order_acquire);
+    for (size_t j = 0; leaf != nullptr && j < LEAF_ENTRIES / 64; j++){
+      leaf->dirty[j] = 0;
+    }
+  }
+}
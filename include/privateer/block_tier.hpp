@@ -0,0 +1,249 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "utility/file_util.hpp"
+
+// Storage tier holding immutable, content-addressed blocks.
+// A block is identified by the blocks subdirectory index it belongs to and its hash.
+class BlockTier
+{
+  public:
+    virtual ~BlockTier(){}
+    virtual bool contains(size_t subdir_index, const std::string &hash) = 0;
+    // Returns a read-only file descriptor for the block or -1 if the tier does not hold it
+    virtual int open_block(size_t subdir_index, const std::string &hash) = 0;
+    // Atomically publishes length bytes read from source_fd as the given block
+    virtual bool put_block(size_t subdir_index, const std::string &hash, int source_fd, size_t length) = 0;
+    virtual bool remove_block(size_t subdir_index, const std::string &hash) = 0;
+    virtual void for_each_block(std::function<void(size_t subdir_index, const std::string &hash)> visit) = 0;
+    virtual std::string description() = 0;
+};
+
+// Blocks laid out as <root>/<subdir_index>/<hash>, the same layout as the fast tier,
+// e.g. a directory on a parallel file system
+class DirectoryTier : public BlockTier
+{
+  public:
+    DirectoryTier(std::string root_directory);
+    bool contains(size_t subdir_index, const std::string &hash);
+    int open_block(size_t subdir_index, const std::string &hash);
+    bool put_block(size_t subdir_index, const std::string &hash, int source_fd, size_t length);
+    bool remove_block(size_t subdir_index, const std::string &hash);
+    void for_each_block(std::function<void(size_t subdir_index, const std::string &hash)> visit);
+    std::string description();
+
+  private:
+    std::string root_directory;
+    std::string block_path(size_t subdir_index, const std::string &hash);
+};
+
+// Local stand-in for an object store bucket: a flat key space of whole objects named
+// <subdir_index>.<hash>, uploaded through a staging area and published with a single rename
+class ObjectStoreTier : public BlockTier
+{
+  public:
+    ObjectStoreTier(std::string bucket_directory);
+    bool contains(size_t subdir_index, const std::string &hash);
+    int open_block(size_t subdir_index, const std::string &hash);
+    bool put_block(size_t subdir_index, const std::string &hash, int source_fd, size_t length);
+    bool remove_block(size_t subdir_index, const std::string &hash);
+    void for_each_block(std::function<void(size_t subdir_index, const std::string &hash)> visit);
+    std::string description();
+
+  private:
+    std::string bucket_directory;
+    std::string object_key(size_t subdir_index, const std::string &hash);
+};
+
+// Tier specifications have the form "directory:<path>" or "object:<path>"
+inline std::shared_ptr<BlockTier> make_block_tier(std::string specification){
+  size_t separator = specification.find(':');
+  if (separator == std::string::npos){
+    std::cerr << "BlockTier: Error - Invalid tier specification " << specification << std::endl;
+    return nullptr;
+  }
+  std::string type = specification.substr(0, separator);
+  std::string path = specification.substr(separator + 1);
+  if (type.compare("directory") == 0){
+    return std::make_shared<DirectoryTier>(path);
+  }
+  if (type.compare("object") == 0){
+    return std::make_shared<ObjectStoreTier>(path);
+  }
+  std::cerr << "BlockTier: Error - Unknown tier type " << type << std::endl;
+  return nullptr;
+}
+
+inline bool is_block_hash_name(const char* name){
+  if (strlen(name) != 64){
+    return false;
+  }
+  for (int i = 0; i < 64; i++){
+    if (!isxdigit(name[i])){
+      return false;
+    }
+  }
+  return true;
+}
+
+// Copies a block into path through a temporary file and a rename, so readers never see partial blocks
+inline bool publish_block_file(const std::string &path, int source_fd, size_t length){
+  std::string temporary_path = path + "_temp_XXXXXX";
+  int fd = mkstemp((char*) temporary_path.c_str());
+  if (fd == -1){
+    std::cerr << "BlockTier: Error creating temporary file " << strerror(errno) << std::endl;
+    return false;
+  }
+  bool copied = utility::copy_file_range(source_fd, 0, fd, 0, length) && (fsync(fd) == 0);
+  ::close(fd);
+  if (!copied || rename(temporary_path.c_str(), path.c_str()) != 0){
+    std::cerr << "BlockTier: Error publishing block " << path << std::endl;
+    remove(temporary_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+inline DirectoryTier::DirectoryTier(std::string root_directory_path){
+  root_directory = root_directory_path;
+  if (!utility::directory_exists(root_directory.c_str())){
+    if (!utility::create_directory(root_directory.c_str())){
+      std::cerr << "DirectoryTier: Error - Failed to create directory " << root_directory << std::endl;
+      exit(-1);
+    }
+  }
+}
+
+inline std::string DirectoryTier::block_path(size_t subdir_index, const std::string &hash){
+  return root_directory + "/" + std::to_string(subdir_index) + "/" + hash;
+}
+
+inline bool DirectoryTier::contains(size_t subdir_index, const std::string &hash){
+  return utility::file_exists(block_path(subdir_index, hash).c_str());
+}
+
+inline int DirectoryTier::open_block(size_t subdir_index, const std::string &hash){
+  return ::open(block_path(subdir_index, hash).c_str(), O_RDONLY);
+}
+
+inline bool DirectoryTier::put_block(size_t subdir_index, const std::string &hash, int source_fd, size_t length){
+  std::string subdir_name = root_directory + "/" + std::to_string(subdir_index);
+  if (!utility::directory_exists(subdir_name.c_str()) && !utility::create_directory(subdir_name.c_str())){
+    return false;
+  }
+  return publish_block_file(block_path(subdir_index, hash), source_fd, length);
+}
+
+inline bool DirectoryTier::remove_block(size_t subdir_index, const std::string &hash){
+  return remove(block_path(subdir_index, hash).c_str()) == 0;
+}
+
+inline void DirectoryTier::for_each_block(std::function<void(size_t subdir_index, const std::string &hash)> visit){
+  DIR* root = opendir(root_directory.c_str());
+  if (root == nullptr){
+    return;
+  }
+  struct dirent* subdir_entry;
+  while ((subdir_entry = readdir(root)) != nullptr){
+    if (!isdigit(subdir_entry->d_name[0])){
+      continue;
+    }
+    size_t subdir_index = std::stoul(subdir_entry->d_name);
+    std::string subdir_name = root_directory + "/" + subdir_entry->d_name;
+    DIR* subdir = opendir(subdir_name.c_str());
+    if (subdir == nullptr){
+      continue;
+    }
+    struct dirent* block_entry;
+    while ((block_entry = readdir(subdir)) != nullptr){
+      if (is_block_hash_name(block_entry->d_name)){
+        visit(subdir_index, std::string(block_entry->d_name));
+      }
+    }
+    closedir(subdir);
+  }
+  closedir(root);
+}
+
+inline std::string DirectoryTier::description(){
+  return "directory:" + root_directory;
+}
+
+inline ObjectStoreTier::ObjectStoreTier(std::string bucket_directory_path){
+  bucket_directory = bucket_directory_path;
+  std::string staging_directory = bucket_directory + "/.staging";
+  if (!utility::directory_exists(bucket_directory.c_str()) && !utility::create_directory(bucket_directory.c_str())){
+    std::cerr << "ObjectStoreTier: Error - Failed to create bucket " << bucket_directory << std::endl;
+    exit(-1);
+  }
+  if (!utility::directory_exists(staging_directory.c_str()) && !utility::create_directory(staging_directory.c_str())){
+    std::cerr << "ObjectStoreTier: Error - Failed to create staging area " << staging_directory << std::endl;
+    exit(-1);
+  }
+}
+
+inline std::string ObjectStoreTier::object_key(size_t subdir_index, const std::string &hash){
+  return std::to_string(subdir_index) + "." + hash;
+}
+
+inline bool ObjectStoreTier::contains(size_t subdir_index, const std::string &hash){
+  std::string object_path = bucket_directory + "/" + object_key(subdir_index, hash);
+  return utility::file_exists(object_path.c_str());
+}
+
+inline int ObjectStoreTier::open_block(size_t subdir_index, const std::string &hash){
+  std::string object_path = bucket_directory + "/" + object_key(subdir_index, hash);
+  return ::open(object_path.c_str(), O_RDONLY);
+}
+
+inline bool ObjectStoreTier::put_block(size_t subdir_index, const std::string &hash, int source_fd, size_t length){
+  // Upload to the staging area, then complete the upload by publishing the object under its key
+  std::string staging_path = bucket_directory + "/.staging/" + object_key(subdir_index, hash);
+  if (!publish_block_file(staging_path, source_fd, length)){
+    return false;
+  }
+  std::string object_path = bucket_directory + "/" + object_key(subdir_index, hash);
+  return rename(staging_path.c_str(), object_path.c_str()) == 0;
+}
+
+inline bool ObjectStoreTier::remove_block(size_t subdir_index, const std::string &hash){
+  std::string object_path = bucket_directory + "/" + object_key(subdir_index, hash);
+  return remove(object_path.c_str()) == 0;
+}
+
+inline void ObjectStoreTier::for_each_block(std::function<void(size_t subdir_index, const std::string &hash)> visit){
+  DIR* bucket = opendir(bucket_directory.c_str());
+  if (bucket == nullptr){
+    return;
+  }
+  struct dirent* object_entry;
+  while ((object_entry = readdir(bucket)) != nullptr){
+    const char* separator = strchr(object_entry->d_name, '.');
+    if (separator == nullptr || separator == object_entry->d_name || !is_block_hash_name(separator + 1)){
+      continue;
+    }
+    size_t subdir_index = std::stoul(std::string(object_entry->d_name, separator - object_entry->d_name));
+    visit(subdir_index, std::string(separator + 1));
+  }
+  closedir(bucket);
+}
+
+inline std::string ObjectStoreTier::description(){
+  return "object:" + bucket_directory;
+}
@@ -0,0 +1,127 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Pages marked dirty by the application, grouped by block, set concurrently by any number of
+// threads. A summary bit per block lets commits find the marked blocks without scanning pages.
+class DirtyPageBitmap
+{
+  public:
+    DirtyPageBitmap(size_t num_blocks, size_t pages_per_block);
+    // Copies the marks, not concurrently with set() or take_block()
+    DirtyPageBitmap(const DirtyPageBitmap &bitmap);
+    ~DirtyPageBitmap();
+
+    void set(size_t first_page, size_t num_pages);
+    // Marked blocks within [first_block, last_block)
+    std::vector<size_t> marked_blocks(size_t first_block, size_t last_block);
+    // Moves the page bits of a block to page_words (words_per_block() words), false if none was set
+    bool take_block(size_t block_index, uint64_t* page_words);
+    size_t words_per_block();
+
+  private:
+    size_t num_blocks;
+    size_t pages_per_block;
+    size_t m_words_per_block;
+    std::atomic<uint64_t>* page_words;
+    std::atomic<uint64_t>* block_words;
+};
+
+inline DirtyPageBitmap::DirtyPageBitmap(size_t num_blocks_arg, size_t pages_per_block_arg){
+  num_blocks = num_blocks_arg;
+  pages_per_block = pages_per_block_arg;
+  m_words_per_block = (pages_per_block + 63) / 64;
+  page_words = new std::atomic<uint64_t>[num_blocks*m_words_per_block];
+  block_words = new std::atomic<uint64_t>[(num_blocks + 63) / 64];
+  for (size_t i = 0; i < num_blocks*m_words_per_block; i++){
+    page_words[i] = 0;
+  }
+  for (size_t i = 0; i < (num_blocks + 63) / 64; i++){
+    block_words[i] = 0;
+  }
+}
+
+inline DirtyPageBitmap::DirtyPageBitmap(const DirtyPageBitmap &bitmap)
+  : DirtyPageBitmap(bitmap.num_blocks, bitmap.pages_per_block){
+  for (size_t i = 0; i < num_blocks*m_words_per_block; i++){
+    page_words[i] = bitmap.page_words[i].load();
+  }
+  for (size_t i = 0; i < (num_blocks + 63) / 64; i++){
+    block_words[i] = bitmap.block_words[i].load();
+  }
+}
+
+inline DirtyPageBitmap::~DirtyPageBitmap(){
+  delete [] page_words;
+  delete [] block_words;
+}
+
+inline size_t DirtyPageBitmap::words_per_block(){
+  return m_words_per_block;
+}
+
+inline void DirtyPageBitmap::set(size_t first_page, size_t num_pages){
+  size_t page = first_page;
+  size_t end_page = std::min(first_page + num_pages, num_blocks*pages_per_block);
+  while (page < end_page){
+    size_t block_index = page / pages_per_block;
+    size_t block_end_page = std::min(end_page, (block_index + 1)*pages_per_block);
+    // Page bits first, so a commit that sees the block bit also sees its pages
+    for (size_t block_page = page - block_index*pages_per_block; page < block_end_page; ){
+      size_t bit = block_page % 64;
+      size_t count = std::min((size_t) 64 - bit, block_end_page - page);
+      uint64_t mask = (count == 64) ? ~0ULL : (((1ULL << count) - 1) << bit);
+      std::atomic<uint64_t> &word = page_words[block_index*m_words_per_block + block_page / 64];
+      // Skip the atomic write (and the cache line transfer) when already marked
+      if ((word.load(std::memory_order_relaxed) & mask) != mask){
+        word.fetch_or(mask);
+      }
+      page += count;
+      block_page += count;
+    }
+    std::atomic<uint64_t> &block_word = block_words[block_index / 64];
+    uint64_t block_mask = 1ULL << (block_index % 64);
+    if ((block_word.load(std::memory_order_relaxed) & block_mask) == 0){
+      block_word.fetch_or(block_mask);
+    }
+  }
+}
+
+inline std::vector<size_t> DirtyPageBitmap::marked_blocks(size_t first_block, size_t last_block){
+  std::vector<size_t> block_indices;
+  last_block = std::min(last_block, num_blocks);
+  for (size_t block_index = first_block; block_index < last_block; ){
+    uint64_t word = block_words[block_index / 64].load() >> (block_index % 64);
+    if (word == 0){
+      block_index += 64 - block_index % 64;
+      continue;
+    }
+    block_index += __builtin_ctzll(word);
+    if (block_index < last_block){
+      block_indices.push_back(block_index);
+    }
+    block_index++;
+  }
+  return block_indices;
+}
+
+inline bool DirtyPageBitmap::take_block(size_t block_index, uint64_t* taken_page_words){
+  uint64_t block_mask = 1ULL << (block_index % 64);
+  if ((block_words[block_index / 64].fetch_and(~block_mask) & block_mask) == 0){
+    return false;
+  }
+  // Pages marked from now on are committed next time
+  for (size_t i = 0; i < m_words_per_block; i++){
+    taken_page_words[i] = page_words[block_index*m_words_per_block + i].exchange(0);
+  }
+  return true;
+}
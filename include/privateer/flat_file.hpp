@@ -0,0 +1,196 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "utility/file_util.hpp"
+#include "utility/sha256_hash.hpp"
+#include "utility/system.hpp"
+#include "block_storage.hpp"
+#include "block_table.hpp"
+#include "recipe.hpp"
+#include "version_catalog.hpp"
+
+// Bulk conversion between flat files and versions, without mapping a region. Blocks are
+// processed in parallel; zero blocks are left empty and blocks already in the store are not
+// written again. Block content is copied file to file with copy_file_range, which reflinks on
+// file systems that support it, falling back to buffered writes.
+class FlatFile
+{
+  public:
+    // Imports a file as a new version of the data store at blocks_dir_path, created if it does not exist.
+    // The version's size is the file's size rounded up to the block granularity, zero padded.
+    static bool import_file(const char* file_path, const char* blocks_dir_path, const char* version_metadata_path, size_t capacity = 0);
+    // Writes a version's data to a new file, of length bytes if not 0 (e.g., an imported file's size)
+    static bool export_file(const char* version_metadata_path, const char* file_path, size_t length = 0);
+
+  private:
+    static constexpr size_t FILE_GRANULARITY_DEFAULT_BYTES = 2*134217728; // As Privateer's
+
+    static bool import_block(int file_fd, size_t block_index, size_t length, BlockStorage &block_storage, char* buffer,
+                             unsigned char* digest);
+};
+
+// Stores [block_index*granularity, + length) of the file as a block; digest stays empty for zero blocks
+inline bool FlatFile::import_block(int file_fd, size_t block_index, size_t length, BlockStorage &block_storage, char* buffer,
+                                   unsigned char* digest){
+  size_t granularity = block_storage.get_block_granularity();
+  size_t read_bytes = 0;
+  while (read_bytes < length){
+    ssize_t count = ::pread(file_fd, buffer + read_bytes, length - read_bytes, block_index*granularity + read_bytes);
+    if (count <= 0){
+      std::cerr << "FlatFile: Error reading block " << block_index << std::endl;
+      return false;
+    }
+    read_bytes += count;
+  }
+  memset(buffer + length, 0, granularity - length);
+  if (buffer[0] == 0 && memcmp(buffer, buffer + 1, granularity - 1) == 0){
+    return true;
+  }
+  std::string block_hash = utility::compute_hash(buffer, granularity);
+  std::string temporary_file_name_template = std::to_string(block_index) + "_temp_XXXXXX";
+  int block_fd = block_storage.create_temporary_unique_block((char*) temporary_file_name_template.c_str(), block_index);
+  if (block_fd == -1){
+    return false;
+  }
+  // Duplicates are not copied, storing finds them
+  std::string block_path = block_storage.get_blocks_subdirectory(block_index) + "/" + block_hash;
+  bool write_from_buffer = false;
+  if (!utility::file_exists(block_path.c_str())){
+    write_from_buffer = !utility::copy_file_range(file_fd, block_index*granularity, block_fd, 0, length);
+  }
+  bool stored = block_storage.store_block(block_fd, buffer, write_from_buffer, block_index, block_hash);
+  ::close(block_fd);
+  if (!stored){
+    std::cerr << "FlatFile: Error storing block " << block_index << std::endl;
+    return false;
+  }
+  utility::hex_to_digest(block_hash.c_str(), digest);
+  return true;
+}
+
+inline bool FlatFile::import_file(const char* file_path, const char* blocks_dir_path, const char* version_metadata_path, size_t capacity){
+  int file_fd = ::open(file_path, O_RDONLY);
+  struct stat file_stat;
+  if (file_fd == -1 || fstat(file_fd, &file_stat) != 0){
+    std::cerr << "FlatFile: Error opening " << file_path << " - " << strerror(errno) << std::endl;
+    return false;
+  }
+  size_t file_size = file_stat.st_size;
+  BlockStorage* block_storage;
+  if (utility::directory_exists(blocks_dir_path)){
+    block_storage = new BlockStorage(blocks_dir_path);
+  }
+  else{
+    // Same settings as a data store created by Privateer
+    size_t granularity = utility::get_environment_variable("PRIVATEER_FILE_GRANULARITY");
+    if (granularity == 0){
+      granularity = FILE_GRANULARITY_DEFAULT_BYTES;
+    }
+    granularity = std::min(granularity, std::max(capacity, file_size));
+    size_t pagesize = sysconf(_SC_PAGE_SIZE);
+    granularity = std::max((granularity + pagesize - 1) / pagesize * pagesize, pagesize);
+    std::vector<std::string> stripe_directories = utility::get_environment_path_list("PRIVATEER_STRIPE_DIRECTORIES");
+    if (stripe_directories.empty()){
+      block_storage = new BlockStorage(blocks_dir_path, granularity);
+    }
+    else{
+      block_storage = new BlockStorage(blocks_dir_path, granularity, stripe_directories);
+    }
+  }
+  size_t granularity = block_storage->get_block_granularity();
+  size_t num_blocks = (file_size + granularity - 1) / granularity;
+  size_t size = num_blocks*granularity;
+  capacity = std::max(size, (capacity + granularity - 1) / granularity * granularity);
+  BlockTable table(capacity / granularity);
+  posix_fadvise(file_fd, 0, file_size, POSIX_FADV_SEQUENTIAL);
+
+  bool imported = true;
+  #pragma omp parallel reduction(&&:imported)
+  {
+    BlockStorage block_storage_local(*block_storage);
+    std::vector<char> buffer(granularity);
+    #pragma omp for schedule(dynamic)
+    for (size_t block_index = 0; block_index < num_blocks; block_index++){
+      unsigned char digest[utility::DIGEST_SIZE] = {0};
+      size_t length = std::min(granularity, file_size - block_index*granularity);
+      if (imported && import_block(file_fd, block_index, length, block_storage_local, buffer.data(), digest)){
+        if (!utility::is_empty_digest(digest)){
+          table.set(block_index, digest);
+        }
+      }
+      else{
+        imported = false;
+      }
+    }
+  }
+  ::close(file_fd);
+  if (imported){
+    VersionLayout layout = {size, capacity, granularity, num_blocks, blocks_dir_path, VersionCatalog::NO_RECORD};
+    std::string catalog_blocks_dir_path, name;
+    bool in_catalog = VersionCatalog::parse_reference(version_metadata_path, catalog_blocks_dir_path, name);
+    imported = store_version_digests(version_metadata_path, layout, &table)
+               && (in_catalog || block_storage->register_version(version_metadata_path));
+  }
+  delete block_storage;
+  if (!imported){
+    std::cerr << "FlatFile: Error importing " << file_path << std::endl;
+  }
+  return imported;
+}
+
+inline bool FlatFile::export_file(const char* version_metadata_path, const char* file_path, size_t length){
+  VersionLayout layout;
+  BlockTable* table = load_version_digests(version_metadata_path, layout, true);
+  if (table == nullptr){
+    std::cerr << "FlatFile: Error reading version " << version_metadata_path << std::endl;
+    return false;
+  }
+  if (length == 0 || length > layout.size){
+    length = layout.size;
+  }
+  int file_fd = ::open(file_path, O_RDWR | O_CREAT | O_EXCL, (mode_t) 0666);
+  // Empty blocks are holes of the file
+  if (file_fd == -1 || ftruncate(file_fd, length) != 0){
+    std::cerr << "FlatFile: Error creating " << file_path << " - " << strerror(errno) << std::endl;
+    delete table;
+    return false;
+  }
+  BlockStorage block_storage(layout.blocks_dir_path);
+  size_t granularity = layout.granularity;
+  size_t num_blocks = (length + granularity - 1) / granularity;
+
+  bool exported = true;
+  #pragma omp parallel for schedule(dynamic) reduction(&&:exported)
+  for (size_t block_index = 0; block_index < num_blocks; block_index++){
+    if (!exported || table->is_empty(block_index)){
+      continue;
+    }
+    std::string block_hash = utility::digest_to_hex(table->get(block_index));
+    int block_fd = block_storage.get_block_fd(block_hash.c_str(), block_index);
+    size_t block_length = std::min(granularity, length - block_index*granularity);
+    if (block_fd == -1 || !utility::copy_file_range(block_fd, 0, file_fd, block_index*granularity, block_length)){
+      std::cerr << "FlatFile: Error exporting block " << block_index << std::endl;
+      exported = false;
+    }
+    if (block_fd != -1){
+      ::close(block_fd);
+    }
+  }
+  exported = fsync(file_fd) == 0 && exported;
+  ::close(file_fd);
+  delete table;
+  return exported;
+}
@@ -0,0 +1,444 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <omp.h>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "block_storage.hpp"
+#include "recipe.hpp"
+#include "version_catalog.hpp"
+
+// Mark-and-sweep garbage collection of blocks no live version refers to.
+//
+// Live versions are the versions registered with the store whose metadata still exists, and
+// the version catalog's versions that were not dropped; dropping a version means deleting its
+// metadata directory or VersionCatalog::drop. Collection is safe while other
+// processes commit new blocks: blocks written or reused after marking started carry a recent
+// modification time (BlockStorage::store_block touches reused blocks) and are never swept,
+// and a block is moved aside before being unlinked so a concurrent reuse can be detected and
+// undone. Blocks younger than a grace period are never swept either, covering commits that
+// stored blocks before marking started but publish their recipe after it; the grace period
+// must exceed the longest msync. Versions must not be dropped while a process still has them open.
+//
+// Stores created before the versions registry hold versions it does not list; nothing is swept
+// from them until their versions are adopted with adopt_versions.
+class GarbageCollector
+{
+  public:
+    GarbageCollector(std::string blocks_dir_path);
+    ~GarbageCollector();
+
+    // Scans all live version recipes, returns the number of distinct referenced blocks
+    size_t mark();
+    // Removes up to max_blocks unreferenced blocks (0 for no limit), at most
+    // max_bytes_per_second of blocks per second (0 for no limit). Returns the bytes reclaimed;
+    // call repeatedly to collect incrementally, until sweep_done().
+    size_t sweep(size_t max_blocks, size_t max_bytes_per_second);
+    bool sweep_done();
+    size_t collect(size_t max_bytes_per_second);
+
+    // Bytes of blocks that are not referenced by any live version
+    size_t unreferenced_bytes();
+    // Bytes that would be reclaimed by dropping each live version alone
+    std::map<std::string, size_t> reclaimable_bytes_per_version();
+    std::vector<std::string> live_versions();
+    void set_grace_period(size_t seconds);
+    // Registers the versions of this store found under the given directories (searched
+    // recursively for version metadata) and marks the registry complete, enabling sweeps on
+    // stores created before the registry. All directories holding versions must be listed.
+    bool adopt_versions(const std::vector<std::string> &search_directories);
+
+  private:
+    typedef std::string block_key; // "<subdir_index>/<hash>"
+    BlockStorage* block_storage;
+    VersionCatalog* catalog;
+    std::string blocks_dir_path;
+    size_t block_granularity;
+    std::vector<std::string> versions;
+    // Number of live versions referencing each block and, for singly referenced blocks, which one
+    std::unordered_map<block_key, std::pair<uint32_t, uint32_t>> references;
+    std::vector<std::pair<size_t, std::string>> candidates;
+    std::vector<bool> candidate_in_capacity_tier;
+    size_t next_candidate;
+    size_t registered_count;
+    size_t catalog_record_count;
+    bool marked;
+    bool registry_complete;
+    bool candidates_found;
+    size_t grace_period_seconds;
+    struct timespec mark_start_time;
+
+    void mark_versions(size_t first_version);
+    void mark_catalog_records(std::vector<std::pair<std::string, uint64_t>> records);
+    void add_references(std::string version, std::vector<block_key> &keys);
+    void remark_updated_versions();
+    void find_candidates();
+    bool sweep_block(size_t subdir_index, const std::string &hash, bool in_capacity_tier);
+    bool modified_since_mark(const std::string &path);
+    static std::vector<block_key> read_version_blocks(std::string version_path, size_t files_per_subdirectory);
+    std::vector<block_key> read_catalog_version_blocks(uint64_t record_offset, CatalogRecord &record, size_t files_per_subdirectory);
+};
+
+inline GarbageCollector::GarbageCollector(std::string blocks_dir_path_arg){
+  blocks_dir_path = blocks_dir_path_arg;
+  block_storage = new BlockStorage(blocks_dir_path);
+  catalog = new VersionCatalog(blocks_dir_path);
+  block_granularity = block_storage->get_block_granularity();
+  next_candidate = 0;
+  registered_count = 0;
+  catalog_record_count = 0;
+  marked = false;
+  registry_complete = false;
+  candidates_found = false;
+  grace_period_seconds = 600;
+}
+
+inline GarbageCollector::~GarbageCollector(){
+  delete catalog;
+  delete block_storage;
+}
+
+inline std::vector<GarbageCollector::block_key> GarbageCollector::read_version_blocks(std::string version_path, size_t files_per_subdirectory){
+  std::vector<block_key> keys;
+  Recipe recipe;
+  if (!recipe.load(version_path)){
+    return keys;
+  }
+  for (size_t i = 0; i < recipe.num_blocks(); i++){
+    if (!utility::is_empty_digest(recipe.digest(i))){
+      keys.push_back(std::to_string(i % files_per_subdirectory) + "/" + utility::digest_to_hex(recipe.digest(i)));
+    }
+  }
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+  return keys;
+}
+
+inline std::vector<GarbageCollector::block_key> GarbageCollector::read_catalog_version_blocks(uint64_t record_offset, CatalogRecord &record, size_t files_per_subdirectory){
+  std::vector<block_key> keys;
+  BlockTable table(record.num_blocks);
+  if (!catalog->load(record_offset, &table)){
+    return keys;
+  }
+  for (size_t i = 0; i < record.num_blocks; i++){
+    if (!table.is_empty(i)){
+      keys.push_back(std::to_string(i % files_per_subdirectory) + "/" + utility::digest_to_hex(table.get(i)));
+    }
+  }
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+  return keys;
+}
+
+inline size_t GarbageCollector::mark(){
+  clock_gettime(CLOCK_REALTIME, &mark_start_time);
+  references.clear();
+  versions.clear();
+  candidates.clear();
+  candidate_in_capacity_tier.clear();
+  next_candidate = 0;
+  registered_count = 0;
+  candidates_found = false;
+  registry_complete = block_storage->is_registry_complete();
+  if (!registry_complete){
+    std::cerr << "GarbageCollector: The versions registry of " << blocks_dir_path << " may not list all versions, "
+              << "nothing will be swept until they are adopted (see adopt_versions)" << std::endl;
+  }
+  mark_versions(0);
+  catalog_record_count = catalog->records_since(0).size();
+  std::vector<std::pair<std::string, uint64_t>> catalog_versions;
+  for (auto &version : catalog->live_versions()){
+    catalog_versions.push_back(version);
+  }
+  mark_catalog_records(catalog_versions);
+  marked = true;
+  return references.size();
+}
+
+// Marks the blocks of versions registered from first_version on; versions whose metadata is gone were dropped
+inline void GarbageCollector::mark_versions(size_t first_version){
+  std::vector<std::string> registered_versions = block_storage->get_registered_versions();
+  std::vector<std::string> new_versions;
+  for (size_t i = first_version; i < registered_versions.size(); i++){
+    if (utility::file_exists((registered_versions[i] + "/_metadata").c_str())){
+      new_versions.push_back(registered_versions[i]);
+    }
+  }
+  size_t files_per_subdirectory = block_storage->get_files_per_subdirectory();
+  std::vector<std::vector<block_key>> version_blocks(new_versions.size());
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < new_versions.size(); i++){
+    version_blocks[i] = read_version_blocks(new_versions[i], files_per_subdirectory);
+  }
+  for (size_t i = 0; i < new_versions.size(); i++){
+    add_references(new_versions[i], version_blocks[i]);
+  }
+  registered_count = registered_versions.size();
+}
+
+// Marks the blocks of catalog records, given as (version name, record offset)
+inline void GarbageCollector::mark_catalog_records(std::vector<std::pair<std::string, uint64_t>> records){
+  std::vector<CatalogRecord> catalog_records(records.size());
+  for (size_t i = 0; i < records.size(); i++){
+    if (!catalog->read_record(records[i].second, catalog_records[i])){
+      catalog_records[i].type = VersionCatalog::RECORD_DROP;
+    }
+  }
+  size_t files_per_subdirectory = block_storage->get_files_per_subdirectory();
+  std::vector<std::vector<block_key>> version_blocks(records.size());
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < records.size(); i++){
+    if (catalog_records[i].type != VersionCatalog::RECORD_DROP){
+      version_blocks[i] = read_catalog_version_blocks(records[i].second, catalog_records[i], files_per_subdirectory);
+    }
+  }
+  for (size_t i = 0; i < records.size(); i++){
+    if (catalog_records[i].type != VersionCatalog::RECORD_DROP){
+      add_references(blocks_dir_path + "@" + records[i].first, version_blocks[i]);
+    }
+  }
+}
+
+inline void GarbageCollector::add_references(std::string version, std::vector<block_key> &keys){
+  uint32_t version_id = versions.size();
+  versions.push_back(version);
+  for (block_key &key : keys){
+    auto reference = references.find(key);
+    if (reference == references.end()){
+      references[key] = std::make_pair(1, version_id);
+    }
+    else{
+      reference->second.first++;
+    }
+  }
+}
+
+// Recipes rewritten since marking started may refer to blocks stored meanwhile
+inline void GarbageCollector::remark_updated_versions(){
+  size_t files_per_subdirectory = block_storage->get_files_per_subdirectory();
+  for (uint32_t version_id = 0; version_id < versions.size(); version_id++){
+    struct stat st;
+    std::string metadata_file_name = versions[version_id] + "/_metadata";
+    if (stat(metadata_file_name.c_str(), &st) != 0 || st.st_mtim.tv_sec < mark_start_time.tv_sec){
+      continue;
+    }
+    for (block_key &key : read_version_blocks(versions[version_id], files_per_subdirectory)){
+      if (references.find(key) == references.end()){
+        references[key] = std::make_pair(1, version_id);
+      }
+    }
+  }
+}
+
+inline void GarbageCollector::find_candidates(){
+  block_storage->for_each_block([&](size_t subdir_index, const std::string &hash){
+    if (references.find(std::to_string(subdir_index) + "/" + hash) == references.end()){
+      candidates.push_back(std::make_pair(subdir_index, hash));
+      candidate_in_capacity_tier.push_back(false);
+    }
+  });
+  std::shared_ptr<BlockTier> capacity_tier = block_storage->get_capacity_tier();
+  if (capacity_tier != nullptr){
+    capacity_tier->for_each_block([&](size_t subdir_index, const std::string &hash){
+      if (references.find(std::to_string(subdir_index) + "/" + hash) == references.end()){
+        candidates.push_back(std::make_pair(subdir_index, hash));
+        candidate_in_capacity_tier.push_back(true);
+      }
+    });
+  }
+}
+
+inline bool GarbageCollector::modified_since_mark(const std::string &path){
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0){
+    return true;
+  }
+  time_t threshold = mark_start_time.tv_sec - grace_period_seconds;
+  return st.st_mtim.tv_sec > threshold
+      || (st.st_mtim.tv_sec == threshold && st.st_mtim.tv_nsec >= mark_start_time.tv_nsec);
+}
+
+inline bool GarbageCollector::sweep_block(size_t subdir_index, const std::string &hash, bool in_capacity_tier){
+  if (in_capacity_tier){
+    // Writers never reuse capacity tier copies, recently demoted copies are left for the next cycle
+    std::shared_ptr<BlockTier> capacity_tier = block_storage->get_capacity_tier();
+    int fd = capacity_tier->open_block(subdir_index, hash);
+    if (fd == -1){
+      return false;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    ::close(fd);
+    if (st.st_mtim.tv_sec >= mark_start_time.tv_sec - (time_t) grace_period_seconds){
+      return false;
+    }
+    return capacity_tier->remove_block(subdir_index, hash);
+  }
+  std::string block_path = block_storage->get_block_path(subdir_index, hash);
+  if (modified_since_mark(block_path)){
+    return false;
+  }
+  // Move the block aside, then check it was not reused (touched) before it moved
+  std::string collected_path = block_path + "_collected";
+  if (rename(block_path.c_str(), collected_path.c_str()) != 0){
+    return false;
+  }
+  if (modified_since_mark(collected_path)){
+    if (!utility::file_exists(block_path.c_str())){
+      rename(collected_path.c_str(), block_path.c_str());
+    }
+    else{
+      remove(collected_path.c_str());
+    }
+    return false;
+  }
+  return remove(collected_path.c_str()) == 0;
+}
+
+inline size_t GarbageCollector::sweep(size_t max_blocks, size_t max_bytes_per_second){
+  if (!marked){
+    mark();
+  }
+  if (!registry_complete){
+    // Blocks of unregistered versions would look unreferenced
+    return 0;
+  }
+  if (!candidates_found){
+    // Pick up versions registered or updated while marking, before deciding what is unreferenced
+    mark_versions(registered_count);
+    remark_updated_versions();
+    std::vector<std::pair<std::string, uint64_t>> catalog_records;
+    for (uint64_t record_offset : catalog->records_since(catalog_record_count)){
+      CatalogRecord record;
+      if (catalog->read_record(record_offset, record)){
+        catalog_records.push_back(std::make_pair(std::string(record.name), record_offset));
+      }
+    }
+    mark_catalog_records(catalog_records);
+    find_candidates();
+    candidates_found = true;
+  }
+  size_t reclaimed = 0;
+  size_t num_visited = 0;
+  auto sweep_start = std::chrono::steady_clock::now();
+  while (next_candidate < candidates.size() && (max_blocks == 0 || num_visited < max_blocks)){
+    std::pair<size_t, std::string> &candidate = candidates[next_candidate];
+    if (sweep_block(candidate.first, candidate.second, candidate_in_capacity_tier[next_candidate])){
+      reclaimed += block_granularity;
+    }
+    next_candidate++;
+    num_visited++;
+    if (max_bytes_per_second != 0){
+      // Throttle to the requested rate
+      std::chrono::duration<double> expected(reclaimed * 1.0 / max_bytes_per_second);
+      auto elapsed = std::chrono::steady_clock::now() - sweep_start;
+      if (elapsed < expected){
+        std::this_thread::sleep_for(expected - elapsed);
+      }
+    }
+  }
+  return reclaimed;
+}
+
+inline bool GarbageCollector::sweep_done(){
+  return (marked && !registry_complete) || (candidates_found && next_candidate >= candidates.size());
+}
+
+inline size_t GarbageCollector::collect(size_t max_bytes_per_second){
+  mark();
+  return sweep(0, max_bytes_per_second);
+}
+
+inline size_t GarbageCollector::unreferenced_bytes(){
+  if (!marked){
+    mark();
+  }
+  size_t num_unreferenced = 0;
+  block_storage->for_each_block([&](size_t subdir_index, const std::string &hash){
+    if (references.find(std::to_string(subdir_index) + "/" + hash) == references.end()){
+      num_unreferenced++;
+    }
+  });
+  return num_unreferenced * block_granularity;
+}
+
+inline std::map<std::string, size_t> GarbageCollector::reclaimable_bytes_per_version(){
+  if (!marked){
+    mark();
+  }
+  std::map<std::string, size_t> reclaimable;
+  for (std::string &version : versions){
+    reclaimable[version] = 0;
+  }
+  for (auto &reference : references){
+    if (reference.second.first == 1){
+      reclaimable[versions[reference.second.second]] += block_granularity;
+    }
+  }
+  return reclaimable;
+}
+
+inline void GarbageCollector::set_grace_period(size_t seconds){
+  grace_period_seconds = seconds;
+}
+
+inline std::vector<std::string> GarbageCollector::live_versions(){
+  if (!marked){
+    mark();
+  }
+  return versions;
+}
+
+inline bool GarbageCollector::adopt_versions(const std::vector<std::string> &search_directories){
+  std::error_code ec;
+  std::filesystem::path store_path = std::filesystem::absolute(blocks_dir_path, ec).lexically_normal();
+  for (const std::string &search_directory : search_directories){
+    std::filesystem::recursive_directory_iterator entry(search_directory, std::filesystem::directory_options::skip_permission_denied, ec);
+    if (ec){
+      std::cerr << "GarbageCollector: Error searching " << search_directory << " - " << ec.message() << std::endl;
+      return false;
+    }
+    for (; entry != std::filesystem::recursive_directory_iterator(); entry.increment(ec)){
+      if (ec){
+        std::cerr << "GarbageCollector: Error searching " << search_directory << " - " << ec.message() << std::endl;
+        return false;
+      }
+      // Blocks directories hold no versions
+      if (entry->is_directory(ec) && std::filesystem::equivalent(entry->path(), store_path, ec)){
+        entry.disable_recursion_pending();
+        continue;
+      }
+      if (entry->path().filename() != "_metadata" || !entry->is_regular_file(ec)){
+        continue;
+      }
+      std::string version_path = entry->path().parent_path().string();
+      Recipe recipe;
+      if (!recipe.load(version_path)){
+        continue;
+      }
+      // Versions whose blocks path cannot be resolved (e.g., relative to another directory) are kept as roots
+      std::error_code equivalent_ec;
+      bool same_store = std::filesystem::equivalent(recipe.blocks_path(), store_path, equivalent_ec);
+      if ((same_store || equivalent_ec) && !block_storage->register_version(version_path)){
+        return false;
+      }
+    }
+  }
+  return block_storage->set_registry_complete();
+}
@@ -0,0 +1,207 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <mpi.h>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "privateer_mpi.hpp"
+
+// A single version partitioned by block over the ranks of an MPI communicator.
+//
+// Every rank maps the whole region at its own address, reserving memory only for the pages it
+// touches. Blocks are dealt to ranks in contiguous ranges; a rank writes its own blocks and reads
+// any block, blocks of other ranks being faulted in on demand from the shared block store as of
+// the last collective commit. Collective msync and snapshot store each rank's blocks and then
+// assemble the version's recipe from the digests of all ranks. Writes to blocks of other ranks
+// are discarded on commit.
+class DistributedRegion
+{
+  public:
+    // Collective: creates a version of capacity bytes
+    DistributedRegion(const char* blocks_dir_path, const char* version_metadata_path, size_t capacity, MPI_Comm comm);
+    // Collective: opens an existing version
+    DistributedRegion(const char* version_metadata_path, MPI_Comm comm);
+    ~DistributedRegion();
+
+    void* data();
+    size_t size();
+    size_t block_granularity();
+    // Byte range [local_offset(), local_offset() + local_size()) owned by this rank
+    size_t local_offset();
+    size_t local_size();
+    int owner(size_t offset);
+
+    // Collective: commits every rank's blocks and updates the version
+    bool msync();
+    // Collective: commits every rank's blocks and writes them as a new version
+    bool snapshot(const char* version_metadata_path);
+
+  private:
+    MPI_Comm comm;
+    int rank;
+    int num_ranks;
+    Privateer* privateer;
+    size_t granularity;
+    size_t num_blocks;
+
+    void open(const char* version_metadata_path);
+    size_t first_block(int partition_rank);
+    bool commit_partitions();
+    bool all(bool local_status);
+};
+
+inline DistributedRegion::DistributedRegion(const char* blocks_dir_path, const char* version_metadata_path, size_t capacity, MPI_Comm comm_arg){
+  comm = comm_arg;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &num_ranks);
+  if (rank == 0){
+    // The whole capacity is addressable, blocks are only stored once written
+    Privateer creator(blocks_dir_path, version_metadata_path, capacity, capacity);
+  }
+  MPI_Barrier(comm);
+  open(version_metadata_path);
+}
+
+inline DistributedRegion::DistributedRegion(const char* version_metadata_path, MPI_Comm comm_arg){
+  comm = comm_arg;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &num_ranks);
+  open(version_metadata_path);
+}
+
+inline DistributedRegion::~DistributedRegion(){
+  delete privateer;
+}
+
+inline void DistributedRegion::open(const char* version_metadata_path){
+  VersionLayout layout;
+  BlockTable* table = PrivateerMPI::broadcast_recipe(version_metadata_path, layout, comm);
+  if (table == nullptr){
+    std::cerr << "DistributedRegion: Error opening " << version_metadata_path << std::endl;
+    exit(-1);
+  }
+  // Blocks are mapped, not read: each rank only faults in what it accesses
+  privateer = new Privateer(nullptr, version_metadata_path, layout, table, false);
+  granularity = layout.granularity;
+  num_blocks = layout.size / granularity;
+}
+
+inline void* DistributedRegion::data(){
+  return privateer->data();
+}
+
+inline size_t DistributedRegion::size(){
+  return privateer->current_size();
+}
+
+inline size_t DistributedRegion::block_granularity(){
+  return granularity;
+}
+
+inline size_t DistributedRegion::first_block(int partition_rank){
+  return num_blocks*partition_rank / num_ranks;
+}
+
+inline size_t DistributedRegion::local_offset(){
+  return first_block(rank)*granularity;
+}
+
+inline size_t DistributedRegion::local_size(){
+  return (first_block(rank + 1) - first_block(rank))*granularity;
+}
+
+inline int DistributedRegion::owner(size_t offset){
+  size_t block_index = offset / granularity;
+  if (num_blocks == 0){
+    return 0;
+  }
+  int partition_rank = (block_index*num_ranks) / num_blocks;
+  // Rounding of the partition bounds
+  while (partition_rank > 0 && block_index < first_block(partition_rank)){
+    partition_rank--;
+  }
+  while (partition_rank + 1 < num_ranks && block_index >= first_block(partition_rank + 1)){
+    partition_rank++;
+  }
+  return partition_rank;
+}
+
+inline bool DistributedRegion::all(bool local_status){
+  int local = local_status ? 1 : 0;
+  int global = 0;
+  MPI_Allreduce(&local, &global, 1, MPI_INT, MPI_LAND, comm);
+  return global != 0;
+}
+
+// Stores each rank's dirty blocks, then maps the blocks committed by the other ranks
+inline bool DistributedRegion::commit_partitions(){
+  std::vector<HashedBlock> hashed_blocks = privateer->hash_dirty_blocks();
+  std::vector<HashedBlock> local_blocks;
+  std::vector<size_t> foreign_blocks;
+  for (HashedBlock &hashed_block : hashed_blocks){
+    if (owner(hashed_block.block_index*granularity) == rank){
+      local_blocks.push_back(hashed_block);
+    }
+    else{
+      foreign_blocks.push_back(hashed_block.block_index);
+    }
+  }
+  if (!foreign_blocks.empty()){
+    std::cerr << "DistributedRegion: Discarding changes to " << foreign_blocks.size() << " blocks of other ranks" << std::endl;
+  }
+  bool committed = privateer->discard_blocks(foreign_blocks)
+                   && privateer->commit_hashed_blocks(local_blocks, std::vector<bool>(local_blocks.size(), true));
+  if (!all(committed)){
+    return false;
+  }
+
+  // Exchange the digests of the committed blocks
+  int local_bytes = local_blocks.size()*sizeof(HashedBlock);
+  std::vector<int> rank_bytes(num_ranks), rank_displacements(num_ranks);
+  MPI_Allgather(&local_bytes, 1, MPI_INT, rank_bytes.data(), 1, MPI_INT, comm);
+  size_t total_bytes = 0;
+  for (int r = 0; r < num_ranks; r++){
+    rank_displacements[r] = total_bytes;
+    total_bytes += rank_bytes[r];
+  }
+  std::vector<HashedBlock> committed_blocks(total_bytes / sizeof(HashedBlock));
+  MPI_Allgatherv(local_blocks.data(), local_bytes, MPI_BYTE, committed_blocks.data(), rank_bytes.data(), rank_displacements.data(), MPI_BYTE, comm);
+  std::vector<HashedBlock> remote_blocks;
+  for (HashedBlock &committed_block : committed_blocks){
+    if (owner(committed_block.block_index*granularity) != rank){
+      remote_blocks.push_back(committed_block);
+    }
+  }
+  return all(privateer->commit_hashed_blocks(remote_blocks, std::vector<bool>(remote_blocks.size(), false)));
+}
+
+inline bool DistributedRegion::msync(){
+  if (!commit_partitions()){
+    return false;
+  }
+  // Rank 0 holds all digests and no uncommitted pages, it only writes the recipe
+  if (rank == 0){
+    privateer->msync();
+  }
+  MPI_Barrier(comm);
+  return true;
+}
+
+inline bool DistributedRegion::snapshot(const char* version_metadata_path){
+  if (!commit_partitions()){
+    return false;
+  }
+  int snapshotted = 0;
+  if (rank == 0){
+    snapshotted = privateer->snapshot(version_metadata_path) ? 1 : 0;
+  }
+  MPI_Bcast(&snapshotted, 1, MPI_INT, 0, comm);
+  return snapshotted != 0;
+}
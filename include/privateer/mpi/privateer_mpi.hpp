@@ -0,0 +1,422 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <mpi.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "../privateer.hpp"
+
+// Collective operations of Privateer regions held by the ranks of an MPI communicator, one
+// region per rank, all over the same block store.
+//
+// Ranks commit their blocks in two phases: dirty blocks are hashed and their digests exchanged
+// first, then each distinct block (same block index and content) is written by a single rank
+// and the other ranks holding it map the stored block. Replicated data is written once instead
+// of once per rank.
+//
+// Ranks opening the same version collectively read its recipe once and each of its blocks once
+// per node (or once overall, with a node-local block cache).
+//
+// Node caches belong to the application: blocks stay cached across opens (and jobs, for a
+// persistent directory) until trimmed by open or removed by clear_node_cache. Removing cached
+// blocks is safe while regions map them, their memory is released once the regions are closed.
+class PrivateerMPI
+{
+  public:
+    // Collective: commits the blocks of every rank's region, writing each distinct block once
+    static bool commit_blocks(Privateer &privateer, MPI_Comm comm);
+    // Collective msync: blocks are committed collectively, then each rank updates its version
+    static bool msync(Privateer &privateer, MPI_Comm comm);
+    // Collective snapshot of every rank's region to its own version_metadata_path, true on all
+    // ranks only once the snapshots of all ranks were written
+    static bool snapshot(Privateer &privateer, const char* version_metadata_path, MPI_Comm comm);
+    // Collective open of the same version by all ranks, nullptr on all ranks on error. Rank 0 reads
+    // the recipe and broadcasts it, and every block is read from the store by a single rank of each
+    // node, the other ranks of the node then map it from the page cache. With node_cache_dir_path
+    // (a node-local directory, e.g. on /dev/shm), every block missing from a node's cache is read
+    // from the store by a single node, sent over MPI to the others, and mapped from the cache.
+    // With node_cache_max_bytes, each node cache is then trimmed to that size, least recently
+    // opened blocks first; it can exceed it by the size of the version during the open.
+    static Privateer* open(const char* version_metadata_path, bool read_only, MPI_Comm comm, std::string node_cache_dir_path = "",
+                           size_t node_cache_max_bytes = 0);
+    // Collective: removes all blocks from the node caches of the ranks of comm
+    static bool clear_node_cache(std::string node_cache_dir_path, MPI_Comm comm);
+    // Collective: rank 0 loads the recipe of a version and broadcasts it, nullptr on all ranks on error
+    static BlockTable* broadcast_recipe(const char* version_metadata_path, VersionLayout &layout, MPI_Comm comm);
+
+  private:
+    struct BlockKey
+    {
+      uint64_t block_index;
+      unsigned char digest[utility::DIGEST_SIZE];
+      bool operator<(const BlockKey &other) const {
+        return block_index != other.block_index ? block_index < other.block_index
+                                                : memcmp(digest, other.digest, utility::DIGEST_SIZE) < 0;
+      }
+    };
+
+    static constexpr size_t READ_CHUNK_BYTES = 1 << 20;
+
+    static bool all(bool local_status, MPI_Comm comm);
+    static bool same_block_store(Privateer &privateer, MPI_Comm comm);
+    static bool read_block(BlockStorage &block_storage, size_t block_index, const std::string &block_hash, char* buffer, size_t length);
+    static bool distribute_blocks(BlockStorage &block_storage, const std::vector<std::pair<size_t, std::string>> &distinct_blocks,
+                                  std::string node_cache_dir_path, MPI_Comm leader_comm);
+    static size_t trim_node_cache(BlockStorage &block_storage, const std::vector<std::pair<size_t, std::string>> &used_blocks,
+                                  std::string node_cache_dir_path, size_t max_bytes);
+};
+
+inline bool PrivateerMPI::all(bool local_status, MPI_Comm comm){
+  int local = local_status ? 1 : 0;
+  int global = 0;
+  MPI_Allreduce(&local, &global, 1, MPI_INT, MPI_LAND, comm);
+  return global != 0;
+}
+
+inline bool PrivateerMPI::same_block_store(Privateer &privateer, MPI_Comm comm){
+  std::string blocks_path = privateer.blocks_path();
+  uint64_t local_hash = std::hash<std::string>{}(blocks_path);
+  uint64_t min_hash, max_hash;
+  MPI_Allreduce(&local_hash, &min_hash, 1, MPI_UINT64_T, MPI_MIN, comm);
+  MPI_Allreduce(&local_hash, &max_hash, 1, MPI_UINT64_T, MPI_MAX, comm);
+  return min_hash == max_hash;
+}
+
+inline bool PrivateerMPI::commit_blocks(Privateer &privateer, MPI_Comm comm){
+  int rank, num_ranks;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &num_ranks);
+
+  std::vector<HashedBlock> hashed_blocks = privateer.hash_dirty_blocks();
+  if (!same_block_store(privateer, comm)){
+    // Nothing to share, every rank stores its own blocks
+    std::cerr << "PrivateerMPI: Ranks use different block stores, committing independently" << std::endl;
+    return all(privateer.commit_hashed_blocks(hashed_blocks, std::vector<bool>(hashed_blocks.size(), true)), comm);
+  }
+
+  // Exchange (block index, digest) of all dirty blocks
+  std::vector<BlockKey> local_keys(hashed_blocks.size());
+  for (size_t k = 0; k < hashed_blocks.size(); k++){
+    local_keys[k].block_index = hashed_blocks[k].block_index;
+    memcpy(local_keys[k].digest, hashed_blocks[k].digest, utility::DIGEST_SIZE);
+  }
+  int local_bytes = local_keys.size()*sizeof(BlockKey);
+  std::vector<int> rank_bytes(num_ranks), rank_displacements(num_ranks);
+  MPI_Allgather(&local_bytes, 1, MPI_INT, rank_bytes.data(), 1, MPI_INT, comm);
+  size_t total_bytes = 0;
+  for (int r = 0; r < num_ranks; r++){
+    rank_displacements[r] = total_bytes;
+    total_bytes += rank_bytes[r];
+  }
+  std::vector<BlockKey> keys(total_bytes / sizeof(BlockKey));
+  MPI_Allgatherv(local_keys.data(), local_bytes, MPI_BYTE, keys.data(), rank_bytes.data(), rank_displacements.data(), MPI_BYTE, comm);
+
+  // Every rank computes the same assignment: each distinct block goes to the rank holding it
+  // with the fewest blocks to write so far
+  std::map<BlockKey, std::vector<int>> holders;
+  for (int r = 0; r < num_ranks; r++){
+    for (size_t k = rank_displacements[r] / sizeof(BlockKey); k < (rank_displacements[r] + rank_bytes[r]) / sizeof(BlockKey); k++){
+      holders[keys[k]].push_back(r);
+    }
+  }
+  std::vector<size_t> rank_load(num_ranks, 0);
+  std::map<BlockKey, int> writers;
+  for (auto &block_holders : holders){
+    int writer = block_holders.second[0];
+    for (int holder : block_holders.second){
+      if (rank_load[holder] < rank_load[writer]){
+        writer = holder;
+      }
+    }
+    rank_load[writer]++;
+    writers[block_holders.first] = writer;
+  }
+  // Writers store their blocks first, the other holders then map them
+  std::vector<HashedBlock> written_blocks, shared_blocks;
+  for (size_t k = 0; k < hashed_blocks.size(); k++){
+    (writers[local_keys[k]] == rank ? written_blocks : shared_blocks).push_back(hashed_blocks[k]);
+  }
+  bool written = all(privateer.commit_hashed_blocks(written_blocks, std::vector<bool>(written_blocks.size(), true)), comm);
+  if (!written){
+    std::cerr << "PrivateerMPI: Error storing blocks" << std::endl;
+    return false;
+  }
+  return all(privateer.commit_hashed_blocks(shared_blocks, std::vector<bool>(shared_blocks.size(), false)), comm);
+}
+
+inline bool PrivateerMPI::msync(Privateer &privateer, MPI_Comm comm){
+  if (!commit_blocks(privateer, comm)){
+    return false;
+  }
+  // No uncommitted pages are left, only metadata is written
+  return all(privateer.update_metadata(), comm);
+}
+
+inline bool PrivateerMPI::snapshot(Privateer &privateer, const char* version_metadata_path, MPI_Comm comm){
+  if (!commit_blocks(privateer, comm)){
+    return false;
+  }
+  return all(privateer.snapshot(version_metadata_path), comm);
+}
+
+// Rank 0 loads the recipe, the other ranks receive it
+inline BlockTable* PrivateerMPI::broadcast_recipe(const char* version_metadata_path, VersionLayout &layout, MPI_Comm comm){
+  int rank;
+  MPI_Comm_rank(comm, &rank);
+  BlockTable* table = nullptr;
+  uint64_t header[8] = {0};
+  if (rank == 0){
+    table = load_version_digests(version_metadata_path, layout, true);
+    if (table != nullptr){
+      header[0] = 1;
+      header[1] = layout.size;
+      header[2] = layout.capacity;
+      header[3] = layout.granularity;
+      header[4] = layout.num_blocks;
+      header[5] = layout.record_offset;
+      header[6] = layout.legacy ? 1 : 0;
+      header[7] = layout.blocks_dir_path.length();
+    }
+    else{
+      std::cerr << "PrivateerMPI: Error reading version " << version_metadata_path << std::endl;
+    }
+  }
+  MPI_Bcast(header, 8, MPI_UINT64_T, 0, comm);
+  if (header[0] == 0){
+    return nullptr;
+  }
+  std::vector<char> blocks_dir_path(header[7]);
+  if (rank == 0){
+    memcpy(blocks_dir_path.data(), layout.blocks_dir_path.c_str(), header[7]);
+  }
+  MPI_Bcast(blocks_dir_path.data(), header[7], MPI_CHAR, 0, comm);
+  size_t num_blocks = header[4];
+  std::vector<unsigned char> digests(num_blocks*utility::DIGEST_SIZE);
+  if (rank == 0){
+    for (size_t i = 0; i < num_blocks; i++){
+      memcpy(&digests[i*utility::DIGEST_SIZE], table->get(i), utility::DIGEST_SIZE);
+    }
+  }
+  MPI_Bcast(digests.data(), digests.size(), MPI_UNSIGNED_CHAR, 0, comm);
+  if (rank != 0){
+    layout.size = header[1];
+    layout.capacity = header[2];
+    layout.granularity = header[3];
+    layout.num_blocks = num_blocks;
+    layout.record_offset = header[5];
+    layout.legacy = (header[6] == 1);
+    layout.blocks_dir_path = std::string(blocks_dir_path.data(), blocks_dir_path.size());
+    table = new BlockTable(std::max(num_blocks, layout.capacity / layout.granularity));
+    for (size_t i = 0; i < num_blocks; i++){
+      if (!utility::is_empty_digest(&digests[i*utility::DIGEST_SIZE])){
+        table->set(i, &digests[i*utility::DIGEST_SIZE]);
+      }
+    }
+    table->clear_dirty();
+  }
+  return table;
+}
+
+// Reads the first length bytes of a block, length 0 only brings it into the page cache
+inline bool PrivateerMPI::read_block(BlockStorage &block_storage, size_t block_index, const std::string &block_hash, char* buffer, size_t length){
+  int block_fd = block_storage.get_block_fd(block_hash.c_str(), block_index);
+  if (block_fd == -1){
+    std::cerr << "PrivateerMPI: Error opening block " << block_hash << std::endl;
+    return false;
+  }
+  size_t granularity = block_storage.get_block_granularity();
+  std::vector<char> chunk(length == 0 ? std::min(granularity, READ_CHUNK_BYTES) : 0);
+  size_t read_bytes = 0;
+  while (read_bytes < granularity){
+    size_t count = std::min(granularity - read_bytes, length == 0 ? chunk.size() : length - read_bytes);
+    ssize_t ret = ::pread(block_fd, length == 0 ? chunk.data() : buffer + read_bytes, count, read_bytes);
+    if (ret <= 0){
+      break;
+    }
+    read_bytes += ret;
+  }
+  ::close(block_fd);
+  return read_bytes == granularity;
+}
+
+// Node leaders fill their node caches: each block missing from any cache is read by one node
+// and broadcast to all
+inline bool PrivateerMPI::distribute_blocks(BlockStorage &block_storage, const std::vector<std::pair<size_t, std::string>> &distinct_blocks,
+                                            std::string node_cache_dir_path, MPI_Comm leader_comm){
+  int node_index, num_nodes;
+  MPI_Comm_rank(leader_comm, &node_index);
+  MPI_Comm_size(leader_comm, &num_nodes);
+  DirectoryTier node_cache(node_cache_dir_path);
+  size_t files_per_subdirectory = block_storage.get_files_per_subdirectory();
+  size_t granularity = block_storage.get_block_granularity();
+
+  std::vector<unsigned char> local_cached(distinct_blocks.size()), cached(distinct_blocks.size());
+  for (size_t k = 0; k < distinct_blocks.size(); k++){
+    local_cached[k] = node_cache.contains(distinct_blocks[k].first % files_per_subdirectory, distinct_blocks[k].second) ? 1 : 0;
+  }
+  MPI_Allreduce(local_cached.data(), cached.data(), distinct_blocks.size(), MPI_UNSIGNED_CHAR, MPI_MIN, leader_comm);
+
+  char* buffer = new char[granularity];
+  int memory_fd = memfd_create("privateer_block", 0);
+  bool distributed = memory_fd != -1 && ftruncate(memory_fd, granularity) == 0;
+  size_t num_distributed = 0;
+  for (size_t k = 0; k < distinct_blocks.size(); k++){
+    if (cached[k]){
+      continue;
+    }
+    size_t block_index = distinct_blocks[k].first;
+    const std::string &block_hash = distinct_blocks[k].second;
+    int source_node = num_distributed++ % num_nodes;
+    int read = 1;
+    if (node_index == source_node){
+      read = (distributed && read_block(block_storage, block_index, block_hash, buffer, granularity)) ? 1 : 0;
+    }
+    MPI_Bcast(&read, 1, MPI_INT, source_node, leader_comm);
+    if (!read){
+      distributed = false;
+      continue;
+    }
+    MPI_Bcast(buffer, granularity, MPI_BYTE, source_node, leader_comm);
+    if (distributed && !local_cached[k]){
+      distributed = ::pwrite(memory_fd, buffer, granularity, 0) == (ssize_t) granularity
+                    && node_cache.put_block(block_index % files_per_subdirectory, block_hash, memory_fd, granularity);
+    }
+  }
+  if (memory_fd != -1){
+    ::close(memory_fd);
+  }
+  delete [] buffer;
+  return distributed;
+}
+
+// Evicts blocks from a node cache until it holds at most max_bytes, least recently used first;
+// the blocks of the version just opened are used now and evicted last
+inline size_t PrivateerMPI::trim_node_cache(BlockStorage &block_storage, const std::vector<std::pair<size_t, std::string>> &used_blocks,
+                                            std::string node_cache_dir_path, size_t max_bytes){
+  DirectoryTier node_cache(node_cache_dir_path);
+  size_t files_per_subdirectory = block_storage.get_files_per_subdirectory();
+  size_t granularity = block_storage.get_block_granularity();
+  std::set<std::pair<size_t, std::string>> used;
+  for (auto &block : used_blocks){
+    size_t subdir_index = block.first % files_per_subdirectory;
+    std::string block_path = node_cache_dir_path + "/" + std::to_string(subdir_index) + "/" + block.second;
+    utimensat(AT_FDCWD, block_path.c_str(), nullptr, 0);
+    used.insert({subdir_index, block.second});
+  }
+  // (used, last use, subdirectory index, hash)
+  std::vector<std::tuple<bool, time_t, long, size_t, std::string>> cached_blocks;
+  node_cache.for_each_block([&](size_t subdir_index, const std::string &hash){
+    std::string block_path = node_cache_dir_path + "/" + std::to_string(subdir_index) + "/" + hash;
+    struct stat block_stat;
+    if (stat(block_path.c_str(), &block_stat) == 0){
+      cached_blocks.push_back(std::make_tuple(used.count({subdir_index, hash}) > 0, block_stat.st_mtim.tv_sec,
+                                              block_stat.st_mtim.tv_nsec, subdir_index, hash));
+    }
+  });
+  std::sort(cached_blocks.begin(), cached_blocks.end());
+  size_t num_evicted = 0;
+  for (size_t k = 0; k < cached_blocks.size() && (cached_blocks.size() - k)*granularity > max_bytes; k++){
+    if (node_cache.remove_block(std::get<3>(cached_blocks[k]), std::get<4>(cached_blocks[k]))){
+      num_evicted++;
+    }
+  }
+  return num_evicted;
+}
+
+inline bool PrivateerMPI::clear_node_cache(std::string node_cache_dir_path, MPI_Comm comm){
+  MPI_Comm node_comm;
+  int rank, node_rank;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node_comm);
+  MPI_Comm_rank(node_comm, &node_rank);
+  MPI_Comm_free(&node_comm);
+  bool cleared = true;
+  if (node_rank == 0 && utility::directory_exists(node_cache_dir_path.c_str())){
+    DirectoryTier node_cache(node_cache_dir_path);
+    std::vector<std::pair<size_t, std::string>> cached_blocks;
+    node_cache.for_each_block([&](size_t subdir_index, const std::string &hash){
+      cached_blocks.push_back({subdir_index, hash});
+    });
+    for (auto &block : cached_blocks){
+      cleared = node_cache.remove_block(block.first, block.second) && cleared;
+    }
+  }
+  return all(cleared, comm);
+}
+
+inline Privateer* PrivateerMPI::open(const char* version_metadata_path, bool read_only, MPI_Comm comm, std::string node_cache_dir_path,
+                                     size_t node_cache_max_bytes){
+  VersionLayout layout;
+  BlockTable* table = broadcast_recipe(version_metadata_path, layout, comm);
+  if (table == nullptr){
+    return nullptr;
+  }
+
+  // Distinct blocks of the version (a block is stored under its index's subdirectory and hash)
+  BlockStorage block_storage(layout.blocks_dir_path);
+  size_t files_per_subdirectory = block_storage.get_files_per_subdirectory();
+  std::set<std::pair<size_t, std::string>> seen_blocks;
+  std::vector<std::pair<size_t, std::string>> distinct_blocks;
+  for (size_t i = 0; i < layout.num_blocks; i++){
+    if (!table->is_empty(i)){
+      std::string block_hash = utility::digest_to_hex(table->get(i));
+      if (seen_blocks.insert({i % files_per_subdirectory, block_hash}).second){
+        distinct_blocks.push_back({i, block_hash});
+      }
+    }
+  }
+
+  MPI_Comm node_comm, leader_comm;
+  int rank, node_rank, node_size;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node_comm);
+  MPI_Comm_rank(node_comm, &node_rank);
+  MPI_Comm_size(node_comm, &node_size);
+  MPI_Comm_split(comm, node_rank == 0 ? 0 : MPI_UNDEFINED, rank, &leader_comm);
+
+  bool read = true;
+  if (node_cache_dir_path.empty()){
+    // Bring the blocks into the node's page cache, each read by one rank of the node
+    for (size_t k = node_rank; k < distinct_blocks.size(); k += node_size){
+      read = read_block(block_storage, distinct_blocks[k].first, distinct_blocks[k].second, nullptr, 0) && read;
+    }
+  }
+  else if (node_rank == 0){
+    read = distribute_blocks(block_storage, distinct_blocks, node_cache_dir_path, leader_comm);
+  }
+  read = all(read, comm);
+  if (leader_comm != MPI_COMM_NULL){
+    MPI_Comm_free(&leader_comm);
+  }
+  if (!read){
+    std::cerr << "PrivateerMPI: Error reading blocks of " << version_metadata_path << std::endl;
+    MPI_Comm_free(&node_comm);
+    delete table;
+    return nullptr;
+  }
+  Privateer* privateer = new Privateer(nullptr, version_metadata_path, layout, table, read_only, node_cache_dir_path);
+  if (!node_cache_dir_path.empty() && node_cache_max_bytes != 0){
+    // Once all ranks of the node mapped the version
+    MPI_Barrier(node_comm);
+    if (node_rank == 0){
+      trim_node_cache(block_storage, distinct_blocks, node_cache_dir_path, node_cache_max_bytes);
+    }
+  }
+  MPI_Comm_free(&node_comm);
+  return privateer;
+}
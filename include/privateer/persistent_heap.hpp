@@ -0,0 +1,762 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/interprocess/offset_ptr.hpp>
+
+#include "privateer.hpp"
+
+// Pointer stored as a distance from its own address, valid wherever the region is mapped
+template <typename T>
+using OffsetPtr = boost::interprocess::offset_ptr<T>;
+
+class PersistentHeap;
+
+// STL allocator over a PersistentHeap, for containers kept in the region. Its pointers are
+// offset pointers, as are the allocator's own reference to the heap, so containers work in
+// any process that opens the version; boost::container containers support them fully.
+// Allocations from a read-only (or destroyed) heap throw std::bad_alloc, deallocations do nothing
+template <typename T>
+class PersistentAllocator
+{
+  public:
+    using value_type = T;
+    using pointer = OffsetPtr<T>;
+    using const_pointer = OffsetPtr<const T>;
+    using void_pointer = OffsetPtr<void>;
+    using const_void_pointer = OffsetPtr<const void>;
+    using size_type = size_t;
+    using difference_type = ptrdiff_t;
+
+    template <typename U>
+    struct rebind
+    {
+      using other = PersistentAllocator<U>;
+    };
+
+    explicit PersistentAllocator(PersistentHeap** heap_slot) : heap_slot(heap_slot) {}
+    template <typename U>
+    PersistentAllocator(const PersistentAllocator<U> &other) : heap_slot(other.heap_slot) {}
+
+    pointer allocate(size_type n);
+    void deallocate(pointer p, size_type n);
+
+    template <typename U>
+    bool operator==(const PersistentAllocator<U> &other) const { return heap_slot == other.heap_slot; }
+    template <typename U>
+    bool operator!=(const PersistentAllocator<U> &other) const { return heap_slot != other.heap_slot; }
+
+  private:
+    template <typename U>
+    friend class PersistentAllocator;
+
+    OffsetPtr<PersistentHeap*> heap_slot; // In the heap's header, see PersistentHeap::heap_of
+};
+
+// Heap inside a Privateer region, for data structures (graphs, hash tables) that are committed and
+// versioned as they are, without serialization. Objects refer to each other with offset pointers
+// and are found again by name, so the region can be opened at any address.
+//
+// Objects up to MAX_SMALL_SIZE bytes are carved out of chunks of one size class; larger ones take
+// runs of whole chunks. Free objects are tracked by a bitmap per chunk kept, with the chunk
+// directory, in one area at the start of the region instead of within the chunks: allocating and
+// freeing write to a few metadata pages rather than dirtying blocks of otherwise unchanged data.
+// Each thread caches free objects per size class and takes or returns them in batches, so threads
+// rarely meet on the heap lock; caches are returned to the heap by msync and snapshot. The region
+// is resized as chunks are handed out, up to its capacity.
+//
+// Commits store the state of the heap at the time they are called; they should not run
+// concurrently with allocations.
+class PersistentHeap
+{
+  public:
+    static constexpr size_t MIN_ALIGNMENT = 16;
+    static constexpr size_t MAX_SMALL_SIZE = 8192;
+    static constexpr size_t MAX_NAME_LENGTH = 55;
+
+    // Create
+    PersistentHeap(const char* blocks_dir_path, const char* version_metadata_path, size_t max_capacity);
+    // Open, and keep updating the version unless read_only
+    PersistentHeap(const char* version_metadata_path, bool read_only);
+    // Open, writing to a new version
+    PersistentHeap(const char* version_metadata_path, const char* new_version_metadata_path);
+    ~PersistentHeap();
+
+    // nullptr when the heap is full or read-only; alignments above MIN_ALIGNMENT up to the page size
+    void* allocate(size_t size, size_t alignment = MIN_ALIGNMENT);
+    void deallocate(void* object);
+
+    // Named objects: construct fails if the name exists, find returns nullptr if it does not
+    template <typename T, typename... Args>
+    T* construct(const std::string &name, Args&&... args);
+    template <typename T>
+    T* find(const std::string &name);
+    template <typename T, typename... Args>
+    T* find_or_construct(const std::string &name, Args&&... args);
+    template <typename T>
+    bool destroy(const std::string &name);
+
+    template <typename T>
+    PersistentAllocator<T> get_allocator();
+
+    void msync();
+    bool snapshot(const char* version_metadata_path);
+    Privateer* privateer();
+
+    // Heap object of this process whose header holds heap_slot, nullptr if none
+    static PersistentHeap* heap_of(PersistentHeap* const* heap_slot);
+
+  private:
+    static constexpr uint64_t MAGIC = 0x5052565448454150ULL;
+    static constexpr size_t HEADER_SIZE = 4096;
+    static constexpr size_t CHUNK_SIZE = 65536;
+    static constexpr size_t BITMAP_WORDS_PER_CHUNK = CHUNK_SIZE / MIN_ALIGNMENT / 64;
+    static constexpr uint64_t NO_CHUNK = ~0ULL;
+    // Chunk kinds, size classes being 1 to num_classes
+    static constexpr uint32_t FREE_CHUNK = 0;
+    static constexpr uint32_t LARGE_CHUNK = 0xFFFFFFFE; // First chunk of a large object
+    static constexpr uint32_t LARGE_CHUNK_CONTINUED = 0xFFFFFFFF;
+
+    // At offset 0 of the region
+    struct Header
+    {
+      uint64_t magic;
+      uint64_t chunk_size;
+      uint64_t max_chunks;
+      uint64_t directory_offset; // ChunkEntry per chunk
+      uint64_t bitmap_offset; // BITMAP_WORDS_PER_CHUNK words per chunk, set bits are allocated objects
+      uint64_t data_offset; // First chunk
+      uint64_t num_chunks; // Chunks handed out, the region covers them
+      uint64_t names_offset; // NamedEntry table, 0 if none
+      uint64_t names_capacity;
+      uint64_t num_names;
+      PersistentHeap* heap; // Slot identifying the heap to its allocators, its content is not used
+    };
+
+    struct ChunkEntry
+    {
+      uint32_t kind;
+      uint32_t num_chunks; // Of a large object, on its first chunk
+    };
+
+    struct NamedEntry
+    {
+      char name[MAX_NAME_LENGTH + 1];
+      uint64_t offset;
+    };
+
+    struct ThreadCache
+    {
+      std::mutex mutex;
+      std::vector<std::vector<uint64_t>> objects; // Offsets of free objects, per size class
+    };
+
+    Privateer* region;
+    bool read_only;
+    char* base;
+    Header* header;
+    ChunkEntry* directory;
+    uint64_t* bitmaps;
+    std::vector<size_t> class_sizes;
+
+    std::mutex heap_mutex; // Chunks, bitmaps and the lists below
+    std::map<uint64_t, uint64_t> free_runs; // First chunk, number of chunks
+    std::vector<std::vector<uint64_t>> partial_chunks; // Chunks with free objects, per size class
+    std::vector<bool> chunk_listed; // In partial_chunks
+
+    std::mutex names_mutex;
+    std::map<std::string, uint64_t> name_index; // Entry index in the names table
+
+    uint64_t heap_id;
+    std::mutex thread_caches_mutex;
+    std::vector<ThreadCache*> thread_caches;
+
+    // Heaps open in this process by header slot; the generation changes with every open and close
+    static std::mutex& registry_mutex();
+    static std::map<PersistentHeap* const*, PersistentHeap*>& registry();
+    static std::atomic<uint64_t>& registry_generation();
+
+    void init();
+    void format();
+    void load();
+    size_t size_class(size_t size);
+    size_t class_size(uint32_t kind);
+    size_t cache_batch(size_t class_index);
+    ThreadCache* thread_cache();
+    void release_thread_caches();
+    uint64_t allocate_chunks(uint64_t num_chunks);
+    void free_chunks(uint64_t first_chunk, uint64_t num_chunks);
+    void refill(size_t class_index, std::vector<uint64_t> &objects, size_t count);
+    void release(size_t class_index, std::vector<uint64_t> &objects, size_t count);
+    uint64_t chunk_offset(uint64_t chunk);
+    NamedEntry* names();
+    void* find_object(const std::string &name);
+    bool add_name(const std::string &name, void* object);
+    void* remove_name(const std::string &name);
+};
+
+template <typename T>
+inline typename PersistentAllocator<T>::pointer PersistentAllocator<T>::allocate(size_type n){
+  PersistentHeap* heap = PersistentHeap::heap_of(heap_slot.get());
+  void* memory = (heap != nullptr) ? heap->allocate(n*sizeof(T), alignof(T)) : nullptr;
+  // Containers expect allocation failures as exceptions
+  if (memory == nullptr){
+    throw std::bad_alloc();
+  }
+  return pointer((T*) memory);
+}
+
+template <typename T>
+inline void PersistentAllocator<T>::deallocate(pointer p, size_type){
+  PersistentHeap* heap = PersistentHeap::heap_of(heap_slot.get());
+  if (heap != nullptr){
+    heap->deallocate(p.get());
+  }
+}
+
+inline PersistentHeap::PersistentHeap(const char* blocks_dir_path, const char* version_metadata_path, size_t max_capacity){
+  region = new Privateer(blocks_dir_path, version_metadata_path, max_capacity);
+  read_only = false;
+  init();
+  format();
+}
+
+inline PersistentHeap::PersistentHeap(const char* version_metadata_path, bool read_only_arg){
+  region = new Privateer(version_metadata_path, read_only_arg);
+  read_only = read_only_arg;
+  init();
+  load();
+}
+
+inline PersistentHeap::PersistentHeap(const char* version_metadata_path, const char* new_version_metadata_path){
+  region = new Privateer(version_metadata_path, new_version_metadata_path);
+  read_only = false;
+  init();
+  load();
+}
+
+inline PersistentHeap::~PersistentHeap(){
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    registry().erase(&header->heap);
+    registry_generation()++;
+  }
+  for (ThreadCache* cache : thread_caches){
+    delete cache;
+  }
+  delete region;
+}
+
+inline void PersistentHeap::init(){
+  static std::atomic<uint64_t> num_heaps(0);
+  heap_id = ++num_heaps;
+  base = (char*) region->data();
+  header = (Header*) base;
+  // Multiples of 16 bytes up to 128, then four classes per power of two
+  for (size_t size = MIN_ALIGNMENT; size <= 128; size += MIN_ALIGNMENT){
+    class_sizes.push_back(size);
+  }
+  for (size_t power = 128; power < MAX_SMALL_SIZE; power *= 2){
+    for (size_t step = 1; step <= 4; step++){
+      class_sizes.push_back(power + step*power / 4);
+    }
+  }
+  partial_chunks.resize(class_sizes.size());
+  // The region may be read-only, allocators find the heap by the address of the header's slot
+  std::lock_guard<std::mutex> lock(registry_mutex());
+  registry()[&header->heap] = this;
+  registry_generation()++;
+}
+
+inline std::mutex& PersistentHeap::registry_mutex(){
+  static std::mutex mutex;
+  return mutex;
+}
+
+inline std::map<PersistentHeap* const*, PersistentHeap*>& PersistentHeap::registry(){
+  static std::map<PersistentHeap* const*, PersistentHeap*> heaps;
+  return heaps;
+}
+
+inline std::atomic<uint64_t>& PersistentHeap::registry_generation(){
+  static std::atomic<uint64_t> generation(0);
+  return generation;
+}
+
+inline PersistentHeap* PersistentHeap::heap_of(PersistentHeap* const* heap_slot){
+  // Allocators of a container keep asking for the same heap, remembered until a heap opens or closes
+  static thread_local PersistentHeap* const* last_heap_slot = nullptr;
+  static thread_local uint64_t last_generation = 0;
+  static thread_local PersistentHeap* last_heap = nullptr;
+  if (heap_slot == last_heap_slot && registry_generation().load() == last_generation){
+    return last_heap;
+  }
+  std::lock_guard<std::mutex> lock(registry_mutex());
+  auto found = registry().find(heap_slot);
+  last_heap_slot = heap_slot;
+  last_generation = registry_generation().load();
+  last_heap = (found != registry().end()) ? found->second : nullptr;
+  return last_heap;
+}
+
+inline void PersistentHeap::format(){
+  size_t capacity = region->max_size();
+  uint64_t max_chunks = (capacity - HEADER_SIZE) / (CHUNK_SIZE + sizeof(ChunkEntry) + BITMAP_WORDS_PER_CHUNK*sizeof(uint64_t));
+  uint64_t directory_offset = HEADER_SIZE;
+  uint64_t bitmap_offset, data_offset;
+  // Metadata areas rounded up to pages, chunks aligned on the chunk size
+  while (true){
+    bitmap_offset = (directory_offset + max_chunks*sizeof(ChunkEntry) + HEADER_SIZE - 1) / HEADER_SIZE * HEADER_SIZE;
+    data_offset = (bitmap_offset + max_chunks*BITMAP_WORDS_PER_CHUNK*sizeof(uint64_t) + CHUNK_SIZE - 1) / CHUNK_SIZE * CHUNK_SIZE;
+    if (max_chunks == 0 || data_offset + max_chunks*CHUNK_SIZE <= capacity){
+      break;
+    }
+    max_chunks--;
+  }
+  if (max_chunks == 0 || !region->resize(data_offset)){
+    std::cerr << "PersistentHeap: Capacity too small for a heap" << std::endl;
+    exit(-1);
+  }
+  header->magic = MAGIC;
+  header->chunk_size = CHUNK_SIZE;
+  header->max_chunks = max_chunks;
+  header->directory_offset = directory_offset;
+  header->bitmap_offset = bitmap_offset;
+  header->data_offset = data_offset;
+  header->num_chunks = 0;
+  header->names_offset = 0;
+  header->names_capacity = 0;
+  header->num_names = 0;
+  header->heap = nullptr;
+  directory = (ChunkEntry*) (base + directory_offset);
+  bitmaps = (uint64_t*) (base + bitmap_offset);
+  chunk_listed.assign(max_chunks, false);
+}
+
+// Rebuilds the free chunk runs, chunks with free objects and name index from the region
+inline void PersistentHeap::load(){
+  if (region->current_size() < HEADER_SIZE || header->magic != MAGIC || header->chunk_size != CHUNK_SIZE){
+    std::cerr << "PersistentHeap: Version does not contain a heap" << std::endl;
+    exit(-1);
+  }
+  directory = (ChunkEntry*) (base + header->directory_offset);
+  bitmaps = (uint64_t*) (base + header->bitmap_offset);
+  chunk_listed.assign(header->max_chunks, false);
+  uint64_t run_first_chunk = NO_CHUNK;
+  for (uint64_t chunk = 0; chunk <= header->num_chunks; chunk++){
+    uint32_t kind = (chunk < header->num_chunks) ? directory[chunk].kind : LARGE_CHUNK;
+    if (kind == FREE_CHUNK){
+      run_first_chunk = (run_first_chunk == NO_CHUNK) ? chunk : run_first_chunk;
+      continue;
+    }
+    if (run_first_chunk != NO_CHUNK){
+      free_runs[run_first_chunk] = chunk - run_first_chunk;
+      run_first_chunk = NO_CHUNK;
+    }
+    if (kind >= 1 && kind <= class_sizes.size()){
+      size_t num_allocated = 0;
+      for (size_t i = 0; i < BITMAP_WORDS_PER_CHUNK; i++){
+        num_allocated += __builtin_popcountll(bitmaps[chunk*BITMAP_WORDS_PER_CHUNK + i]);
+      }
+      if (num_allocated < CHUNK_SIZE / class_size(kind)){
+        partial_chunks[kind - 1].push_back(chunk);
+        chunk_listed[chunk] = true;
+      }
+    }
+  }
+  NamedEntry* entries = names();
+  for (uint64_t i = 0; i < header->num_names; i++){
+    name_index[std::string(entries[i].name)] = i;
+  }
+}
+
+inline Privateer* PersistentHeap::privateer(){
+  return region;
+}
+
+inline void PersistentHeap::msync(){
+  release_thread_caches();
+  region->msync();
+}
+
+inline bool PersistentHeap::snapshot(const char* version_metadata_path){
+  release_thread_caches();
+  return region->snapshot(version_metadata_path);
+}
+
+template <typename T>
+inline PersistentAllocator<T> PersistentHeap::get_allocator(){
+  return PersistentAllocator<T>(&header->heap);
+}
+
+inline size_t PersistentHeap::size_class(size_t size){
+  return std::lower_bound(class_sizes.begin(), class_sizes.end(), size) - class_sizes.begin();
+}
+
+inline size_t PersistentHeap::class_size(uint32_t kind){
+  return class_sizes[kind - 1];
+}
+
+// Objects moved between a thread cache and the heap at once, about 16 KiB
+inline size_t PersistentHeap::cache_batch(size_t class_index){
+  return std::min((size_t) 64, std::max((size_t) 2, 16384 / class_sizes[class_index]));
+}
+
+inline uint64_t PersistentHeap::chunk_offset(uint64_t chunk){
+  return header->data_offset + chunk*CHUNK_SIZE;
+}
+
+inline PersistentHeap::ThreadCache* PersistentHeap::thread_cache(){
+  // Heap identifiers are not reused, so caches of destroyed heaps are never found again
+  static thread_local std::unordered_map<uint64_t, ThreadCache*> caches_of_thread;
+  static thread_local uint64_t last_heap_id = 0;
+  static thread_local ThreadCache* last_cache = nullptr;
+  if (last_heap_id == heap_id){
+    return last_cache;
+  }
+  ThreadCache* &cache = caches_of_thread[heap_id];
+  if (cache == nullptr){
+    cache = new ThreadCache();
+    cache->objects.resize(class_sizes.size());
+    std::lock_guard<std::mutex> lock(thread_caches_mutex);
+    thread_caches.push_back(cache);
+  }
+  last_heap_id = heap_id;
+  last_cache = cache;
+  return cache;
+}
+
+// Returns the objects cached by all threads, so that commits record them as free
+inline void PersistentHeap::release_thread_caches(){
+  std::lock_guard<std::mutex> lock(thread_caches_mutex);
+  for (ThreadCache* cache : thread_caches){
+    std::lock_guard<std::mutex> cache_lock(cache->mutex);
+    for (size_t class_index = 0; class_index < class_sizes.size(); class_index++){
+      if (!cache->objects[class_index].empty()){
+        std::lock_guard<std::mutex> heap_lock(heap_mutex);
+        release(class_index, cache->objects[class_index], cache->objects[class_index].size());
+      }
+    }
+  }
+}
+
+// Called with heap_mutex held; grows the region to cover new chunks
+inline uint64_t PersistentHeap::allocate_chunks(uint64_t num_chunks){
+  for (auto run = free_runs.begin(); run != free_runs.end(); ++run){
+    if (run->second >= num_chunks){
+      uint64_t first_chunk = run->first;
+      uint64_t remaining_chunks = run->second - num_chunks;
+      free_runs.erase(run);
+      if (remaining_chunks > 0){
+        free_runs[first_chunk + num_chunks] = remaining_chunks;
+      }
+      return first_chunk;
+    }
+  }
+  if (header->num_chunks + num_chunks > header->max_chunks){
+    return NO_CHUNK;
+  }
+  size_t end = chunk_offset(header->num_chunks + num_chunks);
+  if (end > region->current_size() && !region->resize(end)){
+    return NO_CHUNK;
+  }
+  uint64_t first_chunk = header->num_chunks;
+  header->num_chunks += num_chunks;
+  return first_chunk;
+}
+
+// Called with heap_mutex held
+inline void PersistentHeap::free_chunks(uint64_t first_chunk, uint64_t num_chunks){
+  for (uint64_t chunk = first_chunk; chunk < first_chunk + num_chunks; chunk++){
+    directory[chunk] = {FREE_CHUNK, 0};
+  }
+  auto next = free_runs.lower_bound(first_chunk);
+  if (next != free_runs.end() && first_chunk + num_chunks == next->first){
+    num_chunks += next->second;
+    free_runs.erase(next);
+  }
+  auto previous = free_runs.lower_bound(first_chunk);
+  if (previous != free_runs.begin() && std::prev(previous)->first + std::prev(previous)->second == first_chunk){
+    --previous;
+    first_chunk = previous->first;
+    num_chunks += previous->second;
+    free_runs.erase(previous);
+  }
+  // A run at the end goes back to the unused chunks
+  if (first_chunk + num_chunks == header->num_chunks){
+    header->num_chunks = first_chunk;
+  }
+  else{
+    free_runs[first_chunk] = num_chunks;
+  }
+}
+
+// Takes free objects of a size class until objects holds count of them; called with heap_mutex held
+inline void PersistentHeap::refill(size_t class_index, std::vector<uint64_t> &objects, size_t count){
+  size_t object_size = class_sizes[class_index];
+  size_t objects_per_chunk = CHUNK_SIZE / object_size;
+  std::vector<uint64_t> &chunks = partial_chunks[class_index];
+  while (objects.size() < count){
+    if (chunks.empty()){
+      uint64_t chunk = allocate_chunks(1);
+      if (chunk == NO_CHUNK){
+        return;
+      }
+      directory[chunk] = {(uint32_t) class_index + 1, 1};
+      chunks.push_back(chunk);
+      chunk_listed[chunk] = true;
+    }
+    uint64_t chunk = chunks.back();
+    uint64_t* bitmap = bitmaps + chunk*BITMAP_WORDS_PER_CHUNK;
+    bool chunk_full = true;
+    for (size_t i = 0; i < (objects_per_chunk + 63) / 64; i++){
+      size_t num_bits = std::min((size_t) 64, objects_per_chunk - i*64);
+      uint64_t valid_mask = (num_bits == 64) ? ~0ULL : ((1ULL << num_bits) - 1);
+      uint64_t free_bits = ~bitmap[i] & valid_mask;
+      while (free_bits != 0 && objects.size() < count){
+        size_t bit = __builtin_ctzll(free_bits);
+        free_bits &= free_bits - 1;
+        bitmap[i] |= 1ULL << bit;
+        objects.push_back(chunk_offset(chunk) + (i*64 + bit)*object_size);
+      }
+      if (free_bits != 0){
+        chunk_full = false;
+        break;
+      }
+    }
+    if (chunk_full){
+      chunks.pop_back();
+      chunk_listed[chunk] = false;
+    }
+  }
+}
+
+// Returns the last count objects to their chunks; called with heap_mutex held
+inline void PersistentHeap::release(size_t class_index, std::vector<uint64_t> &objects, size_t count){
+  size_t object_size = class_sizes[class_index];
+  for (size_t k = objects.size() - count; k < objects.size(); k++){
+    uint64_t chunk = (objects[k] - header->data_offset) / CHUNK_SIZE;
+    size_t object_index = (objects[k] - chunk_offset(chunk)) / object_size;
+    bitmaps[chunk*BITMAP_WORDS_PER_CHUNK + object_index / 64] &= ~(1ULL << (object_index % 64));
+    if (!chunk_listed[chunk]){
+      partial_chunks[class_index].push_back(chunk);
+      chunk_listed[chunk] = true;
+    }
+  }
+  objects.resize(objects.size() - count);
+}
+
+inline void* PersistentHeap::allocate(size_t size, size_t alignment){
+  if (read_only){
+    std::cerr << "PersistentHeap: Heap is read-only" << std::endl;
+    return nullptr;
+  }
+  if (alignment > HEADER_SIZE){
+    std::cerr << "PersistentHeap: Alignment larger than a page is not supported" << std::endl;
+    return nullptr;
+  }
+  size = std::max(size, (size_t) 1);
+  // Objects of a power-of-two class are aligned on their size
+  if (alignment > MIN_ALIGNMENT){
+    size_t power = alignment;
+    while (power < size){
+      power *= 2;
+    }
+    size = power;
+  }
+  if (size <= MAX_SMALL_SIZE){
+    size_t class_index = size_class(size);
+    ThreadCache* cache = thread_cache();
+    std::lock_guard<std::mutex> cache_lock(cache->mutex);
+    std::vector<uint64_t> &objects = cache->objects[class_index];
+    if (objects.empty()){
+      std::lock_guard<std::mutex> heap_lock(heap_mutex);
+      refill(class_index, objects, cache_batch(class_index));
+    }
+    if (objects.empty()){
+      std::cerr << "PersistentHeap: Out of capacity" << std::endl;
+      return nullptr;
+    }
+    uint64_t offset = objects.back();
+    objects.pop_back();
+    return base + offset;
+  }
+  uint64_t num_chunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  std::lock_guard<std::mutex> heap_lock(heap_mutex);
+  uint64_t first_chunk = allocate_chunks(num_chunks);
+  if (first_chunk == NO_CHUNK){
+    std::cerr << "PersistentHeap: Out of capacity" << std::endl;
+    return nullptr;
+  }
+  directory[first_chunk] = {LARGE_CHUNK, (uint32_t) num_chunks};
+  for (uint64_t chunk = first_chunk + 1; chunk < first_chunk + num_chunks; chunk++){
+    directory[chunk] = {LARGE_CHUNK_CONTINUED, 0};
+  }
+  return base + chunk_offset(first_chunk);
+}
+
+inline void PersistentHeap::deallocate(void* object){
+  if (object == nullptr || read_only){
+    return;
+  }
+  uint64_t offset = (char*) object - base;
+  uint64_t chunk = (offset - header->data_offset) / CHUNK_SIZE;
+  if (offset < header->data_offset || chunk >= header->max_chunks){
+    std::cerr << "PersistentHeap: Freeing an object that is not in the heap" << std::endl;
+    return;
+  }
+  uint32_t kind = directory[chunk].kind;
+  if (kind >= 1 && kind <= class_sizes.size()){
+    size_t class_index = kind - 1;
+    ThreadCache* cache = thread_cache();
+    std::lock_guard<std::mutex> cache_lock(cache->mutex);
+    std::vector<uint64_t> &objects = cache->objects[class_index];
+    objects.push_back(offset);
+    // Keep one batch for the next allocations
+    if (objects.size() >= 2*cache_batch(class_index)){
+      std::lock_guard<std::mutex> heap_lock(heap_mutex);
+      release(class_index, objects, objects.size() - cache_batch(class_index));
+    }
+    return;
+  }
+  if (kind != LARGE_CHUNK || offset != chunk_offset(chunk)){
+    std::cerr << "PersistentHeap: Freeing an object that is not allocated" << std::endl;
+    return;
+  }
+  std::lock_guard<std::mutex> heap_lock(heap_mutex);
+  free_chunks(chunk, directory[chunk].num_chunks);
+}
+
+inline PersistentHeap::NamedEntry* PersistentHeap::names(){
+  return (NamedEntry*) (base + header->names_offset);
+}
+
+inline void* PersistentHeap::find_object(const std::string &name){
+  std::lock_guard<std::mutex> lock(names_mutex);
+  auto found = name_index.find(name);
+  if (found == name_index.end()){
+    return nullptr;
+  }
+  return base + names()[found->second].offset;
+}
+
+// Called with names_mutex held; the table doubles when full
+inline bool PersistentHeap::add_name(const std::string &name, void* object){
+  if (header->num_names == header->names_capacity){
+    uint64_t new_capacity = std::max((uint64_t) 64, 2*header->names_capacity);
+    NamedEntry* new_entries = (NamedEntry*) allocate(new_capacity*sizeof(NamedEntry));
+    if (new_entries == nullptr){
+      return false;
+    }
+    if (header->num_names > 0){
+      memcpy(new_entries, names(), header->num_names*sizeof(NamedEntry));
+      deallocate(names());
+    }
+    header->names_offset = (char*) new_entries - base;
+    header->names_capacity = new_capacity;
+  }
+  NamedEntry &entry = names()[header->num_names];
+  memset(entry.name, 0, sizeof(entry.name));
+  memcpy(entry.name, name.c_str(), name.size());
+  entry.offset = (char*) object - base;
+  name_index[name] = header->num_names;
+  header->num_names++;
+  return true;
+}
+
+// Called with names_mutex held; the last entry takes the place of the removed one
+inline void* PersistentHeap::remove_name(const std::string &name){
+  auto found = name_index.find(name);
+  if (found == name_index.end()){
+    return nullptr;
+  }
+  uint64_t entry_index = found->second;
+  NamedEntry* entries = names();
+  void* object = base + entries[entry_index].offset;
+  name_index.erase(found);
+  header->num_names--;
+  if (entry_index != header->num_names){
+    entries[entry_index] = entries[header->num_names];
+    name_index[std::string(entries[entry_index].name)] = entry_index;
+  }
+  return object;
+}
+
+template <typename T, typename... Args>
+inline T* PersistentHeap::construct(const std::string &name, Args&&... args){
+  if (name.empty() || name.size() > MAX_NAME_LENGTH){
+    std::cerr << "PersistentHeap: Object names must have 1 to " << MAX_NAME_LENGTH << " characters" << std::endl;
+    return nullptr;
+  }
+  if (find_object(name) != nullptr){
+    std::cerr << "PersistentHeap: Object " << name << " already exists" << std::endl;
+    return nullptr;
+  }
+  void* memory = allocate(sizeof(T), alignof(T));
+  if (memory == nullptr){
+    return nullptr;
+  }
+  // Constructed outside the lock, the constructor may construct other named objects
+  T* object = new (memory) T(std::forward<Args>(args)...);
+  bool added;
+  {
+    std::lock_guard<std::mutex> lock(names_mutex);
+    added = name_index.find(name) == name_index.end() && add_name(name, object);
+  }
+  if (!added){
+    std::cerr << "PersistentHeap: Error naming object " << name << std::endl;
+    object->~T();
+    deallocate(object);
+    return nullptr;
+  }
+  return object;
+}
+
+template <typename T>
+inline T* PersistentHeap::find(const std::string &name){
+  return (T*) find_object(name);
+}
+
+template <typename T, typename... Args>
+inline T* PersistentHeap::find_or_construct(const std::string &name, Args&&... args){
+  T* object = find<T>(name);
+  if (object == nullptr){
+    object = construct<T>(name, std::forward<Args>(args)...);
+  }
+  return object;
+}
+
+template <typename T>
+inline bool PersistentHeap::destroy(const std::string &name){
+  if (read_only){
+    std::cerr << "PersistentHeap: Heap is read-only" << std::endl;
+    return false;
+  }
+  T* object;
+  {
+    std::lock_guard<std::mutex> lock(names_mutex);
+    object = (T*) remove_name(name);
+  }
+  if (object == nullptr){
+    return false;
+  }
+  object->~T();
+  deallocate(object);
+  return true;
+}
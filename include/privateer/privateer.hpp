@@ -24,15 +24,44 @@
 #include <cmath>
 #include <omp.h>
 #include <sstream>
+#include <mutex>
 
 #include "utility/pagemap.hpp"
 #include "utility/sha256_hash.hpp"
 #include "utility/file_util.hpp"
 #include "utility/system.hpp"
 #include "block_storage.hpp"
+#include "block_table.hpp"
+#include "dirty_page_bitmap.hpp"
+#include "recipe.hpp"
+#include "version_catalog.hpp"
+#include "version_diff.hpp"
+#include "version_merge.hpp"
 
 namespace fs = std::filesystem;
 
+// A block with uncommitted pages and the digest of its current content
+struct HashedBlock
+{
+  size_t block_index;
+  unsigned char digest[utility::DIGEST_SIZE];
+};
+
+// How commits find the pages written since the last commit
+enum class DirtyTracking
+{
+  PAGEMAP, // Scan the page table entries of every block (USE_PAGEMAP)
+  EXPLICIT // Only blocks with pages marked by mark_dirty, writes to other blocks are not committed
+};
+
+// How committed blocks are mapped back into the region
+enum class CommitMode
+{
+  REMAP,   // Map the new block files, pages fault back in when accessed
+  RESIDENT, // Also populate the page tables from the block files, for regions used again right away
+  INGEST    // Write the block files out and drop them from the page cache, for data written once
+};
+
 class Privateer
 {
 public:
@@ -52,18 +81,75 @@ public:
   Privateer(void *addr, const char *version_metadata_path, bool read_only);
   Privateer(const char *version_metadata_path, bool read_only);
 
+  // Open from a recipe loaded elsewhere, e.g. by another process (see mpi/privateer_mpi.hpp),
+  // taking ownership of blocks; blocks found in read_cache_dir_path are mapped from there
+  Privateer(void* addr, const char *version_metadata_path, const VersionLayout &layout, BlockTable* blocks, bool read_only,
+            std::string read_cache_dir_path = "");
+
   ~Privateer();
 
   bool resize(size_t size);
   void msync();
   bool snapshot(const char* version_metadata_path);
+  // Commit only the blocks overlapping [offset, offset + length), the rest of the region keeps
+  // its last committed state; safe to call concurrently on disjoint ranges
+  bool msync_range(size_t offset, size_t length);
+  bool snapshot_range(const char* version_metadata_path, size_t offset, size_t length);
+  // Switches to another version of the same data store, remapping only blocks that differ;
+  // uncommitted changes are discarded
+  bool checkout(const char* version_metadata_path);
+  // Read-only: follows the latest committed state of the version, written by another process
+  bool refresh();
+  // Writable in-memory copy of the current state (committed blocks and uncommitted pages),
+  // not attached to any version until it is snapshotted; owned by the caller. The clone keeps
+  // the dirty tracking mode (with the pages marked so far), volatile ranges and commit mode
+  Privateer* clone(void* addr = nullptr);
+  // Switches how commits find written pages; set before writing, not concurrently with mark_dirty
+  void set_dirty_tracking(DirtyTracking mode);
+  // EXPLICIT tracking: marks [offset, offset + length) as written, cheap to call from many threads
+  void mark_dirty(size_t offset, size_t length);
+  // Excludes the pages of [offset, offset + length) from writeback, e.g. scratch buffers: commits
+  // record them as zeros (whole blocks as empty recipe entries) and drop them from memory.
+  // Kept by this object only, not with the version; not concurrently with commits
+  void set_volatile(size_t offset, size_t length);
+  // Announces that the pages of [offset, offset + length) are about to be entirely rewritten:
+  // their content is dropped, so first writes fault zero pages instead of reading the block files.
+  // The range must be written before the next commit, its content is undefined until then
+  bool will_overwrite(size_t offset, size_t length);
+  // With direct_io, blocks are written with O_DIRECT where the file system supports it
+  void set_commit_mode(CommitMode mode, bool direct_io = false);
+  // Copy data in and out of the region without faulting its pages in: whole blocks written are
+  // stored from buffer directly, partial blocks are written to memory (and committed as usual);
+  // pages without uncommitted changes are read from their block files
+  bool write(size_t offset, const void* buffer, size_t length);
+  bool read(size_t offset, void* buffer, size_t length);
   void* data();
   size_t current_size();
   size_t max_size();
   static size_t version_size(std::string version_path);
   static size_t version_capacity(std::string version_path);
+  std::string blocks_path();
+  // Two-phase block commit, for processes coordinating commits to a shared block store (see
+  // mpi/privateer_mpi.hpp): hashes the blocks with uncommitted pages (or marked pages, with
+  // EXPLICIT tracking; volatile pages are zeroed first), then commits them, storing the blocks
+  // marked in store and mapping the others from blocks stored by another process. Not
+  // concurrently with writes to the region
+  std::vector<HashedBlock> hash_dirty_blocks();
+  bool commit_hashed_blocks(const std::vector<HashedBlock> &hashed_blocks, const std::vector<bool> &store);
+  // Writes the recipe of the committed blocks to the version, completing a two-phase commit
+  bool update_metadata();
+  // Drops the uncommitted pages of the given blocks
+  bool discard_blocks(const std::vector<size_t> &block_indices);
+  // Byte ranges that differ between two versions, see VersionDiff to stream them instead (and to
+  // tell a read error from the end of the ranges)
+  static std::vector<ChangedRange> diff(std::string version_a, std::string version_b);
+  // Three-way merge of versions a and b of base into out_version, see VersionMerge
+  static bool merge(std::string base_version, std::string version_a, std::string version_b, std::string out_version,
+                    MergeConflictPolicy policy = VersionMerge::fail);
 
 private:
+  Privateer() = default; // See clone()
+
   void create(void *addr, const char *blocks_dir_path, const char *version_metadata_path, size_t max_capacity);
 
   void create(void *addr, const char *blocks_dir_path, const char *version_metadata_path, size_t original_size, size_t max_capacity);
@@ -72,36 +158,82 @@ private:
 
   void open(void* addr, const char *version_metadata_path, bool read_only);
 
+  void open(void* addr, const char *version_metadata_path, const VersionLayout &layout, BlockTable* loaded_blocks, bool read_only,
+            std::string read_cache_dir_path);
+
+  void map_region(void* addr, size_t num_recipe_blocks, bool read_only);
+
+  void commit_blocks();
+
+  void commit_blocks(size_t first_block, size_t last_block);
+
+  bool block_range(size_t offset, size_t length, size_t &first_block, size_t &last_block);
+
+  bool write_snapshot(const char* version_metadata_path, size_t first_block, size_t last_block);
+
   void msync_memcopy();
 
-  void msync_pagemap();
+  void msync_pagemap(size_t first_block, size_t last_block);
 
   void msync_pagemap_block_no_copy(void* block_start, size_t block_size);
 
+  void msync_marked(size_t first_block, size_t last_block);
+
+  bool map_committed_block(size_t block_index, int block_fd);
+
+  bool store_full_block(size_t block_index, const char* buffer);
+
+  bool read_block_range(size_t block_index, size_t start, size_t end, char* buffer);
+
+  void commit_marked_block(size_t block_index, const uint64_t* page_words);
+
+  std::vector<size_t> volatile_blocks(size_t first_block, size_t last_block);
+
+  void clear_volatile_pages(size_t first_block, size_t last_block);
+
+  void drop_volatile_pages(size_t first_block, size_t last_block);
+
   void validate(int region_index, int fd);
 
-  void update_metadata();
+  bool write_metadata_copy(int new_metadata_fd);
+
+  void start_block_demotion();
+
+  void* block_address(size_t block_index);
+
+  bool block_has_private_pages(size_t block_index);
+
+  bool remap_block(size_t block_index, const unsigned char* digest, bool within_size);
+
+  bool copy_private_pages(size_t block_index, Privateer* target);
 
   void *m_addr;
   uint64_t m_max_size;
   uint64_t m_current_size;
   int* m_fds; // Array of fds
-  std::string* blocks;
-  void **regions;
+  BlockTable* blocks; // Block digests (file recipe)
+  size_t metadata_num_blocks; // Entries of the recipe file, stale only where blocks is dirty
+  bool metadata_is_legacy;
+  VersionCatalog* catalog; // Set for versions kept in the store's version catalog
+  std::string catalog_name;
+  uint64_t catalog_record_offset; // Record blocks is clean with respect to
   static size_t const FILE_GRANULARITY_DEFAULT_BYTES;
-  static size_t const HASH_SIZE;
-  std::string EMPTY_BLOCK_HASH;
   std::string blocks_dir_path;
   std::string version_metadata_dir_path;
   int metadata_fd;
   size_t file_granularity;
-  std::map<std::string,int> block_file_exist_map;
   bool m_read_only;
   BlockStorage* block_storage;
+  static constexpr size_t NUM_BLOCK_COMMIT_LOCKS = 64;
+  std::mutex block_commit_mutexes[NUM_BLOCK_COMMIT_LOCKS]; // Striped over blocks, see msync_range
+  std::mutex metadata_mutex;
+  DirtyTracking dirty_tracking = DirtyTracking::PAGEMAP;
+  DirtyPageBitmap* dirty_pages = nullptr; // Pages marked since the last commit, EXPLICIT tracking only
+  CommitMode commit_mode = CommitMode::REMAP;
+  std::map<size_t, size_t> volatile_ranges; // Disjoint page-aligned [start, end) byte ranges, see set_volatile
 };
 
 size_t const Privateer::FILE_GRANULARITY_DEFAULT_BYTES = 2*134217728; // 128 MBs 
-size_t const Privateer::HASH_SIZE = 64; // size of SHA-256 hash
 
 // Create interface
 inline Privateer::Privateer(void *addr, const char *blocks_path, const char *version_metadata_path, size_t max_capacity)
@@ -145,6 +277,12 @@ inline Privateer::Privateer(void* addr, const char *version_metadata_path, bool
   open(addr, version_metadata_path, read_only);
 }
 
+inline Privateer::Privateer(void* addr, const char *version_metadata_path, const VersionLayout &layout, BlockTable* loaded_blocks, bool read_only,
+                            std::string read_cache_dir_path)
+{
+  open(addr, version_metadata_path, layout, loaded_blocks, read_only, read_cache_dir_path);
+}
+
 inline void Privateer::create(void *addr, const char *blocks_path, const char *version_metadata_path, size_t max_capacity)
 {
   // Verify page alignment
@@ -178,9 +316,19 @@ inline void Privateer::create(void *addr, const char *blocks_path, const char *v
 
   // std::cout << "Privateer: creating region with Capacity: " << max_capacity << " at address " << (uint64_t) addr << std::endl;
 
-  // create version metadata directory
+  // create version metadata directory, unless the version is kept in the version catalog
   version_metadata_dir_path = version_metadata_path;
-  if (blocks_dir_path.compare(version_metadata_dir_path) != 0){
+  catalog = nullptr;
+  std::string catalog_blocks_dir_path;
+  // A reference to the catalog of the store created here, or of another (existing) store
+  bool in_catalog = VersionCatalog::split_reference(version_metadata_dir_path, catalog_blocks_dir_path, catalog_name)
+                    && (catalog_blocks_dir_path.compare(blocks_path) == 0
+                        || VersionCatalog::parse_reference(version_metadata_dir_path, catalog_blocks_dir_path, catalog_name));
+  if (in_catalog && catalog_blocks_dir_path.compare(blocks_path) != 0){
+    std::cerr << "Error: Version " << version_metadata_dir_path << " does not belong to blocks directory " << blocks_path << std::endl;
+    exit(-1);
+  }
+  if (!in_catalog && blocks_dir_path.compare(version_metadata_dir_path) != 0){
     if (utility::directory_exists(version_metadata_dir_path.c_str())){
       std::cerr << "Error: Version metadata directory already exists" << std::endl;
       exit(-1);
@@ -193,16 +341,12 @@ inline void Privateer::create(void *addr, const char *blocks_path, const char *v
   version_metadata_dir_path = version_metadata_path;
 
   // Create blocks metadata file
-  std::string metadata_file_name = std::string(version_metadata_path) + "/_metadata";
-  metadata_fd = ::open(metadata_file_name.c_str(), O_RDWR | O_CREAT | O_EXCL, (mode_t) 0666);
-  assert(metadata_fd != -1);
-
-  // Create file to save blocks path
-  std::string blocks_path_file_name = std::string(version_metadata_path) + "/_blocks_path";
-  std::ofstream blocks_path_file;
-  blocks_path_file.open(blocks_path_file_name);
-  blocks_path_file << blocks_dir_path;
-  blocks_path_file.close();
+  metadata_fd = -1;
+  if (!in_catalog){
+    std::string metadata_file_name = std::string(version_metadata_path) + "/_metadata";
+    metadata_fd = ::open(metadata_file_name.c_str(), O_RDWR | O_CREAT | O_EXCL, (mode_t) 0666);
+    assert(metadata_fd != -1);
+  }
 
   // Set file granularity
   file_granularity = utility::get_environment_variable("PRIVATEER_FILE_GRANULARITY");
@@ -214,18 +358,34 @@ inline void Privateer::create(void *addr, const char *blocks_path, const char *v
   // Handling if requested size is less than file granularity
   file_granularity = std::min(max_capacity, file_granularity);
 
-  // Create size file
   m_current_size = original_size;
-  std::string size_file_name = std::string(version_metadata_path) + "/_size";
-  std::ofstream size_file;
-  size_file.open(size_file_name);
-  size_file << m_current_size;
-  size_file.close();
-
-
 
-  // create blocks base directory
-  block_storage = new BlockStorage(blocks_path, file_granularity);
+  // create blocks base directory, striped over PRIVATEER_STRIPE_DIRECTORIES if set
+  std::vector<std::string> stripe_directories = utility::get_environment_path_list("PRIVATEER_STRIPE_DIRECTORIES");
+  if (stripe_directories.empty()){
+    block_storage = new BlockStorage(blocks_path, file_granularity);
+  }
+  else{
+    block_storage = new BlockStorage(blocks_path, file_granularity, stripe_directories);
+  }
+  // Optionally put a capacity tier behind the (fast) blocks directories
+  char* capacity_tier_specification = std::getenv("PRIVATEER_CAPACITY_TIER");
+  if (capacity_tier_specification != NULL){
+    block_storage->set_capacity_tier(std::string(capacity_tier_specification));
+  }
+  start_block_demotion();
+  if (in_catalog){
+    catalog = new VersionCatalog(blocks_dir_path);
+    CatalogRecord existing_record;
+    if (catalog->find(catalog_name, existing_record, catalog_record_offset)){
+      std::cerr << "Error: Version " << version_metadata_dir_path << " already exists" << std::endl;
+      exit(-1);
+    }
+    catalog_record_offset = VersionCatalog::NO_RECORD;
+  }
+  else{
+    block_storage->register_version(version_metadata_dir_path);
+  }
 
   // init block hashes array
   size_t num_blocks = (size_t)ceil(max_capacity*1.0 / file_granularity);
@@ -233,13 +393,6 @@ inline void Privateer::create(void *addr, const char *blocks_path, const char *v
   size_t ceiled_max_capacity = num_blocks*file_granularity;
   m_max_size = ceiled_max_capacity;
 
-  // Create capacity file
-  std::string capacity_file_name = std::string(version_metadata_path) + "/_capacity";
-  std::ofstream capacity_file;
-  capacity_file.open(capacity_file_name);
-  capacity_file << m_max_size;
-  capacity_file.close(); 
-
   // mmap region with full size
   int flags = MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE;
   if (addr != nullptr)
@@ -252,76 +405,156 @@ inline void Privateer::create(void *addr, const char *blocks_path, const char *v
     std::cerr << "Privateer276: mmap error - " << strerror(errno)<< std::endl;
     exit(-1);
   }
-  //init regions
-  regions = new void*[num_blocks];
-  for (size_t i = 0; i < num_blocks; i++){
-    regions[i] = (size_t) 0;
-  }
-
+  // init regions
   size_t num_init_regions = original_size / file_granularity;
   for (size_t i = 0; i < num_init_regions; i++){
-    uint64_t offset = (uint64_t) m_addr + i*file_granularity;
-    regions[i] = mmap((void*) offset, file_granularity, PROT_READ | PROT_WRITE, flags | MAP_FIXED, -1, 0);
-    if (regions[0] == MAP_FAILED){
+    void* region = mmap(block_address(i), file_granularity, PROT_READ | PROT_WRITE, flags | MAP_FIXED, -1, 0);
+    if (region == MAP_FAILED){
       std::cerr << "Privateer291: mmap error - " << strerror(errno)<< std::endl;
       exit(-1);
     }
   }
 
-  // Initializing block hashes (file recipe)
-  blocks = new std::string[num_blocks];
-  std::string empty_block_hash(HASH_SIZE,'0');
-  EMPTY_BLOCK_HASH = empty_block_hash;
-
-  for (size_t i = 0 ; i < num_blocks ; i++){
-    blocks[i] = EMPTY_BLOCK_HASH;
-  }
+  // Initializing block hashes (file recipe), all empty
+  blocks = new BlockTable(num_blocks);
+  metadata_num_blocks = 0;
+  metadata_is_legacy = false;
 
   m_read_only = false;
+
+  // Write recipe header (size, capacity, granularity and blocks path)
+  update_metadata();
 }
 
 inline void Privateer::open(void* addr, const char *version_metadata_path, bool read_only){
 
-  // Check if datastore exist
-  if(!utility::directory_exists(version_metadata_path)){
-    std::cerr << "Error: Directory " << version_metadata_path << " does not exists" << std::endl;
-    throw "Directory Does Not Exists";
-  }
-
   version_metadata_dir_path = version_metadata_path;
-  // Read blocks path
-  std::string blocks_path_file_name = std::string(version_metadata_path) + "/_blocks_path";
-  std::ifstream blocks_path_file;
-  blocks_path_file.open(blocks_path_file_name);
-  if (!blocks_path_file.is_open()){
-    std::cerr << "Error opening blocks file path at: " << blocks_path_file_name << std::endl;
+  catalog = nullptr;
+  std::string catalog_blocks_dir_path;
+  CatalogRecord catalog_record;
+  Recipe recipe;
+  if (VersionCatalog::parse_reference(version_metadata_dir_path, catalog_blocks_dir_path, catalog_name)){
+    // Look up the version's latest catalog record
+    catalog = new VersionCatalog(catalog_blocks_dir_path);
+    if (!catalog->find(catalog_name, catalog_record, catalog_record_offset)){
+      std::cerr << "Error: Version " << version_metadata_path << " does not exists" << std::endl;
+      throw "Version Does Not Exists";
+    }
+    blocks_dir_path = catalog_blocks_dir_path;
   }
-  if (!std::getline(blocks_path_file, blocks_dir_path)){
-    std::cerr << "Error reading blocks path file" << std::endl;
+  else{
+    // Check if datastore exist
+    if(!utility::directory_exists(version_metadata_path)){
+      std::cerr << "Error: Directory " << version_metadata_path << " does not exists" << std::endl;
+      throw "Directory Does Not Exists";
+    }
+    // Read recipe header (legacy text recipes are parsed into memory)
+    if (!recipe.load(version_metadata_dir_path)){
+      std::cerr << "Error reading version metadata at: " << version_metadata_dir_path << std::endl;
+      throw "Invalid Version Metadata";
+    }
+    blocks_dir_path = recipe.blocks_path();
   }
 
   // Open block storage
   block_storage = new BlockStorage(blocks_dir_path);
   file_granularity = block_storage->get_block_granularity();
+  start_block_demotion();
+  // Opened versions are garbage collection roots too, e.g. versions of stores older than the registry
+  if (catalog == nullptr){
+    block_storage->register_version(version_metadata_dir_path);
+  }
 
   // Get current size
-  m_current_size = version_size(version_metadata_path);
-  size_t num_blocks_current_size = m_current_size / file_granularity;
+  m_current_size = catalog != nullptr ? catalog_record.size : recipe.size();
 
-  // Open existing metadata file and get size
+  // Open existing metadata file
   m_read_only = read_only;
-  std::string metadata_file_name = std::string(version_metadata_path) + "/_metadata";
-  int flags = read_only? O_RDONLY: O_RDWR;
-  metadata_fd = ::open(metadata_file_name.c_str(), flags, (mode_t) 0666);
-  assert(metadata_fd != -1);
-  struct stat st;
-  fstat(metadata_fd, &st);
-  size_t metadata_size = st.st_size;
+  metadata_fd = -1;
+  if (catalog == nullptr){
+    std::string metadata_file_name = std::string(version_metadata_path) + "/_metadata";
+    int flags = read_only? O_RDONLY: O_RDWR;
+    metadata_fd = ::open(metadata_file_name.c_str(), flags, (mode_t) 0666);
+    assert(metadata_fd != -1);
+  }
 
-  // Start: Read capacity file
-  m_max_size = version_capacity(version_metadata_path);
+  // Start: Read capacity
+  m_max_size = catalog != nullptr ? catalog_record.capacity : recipe.capacity();
 
   size_t num_blocks = m_max_size / file_granularity;
+  size_t num_recipe_blocks = catalog != nullptr ? catalog_record.num_blocks : recipe.num_blocks();
+
+  // Initialize blocks: binary recipes are mapped in place, no per-block work until a block is touched
+  blocks = new BlockTable(num_blocks);
+  RecipeHeader recipe_header;
+  metadata_is_legacy = false;
+  metadata_num_blocks = 0;
+  if (catalog != nullptr){
+    if (!catalog->load(catalog_record_offset, blocks)){
+      std::cerr << "Error reading version " << version_metadata_path << " from the version catalog" << std::endl;
+      throw "Invalid Version Metadata";
+    }
+  }
+  else if (Recipe::read_header(metadata_fd, recipe_header)){
+    // Read-only users keep a private copy, the version may be updated in place by a writer
+    bool loaded = read_only ? blocks->read_entries(metadata_fd, Recipe::HEADER_SIZE, num_recipe_blocks, recipe_header.digests_checksum)
+                            : blocks->map_base(metadata_fd, Recipe::HEADER_SIZE, num_recipe_blocks, recipe_header.digests_checksum);
+    if (!loaded){
+      exit(-1);
+    }
+    metadata_num_blocks = num_recipe_blocks;
+  }
+  else{
+    // Rewritten in the binary format on the next update
+    for (size_t i = 0; i < num_recipe_blocks; i++){
+      blocks->set(i, recipe.digest(i));
+    }
+    metadata_is_legacy = true;
+  }
+
+  map_region(addr, num_recipe_blocks, read_only);
+}
+
+inline void Privateer::open(void* addr, const char *version_metadata_path, const VersionLayout &layout, BlockTable* loaded_blocks, bool read_only,
+                            std::string read_cache_dir_path){
+  version_metadata_dir_path = version_metadata_path;
+  blocks_dir_path = layout.blocks_dir_path;
+  catalog = nullptr;
+  metadata_fd = -1;
+  if (layout.record_offset != VersionCatalog::NO_RECORD){
+    std::string catalog_blocks_dir_path;
+    VersionCatalog::parse_reference(version_metadata_dir_path, catalog_blocks_dir_path, catalog_name);
+    catalog = new VersionCatalog(blocks_dir_path);
+    catalog_record_offset = layout.record_offset;
+  }
+  else{
+    std::string metadata_file_name = std::string(version_metadata_path) + "/_metadata";
+    metadata_fd = ::open(metadata_file_name.c_str(), read_only ? O_RDONLY : O_RDWR, (mode_t) 0666);
+    assert(metadata_fd != -1);
+  }
+
+  block_storage = new BlockStorage(blocks_dir_path);
+  if (!read_cache_dir_path.empty()){
+    block_storage->set_read_cache(read_cache_dir_path);
+  }
+  file_granularity = block_storage->get_block_granularity();
+  start_block_demotion();
+  if (catalog == nullptr){
+    block_storage->register_version(version_metadata_dir_path);
+  }
+
+  m_read_only = read_only;
+  m_current_size = layout.size;
+  m_max_size = layout.capacity;
+  blocks = loaded_blocks;
+  metadata_is_legacy = layout.legacy;
+  metadata_num_blocks = layout.legacy ? 0 : layout.num_blocks;
+  map_region(addr, layout.num_blocks, read_only);
+}
+
+// Reserves the region and maps the blocks of the loaded recipe, anonymous memory for empty blocks
+inline void Privateer::map_region(void* addr, size_t num_recipe_blocks, bool read_only){
+  size_t num_blocks_current_size = m_current_size / file_granularity;
 
   // allocate virtual memory region
   int mmap_flags = MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE;
@@ -339,73 +572,97 @@ inline void Privateer::open(void* addr, const char *version_metadata_path, bool
   assert(m_addr != MAP_FAILED);
 
   // Initialize regions
-  regions = new void*[num_blocks];
-  for (size_t i = 0; i < num_blocks; i++){
-    if (i < num_blocks_current_size){
-      regions[i] = mmap(m_addr + i*file_granularity, file_granularity, PROT_READ | PROT_WRITE, mmap_flags | MAP_FIXED, -1, 0);
-      if (regions[i] == MAP_FAILED){
-        std::cerr << "Privateer386: mmap error - " << strerror(errno)<< std::endl;
-        exit(-1);
-      }
-    }
-    else{
-      regions[i] = (size_t) 0;
+  for (size_t i = 0; i < num_blocks_current_size; i++){
+    void* region = mmap(block_address(i), file_granularity, PROT_READ | PROT_WRITE, mmap_flags | MAP_FIXED, -1, 0);
+    if (region == MAP_FAILED){
+      std::cerr << "Privateer386: mmap error - " << strerror(errno)<< std::endl;
+      exit(-1);
     }
   }
 
-  //Initialize blocks
-  blocks = new std::string[num_blocks];
-
   // Open and mmap files
-  char* metadata_content = new char[metadata_size];
-  size_t read = ::pread(metadata_fd, (void*) metadata_content, metadata_size, 0);
-  assert(read != (size_t)-1);
-
-  std::string empty_block_hash(HASH_SIZE,'0');
-  EMPTY_BLOCK_HASH = empty_block_hash;
-
-  std::string all_hashes(metadata_content, metadata_size);
-  uint64_t offset = 0;
-  // std::cout << "Privateer: Metadata size = " << metadata_size  << std::endl;
-  for (size_t i = 0; i < metadata_size; i += HASH_SIZE){
-    // std::cout << "Privateer: Initializing blocks and regions, iteration no. " << i << std::endl;
-    std::string block_hash(all_hashes, i, HASH_SIZE);
-    blocks[i / HASH_SIZE] = block_hash;
-    // std::cout << "After assigning blocks[" << i << "]"<<std::endl;
-    if (block_hash.compare(EMPTY_BLOCK_HASH) != 0){
+  // Blocks may be spread over several stripe devices, open them concurrently
+  #pragma omp parallel for
+  for (size_t i = 0; i < num_recipe_blocks; i++){
+    if (!blocks->is_empty(i)){
+      std::string block_hash = utility::digest_to_hex(blocks->get(i));
       int block_fd;
       // open and mmap file
-      block_fd = block_storage->get_block_fd(block_hash.c_str(), (uint64_t) i / HASH_SIZE);
+      block_fd = block_storage->get_block_fd(block_hash.c_str(), (uint64_t) i);
       if (block_fd == -1){
         std::cerr << "Privateer: Error opening and mapping block " << block_hash << " " << strerror(errno) << std::endl;
       }
       assert(block_fd != -1);
 
-      // Add to hash map block_fds_map
-      block_file_exist_map[block_hash] = 1;
-
-      // calculate mmap offset then mmap
-      offset = (uint64_t) m_addr + (i / HASH_SIZE)*file_granularity;
-      // std::cout << "Privateer: offset = " << (uint64_t) offset <<std::endl;
       int prot_flags = read_only ? PROT_READ : PROT_READ | PROT_WRITE;
-      /* temp debug --> */ // int mmap_flags = read_only ? MAP_SHARED | MAP_FIXED : MAP_PRIVATE | MAP_FIXED;
-      void* region = mmap((void*) offset, file_granularity, prot_flags, MAP_FIXED | MAP_PRIVATE, block_fd, 0);
+      void* region = mmap(block_address(i), file_granularity, prot_flags, MAP_FIXED | MAP_PRIVATE, block_fd, 0);
       if (region == MAP_FAILED){
         std::cerr << "Privateer458: mmap error - " << strerror(errno)<< std::endl;
         exit(-1);
       }
-
-      assert(region != NULL);
-      regions[i / HASH_SIZE] = region;
       int close_ret = ::close(block_fd);
       assert(close_ret == 0);
     }
   }
-  delete [] metadata_content;
 }
 
 inline void Privateer::open(void *addr, const char *version_metadata_path, const char *new_version_metadata_path)
 {
+  std::string source_blocks_dir_path, source_name, new_blocks_dir_path, new_name;
+  bool source_in_catalog = VersionCatalog::parse_reference(version_metadata_path, source_blocks_dir_path, source_name);
+  bool new_in_catalog = VersionCatalog::parse_reference(new_version_metadata_path, new_blocks_dir_path, new_name);
+  if (source_in_catalog || new_in_catalog){
+    // Open the source, then continue as the new version: no metadata copy for catalog versions
+    open(addr, version_metadata_path, false);
+    if (new_in_catalog){
+      if (new_blocks_dir_path.compare(blocks_dir_path) != 0){
+        std::cerr << "Error: Version " << new_version_metadata_path << " does not belong to blocks directory " << blocks_dir_path << std::endl;
+        exit(-1);
+      }
+      VersionCatalog* new_catalog = catalog != nullptr ? catalog : new VersionCatalog(blocks_dir_path);
+      CatalogRecord existing_record;
+      uint64_t existing_record_offset;
+      if (new_catalog->find(new_name, existing_record, existing_record_offset)){
+        std::cerr << "Error: Version " << new_version_metadata_path << " already exists" << std::endl;
+        exit(-1);
+      }
+      // A catalog source is clean with respect to its record, others are written in full
+      uint64_t parent_offset = catalog != nullptr ? catalog_record_offset : VersionCatalog::NO_RECORD;
+      catalog = new_catalog;
+      catalog_name = new_name;
+      catalog_record_offset = parent_offset;
+      if (metadata_fd != -1){
+        ::close(metadata_fd);
+        metadata_fd = -1;
+      }
+    }
+    else{
+      if (utility::directory_exists(new_version_metadata_path)){
+        std::cerr << "Error: New version metadata directory already exists" << std::endl;
+        exit(-1);
+      }
+      if (!utility::create_directory(new_version_metadata_path)){
+        std::cerr << "Privateer: Error creating new version directory" << std::endl;
+      }
+      std::string new_metadata_file = std::string(new_version_metadata_path) + "/_metadata";
+      int new_metadata_fd = ::open(new_metadata_file.c_str(), O_RDWR | O_CREAT | O_EXCL, (mode_t) 0666);
+      assert(new_metadata_fd != -1);
+      if (!write_metadata_copy(new_metadata_fd)){
+        std::cerr << "Privateer: Error writing new version metadata" << std::endl;
+        exit(-1);
+      }
+      delete catalog;
+      catalog = nullptr;
+      metadata_fd = new_metadata_fd;
+      metadata_num_blocks = m_current_size / file_granularity;
+      blocks->clear_dirty();
+      block_storage->register_version(new_version_metadata_path);
+    }
+    version_metadata_dir_path = new_version_metadata_path;
+    update_metadata();
+    return;
+  }
+
   // Check if datastore exist
   if(!utility::directory_exists(version_metadata_path)){
     std::cerr << "Error: Directory " << version_metadata_path << " does not exists" << std::endl;
@@ -422,33 +679,38 @@ inline void Privateer::open(void *addr, const char *version_metadata_path, const
   if (!utility::create_directory(new_version_metadata_path)){
     std::cerr << "Privateer: Error creating new version directory" << std::endl;
   }
-  // Copy all metadata files
+  // Copy all metadata files (size, capacity and blocks path files exist for legacy versions only)
   std::string metadata_file = std::string(version_metadata_path) + "/_metadata";
-  std::string size_file = std::string(version_metadata_path) + "/_size";
-  std::string blocks_path_file = std::string(version_metadata_path) + "/_blocks_path";
-
   std::string new_metadata_file = std::string(new_version_metadata_path) + "/_metadata";
-  std::string new_size_file = std::string(new_version_metadata_path) + "/_size";
-  std::string new_blocks_path_file = std::string(new_version_metadata_path) + "/_blocks_path";
 
   if (!utility::copy_file(metadata_file.c_str(),new_metadata_file.c_str(), false)){
     std::cerr << "Privateer: Error Copying metada file" << std::endl;
     exit(-1);
   }
-  if (!utility::copy_file(size_file.c_str(), new_size_file.c_str(), false)){
-    std::cerr << "Privateer: Error Copying size file" << std::endl;
-    exit(-1);
-  }
-  if (!utility::copy_file(blocks_path_file.c_str(), new_blocks_path_file.c_str(), false)){
-    std::cerr << "Privateer: Error Copying blocks path file" << std::endl;
-    exit(-1);
+  for (std::string legacy_file_name : {"/_size", "/_capacity", "/_blocks_path"}){
+    std::string legacy_file = std::string(version_metadata_path) + legacy_file_name;
+    std::string new_legacy_file = std::string(new_version_metadata_path) + legacy_file_name;
+    if (utility::file_exists(legacy_file.c_str()) && !utility::copy_file(legacy_file.c_str(), new_legacy_file.c_str(), false)){
+      std::cerr << "Privateer: Error Copying " << legacy_file_name << " file" << std::endl;
+      exit(-1);
+    }
   }
   // Open new copy
 
   open(addr, new_version_metadata_path, false);
+  block_storage->register_version(new_version_metadata_path);
 
 }
 
+// Demote blocks to the capacity tier in the background, once they have not been accessed for
+// PRIVATEER_DEMOTION_AGE seconds
+inline void Privateer::start_block_demotion(){
+  size_t demotion_age = utility::get_environment_variable("PRIVATEER_DEMOTION_AGE");
+  if (block_storage->has_capacity_tier() && !std::isnan(demotion_age) && demotion_age > 0){
+    block_storage->start_demotion(demotion_age);
+  }
+}
+
 inline bool Privateer::resize(size_t size){
 
   if (m_read_only){
@@ -471,9 +733,11 @@ inline bool Privateer::resize(size_t size){
   }
   for (size_t i = 0 ; i < num_new_regions; i++){
     size_t starting_index = starting_region_index + i;
-    regions[starting_index] = mmap((void*)((uint64_t)m_addr + m_current_size + i*file_granularity), file_granularity, PROT_READ | PROT_WRITE, MAP_ANONYMOUS |MAP_PRIVATE | MAP_FIXED, -1, 0);
-    blocks[starting_index] = EMPTY_BLOCK_HASH;
-    if (regions[starting_index] == MAP_FAILED){
+    void* region = mmap((void*)((uint64_t)m_addr + m_current_size + i*file_granularity), file_granularity, PROT_READ | PROT_WRITE, MAP_ANONYMOUS |MAP_PRIVATE | MAP_FIXED, -1, 0);
+    if (!blocks->is_empty(starting_index)){
+      blocks->set(starting_index, EMPTY_DIGEST);
+    }
+    if (region == MAP_FAILED){
       std::cerr << "Error: failed to map region: " << starting_index << " - " << strerror(errno) << std::endl;
       return false;
     }
@@ -483,14 +747,61 @@ inline bool Privateer::resize(size_t size){
 }
 
 inline void Privateer::msync(){
+  if (version_metadata_dir_path.empty()){
+    std::cerr << "Privateer: Clone is not attached to a version, snapshot it instead" << std::endl;
+    return;
+  }
+  commit_blocks();
+  update_metadata();
+  std::cout << "Done updating metadata" << std::endl;
+}
 
+inline void Privateer::commit_blocks(){
+  commit_blocks(0, m_current_size / file_granularity);
+}
 
-  #ifdef USE_PAGEMAP
-  msync_pagemap();
-  #else
-  msync_memcopy();
-  #endif
+inline void Privateer::commit_blocks(size_t first_block, size_t last_block){
+  clear_volatile_pages(first_block, last_block);
+  if (dirty_tracking == DirtyTracking::EXPLICIT){
+    msync_marked(first_block, last_block);
+  }
+  else{
+    #ifdef USE_PAGEMAP
+    msync_pagemap(first_block, last_block);
+    #else
+    msync_memcopy();
+    #endif
+  }
+  drop_volatile_pages(first_block, last_block);
+}
 
+// Blocks [first_block, last_block) overlapping the byte range, false if it is beyond the current size
+inline bool Privateer::block_range(size_t offset, size_t length, size_t &first_block, size_t &last_block){
+  if (offset + length > m_current_size || offset + length < offset){
+    std::cerr << "Privateer: Range beyond the current size" << std::endl;
+    return false;
+  }
+  first_block = offset / file_granularity;
+  last_block = (offset + length + file_granularity - 1) / file_granularity;
+  return true;
+}
+
+inline bool Privateer::msync_range(size_t offset, size_t length){
+  size_t first_block, last_block;
+  if (m_read_only || version_metadata_dir_path.empty() || !block_range(offset, length, first_block, last_block)){
+    return false;
+  }
+  commit_blocks(first_block, last_block);
+  update_metadata();
+  return true;
+}
+
+inline bool Privateer::snapshot_range(const char* version_metadata_path, size_t offset, size_t length){
+  size_t first_block, last_block;
+  if (!block_range(offset, length, first_block, last_block)){
+    return false;
+  }
+  return write_snapshot(version_metadata_path, first_block, last_block);
 }
 
 inline void Privateer::msync_memcopy()
@@ -532,16 +843,16 @@ inline void Privateer::msync_memcopy()
   // validate();
 }
 
-inline void Privateer::msync_pagemap(){
+inline void Privateer::msync_pagemap(size_t first_block, size_t last_block){
   std::cout << "Starting msync" << std::endl;
   #pragma omp parallel for // firstprivate(block_storage)
-  for(uint64_t block_start = (uint64_t)m_addr; block_start < ((uint64_t) m_addr + m_current_size); block_start += file_granularity){
-    // std::cout << "msync-ing block: " << (block_start - (uint64_t)m_addr) / file_granularity << std::endl;
-    msync_pagemap_block_no_copy( (void*) block_start, file_granularity);
+  for(size_t block_index = first_block; block_index < last_block; block_index++){
+    // std::cout << "msync-ing block: " << block_index << std::endl;
+    // Ranges committed concurrently may share a block at their bounds
+    std::lock_guard<std::mutex> lock(block_commit_mutexes[block_index % NUM_BLOCK_COMMIT_LOCKS]);
+    msync_pagemap_block_no_copy(block_address(block_index), file_granularity);
   }
   std::cout << "Done msync blocks" << std::endl;
-  update_metadata();
-  std::cout << "Done updating metadata" << std::endl;
 
  // Validate: Temporarily commented
 
@@ -549,8 +860,8 @@ inline void Privateer::msync_pagemap(){
   /* #pragma omp parallel for
   for(int i = 0 ; i < num_regions ; i++){
     // if (blocks_fds_map.find(blocks[i]) != blocks_fds_map.end()){
-    if (blocks[i].compare(EMPTY_BLOCK_HASH) != 0){
-      std::string file_path = blocks_dir_path + "/" + blocks[i];
+    if (!blocks->is_empty(i)){
+      std::string file_path = blocks_dir_path + "/" + utility::digest_to_hex(blocks->get(i));
       int fd = ::open(file_path.c_str(), O_RDWR | O_EXCL, (mode_t) 0666);
       assert(fd != -1);
       // std::cout << "Privateer: file desriptor " << fd << std::endl;
@@ -614,8 +925,7 @@ inline void Privateer::msync_pagemap_block_no_copy(void* block_start, size_t blo
               temporary_file_name_template = std::to_string(file_index) + "_temp_XXXXXX";
               char* name_template = (char*) temporary_file_name_template.c_str();
               // std::cout << "Privateer: temporary file name = " << name_template << std::endl;
-              std::string block_hash = blocks[file_index];
-              if (block_hash.compare(EMPTY_BLOCK_HASH) != 0){
+              if (!blocks->is_empty(file_index)){
                 // existing_block_file_name =  block_storage->get_blocks_subdirectory(file_index) + "/" + block_hash;
                 // copy
                 /* std::stringstream copy_stream;
@@ -655,8 +965,7 @@ inline void Privateer::msync_pagemap_block_no_copy(void* block_start, size_t blo
         if (block_fd == -1){
           temporary_file_name_template = std::to_string(file_index) + "_temp_XXXXXX";
           char* name_template = (char*) temporary_file_name_template.c_str();
-          std::string block_hash = blocks[file_index];
-          if (block_hash.compare(EMPTY_BLOCK_HASH) != 0){
+          if (!blocks->is_empty(file_index)){
             // existing_block_file_name = block_storage->get_blocks_subdirectory(file_index) + "/" + block_hash;
 
             block_fd = block_storage_local.create_temporary_unique_block(name_template, file_index); //, existing_block_file_name.c_str());
@@ -694,16 +1003,15 @@ inline void Privateer::msync_pagemap_block_no_copy(void* block_start, size_t blo
         exit(-1);
       }
       // mmap new file
-      regions[file_index] = mmap((void*)block_start, file_granularity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, block_fd, 0);
-      if (regions[file_index] == MAP_FAILED){
+      if (!map_committed_block(file_index, block_fd)){
         std::cerr << "Privateer797: mmap error - " << strerror(errno)<< std::endl;
         exit(-1);
       }
-      assert(regions[file_index] != MAP_FAILED);
-      // update blocks_fds_map, blocks, and regions if needed.
+      // update the block's recipe entry
       std::string block_hash = std::string(block_storage_local.get_block_hash(block_fd));
-      block_file_exist_map[block_hash] = 1; // block_fd;
-      blocks[file_index] = block_hash;
+      unsigned char digest[utility::DIGEST_SIZE];
+      utility::hex_to_digest(block_hash.c_str(), digest);
+      blocks->set(file_index, digest);
       // close file
       int close_ret = close(block_fd);
       assert(close_ret != -1);
@@ -715,8 +1023,271 @@ inline void Privateer::msync_pagemap_block_no_copy(void* block_start, size_t blo
   delete [] pagemap_raw_data;
 }
 
+inline void Privateer::set_commit_mode(CommitMode mode, bool direct_io){
+  commit_mode = mode;
+  block_storage->set_direct_io(direct_io);
+}
+
+// Replaces the pages of a committed block with its block file, see CommitMode
+inline bool Privateer::map_committed_block(size_t block_index, int block_fd){
+  void* block_start = block_address(block_index);
+  if (commit_mode == CommitMode::RESIDENT){
+    // The block was just written, its pages are in the page cache. Populated read-only: populating
+    // a writable private mapping would copy every page, and they would all look dirty to pagemap
+    return mmap(block_start, file_granularity, PROT_READ, MAP_PRIVATE | MAP_FIXED | MAP_POPULATE, block_fd, 0) != MAP_FAILED
+           && mprotect(block_start, file_granularity, PROT_READ | PROT_WRITE) == 0;
+  }
+  if (commit_mode == CommitMode::INGEST){
+    // Remapping already released the written pages; the block file's pages are written out and
+    // dropped too, so that memory does not fill up with committed data
+    bool mapped = mmap(block_start, file_granularity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, block_fd, 0) != MAP_FAILED;
+    sync_file_range(block_fd, 0, file_granularity, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(block_fd, 0, file_granularity, POSIX_FADV_DONTNEED);
+    return mapped;
+  }
+  return mmap(block_start, file_granularity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, block_fd, 0) != MAP_FAILED;
+}
+
+inline void Privateer::set_dirty_tracking(DirtyTracking mode){
+  delete dirty_pages;
+  dirty_pages = nullptr;
+  dirty_tracking = mode;
+  if (mode == DirtyTracking::EXPLICIT){
+    size_t pagesize = sysconf(_SC_PAGE_SIZE);
+    dirty_pages = new DirtyPageBitmap(m_max_size / file_granularity, file_granularity / pagesize);
+  }
+}
+
+inline void Privateer::mark_dirty(size_t offset, size_t length){
+  if (dirty_pages == nullptr || length == 0){
+    return;
+  }
+  size_t pagesize = sysconf(_SC_PAGE_SIZE);
+  size_t first_page = offset / pagesize;
+  dirty_pages->set(first_page, (offset + length + pagesize - 1) / pagesize - first_page);
+}
+
+inline void Privateer::set_volatile(size_t offset, size_t length){
+  size_t pagesize = sysconf(_SC_PAGE_SIZE);
+  // Only whole pages, the rest of a partially covered page is kept
+  size_t start = (offset + pagesize - 1) / pagesize * pagesize;
+  size_t end = std::min((offset + length) / pagesize * pagesize, (size_t) m_max_size);
+  if (start >= end){
+    return;
+  }
+  // Merge with overlapping or adjacent ranges
+  auto range = volatile_ranges.upper_bound(start);
+  if (range != volatile_ranges.begin() && std::prev(range)->second >= start){
+    --range;
+    start = range->first;
+  }
+  while (range != volatile_ranges.end() && range->first <= end){
+    end = std::max(end, range->second);
+    range = volatile_ranges.erase(range);
+  }
+  volatile_ranges[start] = end;
+}
+
+inline bool Privateer::will_overwrite(size_t offset, size_t length){
+  if (m_read_only){
+    std::cerr << "Privateer: Region is read-only" << std::endl;
+    return false;
+  }
+  if (offset + length > m_current_size || offset + length < offset){
+    std::cerr << "Privateer: Range beyond the current size" << std::endl;
+    return false;
+  }
+  size_t pagesize = sysconf(_SC_PAGE_SIZE);
+  // Only whole pages, partially rewritten pages keep their content
+  size_t start = (offset + pagesize - 1) / pagesize * pagesize;
+  size_t end = (offset + length) / pagesize * pagesize;
+  if (start >= end){
+    return true;
+  }
+  void* region = mmap((char*) m_addr + start, end - start, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE | MAP_FIXED, -1, 0);
+  if (region == MAP_FAILED){
+    std::cerr << "Privateer: mmap error - " << strerror(errno) << std::endl;
+    return false;
+  }
+  mark_dirty(start, end - start);
+  return true;
+}
+
+// Blocks within [first_block, last_block) with volatile pages
+inline std::vector<size_t> Privateer::volatile_blocks(size_t first_block, size_t last_block){
+  std::vector<size_t> block_indices;
+  for (auto &range : volatile_ranges){
+    size_t range_first_block = std::max(range.first / file_granularity, first_block);
+    size_t range_last_block = std::min((range.second + file_granularity - 1) / file_granularity, last_block);
+    for (size_t block_index = range_first_block; block_index < range_last_block; block_index++){
+      // Ranges are sorted, only consecutive ones can share a block
+      if (block_indices.empty() || block_indices.back() != block_index){
+        block_indices.push_back(block_index);
+      }
+    }
+  }
+  return block_indices;
+}
+
+// Before a commit: volatile pages become zero so that they are stored as such, fully volatile
+// blocks get an empty recipe entry and are not stored at all
+inline void Privateer::clear_volatile_pages(size_t first_block, size_t last_block){
+  if (volatile_ranges.empty()){
+    return;
+  }
+  std::vector<size_t> block_indices = volatile_blocks(first_block, last_block);
+  size_t pagesize = sysconf(_SC_PAGE_SIZE);
+  #pragma omp parallel for
+  for (size_t k = 0; k < block_indices.size(); k++){
+    size_t block_index = block_indices[k];
+    size_t block_start = block_index*file_granularity;
+    size_t block_end = block_start + file_granularity;
+    std::lock_guard<std::mutex> lock(block_commit_mutexes[block_index % NUM_BLOCK_COMMIT_LOCKS]);
+    auto range = std::prev(volatile_ranges.upper_bound(block_start + file_granularity - 1));
+    if (range->first <= block_start && range->second >= block_end){
+      if (dirty_pages != nullptr){
+        std::vector<uint64_t> page_words(dirty_pages->words_per_block());
+        dirty_pages->take_block(block_index, page_words.data());
+      }
+      if (!remap_block(block_index, EMPTY_DIGEST, true)){
+        exit(-1);
+      }
+      if (!blocks->is_empty(block_index)){
+        blocks->set(block_index, EMPTY_DIGEST);
+      }
+      continue;
+    }
+    bool block_is_empty = blocks->is_empty(block_index);
+    range = volatile_ranges.upper_bound(block_start);
+    if (range != volatile_ranges.begin() && std::prev(range)->second > block_start){
+      --range;
+    }
+    for (; range != volatile_ranges.end() && range->first < block_end; ++range){
+      size_t start = std::max(range->first, block_start);
+      size_t end = std::min(range->second, block_end);
+      if (block_is_empty){
+        // Anonymous memory: back to unwritten zero pages, which are not stored
+        madvise((char*) m_addr + start, end - start, MADV_DONTNEED);
+        continue;
+      }
+      // Mapped from a stored block: zero the pages that are not zero yet
+      for (size_t page_start = start; page_start < end; page_start += pagesize){
+        char* page = (char*) m_addr + page_start;
+        if (page[0] != 0 || memcmp(page, page + 1, pagesize - 1) != 0){
+          memset(page, 0, pagesize);
+          if (dirty_pages != nullptr){
+            dirty_pages->set(page_start / pagesize, 1);
+          }
+        }
+      }
+    }
+  }
+}
+
+// After a commit: volatile pages are zero in the committed blocks, drop their memory
+inline void Privateer::drop_volatile_pages(size_t first_block, size_t last_block){
+  for (auto &range : volatile_ranges){
+    size_t start = std::max(range.first, first_block*file_granularity);
+    size_t end = std::min(range.second, last_block*file_granularity);
+    if (start < end){
+      madvise((char*) m_addr + start, end - start, MADV_DONTNEED);
+    }
+  }
+}
+
+// Commits the blocks with marked pages, at a cost proportional to the marked blocks rather than the region
+inline void Privateer::msync_marked(size_t first_block, size_t last_block){
+  std::vector<size_t> block_indices = dirty_pages->marked_blocks(first_block, last_block);
+  #pragma omp parallel for
+  for (size_t k = 0; k < block_indices.size(); k++){
+    std::lock_guard<std::mutex> lock(block_commit_mutexes[block_indices[k] % NUM_BLOCK_COMMIT_LOCKS]);
+    std::vector<uint64_t> page_words(dirty_pages->words_per_block());
+    // Taken by a concurrent commit of an overlapping range otherwise
+    if (dirty_pages->take_block(block_indices[k], page_words.data())){
+      commit_marked_block(block_indices[k], page_words.data());
+    }
+  }
+}
+
+inline void Privateer::commit_marked_block(size_t block_index, const uint64_t* page_words){
+  BlockStorage block_storage_local(*block_storage);
+  char* block_start = (char*) block_address(block_index);
+  size_t pagesize = sysconf(_SC_PAGE_SIZE);
+  std::string temporary_file_name_template = std::to_string(block_index) + "_temp_XXXXXX";
+  int block_fd = block_storage_local.create_temporary_unique_block((char*) temporary_file_name_template.c_str(), block_index);
+  if (block_fd == -1){
+    std::cerr << "Privateer: Error creating temporary file" << std::endl;
+    exit(-1);
+  }
+  // As with pagemap scanning, an existing block is stored whole, a new one only holds its written pages
+  bool write_block_fd = !blocks->is_empty(block_index);
+  if (!write_block_fd){
+    // Unmarked pages that are not zero were written as well, keep the block consistent with its hash
+    std::vector<char> zero_page(pagesize, 0);
+    size_t num_pages = file_granularity / pagesize;
+    size_t write_start = 0;
+    bool in_dirty_run = false;
+    for (size_t page_index = 0; page_index <= num_pages; page_index++){
+      bool dirty = page_index < num_pages
+                   && (((page_words[page_index / 64] >> (page_index % 64)) & 1)
+                       || memcmp(block_start + page_index*pagesize, zero_page.data(), pagesize) != 0);
+      if (dirty && !in_dirty_run){
+        write_start = page_index;
+        in_dirty_run = true;
+      }
+      else if (!dirty && in_dirty_run){
+        const auto written = ::pwrite(block_fd, block_start + write_start*pagesize, (page_index - write_start)*pagesize, write_start*pagesize);
+        if (written == -1){
+          std::cerr << "Error: Failed to write page with address: " << std::to_string((uint64_t) block_start + write_start*pagesize) << std::endl;
+          exit(-1);
+        }
+        in_dirty_run = false;
+      }
+    }
+  }
+  if (!block_storage_local.store_block(block_fd, block_start, write_block_fd, block_index)){
+    std::cerr << "Privateer: Error storing block with index " << block_index << std::endl;
+    exit(-1);
+  }
+  if (!map_committed_block(block_index, block_fd)){
+    std::cerr << "Privateer: mmap error - " << strerror(errno) << std::endl;
+    exit(-1);
+  }
+  unsigned char digest[utility::DIGEST_SIZE];
+  utility::hex_to_digest(block_storage_local.get_block_hash(block_fd), digest);
+  blocks->set(block_index, digest);
+  ::close(block_fd);
+}
+
+
+inline bool Privateer::snapshot(const char* version_metadata_path){
+  return write_snapshot(version_metadata_path, 0, m_current_size / file_granularity);
+}
+
+// Commits blocks [first_block, last_block) and writes the region's committed state as a new version
+inline bool Privateer::write_snapshot(const char* version_metadata_path, size_t first_block, size_t last_block){
+  std::string snapshot_blocks_dir_path, snapshot_name;
+  if (VersionCatalog::parse_reference(version_metadata_path, snapshot_blocks_dir_path, snapshot_name)){
+    // Catalog snapshot: a delta of the current catalog record, or a full record
+    if (snapshot_blocks_dir_path.compare(blocks_dir_path) != 0){
+      std::cerr << "Error: Version " << version_metadata_path << " does not belong to blocks directory " << blocks_dir_path << std::endl;
+      return false;
+    }
+    VersionCatalog own_catalog(blocks_dir_path);
+    VersionCatalog* snapshot_catalog = catalog != nullptr ? catalog : &own_catalog;
+    CatalogRecord existing_record;
+    uint64_t existing_record_offset;
+    if (snapshot_catalog->find(snapshot_name, existing_record, existing_record_offset)){
+      std::cerr << "Error: Version " << version_metadata_path << " already exists" << std::endl;
+      return false;
+    }
+    commit_blocks(first_block, last_block);
+    std::lock_guard<std::mutex> lock(metadata_mutex);
+    uint64_t parent_offset = catalog != nullptr ? catalog_record_offset : VersionCatalog::NO_RECORD;
+    return snapshot_catalog->append(snapshot_name, parent_offset, blocks, m_current_size, m_max_size, file_granularity,
+                                    m_current_size / file_granularity) != VersionCatalog::NO_RECORD;
+  }
 
-bool Privateer::snapshot(const char* version_metadata_path){
   // Create new version metadata directory
   if(utility::directory_exists(version_metadata_path)){
     std::cerr << "Error: Version metadata directory already exists" << std::endl;
@@ -727,37 +1298,21 @@ bool Privateer::snapshot(const char* version_metadata_path){
     std::cerr << "Error: Failed to create version metadata directory" << std::endl;
   }
 
-  // temporarily change metadata file descriptor
-  int temp_metada_fd = metadata_fd;
   std::string snapshot_metadata_path = std::string(version_metadata_path) + "/_metadata";
   // std::cout << "Privateer: Snapshotting to " << snapshot_metadata_path << std::endl;
-  metadata_fd = ::open(snapshot_metadata_path.c_str(), O_RDWR | O_CREAT, (mode_t) 0666);
-  assert(metadata_fd != -1);
-  msync();
-  metadata_fd = temp_metada_fd;
-
-  // Create file to save blocks path
-  std::string blocks_path_file_name = std::string(version_metadata_path) + "/_blocks_path";
-  std::ofstream blocks_path_file;
-  blocks_path_file.open(blocks_path_file_name);
-  blocks_path_file << blocks_dir_path;
-  blocks_path_file.close();
-
-  // Create file to save current size
-  std::string size_path_file_name = std::string(version_metadata_path) + "/_size";
-  std::ofstream size_path_file;
-  size_path_file.open(size_path_file_name);
-  size_path_file << m_current_size;
-  size_path_file.close();
-
-
-  // Create file to save max. capacity
-  std::string capacity_path_file_name = std::string(version_metadata_path) + "/_capacity";
-  std::ofstream capacity_path_file;
-  capacity_path_file.open(capacity_path_file_name);
-  capacity_path_file << m_max_size;
-  capacity_path_file.close();
+  int snapshot_metadata_fd = ::open(snapshot_metadata_path.c_str(), O_RDWR | O_CREAT, (mode_t) 0666);
+  assert(snapshot_metadata_fd != -1);
+  commit_blocks(first_block, last_block);
+  std::unique_lock<std::mutex> lock(metadata_mutex);
+  bool written = write_metadata_copy(snapshot_metadata_fd);
+  lock.unlock();
+  ::close(snapshot_metadata_fd);
+  if (!written){
+    std::cerr << "Error: Failed to write snapshot metadata" << std::endl;
+    return false;
+  }
 
+  block_storage->register_version(version_metadata_path);
   return true;
 }
 
@@ -765,7 +1320,7 @@ inline void Privateer::validate(int region_index, int fd)
 {
   char *v_addr = (char *)mmap(nullptr, file_granularity, PROT_READ, MAP_SHARED, fd, 0);
   assert(v_addr != MAP_FAILED);
-  char *d_addr = (char *) regions[region_index];
+  char *d_addr = (char *) block_address(region_index);
 
   for (size_t i = 0; i < file_granularity; ++i)
   {
@@ -777,45 +1332,78 @@ inline void Privateer::validate(int region_index, int fd)
   // std::cout << "unmapping done" << std::endl;
 }
 
-inline void Privateer::update_metadata(){
+inline bool Privateer::update_metadata(){
+  if (version_metadata_dir_path.empty()){
+    std::cerr << "Privateer: Clone is not attached to a version, snapshot it instead" << std::endl;
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(metadata_mutex);
 
   // std::cout << "Privateer: update metadata m_current_size = " << m_current_size << std::endl;
   // std::cout << "Privateer: update metadata m_max_size = " << m_max_size << std::endl;
   size_t num_blocks = m_current_size / file_granularity;
-  size_t current_size = 0;
-  char* blocks_bytes = new char[num_blocks*HASH_SIZE];
-  for (size_t i = 0 ; i < num_blocks ; i++){
-    const char* block_hash_bytes = blocks[i].c_str();
-    if (blocks[i].compare(EMPTY_BLOCK_HASH) != 0){
-      current_size = (i+1)*file_granularity;
+
+  bool written;
+  if (catalog != nullptr){
+    // Append a record of the changed entries to the version catalog
+    uint64_t record_offset = catalog->append(catalog_name, catalog_record_offset, blocks, m_current_size, m_max_size, file_granularity, num_blocks);
+    written = record_offset != VersionCatalog::NO_RECORD;
+    if (written){
+      catalog_record_offset = record_offset;
+      blocks->clear_dirty();
     }
-    for (int j = 0; j < HASH_SIZE; j++){
-      blocks_bytes[i*HASH_SIZE + j] = block_hash_bytes[j];
+    else{
+      std::cerr << "Error, failed to update version catalog" << std::endl;
     }
+    assert(written);
+    return written;
   }
 
-  // Update metadata file
-  const auto written = ::pwrite(metadata_fd ,(void*) blocks_bytes, num_blocks*HASH_SIZE, 0);
-  if (written == -1){
+  // Update metadata file: digests of changed recipe pages only, then header (size, capacity, granularity, blocks path)
+  if (metadata_is_legacy){
+    written = (ftruncate(metadata_fd, 0) == 0) && (ftruncate(metadata_fd, Recipe::HEADER_SIZE + num_blocks*utility::DIGEST_SIZE) == 0)
+              && blocks->write_all(metadata_fd, num_blocks);
+    if (written){
+      blocks->clear_dirty();
+      metadata_is_legacy = false;
+    }
+  }
+  else{
+    written = (num_blocks == metadata_num_blocks || ftruncate(metadata_fd, Recipe::HEADER_SIZE + num_blocks*utility::DIGEST_SIZE) == 0)
+              && blocks->write_dirty(metadata_fd, num_blocks, true);
+  }
+  if (written){
+    metadata_num_blocks = num_blocks;
+    written = Recipe::write_header(metadata_fd, m_current_size, m_max_size, file_granularity, blocks_dir_path, num_blocks, blocks->checksum());
+  }
+  if (!written){
     std::cerr << "Error, failed to update metadata and mappings: " << strerror(errno) << std::endl;
   }
-  assert(written != -1);
-
-  // Update size file
-  // Create size file
-  // m_current_size = current_size;
-  // std::cout << "Privateer: m_current_size in update_metadata() = " << m_current_size << std::endl;
-  std::string size_file_name = std::string(version_metadata_dir_path) + "/_size";
-  // std::cout << "Privateer: update_metadata() size_file_name = " << size_file_name << std::endl;
-  std::ofstream size_file(size_file_name, std::ios::trunc);
-  if (!size_file.good()){
-    std::cerr << "Privateer: Error updaging metadata size file - " << strerror(errno) << std::endl;
-    exit(-1);
+  assert(written);
+  return written;
+}
+
+// Writes the current recipe to another (empty) metadata file: the own recipe file is copied,
+// possibly sharing its extents, and only entries changed since it was written are rewritten
+inline bool Privateer::write_metadata_copy(int new_metadata_fd){
+  size_t num_blocks = m_current_size / file_granularity;
+  if (ftruncate(new_metadata_fd, Recipe::HEADER_SIZE + num_blocks*utility::DIGEST_SIZE) != 0){
+    return false;
   }
-  size_file << m_current_size;
-  size_file.close();
-  delete [] blocks_bytes;
+  bool written;
+  if (metadata_is_legacy || catalog != nullptr || metadata_fd == -1){
+    written = blocks->write_all(new_metadata_fd, num_blocks);
+  }
+  else{
+    size_t copied_length = std::min(metadata_num_blocks, num_blocks)*utility::DIGEST_SIZE;
+    written = utility::copy_file_range(metadata_fd, Recipe::HEADER_SIZE, new_metadata_fd, Recipe::HEADER_SIZE, copied_length)
+              && blocks->write_dirty(new_metadata_fd, num_blocks, false);
+  }
+  return written && Recipe::write_header(new_metadata_fd, m_current_size, m_max_size, file_granularity, blocks_dir_path, num_blocks, blocks->checksum());
+}
 
+inline void* Privateer::block_address(size_t block_index){
+  return (char*) m_addr + block_index*file_granularity;
 }
 
 inline Privateer::~Privateer()
@@ -845,8 +1433,6 @@ inline Privateer::~Privateer()
     }
   } */
   std::cout << "Done unmapping regions" << std::endl;
-  delete [] regions;
-  std::cout << "Done deleting regions" << std::endl;
   // close all files and free memory
   /* for(int i = 0; i < num_regions; i++){
     int fd = blocks_fds_map[blocks[i]];
@@ -856,14 +1442,150 @@ inline Privateer::~Privateer()
       blocks_fds_map[blocks[i]] = -1;
     }
   } */
-  delete [] blocks;
+  delete blocks;
+  delete dirty_pages;
+  delete catalog;
   std::cout << "Done deleting blocks" << std::endl;
   delete block_storage;
   std::cout << "Done deleting block storage" << std::endl;
-  int close_metadata = ::close(metadata_fd);
+  int close_metadata = metadata_fd != -1 ? ::close(metadata_fd) : 0;
   std::cout << "Privateer: Object destroyed successfully" << std::endl;
 }
 
+inline bool Privateer::write(size_t offset, const void* buffer, size_t length){
+  size_t first_block, last_block;
+  if (m_read_only){
+    std::cerr << "Privateer: Region is read-only" << std::endl;
+    return false;
+  }
+  if (!block_range(offset, length, first_block, last_block)){
+    return false;
+  }
+  const char* in = (const char*) buffer;
+  bool written = true;
+  #pragma omp parallel for reduction(&&:written)
+  for (size_t block_index = first_block; block_index < last_block; block_index++){
+    size_t start = std::max(offset, block_index*file_granularity);
+    size_t end = std::min(offset + length, (block_index + 1)*file_granularity);
+    if (end - start == file_granularity){
+      written = store_full_block(block_index, in + (start - offset)) && written;
+    }
+    else{
+      memcpy((char*) m_addr + start, in + (start - offset), end - start);
+      mark_dirty(start, end - start);
+    }
+  }
+  return written;
+}
+
+// Stores a block's new content from buffer and maps it, replacing any uncommitted pages
+inline bool Privateer::store_full_block(size_t block_index, const char* buffer){
+  BlockStorage block_storage_local(*block_storage);
+  std::string temporary_file_name_template = std::to_string(block_index) + "_temp_XXXXXX";
+  int block_fd = block_storage_local.create_temporary_unique_block((char*) temporary_file_name_template.c_str(), block_index);
+  if (block_fd == -1){
+    return false;
+  }
+  bool stored = block_storage_local.store_block(block_fd, (void*) buffer, true, block_index);
+  if (stored){
+    std::lock_guard<std::mutex> lock(block_commit_mutexes[block_index % NUM_BLOCK_COMMIT_LOCKS]);
+    if (dirty_pages != nullptr){
+      // Pages marked before are overwritten
+      std::vector<uint64_t> page_words(dirty_pages->words_per_block());
+      dirty_pages->take_block(block_index, page_words.data());
+    }
+    stored = map_committed_block(block_index, block_fd);
+    if (stored){
+      unsigned char digest[utility::DIGEST_SIZE];
+      utility::hex_to_digest(block_storage_local.get_block_hash(block_fd), digest);
+      blocks->set(block_index, digest);
+    }
+  }
+  if (!stored){
+    std::cerr << "Privateer: Error storing block with index " << block_index << std::endl;
+  }
+  ::close(block_fd);
+  return stored;
+}
+
+inline bool Privateer::read(size_t offset, void* buffer, size_t length){
+  size_t first_block, last_block;
+  if (!block_range(offset, length, first_block, last_block)){
+    return false;
+  }
+  char* out = (char*) buffer;
+  bool read_all = true;
+  #pragma omp parallel for reduction(&&:read_all)
+  for (size_t block_index = first_block; block_index < last_block; block_index++){
+    size_t start = std::max(offset, block_index*file_granularity);
+    size_t end = std::min(offset + length, (block_index + 1)*file_granularity);
+    read_all = read_block_range(block_index, start, end, out + (start - offset)) && read_all;
+  }
+  return read_all;
+}
+
+// Reads [start, end) of a block: pages with uncommitted changes from memory, the others from the block file
+inline bool Privateer::read_block_range(size_t block_index, size_t start, size_t end, char* buffer){
+  size_t pagesize = sysconf(_SC_PAGE_SIZE);
+  size_t first_page = start / pagesize;
+  size_t last_page = (end + pagesize - 1) / pagesize;
+  uint64_t* pagemap_raw_data = utility::read_raw_pagemap((char*) m_addr + first_page*pagesize, (last_page - first_page)*pagesize);
+  const unsigned char* digest = blocks->get(block_index);
+  int block_fd = -1;
+  if (!utility::is_empty_digest(digest)){
+    std::string block_hash = utility::digest_to_hex(digest);
+    block_fd = block_storage->get_block_fd(block_hash.c_str(), block_index);
+    if (block_fd == -1){
+      std::cerr << "Privateer: Error opening block " << block_hash << std::endl;
+      delete [] pagemap_raw_data;
+      return false;
+    }
+  }
+  bool read_all = true;
+  size_t page_index = first_page;
+  while (page_index < last_page && read_all){
+    utility::PagemapEntry pme = utility::parse_pagemap_entry(pagemap_raw_data[page_index - first_page]);
+    bool private_page = !pme.file_page && (pme.present || pme.swapped);
+    // Run of pages read the same way
+    size_t run_end = page_index + 1;
+    while (run_end < last_page){
+      utility::PagemapEntry next_pme = utility::parse_pagemap_entry(pagemap_raw_data[run_end - first_page]);
+      if ((!next_pme.file_page && (next_pme.present || next_pme.swapped)) != private_page){
+        break;
+      }
+      run_end++;
+    }
+    size_t run_start_byte = std::max(start, page_index*pagesize);
+    size_t run_end_byte = std::min(end, run_end*pagesize);
+    char* out = buffer + (run_start_byte - start);
+    if (private_page){
+      memcpy(out, (char*) m_addr + run_start_byte, run_end_byte - run_start_byte);
+    }
+    else if (block_fd == -1){
+      memset(out, 0, run_end_byte - run_start_byte);
+    }
+    else{
+      size_t file_offset = run_start_byte - block_index*file_granularity;
+      size_t read_bytes = 0;
+      while (read_bytes < run_end_byte - run_start_byte){
+        ssize_t count = ::pread(block_fd, out + read_bytes, run_end_byte - run_start_byte - read_bytes, file_offset + read_bytes);
+        if (count <= 0){
+          std::cerr << "Privateer: Error reading block with index " << block_index << std::endl;
+          read_all = false;
+          break;
+        }
+        read_bytes += count;
+      }
+    }
+    page_index = run_end;
+  }
+  if (block_fd != -1){
+    ::close(block_fd);
+  }
+  delete [] pagemap_raw_data;
+  return read_all;
+}
+
 inline void* Privateer::data(){
   return m_addr;
 }
@@ -876,50 +1598,379 @@ inline size_t Privateer::max_size(){
   return m_max_size;
 }
 
+inline std::string Privateer::blocks_path(){
+  return blocks_dir_path;
+}
+
 inline size_t Privateer::version_size(std::string version_path){
-  // Read size path
-  std::string size_string;
-  std::string size_file_name = std::string(version_path) + "/_size";
-  std::ifstream size_file;
-  size_file.open(size_file_name);
-  if (!size_file.is_open()){
-    std::cerr << "Error opening size file path at: " << size_file_name << std::endl;
-    return (size_t) -1;
+  std::string catalog_blocks_dir_path, name;
+  if (VersionCatalog::parse_reference(version_path, catalog_blocks_dir_path, name)){
+    VersionCatalog version_catalog(catalog_blocks_dir_path);
+    CatalogRecord record;
+    uint64_t record_offset;
+    if (!version_catalog.find(name, record, record_offset)){
+      std::cerr << "Error: Version " << version_path << " does not exists" << std::endl;
+      return (size_t) -1;
+    }
+    return record.size;
   }
-  if (!std::getline(size_file, size_string)){
-    std::cerr << "Error reading reading file" << std::endl;
+  Recipe recipe;
+  if (!recipe.load(version_path)){
+    std::cerr << "Error reading version metadata at: " << version_path << std::endl;
     return (size_t) -1;
   }
-  try {
-    size_t size = std::stol(size_string);
-    return size;
+  return recipe.size();
+}
+
+inline size_t Privateer::version_capacity(std::string version_path){
+  std::string catalog_blocks_dir_path, name;
+  if (VersionCatalog::parse_reference(version_path, catalog_blocks_dir_path, name)){
+    VersionCatalog version_catalog(catalog_blocks_dir_path);
+    CatalogRecord record;
+    uint64_t record_offset;
+    if (!version_catalog.find(name, record, record_offset)){
+      std::cerr << "Error: Version " << version_path << " does not exists" << std::endl;
+      return (size_t) -1;
+    }
+    return record.capacity;
   }
-  catch (const std::invalid_argument& ia){
-    std::cerr << "Error parsing version size from file - " << ia.what() << std::endl;
+  Recipe recipe;
+  if (!recipe.load(version_path)){
+    std::cerr << "Error reading version metadata at: " << version_path << std::endl;
     return (size_t) -1;
   }
+  return recipe.capacity();
 }
 
-inline size_t Privateer::version_capacity(std::string version_path){
-  // Read size path
-  std::string size_string;
-  std::string size_file_name = std::string(version_path) + "/_capacity";
-  std::ifstream size_file;
-  size_file.open(size_file_name);
-  if (!size_file.is_open()){
-    std::cerr << "Error opening size file path at: " << size_file_name << std::endl;
-    return (size_t) -1;
+inline std::vector<ChangedRange> Privateer::diff(std::string version_a, std::string version_b){
+  std::vector<ChangedRange> changed_ranges;
+  VersionDiff version_diff(version_a, version_b);
+  ChangedRange changed_range;
+  while (version_diff.next(changed_range)){
+    changed_ranges.push_back(changed_range);
   }
-  if (!std::getline(size_file, size_string)){
-    std::cerr << "Error reading reading file" << std::endl;
-    return (size_t) -1;
+  return changed_ranges;
+}
+
+inline bool Privateer::merge(std::string base_version, std::string version_a, std::string version_b, std::string out_version,
+                              MergeConflictPolicy policy){
+  VersionMerge version_merge(base_version, version_a, version_b);
+  return version_merge.merge(out_version, policy);
+}
+
+inline bool Privateer::checkout(const char* version_metadata_path){
+  VersionLayout layout;
+  BlockTable* target_blocks = load_version_digests(version_metadata_path, layout, true);
+  if (target_blocks == nullptr){
+    std::cerr << "Privateer: Error reading version " << version_metadata_path << std::endl;
+    return false;
   }
-  try {
-    size_t size = std::stol(size_string);
-    return size;
+  if (layout.blocks_dir_path.compare(blocks_dir_path) != 0 || layout.granularity != file_granularity
+      || layout.capacity != m_max_size || target_blocks->num_entries() != blocks->num_entries()){
+    std::cerr << "Privateer: Error - " << version_metadata_path << " is not a version of the same data store and capacity" << std::endl;
+    delete target_blocks;
+    return false;
   }
-  catch (const std::invalid_argument& ia){
-    std::cerr << "Error parsing version size from file - " << ia.what() << std::endl;
-    return (size_t) -1;
+  bool in_catalog = (layout.record_offset != VersionCatalog::NO_RECORD);
+  if (!in_catalog && target_blocks->recompute_checksum(layout.num_blocks) != target_blocks->checksum()){
+    // Caught while its writer was updating it
+    delete target_blocks;
+    return false;
+  }
+  // Open the version's metadata before changing any mapping
+  int target_metadata_fd = -1;
+  RecipeHeader recipe_header;
+  if (!in_catalog){
+    std::string metadata_file_name = std::string(version_metadata_path) + "/_metadata";
+    target_metadata_fd = ::open(metadata_file_name.c_str(), m_read_only ? O_RDONLY : O_RDWR);
+    if (target_metadata_fd == -1){
+      std::cerr << "Privateer: Error opening " << metadata_file_name << " - " << strerror(errno) << std::endl;
+      delete target_blocks;
+      return false;
+    }
+  }
+
+  // Remap blocks whose digest differs, blocks entering or leaving the current size, and
+  // (writable regions) blocks with uncommitted pages
+  size_t num_current_blocks = m_current_size / file_granularity;
+  size_t num_target_blocks = layout.size / file_granularity;
+  bool remapped = true;
+  #pragma omp parallel for reduction(&&:remapped)
+  for (size_t i = 0; i < std::max(num_current_blocks, num_target_blocks); i++){
+    bool changed = (memcmp(blocks->get(i), target_blocks->get(i), utility::DIGEST_SIZE) != 0)
+                   || ((i < num_current_blocks) != (i < num_target_blocks));
+    if (!changed && !m_read_only){
+      changed = block_has_private_pages(i);
+    }
+    if (changed){
+      remapped = remap_block(i, target_blocks->get(i), i < num_target_blocks) && remapped;
+    }
+  }
+  if (!remapped){
+    std::cerr << "Privateer: Error remapping blocks of " << version_metadata_path << std::endl;
+    exit(-1);
+  }
+
+  // Continue as the checked out version
+  delete blocks;
+  blocks = target_blocks;
+  m_current_size = layout.size;
+  version_metadata_dir_path = version_metadata_path;
+  if (metadata_fd != -1){
+    ::close(metadata_fd);
+  }
+  metadata_fd = target_metadata_fd;
+  if (in_catalog){
+    std::string catalog_blocks_dir_path;
+    VersionCatalog::parse_reference(version_metadata_path, catalog_blocks_dir_path, catalog_name);
+    if (catalog == nullptr){
+      catalog = new VersionCatalog(blocks_dir_path);
+    }
+    catalog_record_offset = layout.record_offset;
+  }
+  else{
+    delete catalog;
+    catalog = nullptr;
+    metadata_is_legacy = !Recipe::read_header(metadata_fd, recipe_header);
+    metadata_num_blocks = metadata_is_legacy ? 0 : layout.num_blocks;
+    block_storage->register_version(version_metadata_dir_path);
+  }
+  return true;
+}
+
+inline bool Privateer::refresh(){
+  if (!m_read_only){
+    std::cerr << "Privateer: refresh is for read-only regions, use checkout" << std::endl;
+    return false;
+  }
+  // Nothing to do unless a newer state was committed
+  if (catalog != nullptr){
+    CatalogRecord record;
+    uint64_t record_offset;
+    if (catalog->find(catalog_name, record, record_offset) && record_offset == catalog_record_offset){
+      return true;
+    }
+  }
+  else{
+    RecipeHeader recipe_header;
+    if (Recipe::read_header(metadata_fd, recipe_header) && recipe_header.size == m_current_size
+        && recipe_header.digests_checksum == blocks->checksum()){
+      return true;
+    }
+  }
+  return checkout(version_metadata_dir_path.c_str());
+}
+
+inline bool Privateer::block_has_private_pages(size_t block_index){
+  size_t pagesize = sysconf(_SC_PAGE_SIZE);
+  uint64_t* pagemap_raw_data = utility::read_raw_pagemap(block_address(block_index), file_granularity);
+  bool has_private_pages = false;
+  for (size_t page_index = 0; page_index < file_granularity / pagesize && !has_private_pages; page_index++){
+    utility::PagemapEntry pme = utility::parse_pagemap_entry(pagemap_raw_data[page_index]);
+    has_private_pages = !pme.file_page && (pme.present || pme.swapped);
+  }
+  delete [] pagemap_raw_data;
+  return has_private_pages;
+}
+
+// Maps a block's committed content at its address: its block file, anonymous memory for empty
+// blocks, or inaccessible memory beyond the current size
+inline bool Privateer::remap_block(size_t block_index, const unsigned char* digest, bool within_size){
+  void* region;
+  if (!within_size){
+    region = mmap(block_address(block_index), file_granularity, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE | MAP_FIXED, -1, 0);
+  }
+  else if (utility::is_empty_digest(digest)){
+    region = mmap(block_address(block_index), file_granularity, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE | MAP_FIXED, -1, 0);
+  }
+  else{
+    std::string block_hash = utility::digest_to_hex(digest);
+    int block_fd = block_storage->get_block_fd(block_hash.c_str(), block_index);
+    if (block_fd == -1){
+      std::cerr << "Privateer: Error opening block " << block_hash << " " << strerror(errno) << std::endl;
+      return false;
+    }
+    int prot_flags = m_read_only ? PROT_READ : PROT_READ | PROT_WRITE;
+    region = mmap(block_address(block_index), file_granularity, prot_flags, MAP_PRIVATE | MAP_FIXED, block_fd, 0);
+    ::close(block_fd);
+  }
+  if (region == MAP_FAILED){
+    std::cerr << "Privateer: mmap error - " << strerror(errno) << std::endl;
+    return false;
+  }
+  return true;
+}
+
+inline Privateer* Privateer::clone(void* addr){
+  int mmap_flags = MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE;
+  if (addr != nullptr){
+    mmap_flags |= MAP_FIXED;
+  }
+  void* cloned_addr = mmap(addr, m_max_size, PROT_NONE, mmap_flags, -1, 0);
+  if (cloned_addr == MAP_FAILED){
+    std::cerr << "Privateer: mmap error - " << strerror(errno) << std::endl;
+    return nullptr;
+  }
+  Privateer* cloned = new Privateer();
+  cloned->m_addr = cloned_addr;
+  cloned->m_max_size = m_max_size;
+  cloned->m_current_size = m_current_size;
+  cloned->file_granularity = file_granularity;
+  cloned->blocks_dir_path = blocks_dir_path;
+  cloned->metadata_fd = -1;
+  cloned->metadata_num_blocks = 0;
+  cloned->metadata_is_legacy = false;
+  cloned->catalog = nullptr;
+  cloned->catalog_record_offset = VersionCatalog::NO_RECORD;
+  cloned->m_read_only = false;
+  cloned->m_fds = nullptr;
+  // Also keeps the direct I/O setting and tiers
+  cloned->block_storage = new BlockStorage(*block_storage);
+  cloned->dirty_tracking = dirty_tracking;
+  cloned->dirty_pages = dirty_pages != nullptr ? new DirtyPageBitmap(*dirty_pages) : nullptr;
+  cloned->volatile_ranges = volatile_ranges;
+  cloned->commit_mode = commit_mode;
+  // The clone has no recipe file, all its entries are written on its first snapshot
+  cloned->blocks = new BlockTable(blocks->num_entries());
+  size_t num_blocks = m_current_size / file_granularity;
+  for (size_t i = 0; i < num_blocks; i++){
+    if (!blocks->is_empty(i)){
+      cloned->blocks->set(i, blocks->get(i));
+    }
+  }
+
+  // Share the committed block files, then copy only the pages changed since the last commit
+  bool cloned_blocks = true;
+  #pragma omp parallel for reduction(&&:cloned_blocks)
+  for (size_t i = 0; i < num_blocks; i++){
+    cloned_blocks = cloned->remap_block(i, blocks->get(i), true) && copy_private_pages(i, cloned) && cloned_blocks;
+  }
+  if (!cloned_blocks){
+    std::cerr << "Privateer: Error cloning region" << std::endl;
+    delete cloned;
+    return nullptr;
+  }
+  return cloned;
+}
+
+// Copies the block's pages that differ from its committed content to the same block of target
+inline bool Privateer::copy_private_pages(size_t block_index, Privateer* target){
+  size_t pagesize = sysconf(_SC_PAGE_SIZE);
+  uint64_t* pagemap_raw_data = utility::read_raw_pagemap(block_address(block_index), file_granularity);
+  if (pagemap_raw_data == nullptr){
+    return false;
+  }
+  char* source = (char*) block_address(block_index);
+  char* destination = (char*) target->block_address(block_index);
+  size_t num_pages = file_granularity / pagesize;
+  size_t run_start = num_pages;
+  for (size_t page_index = 0; page_index <= num_pages; page_index++){
+    bool is_private = false;
+    if (page_index < num_pages){
+      utility::PagemapEntry pme = utility::parse_pagemap_entry(pagemap_raw_data[page_index]);
+      is_private = !pme.file_page && (pme.present || pme.swapped);
+    }
+    if (is_private && run_start == num_pages){
+      run_start = page_index;
+    }
+    else if (!is_private && run_start != num_pages){
+      memcpy(destination + run_start*pagesize, source + run_start*pagesize, (page_index - run_start)*pagesize);
+      run_start = num_pages;
+    }
+  }
+  delete [] pagemap_raw_data;
+  return true;
+}
+
+inline std::vector<HashedBlock> Privateer::hash_dirty_blocks(){
+  if (m_read_only){
+    return std::vector<HashedBlock>();
+  }
+  size_t num_blocks = m_current_size / file_granularity;
+  // As in commit_blocks: volatile pages are committed as zeros, and with EXPLICIT tracking only
+  // marked blocks are considered, their marks taken by this commit
+  clear_volatile_pages(0, num_blocks);
+  std::vector<size_t> block_indices;
+  if (dirty_tracking == DirtyTracking::EXPLICIT){
+    block_indices = dirty_pages->marked_blocks(0, num_blocks);
+  }
+  else{
+    for (size_t i = 0; i < num_blocks; i++){
+      block_indices.push_back(i);
+    }
+  }
+  std::vector<char> dirty(block_indices.size());
+  std::vector<HashedBlock> hashed_blocks(block_indices.size());
+  #pragma omp parallel for
+  for (size_t k = 0; k < block_indices.size(); k++){
+    size_t i = block_indices[k];
+    if (dirty_tracking == DirtyTracking::EXPLICIT){
+      std::vector<uint64_t> page_words(dirty_pages->words_per_block());
+      dirty[k] = dirty_pages->take_block(i, page_words.data());
+    }
+    else{
+      dirty[k] = block_has_private_pages(i);
+    }
+    if (dirty[k]){
+      hashed_blocks[k].block_index = i;
+      std::string block_hash = utility::compute_hash((char*) block_address(i), file_granularity);
+      utility::hex_to_digest(block_hash.c_str(), hashed_blocks[k].digest);
+    }
+  }
+  size_t num_dirty_blocks = 0;
+  for (size_t k = 0; k < block_indices.size(); k++){
+    if (dirty[k]){
+      hashed_blocks[num_dirty_blocks++] = hashed_blocks[k];
+    }
+  }
+  hashed_blocks.resize(num_dirty_blocks);
+  return hashed_blocks;
+}
+
+inline bool Privateer::commit_hashed_blocks(const std::vector<HashedBlock> &hashed_blocks, const std::vector<bool> &store){
+  if (m_read_only){
+    std::cerr << "Privateer: Region is read-only" << std::endl;
+    return false;
+  }
+  bool committed = true;
+  #pragma omp parallel for reduction(&&:committed)
+  for (size_t k = 0; k < hashed_blocks.size(); k++){
+    const HashedBlock &hashed_block = hashed_blocks[k];
+    bool block_committed;
+    if (store[k]){
+      // Store the block's content, then map it from its block file
+      BlockStorage block_storage_local(*block_storage);
+      std::string temporary_file_name_template = std::to_string(hashed_block.block_index) + "_temp_XXXXXX";
+      int block_fd = block_storage_local.create_temporary_unique_block((char*) temporary_file_name_template.c_str(), hashed_block.block_index);
+      block_committed = block_fd != -1
+                        && block_storage_local.store_block(block_fd, block_address(hashed_block.block_index), true, hashed_block.block_index,
+                                                           utility::digest_to_hex(hashed_block.digest))
+                        && map_committed_block(hashed_block.block_index, block_fd);
+      if (block_fd != -1){
+        ::close(block_fd);
+      }
+    }
+    else{
+      // Stored by another process
+      block_committed = remap_block(hashed_block.block_index, hashed_block.digest, true);
+    }
+    if (block_committed){
+      blocks->set(hashed_block.block_index, hashed_block.digest);
+      drop_volatile_pages(hashed_block.block_index, hashed_block.block_index + 1);
+    }
+    else{
+      std::cerr << "Privateer: Error committing block " << hashed_block.block_index << std::endl;
+    }
+    committed = block_committed && committed;
+  }
+  return committed;
+}
+
+inline bool Privateer::discard_blocks(const std::vector<size_t> &block_indices){
+  bool discarded = true;
+  #pragma omp parallel for reduction(&&:discarded)
+  for (size_t k = 0; k < block_indices.size(); k++){
+    discarded = remap_block(block_indices[k], blocks->get(block_indices[k]), block_indices[k] < m_current_size / file_granularity) && discarded;
   }
+  return discarded;
 }
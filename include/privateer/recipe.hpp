@@ -0,0 +1,306 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "utility/sha256_hash.hpp"
+#include "utility/file_util.hpp"
+
+// Version recipe (the _metadata file of a version): a 4 KiB header followed by one packed
+// binary digest per block.
+struct RecipeHeader
+{
+  char magic[8];
+  uint32_t format_version;
+  uint32_t hash_algorithm;
+  uint64_t size;
+  uint64_t capacity;
+  uint64_t granularity;
+  uint64_t num_blocks;
+  // XOR of a hash of (index, digest) over non-empty entries, maintainable per changed entry
+  uint64_t digests_checksum;
+  // Hash of the whole header with this field zeroed
+  uint64_t header_checksum;
+  char blocks_path[4096 - 64];
+};
+
+static_assert(sizeof(RecipeHeader) == 4096, "Recipe header size is part of the recipe format");
+
+class Recipe
+{
+  public:
+    static constexpr char MAGIC[8] = {'P', 'R', 'V', 'R', 'C', 'P', 'E', '\0'};
+    static const uint32_t FORMAT_VERSION = 1;
+    static const uint32_t HASH_ALGORITHM_SHA256 = 1;
+    static const size_t HEADER_SIZE = sizeof(RecipeHeader);
+
+    Recipe();
+    ~Recipe();
+
+    // Maps the recipe of a version (or parses a legacy text recipe); false if it cannot be read
+    bool load(std::string version_metadata_path);
+    size_t size();
+    size_t capacity();
+    size_t granularity();
+    size_t num_blocks();
+    std::string blocks_path();
+    const unsigned char* digest(size_t block_index);
+
+    static bool read_header(int metadata_fd, RecipeHeader &header);
+    static bool write(int metadata_fd, size_t size, size_t capacity, size_t granularity, std::string blocks_path,
+                      const unsigned char* digests, size_t num_blocks);
+    static bool write_header(int metadata_fd, size_t size, size_t capacity, size_t granularity, std::string blocks_path,
+                             size_t num_blocks, uint64_t digests_checksum);
+    static uint64_t entry_checksum(size_t block_index, const unsigned char* digest);
+    static uint64_t digests_checksum(const unsigned char* digests, size_t num_blocks);
+    // Full check of the digests against the header checksum, O(number of blocks)
+    static bool verify(std::string version_metadata_path);
+
+  private:
+    RecipeHeader header;
+    std::string m_blocks_path;
+    unsigned char* digests;
+    void* mapping; // Whole recipe, digests start HEADER_SIZE bytes in
+    size_t mapped_length;
+    bool mapped;
+
+    bool load_legacy(std::string version_metadata_path, int metadata_fd);
+    static uint64_t fnv1a(const unsigned char* data, size_t length, uint64_t seed);
+};
+
+inline uint64_t Recipe::fnv1a(const unsigned char* data, size_t length, uint64_t seed){
+  uint64_t hash = seed;
+  for (size_t i = 0; i < length; i++){
+    hash ^= data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+inline uint64_t Recipe::entry_checksum(size_t block_index, const unsigned char* digest){
+  if (utility::is_empty_digest(digest)){
+    return 0;
+  }
+  uint64_t index = block_index;
+  uint64_t hash = fnv1a((const unsigned char*) &index, sizeof(index), 14695981039346656037ULL);
+  return fnv1a(digest, utility::DIGEST_SIZE, hash);
+}
+
+inline uint64_t Recipe::digests_checksum(const unsigned char* digests, size_t num_blocks){
+  uint64_t checksum = 0;
+  for (size_t i = 0; i < num_blocks; i++){
+    checksum ^= entry_checksum(i, digests + i*utility::DIGEST_SIZE);
+  }
+  return checksum;
+}
+
+inline Recipe::Recipe(){
+  memset(&header, 0, sizeof(header));
+  digests = nullptr;
+  mapping = nullptr;
+  mapped_length = 0;
+  mapped = false;
+}
+
+inline Recipe::~Recipe(){
+  if (digests == nullptr){
+    return;
+  }
+  if (mapped){
+    munmap(mapping, mapped_length);
+  }
+  else{
+    delete [] digests;
+  }
+}
+
+inline bool Recipe::read_header(int metadata_fd, RecipeHeader &recipe_header){
+  ssize_t read = ::pread(metadata_fd, (void*) &recipe_header, sizeof(RecipeHeader), 0);
+  if (read != sizeof(RecipeHeader) || memcmp(recipe_header.magic, MAGIC, sizeof(MAGIC)) != 0){
+    return false;
+  }
+  uint64_t stored_checksum = recipe_header.header_checksum;
+  recipe_header.header_checksum = 0;
+  uint64_t checksum = fnv1a((const unsigned char*) &recipe_header, sizeof(RecipeHeader), 14695981039346656037ULL);
+  recipe_header.header_checksum = stored_checksum;
+  if (checksum != stored_checksum){
+    std::cerr << "Recipe: Error - Header checksum mismatch" << std::endl;
+    return false;
+  }
+  if (recipe_header.format_version != FORMAT_VERSION || recipe_header.hash_algorithm != HASH_ALGORITHM_SHA256){
+    std::cerr << "Recipe: Error - Unsupported recipe format " << recipe_header.format_version << std::endl;
+    return false;
+  }
+  return true;
+}
+
+inline bool Recipe::load(std::string version_metadata_path){
+  std::string metadata_file_name = version_metadata_path + "/_metadata";
+  int metadata_fd = ::open(metadata_file_name.c_str(), O_RDONLY);
+  if (metadata_fd == -1){
+    return false;
+  }
+  char magic[sizeof(MAGIC)];
+  if (::pread(metadata_fd, magic, sizeof(magic), 0) != sizeof(magic) || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0){
+    bool status = load_legacy(version_metadata_path, metadata_fd);
+    ::close(metadata_fd);
+    return status;
+  }
+  if (!read_header(metadata_fd, header)){
+    ::close(metadata_fd);
+    return false;
+  }
+  m_blocks_path = std::string(header.blocks_path);
+  if (header.num_blocks > 0){
+    // Mapped from the start of the file: the header is not page aligned on systems with pages above 4 KiB
+    size_t pagesize = sysconf(_SC_PAGE_SIZE);
+    mapped_length = ((HEADER_SIZE + header.num_blocks*utility::DIGEST_SIZE + pagesize - 1) / pagesize) * pagesize;
+    mapping = mmap(nullptr, mapped_length, PROT_READ, MAP_PRIVATE, metadata_fd, 0);
+    if (mapping == MAP_FAILED){
+      std::cerr << "Recipe: mmap error - " << strerror(errno) << std::endl;
+      mapping = nullptr;
+      ::close(metadata_fd);
+      return false;
+    }
+    digests = (unsigned char*) mapping + HEADER_SIZE;
+    mapped = true;
+  }
+  ::close(metadata_fd);
+  return true;
+}
+
+// Recipes written before the binary format: 64 hex characters per block, with size,
+// capacity and blocks path in separate text files
+inline bool Recipe::load_legacy(std::string version_metadata_path, int metadata_fd){
+  struct stat st;
+  fstat(metadata_fd, &st);
+  const size_t hex_size = 2*utility::DIGEST_SIZE;
+  std::string all_hashes(st.st_size, '\0');
+  if (::pread(metadata_fd, (void*) all_hashes.data(), st.st_size, 0) != st.st_size){
+    return false;
+  }
+  std::string text_fields[3];
+  const char* text_field_names[3] = {"/_size", "/_capacity", "/_blocks_path"};
+  for (int i = 0; i < 3; i++){
+    std::ifstream field_file(version_metadata_path + text_field_names[i]);
+    if (!std::getline(field_file, text_fields[i])){
+      std::cerr << "Recipe: Error reading " << version_metadata_path << text_field_names[i] << std::endl;
+      return false;
+    }
+  }
+  try{
+    header.size = std::stol(text_fields[0]);
+    header.capacity = std::stol(text_fields[1]);
+  }
+  catch (const std::invalid_argument& ia){
+    std::cerr << "Recipe: Error parsing legacy version metadata - " << ia.what() << std::endl;
+    return false;
+  }
+  m_blocks_path = text_fields[2];
+  std::ifstream granularity_file(m_blocks_path + "/_granularity");
+  std::string granularity_string;
+  if (std::getline(granularity_file, granularity_string)){
+    header.granularity = std::stol(granularity_string);
+  }
+  header.num_blocks = all_hashes.size() / hex_size;
+  digests = new unsigned char[header.num_blocks*utility::DIGEST_SIZE];
+  for (size_t i = 0; i < header.num_blocks; i++){
+    if (!utility::hex_to_digest(all_hashes.c_str() + i*hex_size, digests + i*utility::DIGEST_SIZE)){
+      std::cerr << "Recipe: Error parsing legacy recipe entry " << i << std::endl;
+      return false;
+    }
+  }
+  header.hash_algorithm = HASH_ALGORITHM_SHA256;
+  return true;
+}
+
+inline size_t Recipe::size(){
+  return header.size;
+}
+
+inline size_t Recipe::capacity(){
+  return header.capacity;
+}
+
+inline size_t Recipe::granularity(){
+  return header.granularity;
+}
+
+inline size_t Recipe::num_blocks(){
+  return header.num_blocks;
+}
+
+inline std::string Recipe::blocks_path(){
+  return m_blocks_path;
+}
+
+inline const unsigned char* Recipe::digest(size_t block_index){
+  return digests + block_index*utility::DIGEST_SIZE;
+}
+
+inline bool Recipe::write_header(int metadata_fd, size_t size, size_t capacity, size_t granularity, std::string blocks_path,
+                                 size_t num_blocks, uint64_t digests_checksum){
+  RecipeHeader recipe_header;
+  memset(&recipe_header, 0, sizeof(recipe_header));
+  if (blocks_path.length() >= sizeof(recipe_header.blocks_path)){
+    std::cerr << "Recipe: Error - Blocks path too long" << std::endl;
+    return false;
+  }
+  memcpy(recipe_header.magic, MAGIC, sizeof(MAGIC));
+  recipe_header.format_version = FORMAT_VERSION;
+  recipe_header.hash_algorithm = HASH_ALGORITHM_SHA256;
+  recipe_header.size = size;
+  recipe_header.capacity = capacity;
+  recipe_header.granularity = granularity;
+  recipe_header.num_blocks = num_blocks;
+  recipe_header.digests_checksum = digests_checksum;
+  memcpy(recipe_header.blocks_path, blocks_path.c_str(), blocks_path.length());
+  recipe_header.header_checksum = fnv1a((const unsigned char*) &recipe_header, sizeof(RecipeHeader), 14695981039346656037ULL);
+  ssize_t written = ::pwrite(metadata_fd, (void*) &recipe_header, sizeof(RecipeHeader), 0);
+  if (written != sizeof(RecipeHeader)){
+    std::cerr << "Recipe: Error writing header - " << strerror(errno) << std::endl;
+    return false;
+  }
+  return true;
+}
+
+inline bool Recipe::write(int metadata_fd, size_t size, size_t capacity, size_t granularity, std::string blocks_path,
+                          const unsigned char* digests, size_t num_blocks){
+  size_t digests_length = num_blocks*utility::DIGEST_SIZE;
+  ssize_t written = ::pwrite(metadata_fd, (void*) digests, digests_length, HEADER_SIZE);
+  if (written != (ssize_t) digests_length){
+    std::cerr << "Recipe: Error writing digests - " << strerror(errno) << std::endl;
+    return false;
+  }
+  if (ftruncate(metadata_fd, HEADER_SIZE + digests_length) != 0){
+    std::cerr << "Recipe: Error sizing recipe - " << strerror(errno) << std::endl;
+    return false;
+  }
+  return write_header(metadata_fd, size, capacity, granularity, blocks_path, num_blocks, digests_checksum(digests, num_blocks));
+}
+
+inline bool Recipe::verify(std::string version_metadata_path){
+  Recipe recipe;
+  if (!recipe.load(version_metadata_path)){
+    return false;
+  }
+  if (!recipe.mapped){
+    // Legacy recipes carry no checksum
+    return true;
+  }
+  return digests_checksum(recipe.digests, recipe.num_blocks()) == recipe.header.digests_checksum;
+}
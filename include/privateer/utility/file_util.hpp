@@ -9,7 +9,11 @@
 #include <fstream>
 #include <cstdlib>
 #include <filesystem>
+#include <cstring>
+#include <algorithm>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 
 namespace utility{
@@ -54,4 +58,42 @@ namespace utility{
     return true;
   }
 
+  // Copy length bytes between file descriptors, in kernel (and reflinked where the file system supports it)
+  // when possible, falling back to a user space copy otherwise
+  bool copy_file_range(int source_fd, off_t source_offset, int destination_fd, off_t destination_offset, size_t length){
+    size_t copied = 0;
+    while (copied < length){
+      ssize_t ret = ::copy_file_range(source_fd, &source_offset, destination_fd, &destination_offset, length - copied, 0);
+      if (ret <= 0){
+        break;
+      }
+      copied += ret;
+    }
+    if (copied == length){
+      return true;
+    }
+    const size_t buffer_size = 1 << 20;
+    char* buffer = new char[buffer_size];
+    while (copied < length){
+      size_t count = std::min(buffer_size, length - copied);
+      ssize_t read_count = ::pread(source_fd, buffer, count, source_offset);
+      if (read_count <= 0){
+        break;
+      }
+      ssize_t written = ::pwrite(destination_fd, buffer, read_count, destination_offset);
+      if (written != read_count){
+        break;
+      }
+      source_offset += read_count;
+      destination_offset += read_count;
+      copied += read_count;
+    }
+    delete [] buffer;
+    if (copied != length){
+      std::cerr << "Privateer: Error copying file range: " << strerror(errno) << std::endl;
+      return false;
+    }
+    return true;
+  }
+
 }
@@ -5,8 +5,11 @@
 
 #pragma once
 
+#include <openssl/evp.h>
 #include <openssl/sha.h>
 #include <sstream>
+#include <iomanip>
+#include <cstring>
 
 namespace utility{
 
@@ -21,5 +24,76 @@ namespace utility{
     std::string out_string = output_string_stream.str();
     return out_string;
   }
-}
 
+  // Binary form of block hashes, as kept in recipes: 32 bytes, all zeros for an empty block
+  const size_t DIGEST_SIZE = 32;
+
+  void compute_digest(char* content_start, size_t content_length, unsigned char* digest){
+    SHA256((unsigned char*) content_start, content_length, digest);
+  }
+
+  // Digest of content hashed piece by piece, e.g. a block written in chunks
+  class DigestStream
+  {
+    public:
+      DigestStream(){
+        context = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(context, EVP_sha256(), nullptr);
+      }
+      ~DigestStream(){
+        EVP_MD_CTX_free(context);
+      }
+      void update(const char* content_start, size_t content_length){
+        EVP_DigestUpdate(context, content_start, content_length);
+      }
+      void finish(unsigned char* digest){
+        EVP_DigestFinal_ex(context, digest, nullptr);
+      }
+
+    private:
+      EVP_MD_CTX* context;
+  };
+
+  std::string digest_to_hex(const unsigned char* digest){
+    static const char hex_digits[] = "0123456789abcdef";
+    std::string hex(2*DIGEST_SIZE, '0');
+    for (size_t i = 0; i < DIGEST_SIZE; i++){
+      hex[2*i] = hex_digits[digest[i] >> 4];
+      hex[2*i + 1] = hex_digits[digest[i] & 0xf];
+    }
+    return hex;
+  }
+
+  bool hex_to_digest(const char* hex, unsigned char* digest){
+    for (size_t i = 0; i < DIGEST_SIZE; i++){
+      unsigned char byte = 0;
+      for (int j = 0; j < 2; j++){
+        char c = hex[2*i + j];
+        byte <<= 4;
+        if (c >= '0' && c <= '9'){
+          byte |= c - '0';
+        }
+        else if (c >= 'a' && c <= 'f'){
+          byte |= c - 'a' + 10;
+        }
+        else if (c >= 'A' && c <= 'F'){
+          byte |= c - 'A' + 10;
+        }
+        else{
+          return false;
+        }
+      }
+      digest[i] = byte;
+    }
+    return true;
+  }
+
+  bool is_empty_digest(const unsigned char* digest){
+    for (size_t i = 0; i < DIGEST_SIZE; i++){
+      if (digest[i] != 0){
+        return false;
+      }
+    }
+    return true;
+  }
+}
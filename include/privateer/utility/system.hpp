@@ -8,6 +8,9 @@
 #include <iostream>
 #include <cstdlib>
 #include <cmath>
+#include <string>
+#include <sstream>
+#include <vector>
 
 namespace utility{
   size_t get_environment_variable(std::string variable_name){
@@ -26,5 +29,20 @@ namespace utility{
     }
     return value;
   }
-}
 
+  std::vector<std::string> get_environment_path_list(std::string variable_name){
+    std::vector<std::string> paths;
+    char* value_c_str = std::getenv(variable_name.c_str());
+    if (value_c_str == NULL){
+      return paths;
+    }
+    std::stringstream value_stream(value_c_str);
+    std::string path;
+    while (std::getline(value_stream, path, ':')){
+      if (!path.empty()){
+        paths.push_back(path);
+      }
+    }
+    return paths;
+  }
+}
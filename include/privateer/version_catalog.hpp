@@ -0,0 +1,509 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "utility/sha256_hash.hpp"
+#include "utility/file_util.hpp"
+#include "utility/system.hpp"
+#include "block_table.hpp"
+
+// Catalog record: a fixed size header, followed by the digests of all blocks (FULL, page
+// aligned so they can be mapped), the (index, digest) entries that changed since the parent
+// record (DELTA), or nothing (DROP)
+struct CatalogRecord
+{
+  char magic[8];
+  uint32_t type;
+  uint32_t chain_depth; // DELTA records since the last FULL record
+  uint64_t parent_offset;
+  uint64_t payload_offset;
+  uint64_t num_entries;
+  uint64_t size;
+  uint64_t capacity;
+  uint64_t granularity;
+  uint64_t num_blocks;
+  uint64_t digests_checksum; // Recipe::digests_checksum of the version
+  uint64_t timestamp;
+  uint64_t record_checksum; // Hash of the header with this field zeroed and of DELTA entries
+  char name[512 - 96];
+};
+
+static_assert(sizeof(CatalogRecord) == 512, "Catalog record header must be 512 bytes");
+
+// Append-only catalog of the versions of a block store, an alternative to one metadata
+// directory per version. A version is named within the store and referenced as
+// <blocks directory>@<name>; its latest record holds the version. Records are appended to
+// <blocks directory>/_catalog and indexed by name hash in <blocks directory>/_catalog_index,
+// which is appended to only once a record is durable. Snapshots of a catalog version are
+// stored as deltas of their parent, with a full checkpoint every checkpoint interval records.
+class VersionCatalog
+{
+  public:
+    static const uint32_t RECORD_FULL = 1;
+    static const uint32_t RECORD_DELTA = 2;
+    static const uint32_t RECORD_DROP = 3;
+    static const uint64_t NO_RECORD = (uint64_t) -1;
+    static const size_t CHECKPOINT_INTERVAL_DEFAULT = 64;
+    static const size_t DELTA_ENTRY_SIZE = sizeof(uint64_t) + utility::DIGEST_SIZE;
+
+    VersionCatalog(std::string blocks_dir_path);
+    ~VersionCatalog();
+
+    // Splits <blocks directory>@<name>; false for plain version metadata directories, including new
+    // ones whose name contains '@' unless what precedes it is an existing blocks directory
+    static bool parse_reference(std::string reference, std::string &blocks_dir_path, std::string &name);
+    // Same, without checking the blocks directory, e.g. for a store about to be created
+    static bool split_reference(std::string reference, std::string &blocks_dir_path, std::string &name);
+
+    // Latest record of a version; false if there is none or the version was dropped
+    bool find(std::string name, CatalogRecord &record, uint64_t &record_offset);
+    bool read_record(uint64_t record_offset, CatalogRecord &record);
+    // Loads the digests of a version into a table with at least record.num_blocks entries, with no dirty entries
+    bool load(uint64_t record_offset, BlockTable* table);
+    // Appends a version record for name; a delta of parent_offset holding the table's dirty entries
+    // if the table is clean with respect to parent_offset, otherwise a full record.
+    // Returns the record offset or NO_RECORD on error.
+    uint64_t append(std::string name, uint64_t parent_offset, BlockTable* table, size_t size,
+                    size_t capacity, size_t granularity, size_t num_blocks);
+    bool drop(std::string name);
+
+    // Latest record offset of every version that was not dropped
+    std::map<std::string, uint64_t> live_versions();
+    // Record offsets in the order they were appended, starting at the first_entry-th
+    std::vector<uint64_t> records_since(size_t first_entry);
+    void set_checkpoint_interval(size_t interval);
+
+  private:
+    std::string catalog_file_name;
+    std::string index_file_name;
+    int catalog_fd;
+    int index_fd;
+    size_t checkpoint_interval;
+
+    struct IndexEntry
+    {
+      uint64_t name_hash;
+      uint64_t record_offset;
+    };
+
+    bool open_files(bool create);
+    std::vector<IndexEntry> read_index();
+    uint64_t append_record(CatalogRecord &record, const std::vector<unsigned char> &entries, BlockTable* table);
+    static uint64_t name_hash(const std::string &name);
+    static uint64_t record_checksum(CatalogRecord record, const unsigned char* entries, size_t entries_length);
+    static void init_record(CatalogRecord &record, uint32_t type, const std::string &name);
+};
+
+inline VersionCatalog::VersionCatalog(std::string blocks_dir_path){
+  catalog_file_name = blocks_dir_path + "/_catalog";
+  index_file_name = blocks_dir_path + "/_catalog_index";
+  catalog_fd = -1;
+  index_fd = -1;
+  checkpoint_interval = utility::get_environment_variable("PRIVATEER_CATALOG_CHECKPOINT_INTERVAL");
+  if (std::isnan(checkpoint_interval) || checkpoint_interval == 0){
+    checkpoint_interval = CHECKPOINT_INTERVAL_DEFAULT;
+  }
+}
+
+inline VersionCatalog::~VersionCatalog(){
+  if (catalog_fd != -1){
+    ::close(catalog_fd);
+  }
+  if (index_fd != -1){
+    ::close(index_fd);
+  }
+}
+
+inline bool VersionCatalog::parse_reference(std::string reference, std::string &blocks_dir_path, std::string &name){
+  return split_reference(reference, blocks_dir_path, name) && utility::file_exists((blocks_dir_path + "/_granularity").c_str());
+}
+
+inline bool VersionCatalog::split_reference(std::string reference, std::string &blocks_dir_path, std::string &name){
+  size_t separator = reference.rfind('@');
+  if (separator == std::string::npos || separator == 0 || separator == reference.length() - 1
+      || reference.find('/', separator) != std::string::npos || utility::directory_exists(reference.c_str())){
+    return false;
+  }
+  blocks_dir_path = reference.substr(0, separator);
+  name = reference.substr(separator + 1);
+  return name.length() < sizeof(CatalogRecord::name);
+}
+
+// Catalog files are created by the first append only, so read-only users never create them
+inline bool VersionCatalog::open_files(bool create){
+  if (catalog_fd != -1 && (index_fd != -1 || !create)){
+    return true;
+  }
+  if (create && catalog_fd != -1){
+    // Opened for reading only so far
+    ::close(catalog_fd);
+    catalog_fd = -1;
+  }
+  int flags = create ? O_RDWR | O_CREAT : O_RDONLY;
+  if (catalog_fd == -1){
+    catalog_fd = ::open(catalog_file_name.c_str(), flags, (mode_t) 0666);
+  }
+  if (create && index_fd == -1){
+    index_fd = ::open(index_file_name.c_str(), O_RDWR | O_CREAT | O_APPEND, (mode_t) 0666);
+  }
+  if (catalog_fd == -1 || (create && index_fd == -1)){
+    if (create){
+      std::cerr << "VersionCatalog: Error opening catalog " << catalog_file_name << " - " << strerror(errno) << std::endl;
+    }
+    return false;
+  }
+  return true;
+}
+
+inline uint64_t VersionCatalog::name_hash(const std::string &name){
+  uint64_t hash = 14695981039346656037ULL;
+  for (char c : name){
+    hash ^= (unsigned char) c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+inline uint64_t VersionCatalog::record_checksum(CatalogRecord record, const unsigned char* entries, size_t entries_length){
+  record.record_checksum = 0;
+  uint64_t hash = 14695981039346656037ULL;
+  const unsigned char* bytes = (const unsigned char*) &record;
+  for (size_t i = 0; i < sizeof(CatalogRecord); i++){
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  for (size_t i = 0; i < entries_length; i++){
+    hash ^= entries[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+inline void VersionCatalog::init_record(CatalogRecord &record, uint32_t type, const std::string &name){
+  memset(&record, 0, sizeof(record));
+  memcpy(record.magic, "PRVCTLG", 8);
+  record.type = type;
+  record.parent_offset = NO_RECORD;
+  record.timestamp = time(nullptr);
+  memcpy(record.name, name.c_str(), std::min(name.length(), sizeof(record.name) - 1));
+}
+
+inline std::vector<VersionCatalog::IndexEntry> VersionCatalog::read_index(){
+  std::vector<IndexEntry> entries;
+  int fd = index_fd != -1 ? index_fd : ::open(index_file_name.c_str(), O_RDONLY);
+  if (fd == -1){
+    return entries;
+  }
+  struct stat st;
+  fstat(fd, &st);
+  entries.resize(st.st_size / sizeof(IndexEntry));
+  ssize_t length = entries.size()*sizeof(IndexEntry);
+  if (::pread(fd, (void*) entries.data(), length, 0) != length){
+    entries.clear();
+  }
+  if (fd != index_fd){
+    ::close(fd);
+  }
+  return entries;
+}
+
+inline bool VersionCatalog::read_record(uint64_t record_offset, CatalogRecord &record){
+  if (!open_files(false)){
+    return false;
+  }
+  if (::pread(catalog_fd, (void*) &record, sizeof(record), record_offset) != sizeof(record)
+      || memcmp(record.magic, "PRVCTLG", 8) != 0){
+    std::cerr << "VersionCatalog: Error reading record at " << record_offset << std::endl;
+    return false;
+  }
+  if (record.type != RECORD_DELTA && record_checksum(record, nullptr, 0) != record.record_checksum){
+    std::cerr << "VersionCatalog: Error - Record checksum mismatch at " << record_offset << std::endl;
+    return false;
+  }
+  return true;
+}
+
+inline bool VersionCatalog::find(std::string name, CatalogRecord &record, uint64_t &record_offset){
+  std::vector<IndexEntry> entries = read_index();
+  uint64_t hash = name_hash(name);
+  for (size_t i = entries.size(); i > 0; i--){
+    if (entries[i - 1].name_hash != hash || !read_record(entries[i - 1].record_offset, record)
+        || name.compare(record.name) != 0){
+      continue;
+    }
+    record_offset = entries[i - 1].record_offset;
+    return record.type != RECORD_DROP;
+  }
+  return false;
+}
+
+inline bool VersionCatalog::load(uint64_t record_offset, BlockTable* table){
+  // Walk back to the last checkpoint, then apply deltas from the oldest on
+  std::vector<CatalogRecord> chain;
+  CatalogRecord record;
+  do{
+    if (!read_record(record_offset, record) || record.type == RECORD_DROP){
+      return false;
+    }
+    chain.push_back(record);
+    record_offset = record.parent_offset;
+  } while (record.type == RECORD_DELTA);
+  if (!table->map_base(catalog_fd, record.payload_offset, record.num_blocks, record.digests_checksum)){
+    return false;
+  }
+  for (size_t i = chain.size() - 1; i > 0; i--){
+    CatalogRecord &delta = chain[i - 1];
+    std::vector<unsigned char> entries(delta.num_entries*DELTA_ENTRY_SIZE);
+    if (::pread(catalog_fd, (void*) entries.data(), entries.size(), delta.payload_offset) != (ssize_t) entries.size()
+        || record_checksum(delta, entries.data(), entries.size()) != delta.record_checksum){
+      std::cerr << "VersionCatalog: Error reading delta of " << delta.name << std::endl;
+      return false;
+    }
+    for (size_t j = 0; j < delta.num_entries; j++){
+      uint64_t index;
+      memcpy(&index, entries.data() + j*DELTA_ENTRY_SIZE, sizeof(index));
+      table->set(index, entries.data() + j*DELTA_ENTRY_SIZE + sizeof(index));
+    }
+  }
+  table->clear_dirty();
+  if (table->checksum() != chain[0].digests_checksum){
+    std::cerr << "VersionCatalog: Error - Digests checksum mismatch for " << chain[0].name << std::endl;
+    return false;
+  }
+  return true;
+}
+
+inline uint64_t VersionCatalog::append_record(CatalogRecord &record, const std::vector<unsigned char> &entries, BlockTable* table){
+  if (!open_files(true) || flock(catalog_fd, LOCK_EX) != 0){
+    return NO_RECORD;
+  }
+  struct stat st;
+  fstat(catalog_fd, &st);
+  uint64_t record_offset = st.st_size;
+  bool written;
+  if (record.type == RECORD_FULL){
+    size_t pagesize = sysconf(_SC_PAGE_SIZE);
+    record.payload_offset = ((record_offset + sizeof(CatalogRecord) + pagesize - 1) / pagesize) * pagesize;
+    written = (ftruncate(catalog_fd, record.payload_offset + record.num_blocks*utility::DIGEST_SIZE) == 0)
+              && table->write_all(catalog_fd, record.num_blocks, record.payload_offset);
+  }
+  else{
+    record.payload_offset = record_offset + sizeof(CatalogRecord);
+    written = entries.empty()
+              || ::pwrite(catalog_fd, (void*) entries.data(), entries.size(), record.payload_offset) == (ssize_t) entries.size();
+  }
+  record.record_checksum = record_checksum(record, entries.data(), entries.size());
+  written = written && ::pwrite(catalog_fd, (void*) &record, sizeof(record), record_offset) == sizeof(record)
+            && fdatasync(catalog_fd) == 0;
+  // Index the record only once it is durable
+  IndexEntry index_entry = {name_hash(record.name), record_offset};
+  written = written && ::write(index_fd, (void*) &index_entry, sizeof(index_entry)) == sizeof(index_entry)
+            && fdatasync(index_fd) == 0;
+  flock(catalog_fd, LOCK_UN);
+  if (!written){
+    std::cerr << "VersionCatalog: Error appending record for " << record.name << " - " << strerror(errno) << std::endl;
+    return NO_RECORD;
+  }
+  return record_offset;
+}
+
+inline uint64_t VersionCatalog::append(std::string name, uint64_t parent_offset, BlockTable* table, size_t size,
+                                       size_t capacity, size_t granularity, size_t num_blocks){
+  CatalogRecord record;
+  init_record(record, RECORD_FULL, name);
+  record.size = size;
+  record.capacity = capacity;
+  record.granularity = granularity;
+  record.num_blocks = num_blocks;
+  record.digests_checksum = table->checksum();
+  std::vector<unsigned char> entries;
+  CatalogRecord parent;
+  size_t num_changed = table->num_dirty(num_blocks);
+  // Write a delta unless a checkpoint is due or the delta would not be smaller than a full record
+  if (parent_offset != NO_RECORD && read_record(parent_offset, parent) && parent.type != RECORD_DROP
+      && parent.chain_depth + 1 < checkpoint_interval && num_changed*DELTA_ENTRY_SIZE < num_blocks*utility::DIGEST_SIZE){
+    record.type = RECORD_DELTA;
+    record.parent_offset = parent_offset;
+    record.chain_depth = parent.chain_depth + 1;
+    record.num_entries = num_changed;
+    entries.resize(num_changed*DELTA_ENTRY_SIZE);
+    size_t position = 0;
+    table->for_each_dirty(num_blocks, [&](size_t index, const unsigned char* digest){
+      uint64_t entry_index = index;
+      memcpy(entries.data() + position, &entry_index, sizeof(entry_index));
+      memcpy(entries.data() + position + sizeof(entry_index), digest, utility::DIGEST_SIZE);
+      position += DELTA_ENTRY_SIZE;
+    });
+  }
+  else{
+    record.num_entries = num_blocks;
+  }
+  return append_record(record, entries, table);
+}
+
+inline bool VersionCatalog::drop(std::string name){
+  CatalogRecord record;
+  uint64_t record_offset;
+  if (!find(name, record, record_offset)){
+    return false;
+  }
+  init_record(record, RECORD_DROP, name);
+  record.parent_offset = record_offset;
+  return append_record(record, std::vector<unsigned char>(), nullptr) != NO_RECORD;
+}
+
+inline std::map<std::string, uint64_t> VersionCatalog::live_versions(){
+  std::map<std::string, uint64_t> versions;
+  for (IndexEntry &entry : read_index()){
+    CatalogRecord record;
+    if (!read_record(entry.record_offset, record)){
+      continue;
+    }
+    if (record.type == RECORD_DROP){
+      versions.erase(record.name);
+    }
+    else{
+      versions[record.name] = entry.record_offset;
+    }
+  }
+  return versions;
+}
+
+inline std::vector<uint64_t> VersionCatalog::records_since(size_t first_entry){
+  std::vector<uint64_t> record_offsets;
+  std::vector<IndexEntry> entries = read_index();
+  for (size_t i = first_entry; i < entries.size(); i++){
+    record_offsets.push_back(entries[i].record_offset);
+  }
+  return record_offsets;
+}
+
+inline void VersionCatalog::set_checkpoint_interval(size_t interval){
+  checkpoint_interval = interval;
+}
+
+// Layout of a version, given as a metadata directory or a version catalog reference
+struct VersionLayout
+{
+  size_t size;
+  size_t capacity;
+  size_t granularity;
+  size_t num_blocks;
+  std::string blocks_dir_path;
+  uint64_t record_offset; // Catalog record, VersionCatalog::NO_RECORD for metadata directories
+  bool legacy = false; // Text recipe, rewritten in the binary format on the next update
+};
+
+// Loads the digests of a version into a new table with an entry per block of its capacity, nullptr on error.
+// With private_copy, the digests of metadata directories are read rather than mapped, so a process
+// updating the version in place cannot change them (catalog records never change).
+inline BlockTable* load_version_digests(std::string version_path, VersionLayout &layout, bool private_copy = false){
+  std::string catalog_blocks_dir_path, name;
+  if (VersionCatalog::parse_reference(version_path, catalog_blocks_dir_path, name)){
+    VersionCatalog catalog(catalog_blocks_dir_path);
+    CatalogRecord record;
+    uint64_t record_offset;
+    if (!catalog.find(name, record, record_offset) || record.granularity == 0){
+      return nullptr;
+    }
+    layout = {record.size, record.capacity, record.granularity, record.num_blocks, catalog_blocks_dir_path, record_offset};
+    BlockTable* table = new BlockTable(std::max(record.num_blocks, record.capacity / record.granularity));
+    if (!catalog.load(record_offset, table)){
+      delete table;
+      return nullptr;
+    }
+    return table;
+  }
+  Recipe recipe;
+  if (!recipe.load(version_path) || recipe.granularity() == 0){
+    return nullptr;
+  }
+  layout = {recipe.size(), recipe.capacity(), recipe.granularity(), recipe.num_blocks(), recipe.blocks_path(), VersionCatalog::NO_RECORD};
+  BlockTable* table = new BlockTable(std::max(recipe.num_blocks(), recipe.capacity() / recipe.granularity()));
+  std::string metadata_file_name = version_path + "/_metadata";
+  int metadata_fd = ::open(metadata_file_name.c_str(), O_RDONLY);
+  RecipeHeader header;
+  bool loaded = true;
+  if (metadata_fd != -1 && Recipe::read_header(metadata_fd, header)){
+    // The header may be newer than the one loaded above
+    layout = {header.size, header.capacity, header.granularity, header.num_blocks, recipe.blocks_path(), VersionCatalog::NO_RECORD};
+    if (header.num_blocks > table->num_entries()){
+      loaded = false;
+    }
+    else if (private_copy){
+      loaded = table->read_entries(metadata_fd, Recipe::HEADER_SIZE, header.num_blocks, header.digests_checksum);
+    }
+    else{
+      loaded = table->map_base(metadata_fd, Recipe::HEADER_SIZE, header.num_blocks, header.digests_checksum);
+    }
+  }
+  else{
+    for (size_t i = 0; i < recipe.num_blocks(); i++){
+      table->set(i, recipe.digest(i));
+    }
+    table->clear_dirty();
+    layout.legacy = true;
+  }
+  if (metadata_fd != -1){
+    ::close(metadata_fd);
+  }
+  if (!loaded){
+    delete table;
+    return nullptr;
+  }
+  return table;
+}
+
+// Writes a new version with the given layout and digests: a metadata directory, or a record of the
+// store's version catalog. Metadata directories still have to be registered with their block store.
+inline bool store_version_digests(std::string version_path, const VersionLayout &layout, BlockTable* table){
+  std::string catalog_blocks_dir_path, name;
+  if (VersionCatalog::parse_reference(version_path, catalog_blocks_dir_path, name)){
+    if (catalog_blocks_dir_path.compare(layout.blocks_dir_path) != 0){
+      std::cerr << "Privateer: Error - " << version_path << " does not belong to blocks directory " << layout.blocks_dir_path << std::endl;
+      return false;
+    }
+    VersionCatalog catalog(layout.blocks_dir_path);
+    CatalogRecord existing_record;
+    uint64_t existing_record_offset;
+    if (catalog.find(name, existing_record, existing_record_offset)){
+      std::cerr << "Privateer: Error - Version " << version_path << " already exists" << std::endl;
+      return false;
+    }
+    return catalog.append(name, VersionCatalog::NO_RECORD, table, layout.size, layout.capacity, layout.granularity, layout.num_blocks) != VersionCatalog::NO_RECORD;
+  }
+  if (utility::directory_exists(version_path.c_str()) || !utility::create_directory(version_path.c_str())){
+    std::cerr << "Privateer: Error creating version metadata directory " << version_path << std::endl;
+    return false;
+  }
+  std::string metadata_file_name = version_path + "/_metadata";
+  int metadata_fd = ::open(metadata_file_name.c_str(), O_RDWR | O_CREAT | O_EXCL, (mode_t) 0666);
+  if (metadata_fd == -1){
+    std::cerr << "Privateer: Error creating " << metadata_file_name << " - " << strerror(errno) << std::endl;
+    return false;
+  }
+  bool written = ftruncate(metadata_fd, Recipe::HEADER_SIZE + layout.num_blocks*utility::DIGEST_SIZE) == 0
+                 && table->write_all(metadata_fd, layout.num_blocks)
+                 && Recipe::write_header(metadata_fd, layout.size, layout.capacity, layout.granularity, layout.blocks_dir_path,
+                                         layout.num_blocks, table->checksum());
+  ::close(metadata_fd);
+  return written;
+}
@@ -0,0 +1,239 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "block_storage.hpp"
+#include "block_table.hpp"
+#include "version_catalog.hpp"
+
+// Byte range [offset, offset + length) of a version's data
+struct ChangedRange
+{
+  size_t offset;
+  size_t length;
+};
+
+// Streams the byte ranges that differ between two versions, in increasing order, adjacent
+// ranges merged. Versions with the same block granularity are compared by recipe first:
+// blocks with equal digests are skipped without any I/O, and only the pages of differing
+// blocks are read and compared. Bytes beyond the size of the smaller version are all changed.
+class VersionDiff
+{
+  public:
+    VersionDiff(std::string version_a, std::string version_b);
+    ~VersionDiff();
+
+    bool valid();
+    // Next changed range; false once all ranges were returned, or on a read error (see failed())
+    bool next(ChangedRange &range);
+    // A block of either version could not be opened or read, e.g. missing or damaged
+    bool failed();
+    // Bytes of blocks known to be equal from their digests, without reading them
+    size_t unchanged_by_recipe();
+
+  private:
+    // A version's data, read block by block
+    struct Source
+    {
+      BlockTable* table;
+      VersionLayout layout;
+      BlockStorage* block_storage;
+      size_t open_block;
+      int open_block_fd;
+    };
+
+    static constexpr size_t COMPARE_CHUNK_BYTES = 1 << 20;
+
+    Source sources[2];
+    bool m_valid;
+    bool m_failed;
+    size_t compared_size;
+    size_t common_size;
+    size_t step; // Compared block size
+    size_t next_block;
+    size_t m_unchanged_by_recipe;
+    std::vector<ChangedRange> queue;
+    size_t queue_position;
+    ChangedRange pending;
+    bool has_pending;
+    char* buffers[2];
+
+    bool open_source(Source &source, std::string version_path);
+    bool read(Source &source, size_t offset, size_t length, char* buffer);
+    bool diff_step(size_t step_index);
+};
+
+inline VersionDiff::VersionDiff(std::string version_a, std::string version_b){
+  for (Source &source : sources){
+    source.table = nullptr;
+    source.block_storage = nullptr;
+    source.open_block_fd = -1;
+  }
+  buffers[0] = buffers[1] = nullptr;
+  next_block = 0;
+  queue_position = 0;
+  has_pending = false;
+  m_failed = false;
+  m_unchanged_by_recipe = 0;
+  m_valid = open_source(sources[0], version_a) && open_source(sources[1], version_b);
+  if (!m_valid){
+    compared_size = common_size = step = 0;
+    return;
+  }
+  compared_size = std::max(sources[0].layout.size, sources[1].layout.size);
+  common_size = std::min(sources[0].layout.size, sources[1].layout.size);
+  step = std::min(sources[0].layout.granularity, sources[1].layout.granularity);
+  buffers[0] = new char[std::min(step, COMPARE_CHUNK_BYTES)];
+  buffers[1] = new char[std::min(step, COMPARE_CHUNK_BYTES)];
+}
+
+inline VersionDiff::~VersionDiff(){
+  for (Source &source : sources){
+    if (source.open_block_fd != -1){
+      ::close(source.open_block_fd);
+    }
+    delete source.table;
+    delete source.block_storage;
+  }
+  delete [] buffers[0];
+  delete [] buffers[1];
+}
+
+inline bool VersionDiff::open_source(Source &source, std::string version_path){
+  source.table = load_version_digests(version_path, source.layout);
+  if (source.table == nullptr){
+    std::cerr << "VersionDiff: Error reading version " << version_path << std::endl;
+    return false;
+  }
+  source.block_storage = new BlockStorage(source.layout.blocks_dir_path);
+  return true;
+}
+
+inline bool VersionDiff::valid(){
+  return m_valid;
+}
+
+inline bool VersionDiff::failed(){
+  return m_failed;
+}
+
+inline size_t VersionDiff::unchanged_by_recipe(){
+  return m_unchanged_by_recipe;
+}
+
+inline bool VersionDiff::read(Source &source, size_t offset, size_t length, char* buffer){
+  while (length > 0){
+    size_t block_index = offset / source.layout.granularity;
+    size_t block_offset = offset % source.layout.granularity;
+    size_t count = std::min(length, source.layout.granularity - block_offset);
+    if (source.table->is_empty(block_index)){
+      memset(buffer, 0, count);
+    }
+    else{
+      if (source.open_block_fd == -1 || source.open_block != block_index){
+        if (source.open_block_fd != -1){
+          ::close(source.open_block_fd);
+        }
+        std::string block_hash = utility::digest_to_hex(source.table->get(block_index));
+        source.open_block_fd = source.block_storage->get_block_fd(block_hash.c_str(), block_index);
+        source.open_block = block_index;
+        if (source.open_block_fd == -1){
+          std::cerr << "VersionDiff: Error opening block " << block_hash << std::endl;
+          return false;
+        }
+      }
+      if (::pread(source.open_block_fd, buffer, count, block_offset) != (ssize_t) count){
+        std::cerr << "VersionDiff: Error reading block " << utility::digest_to_hex(source.table->get(block_index)) << std::endl;
+        return false;
+      }
+    }
+    offset += count;
+    buffer += count;
+    length -= count;
+  }
+  return true;
+}
+
+// Queues the changed ranges within [step_index*step, (step_index + 1)*step), false on a read error
+inline bool VersionDiff::diff_step(size_t step_index){
+  size_t start = step_index*step;
+  size_t end = std::min(start + step, compared_size);
+  if (start >= common_size){
+    queue.push_back({start, end - start});
+    return true;
+  }
+  if (sources[0].layout.granularity == sources[1].layout.granularity
+      && memcmp(sources[0].table->get(step_index), sources[1].table->get(step_index), utility::DIGEST_SIZE) == 0){
+    m_unchanged_by_recipe += end - start;
+    return true;
+  }
+  size_t pagesize = sysconf(_SC_PAGE_SIZE);
+  size_t chunk_size = std::min(step, COMPARE_CHUNK_BYTES);
+  for (size_t chunk_start = start; chunk_start < end; chunk_start += chunk_size){
+    size_t length = std::min(chunk_size, end - chunk_start);
+    if (!read(sources[0], chunk_start, length, buffers[0]) || !read(sources[1], chunk_start, length, buffers[1])){
+      // Not reported as changed, a missing block is no change of the data
+      return false;
+    }
+    for (size_t page_start = 0; page_start < length; page_start += pagesize){
+      size_t page_length = std::min(pagesize, length - page_start);
+      if (memcmp(buffers[0] + page_start, buffers[1] + page_start, page_length) == 0){
+        continue;
+      }
+      if (!queue.empty() && queue.back().offset + queue.back().length == chunk_start + page_start){
+        queue.back().length += page_length;
+      }
+      else{
+        queue.push_back({chunk_start + page_start, page_length});
+      }
+    }
+  }
+  return true;
+}
+
+inline bool VersionDiff::next(ChangedRange &range){
+  if (!m_valid || m_failed){
+    return false;
+  }
+  while (true){
+    while (queue_position == queue.size() && next_block*step < compared_size){
+      queue.clear();
+      queue_position = 0;
+      if (!diff_step(next_block++)){
+        m_failed = true;
+        return false;
+      }
+    }
+    if (queue_position == queue.size()){
+      if (has_pending){
+        range = pending;
+        has_pending = false;
+        return true;
+      }
+      return false;
+    }
+    ChangedRange changed = queue[queue_position++];
+    if (has_pending && pending.offset + pending.length == changed.offset){
+      pending.length += changed.length;
+      continue;
+    }
+    if (has_pending){
+      range = pending;
+      pending = changed;
+      return true;
+    }
+    pending = changed;
+    has_pending = true;
+  }
+}
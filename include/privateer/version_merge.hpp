@@ -0,0 +1,299 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+
+#include "utility/file_util.hpp"
+#include "utility/sha256_hash.hpp"
+#include "block_storage.hpp"
+#include "block_table.hpp"
+#include "recipe.hpp"
+#include "version_catalog.hpp"
+
+// Resolves a page changed differently by both versions: writes the merged content of
+// [offset, offset + length) to merged, or returns false to abort the merge. Blocks are merged
+// in parallel, the policy may be called concurrently
+typedef std::function<bool(size_t offset, size_t length, const char* base, const char* a, const char* b, char* merged)> MergeConflictPolicy;
+
+// Three-way merge of two versions derived from a common base version of the same data store.
+// Recipes are merged block by block without touching data: a block changed on one side only
+// takes that side's digest. Blocks changed on both sides are merged page by page, and pages
+// changed on both sides are resolved by the conflict policy; only such blocks are read and
+// stored as new blocks.
+class VersionMerge
+{
+  public:
+    VersionMerge(std::string base_version, std::string version_a, std::string version_b);
+    ~VersionMerge();
+
+    bool valid();
+    // Writes the merged version to out_version (a metadata directory or a catalog reference)
+    bool merge(std::string out_version, MergeConflictPolicy policy);
+    // Blocks merged page by page, and pages resolved by the conflict policy, by the last merge
+    size_t num_page_merged_blocks();
+    size_t num_conflicts();
+
+    // Conflict policies
+    static bool prefer_a(size_t, size_t length, const char*, const char* a, const char*, char* merged);
+    static bool prefer_b(size_t, size_t length, const char*, const char*, const char* b, char* merged);
+    static bool fail(size_t offset, size_t, const char*, const char*, const char*, char*);
+
+  private:
+    struct Source
+    {
+      BlockTable* table;
+      VersionLayout layout;
+    };
+
+    // Conflicting blocks are read and written in chunks of at most this size
+    static constexpr size_t MERGE_CHUNK_BYTES = 1 << 20;
+
+    Source sources[3]; // base, a, b
+    bool m_valid;
+    std::string blocks_dir_path;
+    size_t granularity;
+    BlockStorage* block_storage;
+    std::atomic<size_t> m_num_page_merged_blocks;
+    std::atomic<size_t> m_num_conflicts;
+
+    const unsigned char* digest(Source &source, size_t block_index);
+    bool open_block(Source &source, size_t block_index, int &block_fd);
+    bool read_chunk(int block_fd, size_t offset, size_t length, char* buffer);
+    bool merge_block(size_t block_index, MergeConflictPolicy &policy, unsigned char* merged_digest);
+    bool write_version(std::string out_version, BlockTable* table, size_t size, size_t capacity);
+};
+
+inline VersionMerge::VersionMerge(std::string base_version, std::string version_a, std::string version_b){
+  std::string version_paths[3] = {base_version, version_a, version_b};
+  block_storage = nullptr;
+  m_num_page_merged_blocks = 0;
+  m_num_conflicts = 0;
+  m_valid = true;
+  for (int i = 0; i < 3; i++){
+    sources[i].table = m_valid ? load_version_digests(version_paths[i], sources[i].layout) : nullptr;
+    if (m_valid && sources[i].table == nullptr){
+      std::cerr << "VersionMerge: Error reading version " << version_paths[i] << std::endl;
+      m_valid = false;
+    }
+  }
+  if (!m_valid){
+    return;
+  }
+  blocks_dir_path = sources[0].layout.blocks_dir_path;
+  granularity = sources[0].layout.granularity;
+  for (int i = 1; i < 3; i++){
+    if (sources[i].layout.blocks_dir_path.compare(blocks_dir_path) != 0 || sources[i].layout.granularity != granularity){
+      std::cerr << "VersionMerge: Error - " << version_paths[i] << " is not a version of the data store of " << base_version << std::endl;
+      m_valid = false;
+      return;
+    }
+  }
+  block_storage = new BlockStorage(blocks_dir_path);
+}
+
+inline VersionMerge::~VersionMerge(){
+  for (Source &source : sources){
+    delete source.table;
+  }
+  delete block_storage;
+}
+
+inline bool VersionMerge::valid(){
+  return m_valid;
+}
+
+inline size_t VersionMerge::num_page_merged_blocks(){
+  return m_num_page_merged_blocks;
+}
+
+inline size_t VersionMerge::num_conflicts(){
+  return m_num_conflicts;
+}
+
+inline bool VersionMerge::prefer_a(size_t, size_t length, const char*, const char* a, const char*, char* merged){
+  memcpy(merged, a, length);
+  return true;
+}
+
+inline bool VersionMerge::prefer_b(size_t, size_t length, const char*, const char*, const char* b, char* merged){
+  memcpy(merged, b, length);
+  return true;
+}
+
+inline bool VersionMerge::fail(size_t offset, size_t, const char*, const char*, const char*, char*){
+  std::cerr << "VersionMerge: Conflicting changes at offset " << offset << std::endl;
+  return false;
+}
+
+// Digest of a block, empty beyond the version's size
+inline const unsigned char* VersionMerge::digest(Source &source, size_t block_index){
+  return block_index < source.layout.size / granularity ? source.table->get(block_index) : EMPTY_DIGEST;
+}
+
+// Opens a version's block, or sets block_fd to -1 for an empty block
+inline bool VersionMerge::open_block(Source &source, size_t block_index, int &block_fd){
+  block_fd = -1;
+  const unsigned char* block_digest = digest(source, block_index);
+  if (utility::is_empty_digest(block_digest)){
+    return true;
+  }
+  std::string block_hash = utility::digest_to_hex(block_digest);
+  block_fd = block_storage->get_block_fd(block_hash.c_str(), block_index);
+  if (block_fd == -1){
+    std::cerr << "VersionMerge: Error opening block " << block_hash << std::endl;
+    return false;
+  }
+  return true;
+}
+
+inline bool VersionMerge::read_chunk(int block_fd, size_t offset, size_t length, char* buffer){
+  if (block_fd == -1){
+    memset(buffer, 0, length);
+    return true;
+  }
+  size_t read_bytes = 0;
+  while (read_bytes < length){
+    ssize_t count = ::pread(block_fd, buffer + read_bytes, length - read_bytes, offset + read_bytes);
+    if (count <= 0){
+      break;
+    }
+    read_bytes += count;
+  }
+  return read_bytes == length;
+}
+
+// Merges a block changed by both versions page by page and stores the result; the block is
+// streamed through chunk-sized buffers, so memory use does not grow with the granularity
+inline bool VersionMerge::merge_block(size_t block_index, MergeConflictPolicy &policy, unsigned char* merged_digest){
+  size_t pagesize = sysconf(_SC_PAGE_SIZE);
+  size_t chunk_size = std::min(granularity, MERGE_CHUNK_BYTES);
+  int block_fds[3];
+  bool merged_block = true;
+  for (int i = 0; i < 3; i++){
+    merged_block = open_block(sources[i], block_index, block_fds[i]) && merged_block;
+  }
+  BlockStorage block_storage_local(*block_storage);
+  int merged_fd = -1;
+  if (merged_block){
+    std::string temporary_file_name_template = std::to_string(block_index) + "_temp_XXXXXX";
+    merged_fd = block_storage_local.create_temporary_unique_block((char*) temporary_file_name_template.c_str(), block_index);
+    merged_block = (merged_fd != -1);
+  }
+  char* buffers = new char[4*chunk_size];
+  char* base = buffers;
+  char* a = buffers + chunk_size;
+  char* b = buffers + 2*chunk_size;
+  char* merged = buffers + 3*chunk_size;
+  utility::DigestStream merged_hash;
+  for (size_t chunk_start = 0; merged_block && chunk_start < granularity; chunk_start += chunk_size){
+    size_t chunk_length = std::min(chunk_size, granularity - chunk_start);
+    merged_block = read_chunk(block_fds[0], chunk_start, chunk_length, base) && read_chunk(block_fds[1], chunk_start, chunk_length, a)
+                   && read_chunk(block_fds[2], chunk_start, chunk_length, b);
+    for (size_t page_start = 0; merged_block && page_start < chunk_length; page_start += pagesize){
+      size_t length = std::min(pagesize, chunk_length - page_start);
+      if (memcmp(a + page_start, b + page_start, length) == 0 || memcmp(b + page_start, base + page_start, length) == 0){
+        memcpy(merged + page_start, a + page_start, length);
+      }
+      else if (memcmp(a + page_start, base + page_start, length) == 0){
+        memcpy(merged + page_start, b + page_start, length);
+      }
+      else{
+        m_num_conflicts++;
+        merged_block = policy(block_index*granularity + chunk_start + page_start, length, base + page_start, a + page_start,
+                              b + page_start, merged + page_start);
+      }
+    }
+    if (merged_block){
+      merged_block = (::pwrite(merged_fd, merged, chunk_length, chunk_start) == (ssize_t) chunk_length);
+      merged_hash.update(merged, chunk_length);
+    }
+  }
+  if (merged_block){
+    merged_hash.finish(merged_digest);
+    merged_block = block_storage_local.store_block(merged_fd, nullptr, false, block_index, utility::digest_to_hex(merged_digest));
+  }
+  else if (merged_fd != -1){
+    block_storage_local.discard_temporary_block(merged_fd);
+  }
+  if (merged_fd != -1){
+    ::close(merged_fd);
+  }
+  for (int i = 0; i < 3; i++){
+    if (block_fds[i] != -1){
+      ::close(block_fds[i]);
+    }
+  }
+  delete [] buffers;
+  if (merged_block){
+    m_num_page_merged_blocks++;
+  }
+  return merged_block;
+}
+
+inline bool VersionMerge::merge(std::string out_version, MergeConflictPolicy policy){
+  if (!m_valid){
+    return false;
+  }
+  m_num_page_merged_blocks = 0;
+  m_num_conflicts = 0;
+  // A size changed on one side only is taken from that side
+  size_t base_size = sources[0].layout.size;
+  size_t size_a = sources[1].layout.size;
+  size_t size_b = sources[2].layout.size;
+  size_t size = (size_a == base_size) ? size_b : (size_b == base_size ? size_a : std::max(size_a, size_b));
+  size_t capacity = std::max({sources[0].layout.capacity, sources[1].layout.capacity, sources[2].layout.capacity});
+  size_t num_blocks = size / granularity;
+  BlockTable table(capacity / granularity);
+
+  // Shared, so that all threads stop merging once one block fails
+  std::atomic<bool> merged(true);
+  #pragma omp parallel for
+  for (size_t i = 0; i < num_blocks; i++){
+    if (!merged){
+      continue;
+    }
+    const unsigned char* base = digest(sources[0], i);
+    const unsigned char* a = digest(sources[1], i);
+    const unsigned char* b = digest(sources[2], i);
+    unsigned char merged_digest[utility::DIGEST_SIZE];
+    const unsigned char* block_digest = nullptr;
+    if (memcmp(a, b, utility::DIGEST_SIZE) == 0 || memcmp(b, base, utility::DIGEST_SIZE) == 0){
+      block_digest = a;
+    }
+    else if (memcmp(a, base, utility::DIGEST_SIZE) == 0){
+      block_digest = b;
+    }
+    else if (merge_block(i, policy, merged_digest)){
+      block_digest = merged_digest;
+    }
+    if (block_digest == nullptr){
+      merged = false;
+    }
+    else if (!utility::is_empty_digest(block_digest)){
+      table.set(i, block_digest);
+    }
+  }
+  if (!merged){
+    std::cerr << "VersionMerge: Error merging into " << out_version << std::endl;
+    return false;
+  }
+  return write_version(out_version, &table, size, capacity);
+}
+
+inline bool VersionMerge::write_version(std::string out_version, BlockTable* table, size_t size, size_t capacity){
+  VersionLayout layout = {size, capacity, granularity, size / granularity, blocks_dir_path, VersionCatalog::NO_RECORD};
+  std::string catalog_blocks_dir_path, name;
+  bool in_catalog = VersionCatalog::parse_reference(out_version, catalog_blocks_dir_path, name);
+  return store_version_digests(out_version, layout, table) && (in_catalog || block_storage->register_version(out_version));
+}
@@ -0,0 +1,326 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "utility/sha256_hash.hpp"
+#include "block_storage.hpp"
+#include "block_table.hpp"
+#include "version_catalog.hpp"
+
+// A non-empty block of a version, see VersionReader
+struct VersionBlock
+{
+  size_t block_index;
+  size_t offset;
+  size_t length;
+  const char* data; // Valid until the next call to next()
+};
+
+// Streams the non-empty blocks of a version in order, for one sequential pass over its data
+// (exports, checksums, scans) without mapping it. Reader threads read blocks ahead into a pool
+// of buffers with one large read per block; a block whose content appears at several offsets
+// within the read-ahead window is read once. Empty blocks are all zeros and skipped.
+class VersionReader
+{
+  public:
+    VersionReader(std::string version_path, size_t num_buffers = 4, bool direct_io = false);
+    ~VersionReader();
+
+    bool valid();
+    size_t size();
+    size_t block_granularity();
+    // Reads into the caller's buffers (block_granularity() bytes each, page-aligned for direct
+    // I/O) instead of pooled ones; before the first call to next()
+    bool set_buffers(const std::vector<char*> &buffers);
+    // Next non-empty block; false once all blocks were returned, or on a read error (see failed())
+    bool next(VersionBlock &block);
+    bool failed();
+
+  private:
+    struct Slot
+    {
+      char* buffer;
+      std::string digest;
+      size_t block_index; // First block read into the buffer
+      size_t references; // Scheduled blocks not returned yet
+      bool ready;
+      bool read_failed;
+    };
+
+    struct ScheduledBlock
+    {
+      size_t block_index;
+      size_t slot_index;
+    };
+
+    static constexpr size_t MAX_READ_THREADS = 8;
+
+    BlockTable* table;
+    VersionLayout layout;
+    BlockStorage* block_storage;
+    bool m_valid;
+    bool m_failed;
+    bool direct_io;
+    bool owns_buffers;
+    std::vector<Slot> slots;
+    std::vector<size_t> free_slots;
+    std::map<std::string, size_t> slot_of_digest; // Slots holding or reading a block
+    std::deque<ScheduledBlock> scheduled;
+    std::deque<size_t> read_queue;
+    size_t next_block; // Next block to schedule
+    bool has_current;
+    size_t current_slot; // Slot of the block returned last
+    std::vector<std::thread> readers;
+    bool stopping;
+    std::mutex mutex;
+    std::condition_variable read_queued;
+    std::condition_variable read_done;
+
+    void allocate_buffers(size_t num_buffers);
+    void release_buffers();
+    void release_slot(size_t slot_index);
+    void schedule();
+    void read_blocks();
+    bool read_block(size_t block_index, const std::string &digest, char* buffer);
+};
+
+inline VersionReader::VersionReader(std::string version_path, size_t num_buffers, bool direct_io_arg){
+  direct_io = direct_io_arg;
+  block_storage = nullptr;
+  owns_buffers = false;
+  m_failed = false;
+  next_block = 0;
+  has_current = false;
+  stopping = false;
+  table = load_version_digests(version_path, layout);
+  m_valid = table != nullptr && num_buffers > 0;
+  if (!m_valid){
+    std::cerr << "VersionReader: Error reading version " << version_path << std::endl;
+    return;
+  }
+  block_storage = new BlockStorage(layout.blocks_dir_path);
+  allocate_buffers(num_buffers);
+}
+
+inline VersionReader::~VersionReader(){
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  read_queued.notify_all();
+  for (std::thread &reader : readers){
+    reader.join();
+  }
+  release_buffers();
+  delete table;
+  delete block_storage;
+}
+
+inline bool VersionReader::valid(){
+  return m_valid;
+}
+
+inline bool VersionReader::failed(){
+  return m_failed;
+}
+
+inline size_t VersionReader::size(){
+  return m_valid ? layout.size : 0;
+}
+
+inline size_t VersionReader::block_granularity(){
+  return m_valid ? layout.granularity : 0;
+}
+
+inline void VersionReader::allocate_buffers(size_t num_buffers){
+  // Page-aligned, as direct I/O requires
+  size_t pagesize = sysconf(_SC_PAGE_SIZE);
+  size_t buffer_size = (layout.granularity + pagesize - 1) / pagesize * pagesize;
+  slots.resize(num_buffers);
+  free_slots.clear();
+  for (size_t i = 0; i < num_buffers; i++){
+    slots[i].buffer = (char*) aligned_alloc(pagesize, buffer_size);
+    free_slots.push_back(num_buffers - 1 - i);
+  }
+  owns_buffers = true;
+}
+
+inline void VersionReader::release_buffers(){
+  if (owns_buffers){
+    for (Slot &slot : slots){
+      free(slot.buffer);
+    }
+  }
+  slots.clear();
+  free_slots.clear();
+}
+
+inline bool VersionReader::set_buffers(const std::vector<char*> &buffers){
+  if (!m_valid || !readers.empty() || buffers.empty()){
+    return false;
+  }
+  release_buffers();
+  slots.resize(buffers.size());
+  for (size_t i = 0; i < buffers.size(); i++){
+    slots[i].buffer = buffers[i];
+    free_slots.push_back(buffers.size() - 1 - i);
+  }
+  owns_buffers = false;
+  return true;
+}
+
+// Called with mutex held
+inline void VersionReader::release_slot(size_t slot_index){
+  Slot &slot = slots[slot_index];
+  if (--slot.references == 0){
+    slot_of_digest.erase(slot.digest);
+    free_slots.push_back(slot_index);
+  }
+}
+
+// Schedules the next blocks in order while buffers are available, called with mutex held
+inline void VersionReader::schedule(){
+  size_t num_blocks = layout.size / layout.granularity;
+  while (next_block < num_blocks){
+    if (table->is_empty(next_block)){
+      next_block++;
+      continue;
+    }
+    std::string digest((const char*) table->get(next_block), utility::DIGEST_SIZE);
+    size_t slot_index;
+    auto found = slot_of_digest.find(digest);
+    if (found != slot_of_digest.end()){
+      // Same content as a block in the window, read once
+      slot_index = found->second;
+    }
+    else{
+      if (free_slots.empty()){
+        break;
+      }
+      slot_index = free_slots.back();
+      free_slots.pop_back();
+      Slot &slot = slots[slot_index];
+      slot.digest = digest;
+      slot.block_index = next_block;
+      slot.references = 0;
+      slot.ready = false;
+      slot.read_failed = false;
+      slot_of_digest[digest] = slot_index;
+      read_queue.push_back(slot_index);
+      read_queued.notify_one();
+    }
+    slots[slot_index].references++;
+    scheduled.push_back({next_block, slot_index});
+    next_block++;
+  }
+}
+
+inline bool VersionReader::next(VersionBlock &block){
+  if (!m_valid || m_failed){
+    return false;
+  }
+  std::unique_lock<std::mutex> lock(mutex);
+  if (readers.empty()){
+    size_t num_readers = std::min(slots.size(), MAX_READ_THREADS);
+    for (size_t i = 0; i < num_readers; i++){
+      readers.emplace_back(&VersionReader::read_blocks, this);
+    }
+  }
+  if (has_current){
+    release_slot(current_slot);
+    has_current = false;
+  }
+  schedule();
+  if (scheduled.empty()){
+    return false;
+  }
+  ScheduledBlock scheduled_block = scheduled.front();
+  scheduled.pop_front();
+  Slot &slot = slots[scheduled_block.slot_index];
+  read_done.wait(lock, [&slot]{ return slot.ready; });
+  has_current = true;
+  current_slot = scheduled_block.slot_index;
+  if (slot.read_failed){
+    std::cerr << "VersionReader: Error reading block " << scheduled_block.block_index << std::endl;
+    m_failed = true;
+    return false;
+  }
+  block.block_index = scheduled_block.block_index;
+  block.offset = scheduled_block.block_index*layout.granularity;
+  block.length = std::min(layout.granularity, layout.size - block.offset);
+  block.data = slot.buffer;
+  return true;
+}
+
+// Reader thread
+inline void VersionReader::read_blocks(){
+  while (true){
+    size_t slot_index;
+    size_t block_index;
+    std::string digest;
+    char* buffer;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      read_queued.wait(lock, [this]{ return stopping || !read_queue.empty(); });
+      if (stopping){
+        return;
+      }
+      slot_index = read_queue.front();
+      read_queue.pop_front();
+      block_index = slots[slot_index].block_index;
+      digest = slots[slot_index].digest;
+      buffer = slots[slot_index].buffer;
+    }
+    bool read = read_block(block_index, digest, buffer);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      slots[slot_index].ready = true;
+      slots[slot_index].read_failed = !read;
+    }
+    read_done.notify_all();
+  }
+}
+
+inline bool VersionReader::read_block(size_t block_index, const std::string &digest, char* buffer){
+  std::string block_hash = utility::digest_to_hex((const unsigned char*) digest.data());
+  int block_fd = block_storage->get_block_fd(block_hash.c_str(), block_index);
+  if (block_fd == -1){
+    std::cerr << "VersionReader: Error opening block " << block_hash << std::endl;
+    return false;
+  }
+  // A single pass does not need the block in the page cache; not all file systems support it
+  bool direct = direct_io && fcntl(block_fd, F_SETFL, fcntl(block_fd, F_GETFL) | O_DIRECT) == 0;
+  size_t read_bytes = 0;
+  while (read_bytes < layout.granularity){
+    ssize_t count = ::pread(block_fd, buffer + read_bytes, layout.granularity - read_bytes, read_bytes);
+    if (count == -1 && errno == EINVAL && direct){
+      // Unaligned buffer
+      fcntl(block_fd, F_SETFL, fcntl(block_fd, F_GETFL) & ~O_DIRECT);
+      direct = false;
+      continue;
+    }
+    if (count <= 0){
+      break;
+    }
+    read_bytes += count;
+  }
+  ::close(block_fd);
+  return read_bytes == layout.granularity;
+}
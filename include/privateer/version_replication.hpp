@@ -0,0 +1,137 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <iostream>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "utility/file_util.hpp"
+#include "utility/sha256_hash.hpp"
+#include "block_storage.hpp"
+#include "block_table.hpp"
+#include "block_tier.hpp"
+#include "recipe.hpp"
+#include "version_catalog.hpp"
+
+struct ReplicationStats
+{
+  size_t num_blocks; // Distinct blocks of the version
+  size_t num_blocks_present; // Already held by the target store
+  size_t num_blocks_copied; // Published by this replication, missing blocks not copied on error
+  size_t bytes_copied;
+};
+
+// Copies a version to another data store, e.g., a backup volume or a file system mounted from
+// another node. The target store's blocks are listed first and only the version's blocks it is
+// missing are copied, over parallel streams; as blocks are content-addressed, replicating daily
+// snapshots only moves their new blocks. Blocks are published with a rename once complete and
+// the version metadata is written last, so an interrupted replication leaves no partial block
+// or version behind and is resumed by running it again.
+class VersionReplication
+{
+  public:
+    // The target store is created with the version's block granularity if it does not exist;
+    // target_version_path is a metadata directory or a reference to the target store's catalog
+    static bool replicate(std::string version_path, std::string target_blocks_dir_path, std::string target_version_path,
+                          size_t num_streams = 4, ReplicationStats* stats = nullptr);
+};
+
+inline bool VersionReplication::replicate(std::string version_path, std::string target_blocks_dir_path, std::string target_version_path,
+                                          size_t num_streams, ReplicationStats* stats){
+  VersionLayout layout;
+  BlockTable* table = load_version_digests(version_path, layout, true);
+  if (table == nullptr){
+    std::cerr << "VersionReplication: Error reading version " << version_path << std::endl;
+    return false;
+  }
+  BlockStorage source_storage(layout.blocks_dir_path);
+  BlockStorage* target_storage;
+  if (utility::directory_exists(target_blocks_dir_path.c_str())){
+    target_storage = new BlockStorage(target_blocks_dir_path);
+    if (target_storage->get_block_granularity() != layout.granularity){
+      std::cerr << "VersionReplication: Error - " << target_blocks_dir_path << " has a different block granularity" << std::endl;
+      delete target_storage;
+      delete table;
+      return false;
+    }
+  }
+  else{
+    target_storage = new BlockStorage(target_blocks_dir_path, layout.granularity);
+  }
+
+  // Index of the target store
+  std::set<std::pair<size_t, std::string>> present_blocks;
+  target_storage->for_each_block([&present_blocks](size_t subdir_index, const std::string &hash){
+    present_blocks.insert(std::make_pair(subdir_index, hash));
+  });
+
+  // Distinct blocks of the version: block files are named by subdirectory and hash
+  size_t files_per_subdirectory = target_storage->get_files_per_subdirectory();
+  std::set<std::pair<size_t, std::string>> version_blocks;
+  std::vector<std::pair<size_t, std::string>> missing_blocks; // Block index, hash
+  for (size_t block_index = 0; block_index < layout.num_blocks; block_index++){
+    if (table->is_empty(block_index)){
+      continue;
+    }
+    std::pair<size_t, std::string> block(block_index % files_per_subdirectory, utility::digest_to_hex(table->get(block_index)));
+    if (version_blocks.insert(block).second && present_blocks.find(block) == present_blocks.end()){
+      missing_blocks.push_back(std::make_pair(block_index, block.second));
+    }
+  }
+
+  // Shared, so that all streams stop copying once one block fails
+  std::atomic<bool> copied(true);
+  size_t num_blocks_copied = 0;
+  size_t bytes_copied = 0;
+  #pragma omp parallel for schedule(dynamic) num_threads(num_streams) reduction(+:num_blocks_copied, bytes_copied)
+  for (size_t k = 0; k < missing_blocks.size(); k++){
+    if (!copied){
+      continue;
+    }
+    size_t block_index = missing_blocks[k].first;
+    const std::string &block_hash = missing_blocks[k].second;
+    int block_fd = source_storage.get_block_fd(block_hash.c_str(), block_index);
+    if (block_fd == -1){
+      std::cerr << "VersionReplication: Error opening block " << block_hash << std::endl;
+      copied = false;
+      continue;
+    }
+    std::string target_path = target_storage->get_blocks_subdirectory(block_index) + "/" + block_hash;
+    if (publish_block_file(target_path, block_fd, layout.granularity)){
+      num_blocks_copied++;
+      bytes_copied += layout.granularity;
+    }
+    else{
+      copied = false;
+    }
+    ::close(block_fd);
+  }
+
+  // Publish the version once all its blocks are in place
+  if (copied){
+    VersionLayout target_layout = layout;
+    target_layout.blocks_dir_path = target_blocks_dir_path;
+    std::string catalog_blocks_dir_path, name;
+    bool in_catalog = VersionCatalog::parse_reference(target_version_path, catalog_blocks_dir_path, name);
+    copied = store_version_digests(target_version_path, target_layout, table)
+             && (in_catalog || target_storage->register_version(target_version_path));
+  }
+  if (stats != nullptr){
+    *stats = {version_blocks.size(), version_blocks.size() - missing_blocks.size(), num_blocks_copied, bytes_copied};
+  }
+  delete target_storage;
+  delete table;
+  if (!copied){
+    std::cerr << "VersionReplication: Error replicating " << version_path << " to " << target_version_path << std::endl;
+  }
+  return copied;
+}
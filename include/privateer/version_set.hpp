@@ -0,0 +1,239 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "utility/sha256_hash.hpp"
+#include "block_storage.hpp"
+#include "block_table.hpp"
+#include "version_catalog.hpp"
+
+// Many versions of one data store open read-only at the same time.
+//
+// Versions share one BlockStorage and one cache of open block files keyed by block hash, so a
+// block common to many versions is opened once. Adding a version only loads its recipe and
+// reserves its address range; blocks are mapped when the version (or a range of it) is first
+// accessed through data() or map().
+class VersionSet
+{
+  public:
+    VersionSet(std::string blocks_dir_path);
+    ~VersionSet();
+
+    // Returns the index of the added version, or -1 if it cannot be read or belongs to another store
+    int add(std::string version_path);
+    size_t size();
+    // Maps all blocks of a version on first use and returns its address
+    void* data(size_t version_index);
+    // Maps only the blocks covering [offset, offset + length) of a version, returns the version's address
+    void* map(size_t version_index, size_t offset, size_t length);
+    size_t version_size(size_t version_index);
+    std::string version_path(size_t version_index);
+    // Number of distinct blocks opened so far
+    size_t num_opened_blocks();
+
+  private:
+    struct Version
+    {
+      std::string path;
+      VersionLayout layout;
+      BlockTable* blocks;
+      void* addr;
+      std::mutex map_mutex; // Guards mapped and num_mapped, held while blocks are mapped
+      std::vector<bool> mapped;
+      size_t num_mapped;
+    };
+
+    std::string blocks_dir_path;
+    BlockStorage* block_storage;
+    std::deque<Version> versions; // Added versions never move
+    std::unordered_map<std::string, int> block_fds; // hash -> open block file
+    size_t max_open_blocks;
+    std::atomic<size_t> m_num_opened_blocks;
+    std::mutex mutex; // Guards versions and block_fds
+
+    int get_block_fd(const std::string &block_hash, size_t block_index, bool &cached);
+    Version& get_version(size_t version_index);
+    bool map_block(Version &version, size_t block_index);
+};
+
+inline VersionSet::VersionSet(std::string blocks_dir_path_arg){
+  blocks_dir_path = blocks_dir_path_arg;
+  block_storage = new BlockStorage(blocks_dir_path);
+  // Keep at most half of the file descriptor limit open
+  struct rlimit limit;
+  max_open_blocks = (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) ? limit.rlim_cur / 2 : 1024;
+  m_num_opened_blocks = 0;
+}
+
+inline VersionSet::~VersionSet(){
+  for (Version &version : versions){
+    munmap(version.addr, version.layout.capacity);
+    delete version.blocks;
+  }
+  for (auto &block_fd : block_fds){
+    ::close(block_fd.second);
+  }
+  delete block_storage;
+}
+
+inline int VersionSet::add(std::string version_path){
+  VersionLayout layout;
+  BlockTable* blocks = load_version_digests(version_path, layout);
+  if (blocks == nullptr){
+    std::cerr << "VersionSet: Error reading version " << version_path << std::endl;
+    return -1;
+  }
+  if (layout.blocks_dir_path.compare(blocks_dir_path) != 0 || layout.granularity != block_storage->get_block_granularity()){
+    std::cerr << "VersionSet: Error - " << version_path << " is not a version of " << blocks_dir_path << std::endl;
+    delete blocks;
+    return -1;
+  }
+  void* addr = mmap(nullptr, layout.capacity, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+  if (addr == MAP_FAILED){
+    std::cerr << "VersionSet: mmap error - " << strerror(errno) << std::endl;
+    delete blocks;
+    return -1;
+  }
+  // Constructed in place, versions hold their own mutex
+  std::lock_guard<std::mutex> lock(mutex);
+  Version &version = versions.emplace_back();
+  version.path = version_path;
+  version.layout = layout;
+  version.blocks = blocks;
+  version.addr = addr;
+  version.mapped.assign(layout.size / layout.granularity, false);
+  version.num_mapped = 0;
+  return versions.size() - 1;
+}
+
+inline size_t VersionSet::size(){
+  std::lock_guard<std::mutex> lock(mutex);
+  return versions.size();
+}
+
+// Versions can be added concurrently: index under the lock, the returned version stays in place
+inline VersionSet::Version& VersionSet::get_version(size_t version_index){
+  std::lock_guard<std::mutex> lock(mutex);
+  return versions[version_index];
+}
+
+inline size_t VersionSet::version_size(size_t version_index){
+  return get_version(version_index).layout.size;
+}
+
+inline std::string VersionSet::version_path(size_t version_index){
+  return get_version(version_index).path;
+}
+
+inline size_t VersionSet::num_opened_blocks(){
+  return m_num_opened_blocks;
+}
+
+// Returns an open file of the block, cached by hash while below the open files budget;
+// the caller closes files that were not cached
+inline int VersionSet::get_block_fd(const std::string &block_hash, size_t block_index, bool &cached){
+  cached = true;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto block_fd = block_fds.find(block_hash);
+    if (block_fd != block_fds.end()){
+      return block_fd->second;
+    }
+  }
+  int block_fd = block_storage->get_block_fd(block_hash.c_str(), block_index);
+  if (block_fd == -1){
+    return -1;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  auto existing = block_fds.find(block_hash);
+  if (existing != block_fds.end()){
+    // Opened concurrently
+    ::close(block_fd);
+    return existing->second;
+  }
+  m_num_opened_blocks++;
+  cached = block_fds.size() < max_open_blocks;
+  if (cached){
+    block_fds[block_hash] = block_fd;
+  }
+  return block_fd;
+}
+
+inline bool VersionSet::map_block(Version &version, size_t block_index){
+  size_t granularity = version.layout.granularity;
+  void* block_address = (char*) version.addr + block_index*granularity;
+  void* region;
+  if (version.blocks->is_empty(block_index)){
+    region = mmap(block_address, granularity, PROT_READ, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE | MAP_FIXED, -1, 0);
+  }
+  else{
+    std::string block_hash = utility::digest_to_hex(version.blocks->get(block_index));
+    bool cached;
+    int block_fd = get_block_fd(block_hash, block_index, cached);
+    if (block_fd == -1){
+      std::cerr << "VersionSet: Error opening block " << block_hash << " " << strerror(errno) << std::endl;
+      return false;
+    }
+    region = mmap(block_address, granularity, PROT_READ, MAP_PRIVATE | MAP_FIXED, block_fd, 0);
+    if (!cached){
+      ::close(block_fd);
+    }
+  }
+  if (region == MAP_FAILED){
+    std::cerr << "VersionSet: mmap error - " << strerror(errno) << std::endl;
+    return false;
+  }
+  return true;
+}
+
+inline void* VersionSet::map(size_t version_index, size_t offset, size_t length){
+  Version &version = get_version(version_index);
+  size_t granularity = version.layout.granularity;
+  size_t first_block = offset / granularity;
+  size_t last_block = std::min((offset + length + granularity - 1) / granularity, version.mapped.size());
+  // Concurrent callers on the same version wait until the blocks they need are mapped
+  std::lock_guard<std::mutex> map_lock(version.map_mutex);
+  if (version.num_mapped == version.mapped.size()){
+    return version.addr;
+  }
+  std::vector<size_t> unmapped_blocks;
+  for (size_t i = first_block; i < last_block; i++){
+    if (!version.mapped[i]){
+      unmapped_blocks.push_back(i);
+    }
+  }
+  bool mapped = true;
+  #pragma omp parallel for reduction(&&:mapped)
+  for (size_t i = 0; i < unmapped_blocks.size(); i++){
+    mapped = map_block(version, unmapped_blocks[i]) && mapped;
+  }
+  if (!mapped){
+    return nullptr;
+  }
+  for (size_t block_index : unmapped_blocks){
+    version.mapped[block_index] = true;
+  }
+  version.num_mapped += unmapped_blocks.size();
+  return version.addr;
+}
+
+inline void* VersionSet::data(size_t version_index){
+  return map(version_index, 0, get_version(version_index).layout.size);
+}
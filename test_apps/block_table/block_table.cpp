@@ -0,0 +1,110 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#include <fcntl.h>
+#include <omp.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cassert>
+#include <iostream>
+#include <string>
+#include "../../include/privateer/block_table.hpp"
+
+// Sparse block table: concurrent updates, checksums, dirty entries, and written tables read back
+// mapped (at any file offset) or copied
+
+static const size_t NUM_ENTRIES = 100000;
+
+static void make_digest(size_t index, size_t version, unsigned char* digest){
+  memset(digest, 0, utility::DIGEST_SIZE);
+  uint64_t value = index*31 + version + 1;
+  memcpy(digest, &value, sizeof(value));
+}
+
+static bool is_set(size_t index){
+  return index % 7 == 0 || (index >= 50000 && index < 50100);
+}
+
+int main(int argc, char** argv){
+  if (argc != 2){
+    std::cerr << "Usage: " << argv[0] << " <base_test_dir>" << std::endl;
+    return -1;
+  }
+  std::string base_test_dir(argv[1]);
+  int mkdir_stat = mkdir(base_test_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  if (mkdir_stat != 0){
+    std::cerr << "Error creating directory at: " << base_test_dir << std::endl;
+    return -1;
+  }
+
+  BlockTable table(NUM_ENTRIES);
+  #pragma omp parallel for
+  for (size_t i = 0; i < NUM_ENTRIES; i++){
+    if (is_set(i)){
+      unsigned char digest[utility::DIGEST_SIZE];
+      make_digest(i, 0, digest);
+      table.set(i, digest);
+    }
+  }
+  size_t num_set = 0;
+  for (size_t i = 0; i < NUM_ENTRIES; i++){
+    unsigned char digest[utility::DIGEST_SIZE];
+    make_digest(i, 0, digest);
+    assert(table.is_empty(i) == !is_set(i));
+    assert(!is_set(i) || memcmp(table.get(i), digest, utility::DIGEST_SIZE) == 0);
+    num_set += is_set(i);
+  }
+  assert(table.num_dirty(NUM_ENTRIES) == num_set);
+  assert(table.checksum() == table.recompute_checksum(NUM_ENTRIES));
+
+  // Written as a recipe and mapped back as the base of another table
+  std::string recipe_file_name = base_test_dir + "/_metadata";
+  int recipe_fd = ::open(recipe_file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, (mode_t) 0666);
+  assert(table.write_all(recipe_fd, NUM_ENTRIES));
+  assert(Recipe::write_header(recipe_fd, NUM_ENTRIES, NUM_ENTRIES, 1, base_test_dir, NUM_ENTRIES, table.checksum()));
+  table.clear_dirty();
+  assert(table.num_dirty(NUM_ENTRIES) == 0);
+  BlockTable mapped_table(NUM_ENTRIES);
+  assert(mapped_table.map_base(recipe_fd, Recipe::HEADER_SIZE, NUM_ENTRIES, table.checksum()));
+  for (size_t i = 0; i < NUM_ENTRIES; i++){
+    assert(memcmp(mapped_table.get(i), table.get(i), utility::DIGEST_SIZE) == 0);
+  }
+
+  // Updates to the mapped table only write the leaves they changed
+  for (size_t i = 0; i < NUM_ENTRIES; i += 1000){
+    unsigned char digest[utility::DIGEST_SIZE];
+    make_digest(i, 1, digest);
+    mapped_table.set(i, digest);
+  }
+  assert(mapped_table.num_dirty(NUM_ENTRIES) == NUM_ENTRIES / 1000);
+  assert(mapped_table.checksum() == mapped_table.recompute_checksum(NUM_ENTRIES));
+  assert(mapped_table.write_dirty(recipe_fd, NUM_ENTRIES, true));
+  assert(mapped_table.num_dirty(NUM_ENTRIES) == 0);
+  BlockTable read_table(NUM_ENTRIES);
+  assert(read_table.read_entries(recipe_fd, Recipe::HEADER_SIZE, NUM_ENTRIES, mapped_table.checksum()));
+  for (size_t i = 0; i < NUM_ENTRIES; i++){
+    unsigned char digest[utility::DIGEST_SIZE];
+    make_digest(i, (i % 1000 == 0) ? 1 : 0, digest);
+    bool expected_set = is_set(i) || i % 1000 == 0;
+    assert(read_table.is_empty(i) == !expected_set);
+    assert(!expected_set || memcmp(read_table.get(i), digest, utility::DIGEST_SIZE) == 0);
+  }
+  assert(read_table.recompute_checksum(NUM_ENTRIES) == mapped_table.checksum());
+  ::close(recipe_fd);
+
+  // Digests at an offset that is not page aligned, as in a version catalog
+  std::string packed_file_name = base_test_dir + "/packed_digests";
+  int packed_fd = ::open(packed_file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, (mode_t) 0666);
+  const off_t unaligned_offset = 100;
+  assert(table.write_all(packed_fd, NUM_ENTRIES, unaligned_offset));
+  BlockTable unaligned_table(NUM_ENTRIES);
+  assert(unaligned_table.map_base(packed_fd, unaligned_offset, NUM_ENTRIES, table.checksum()));
+  for (size_t i = 0; i < NUM_ENTRIES; i++){
+    assert(memcmp(unaligned_table.get(i), table.get(i), utility::DIGEST_SIZE) == 0);
+  }
+  ::close(packed_fd);
+  std::cout << "Block table verified" << std::endl;
+  return 0;
+}
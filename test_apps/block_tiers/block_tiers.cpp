@@ -0,0 +1,121 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cassert>
+#include <iostream>
+#include <string>
+#include "../../include/privateer/privateer.hpp"
+
+// Block storage layout: blocks striped round-robin over several root directories, found again
+// from the store alone once reopened, and demoted to a capacity tier then promoted back on read
+
+static const size_t BLOCK_SIZE = 1024*1024;
+static const size_t NUM_BLOCKS = 6;
+
+static size_t count_tier_blocks(BlockTier &tier){
+  size_t num_blocks = 0;
+  tier.for_each_block([&](size_t, const std::string &){ num_blocks++; });
+  return num_blocks;
+}
+
+static void write_blocks(Privateer &privateer, size_t value){
+  size_t* data = (size_t*) privateer.data();
+  for (size_t i = 0; i < NUM_BLOCKS*BLOCK_SIZE / sizeof(size_t); i++){
+    data[i] = value + i;
+  }
+}
+
+static void verify_blocks(std::string version_path, size_t value){
+  Privateer privateer(version_path.c_str(), true);
+  size_t* data = (size_t*) privateer.data();
+  for (size_t i = 0; i < NUM_BLOCKS*BLOCK_SIZE / sizeof(size_t); i++){
+    assert(data[i] == value + i);
+  }
+}
+
+int main(int argc, char** argv){
+  if (argc != 2){
+    std::cerr << "Usage: " << argv[0] << " <base_test_dir>" << std::endl;
+    return -1;
+  }
+  std::string base_test_dir(argv[1]);
+  int mkdir_stat = mkdir(base_test_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  if (mkdir_stat != 0){
+    std::cerr << "Error creating directory at: " << base_test_dir << std::endl;
+    return -1;
+  }
+  setenv("PRIVATEER_FILE_GRANULARITY", std::to_string(BLOCK_SIZE).c_str(), 1);
+
+  // Striping: blocks i, i + 3, ... land in the same one of the three stripe roots
+  std::string striped_blocks_path = base_test_dir + "/striped_blocks";
+  std::string striped_version = base_test_dir + "/striped_version";
+  std::string stripe_1 = base_test_dir + "/stripe_1";
+  std::string stripe_2 = base_test_dir + "/stripe_2";
+  setenv("PRIVATEER_STRIPE_DIRECTORIES", (stripe_1 + ":" + stripe_2).c_str(), 1);
+  {
+    Privateer privateer(striped_blocks_path.c_str(), striped_version.c_str(), NUM_BLOCKS*BLOCK_SIZE);
+    privateer.resize(NUM_BLOCKS*BLOCK_SIZE);
+    write_blocks(privateer, 0);
+    privateer.msync();
+  }
+  unsetenv("PRIVATEER_STRIPE_DIRECTORIES");
+  {
+    BlockStorage block_storage(striped_blocks_path);
+    assert(block_storage.get_num_stripes() == 3);
+  }
+  for (std::string stripe_root : {striped_blocks_path, stripe_1, stripe_2}){
+    DirectoryTier stripe(stripe_root);
+    assert(count_tier_blocks(stripe) == NUM_BLOCKS / 3);
+  }
+  verify_blocks(striped_version, 0);
+
+  // Tiering: blocks just stored stay in the fast tier, old enough ones are demoted
+  std::string tiered_blocks_path = base_test_dir + "/tiered_blocks";
+  std::string tiered_version = base_test_dir + "/tiered_version";
+  std::string capacity_path = base_test_dir + "/capacity";
+  setenv("PRIVATEER_CAPACITY_TIER", ("directory:" + capacity_path).c_str(), 1);
+  {
+    Privateer privateer(tiered_blocks_path.c_str(), tiered_version.c_str(), NUM_BLOCKS*BLOCK_SIZE);
+    privateer.resize(NUM_BLOCKS*BLOCK_SIZE);
+    write_blocks(privateer, 1000);
+    privateer.msync();
+  }
+  unsetenv("PRIVATEER_CAPACITY_TIER");
+  DirectoryTier fast_tier(tiered_blocks_path);
+  DirectoryTier capacity_tier(capacity_path);
+  {
+    BlockStorage block_storage(tiered_blocks_path);
+    assert(block_storage.has_capacity_tier());
+    assert(block_storage.demote_blocks(3600) == 0);
+    assert(count_tier_blocks(fast_tier) == NUM_BLOCKS && count_tier_blocks(capacity_tier) == 0);
+    // Forced demotion
+    assert(block_storage.demote_blocks(0) == NUM_BLOCKS);
+    assert(count_tier_blocks(fast_tier) == 0 && count_tier_blocks(capacity_tier) == NUM_BLOCKS);
+  }
+
+  // Opening the version promotes its blocks back, the capacity tier keeps its copies
+  verify_blocks(tiered_version, 1000);
+  assert(count_tier_blocks(fast_tier) == NUM_BLOCKS && count_tier_blocks(capacity_tier) == NUM_BLOCKS);
+
+  // Background demotion of blocks not accessed for a second, while the version is mapped
+  setenv("PRIVATEER_DEMOTION_AGE", "1", 1);
+  {
+    Privateer privateer(tiered_version.c_str(), true);
+    sleep(4);
+    assert(count_tier_blocks(fast_tier) == 0);
+    size_t* data = (size_t*) privateer.data();
+    for (size_t i = 0; i < NUM_BLOCKS*BLOCK_SIZE / sizeof(size_t); i++){
+      assert(data[i] == 1000 + i);
+    }
+  }
+  unsetenv("PRIVATEER_DEMOTION_AGE");
+  verify_blocks(tiered_version, 1000);
+
+  std::cout << "Block tiers verified" << std::endl;
+  return 0;
+}
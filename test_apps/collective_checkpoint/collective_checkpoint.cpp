@@ -0,0 +1,150 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#include <mpi.h>
+#include <cassert>
+#include <iostream>
+#include <string>
+
+#include "../../include/privateer/mpi/privateer_mpi.hpp"
+
+int main(int argc, char** argv){
+  MPI_Init(&argc, &argv);
+  int world_rank, world_size;
+  MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+
+  if (argc != 2){
+    if (world_rank == 0){
+      std::cerr << "Usage: " << argv[0] << " <base_test_dir>" << std::endl;
+    }
+    MPI_Finalize();
+    return -1;
+  }
+
+  std::string base_test_dir(argv[1]);
+  std::string blocks_directory_path = base_test_dir + "/blocks";
+  std::string version_0_metadata_path = base_test_dir + "/version_0";
+  std::string version_metadata_prefix = base_test_dir + "/rank_version_";
+  size_t region_capacity = 64*1024*1024;
+  size_t values_size = region_capacity / sizeof(size_t);
+
+  if (world_rank == 0){
+    utility::create_directory(base_test_dir.c_str());
+    Privateer privateer(blocks_directory_path.c_str(), version_0_metadata_path.c_str(), region_capacity);
+    privateer.resize(region_capacity);
+    privateer.msync();
+  }
+  MPI_Barrier(MPI_COMM_WORLD);
+
+  std::string version_metadata_path = version_metadata_prefix + std::to_string(world_rank);
+  {
+    // Every rank holds the same data, except for its last value
+    Privateer privateer(version_0_metadata_path.c_str(), (version_metadata_path + "_initial").c_str());
+    size_t *data = (size_t*) privateer.data();
+    for (size_t i = 0; i < values_size; i++){
+      data[i] = i;
+    }
+    data[values_size - 1] = world_rank;
+    double start = MPI_Wtime();
+    bool snapshotted = PrivateerMPI::snapshot(privateer, version_metadata_path.c_str(), MPI_COMM_WORLD);
+    if (world_rank == 0){
+      std::cout << "Collective snapshot: " << (snapshotted ? "done" : "failed") << " in " << MPI_Wtime() - start << " s" << std::endl;
+    }
+    assert(snapshotted);
+  }
+  MPI_Barrier(MPI_COMM_WORLD);
+
+  if (world_rank == 0){
+    // Validate
+    for (int r = 0; r < world_size; r++){
+      std::string rank_version_metadata_path = version_metadata_prefix + std::to_string(r);
+      Privateer privateer(rank_version_metadata_path.c_str(), true);
+      size_t *data = (size_t*) privateer.data();
+      for (size_t i = 0; i < values_size - 1; i++){
+        assert(data[i] == i);
+      }
+      assert(data[values_size - 1] == (size_t) r);
+    }
+    std::cout << "Validated versions of " << world_size << " ranks" << std::endl;
+  }
+
+  // Collective msync with explicitly marked writes and a volatile scratch range: only marked
+  // blocks are committed, the scratch range is committed as zeros
+  std::string tracked_version_metadata_path = version_metadata_path + "_tracked";
+  size_t scratch_values = 1024*1024;
+  {
+    Privateer privateer((version_metadata_prefix + std::to_string(world_rank)).c_str(), tracked_version_metadata_path.c_str());
+    privateer.set_dirty_tracking(DirtyTracking::EXPLICIT);
+    privateer.set_volatile(0, scratch_values*sizeof(size_t));
+    size_t *data = (size_t*) privateer.data();
+    for (size_t i = 0; i < scratch_values; i++){
+      data[i] = i + 1;
+    }
+    data[values_size - 2] = world_rank + 1;
+    privateer.mark_dirty((values_size - 2)*sizeof(size_t), sizeof(size_t));
+    assert(PrivateerMPI::msync(privateer, MPI_COMM_WORLD));
+    // Marks were taken by the commit
+    assert(privateer.hash_dirty_blocks().empty());
+  }
+  MPI_Barrier(MPI_COMM_WORLD);
+  {
+    Privateer privateer(tracked_version_metadata_path.c_str(), true);
+    size_t *data = (size_t*) privateer.data();
+    for (size_t i = 0; i < scratch_values; i++){
+      assert(data[i] == 0);
+    }
+    assert(data[scratch_values] == scratch_values);
+    assert(data[values_size - 2] == (size_t) world_rank + 1 && data[values_size - 1] == (size_t) world_rank);
+  }
+  MPI_Barrier(MPI_COMM_WORLD);
+  if (world_rank == 0){
+    std::cout << "Collective msync: validated tracked versions" << std::endl;
+  }
+
+  // Restart: all ranks open the version of rank 0, reading the store once per node, then once overall
+  for (std::string node_cache_dir_path : {std::string(""), base_test_dir + "/node_cache"}){
+    double start = MPI_Wtime();
+    Privateer* privateer = PrivateerMPI::open((version_metadata_prefix + "0").c_str(), true, MPI_COMM_WORLD, node_cache_dir_path);
+    assert(privateer != nullptr);
+    size_t *data = (size_t*) privateer->data();
+    for (size_t i = 0; i < values_size - 1; i++){
+      assert(data[i] == i);
+    }
+    assert(data[values_size - 1] == 0);
+    delete privateer;
+    MPI_Barrier(MPI_COMM_WORLD);
+    if (world_rank == 0){
+      std::cout << "Collective open" << (node_cache_dir_path.empty() ? "" : " with node cache") << ": validated in " << MPI_Wtime() - start << " s" << std::endl;
+    }
+  }
+
+  // Node caches limited to one block keep the most recently opened ones, until cleared
+  std::string node_cache_dir_path = base_test_dir + "/node_cache";
+  size_t granularity = BlockStorage(blocks_directory_path).get_block_granularity();
+  std::string last_version_metadata_path = version_metadata_prefix + std::to_string(world_size - 1);
+  Privateer* privateer = PrivateerMPI::open(last_version_metadata_path.c_str(), true, MPI_COMM_WORLD, node_cache_dir_path, granularity);
+  assert(privateer != nullptr);
+  size_t *data = (size_t*) privateer->data();
+  assert(data[values_size - 2] == values_size - 2 && data[values_size - 1] == (size_t) world_size - 1);
+  MPI_Barrier(MPI_COMM_WORLD);
+  size_t num_cached_blocks = 0;
+  DirectoryTier(node_cache_dir_path).for_each_block([&](size_t, const std::string &){ num_cached_blocks++; });
+  assert(num_cached_blocks == 1);
+  MPI_Barrier(MPI_COMM_WORLD);
+  assert(PrivateerMPI::clear_node_cache(node_cache_dir_path, MPI_COMM_WORLD));
+  // Mapped blocks stay readable
+  assert(data[values_size - 1] == (size_t) world_size - 1);
+  delete privateer;
+  num_cached_blocks = 0;
+  DirectoryTier(node_cache_dir_path).for_each_block([&](size_t, const std::string &){ num_cached_blocks++; });
+  assert(num_cached_blocks == 0);
+  if (world_rank == 0){
+    std::cout << "Node cache: validated eviction and cleanup" << std::endl;
+  }
+
+  MPI_Finalize();
+  return 0;
+}
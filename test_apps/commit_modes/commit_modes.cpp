@@ -0,0 +1,139 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../../include/privateer/privateer.hpp"
+
+// Write hints: will_overwrite on a range that is not page-aligned drops only its whole pages,
+// the pages at its edges keep their content, and the rewritten range commits as written.
+// Commit modes: resident commits keep committed blocks in memory and writable, later writes to
+// them are committed as usual; ingest commits drop the blocks from the page cache and read the
+// same bytes back from their files
+
+static const size_t BLOCK_SIZE = 1024*1024;
+static const size_t NUM_BLOCKS = 4;
+
+static bool check_range(const char* data, size_t offset, size_t length, char value){
+  for (size_t i = offset; i < offset + length; i++){
+    if (data[i] != value){
+      return false;
+    }
+  }
+  return true;
+}
+
+static size_t resident_pages(void* addr, size_t length){
+  size_t pagesize = sysconf(_SC_PAGE_SIZE);
+  std::vector<unsigned char> residency(length / pagesize);
+  assert(mincore(addr, length, residency.data()) == 0);
+  size_t num_resident = 0;
+  for (unsigned char page : residency){
+    num_resident += page & 1;
+  }
+  return num_resident;
+}
+
+int main(int argc, char** argv){
+  if (argc != 2){
+    std::cerr << "Usage: " << argv[0] << " <base_test_dir>" << std::endl;
+    return -1;
+  }
+  std::string base_test_dir(argv[1]);
+  int mkdir_stat = mkdir(base_test_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  if (mkdir_stat != 0){
+    std::cerr << "Error creating directory at: " << base_test_dir << std::endl;
+    return -1;
+  }
+  setenv("PRIVATEER_FILE_GRANULARITY", std::to_string(BLOCK_SIZE).c_str(), 1);
+  size_t pagesize = sysconf(_SC_PAGE_SIZE);
+  std::string blocks_path = base_test_dir + "/modes_blocks";
+  std::string version_0 = base_test_dir + "/modes_v0";
+  {
+    Privateer privateer(blocks_path.c_str(), version_0.c_str(), NUM_BLOCKS*BLOCK_SIZE);
+    privateer.resize(NUM_BLOCKS*BLOCK_SIZE);
+    memset(privateer.data(), 'a', NUM_BLOCKS*BLOCK_SIZE);
+    privateer.msync();
+  }
+
+  // [BLOCK_SIZE + 100, BLOCK_SIZE + 100 + 3*pagesize): pages 1 and 2 of block 1 are dropped, the
+  // first and last pages it touches are only partially rewritten
+  size_t overwrite_offset = BLOCK_SIZE + 100;
+  size_t overwrite_length = 3*pagesize;
+  {
+    Privateer privateer(version_0.c_str(), false);
+    char* data = (char*) privateer.data();
+    assert(privateer.will_overwrite(overwrite_offset, overwrite_length));
+    assert(check_range(data, BLOCK_SIZE, 100, 'a'));
+    assert(check_range(data, overwrite_offset + overwrite_length, BLOCK_SIZE + 4*pagesize - overwrite_offset - overwrite_length, 'a'));
+    assert(!privateer.will_overwrite(NUM_BLOCKS*BLOCK_SIZE - pagesize, 2*pagesize));
+    memset(data + overwrite_offset, 'b', overwrite_length);
+    privateer.msync();
+  }
+  {
+    Privateer privateer(version_0.c_str(), true);
+    const char* data = (const char*) privateer.data();
+    assert(check_range(data, 0, overwrite_offset, 'a'));
+    assert(check_range(data, overwrite_offset, overwrite_length, 'b'));
+    assert(check_range(data, overwrite_offset + overwrite_length, NUM_BLOCKS*BLOCK_SIZE - overwrite_offset - overwrite_length, 'a'));
+  }
+
+  // Resident: committed blocks are populated read-only, then made writable again
+  std::string resident_version = base_test_dir + "/modes_resident";
+  {
+    Privateer privateer(version_0.c_str(), resident_version.c_str());
+    privateer.set_commit_mode(CommitMode::RESIDENT);
+    char* data = (char*) privateer.data();
+    memset(data + 2*BLOCK_SIZE, 'c', BLOCK_SIZE);
+    privateer.msync();
+    assert(resident_pages(data + 2*BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE / pagesize);
+    assert(check_range(data, 2*BLOCK_SIZE, BLOCK_SIZE, 'c'));
+    memset(data + 2*BLOCK_SIZE + 10*pagesize, 'd', pagesize);
+    memset(data + 3*BLOCK_SIZE, 'e', pagesize);
+    privateer.msync();
+    assert(check_range(data, 2*BLOCK_SIZE + 10*pagesize, pagesize, 'd') && check_range(data, 3*BLOCK_SIZE, pagesize, 'e'));
+  }
+  {
+    Privateer privateer(resident_version.c_str(), true);
+    const char* data = (const char*) privateer.data();
+    assert(check_range(data, 2*BLOCK_SIZE, 10*pagesize, 'c'));
+    assert(check_range(data, 2*BLOCK_SIZE + 10*pagesize, pagesize, 'd'));
+    assert(check_range(data, 2*BLOCK_SIZE + 11*pagesize, BLOCK_SIZE - 11*pagesize, 'c'));
+    assert(check_range(data, 3*BLOCK_SIZE, pagesize, 'e'));
+    assert(check_range(data, 3*BLOCK_SIZE + pagesize, BLOCK_SIZE - pagesize, 'a'));
+  }
+
+  // Ingest: committed blocks are written out and dropped from the page cache
+  std::string ingest_version = base_test_dir + "/modes_ingest";
+  {
+    Privateer privateer(version_0.c_str(), ingest_version.c_str());
+    privateer.set_commit_mode(CommitMode::INGEST);
+    char* data = (char*) privateer.data();
+    memset(data, 'f', BLOCK_SIZE);
+    memset(data + 3*BLOCK_SIZE + 5*pagesize + 7, 'g', 2*pagesize);
+    privateer.msync();
+    assert(check_range(data, 0, BLOCK_SIZE, 'f'));
+    assert(check_range(data, 3*BLOCK_SIZE + 5*pagesize + 7, 2*pagesize, 'g'));
+  }
+  {
+    Privateer privateer(ingest_version.c_str(), true);
+    const char* data = (const char*) privateer.data();
+    assert(check_range(data, 0, BLOCK_SIZE, 'f'));
+    assert(check_range(data, BLOCK_SIZE, overwrite_offset - BLOCK_SIZE, 'a'));
+    assert(check_range(data, overwrite_offset, overwrite_length, 'b'));
+    assert(check_range(data, overwrite_offset + overwrite_length, 3*BLOCK_SIZE + 5*pagesize + 7 - overwrite_offset - overwrite_length, 'a'));
+    assert(check_range(data, 3*BLOCK_SIZE + 5*pagesize + 7, 2*pagesize, 'g'));
+    assert(check_range(data, 3*BLOCK_SIZE + 7*pagesize + 7, BLOCK_SIZE - 7*pagesize - 7, 'a'));
+  }
+  std::cout << "Commit modes verified" << std::endl;
+  return 0;
+}
@@ -0,0 +1,113 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include "../../include/privateer/privateer.hpp"
+
+// Explicit dirty tracking: pages marked with mark_dirty (from many threads) are committed, writes
+// to blocks without marked pages are not, and marks are consumed by the commit that takes them.
+// Volatile ranges: their whole pages are not written back, they are zeros after a commit and
+// after a reopen, and fully volatile blocks are not stored at all
+
+static const size_t BLOCK_SIZE = 1024*1024;
+static const size_t NUM_BLOCKS = 8;
+
+static bool check_range(const char* data, size_t offset, size_t length, char value){
+  for (size_t i = offset; i < offset + length; i++){
+    if (data[i] != value){
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char** argv){
+  if (argc != 2){
+    std::cerr << "Usage: " << argv[0] << " <base_test_dir>" << std::endl;
+    return -1;
+  }
+  std::string base_test_dir(argv[1]);
+  int mkdir_stat = mkdir(base_test_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  if (mkdir_stat != 0){
+    std::cerr << "Error creating directory at: " << base_test_dir << std::endl;
+    return -1;
+  }
+  setenv("PRIVATEER_FILE_GRANULARITY", std::to_string(BLOCK_SIZE).c_str(), 1);
+  size_t pagesize = sysconf(_SC_PAGE_SIZE);
+  std::string blocks_path = base_test_dir + "/tracking_blocks";
+  std::string version_0 = base_test_dir + "/tracking_v0";
+  {
+    Privateer privateer(blocks_path.c_str(), version_0.c_str(), NUM_BLOCKS*BLOCK_SIZE);
+    privateer.resize(NUM_BLOCKS*BLOCK_SIZE);
+    memset(privateer.data(), 'a', NUM_BLOCKS*BLOCK_SIZE);
+    privateer.msync();
+  }
+
+  {
+    Privateer privateer(version_0.c_str(), false);
+    privateer.set_dirty_tracking(DirtyTracking::EXPLICIT);
+    char* data = (char*) privateer.data();
+    // One page per even block written and marked by concurrent threads, odd blocks written only
+    #pragma omp parallel for
+    for (size_t block_index = 0; block_index < NUM_BLOCKS; block_index++){
+      size_t offset = block_index*BLOCK_SIZE + 3*pagesize + 10;
+      memset(data + offset, 'b', 100);
+      if (block_index % 2 == 0){
+        privateer.mark_dirty(offset, 100);
+      }
+    }
+    privateer.msync();
+
+    // Marks were taken by the commit: block 0 is written again but not marked
+    memset(data, 'c', 100);
+    privateer.msync();
+  }
+  {
+    Privateer privateer(version_0.c_str(), true);
+    const char* data = (const char*) privateer.data();
+    for (size_t block_index = 0; block_index < NUM_BLOCKS; block_index++){
+      size_t offset = block_index*BLOCK_SIZE + 3*pagesize + 10;
+      assert(check_range(data, offset, 100, block_index % 2 == 0 ? 'b' : 'a'));
+      assert(check_range(data, block_index*BLOCK_SIZE, 3*pagesize + 10, 'a'));
+      assert(check_range(data, offset + 100, (block_index + 1)*BLOCK_SIZE - offset - 100, 'a'));
+    }
+  }
+
+  // Volatile pages [BLOCK_SIZE + 3*pagesize, BLOCK_SIZE + 6*pagesize) and all of block 6
+  std::string version_1 = base_test_dir + "/tracking_v1";
+  {
+    Privateer privateer(version_0.c_str(), version_1.c_str());
+    privateer.set_volatile(BLOCK_SIZE + 2*pagesize + 10, 4*pagesize);
+    privateer.set_volatile(6*BLOCK_SIZE, BLOCK_SIZE);
+    char* data = (char*) privateer.data();
+    memset(data + BLOCK_SIZE, 'v', BLOCK_SIZE);
+    memset(data + 5*BLOCK_SIZE, 'w', BLOCK_SIZE);
+    memset(data + 6*BLOCK_SIZE, 'v', BLOCK_SIZE);
+    privateer.msync();
+    assert(check_range(data, BLOCK_SIZE + 3*pagesize, 3*pagesize, 0) && check_range(data, 6*BLOCK_SIZE, BLOCK_SIZE, 0));
+  }
+  {
+    Privateer privateer(version_1.c_str(), true);
+    const char* data = (const char*) privateer.data();
+    // Partially covered pages are kept
+    assert(check_range(data, BLOCK_SIZE, 3*pagesize, 'v'));
+    assert(check_range(data, BLOCK_SIZE + 3*pagesize, 3*pagesize, 0));
+    assert(check_range(data, BLOCK_SIZE + 6*pagesize, BLOCK_SIZE - 6*pagesize, 'v'));
+    assert(check_range(data, 5*BLOCK_SIZE, BLOCK_SIZE, 'w'));
+    assert(check_range(data, 6*BLOCK_SIZE, BLOCK_SIZE, 0));
+  }
+  VersionLayout layout;
+  BlockTable* blocks = load_version_digests(version_1, layout);
+  assert(blocks != nullptr && blocks->is_empty(6) && !blocks->is_empty(1));
+  delete blocks;
+  std::cout << "Dirty tracking verified" << std::endl;
+  return 0;
+}
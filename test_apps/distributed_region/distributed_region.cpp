@@ -0,0 +1,74 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#include <mpi.h>
+#include <cassert>
+#include <iostream>
+#include <string>
+
+#include "../../include/privateer/mpi/distributed_region.hpp"
+
+int main(int argc, char** argv){
+  MPI_Init(&argc, &argv);
+  int world_rank, world_size;
+  MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+
+  if (argc != 2){
+    if (world_rank == 0){
+      std::cerr << "Usage: " << argv[0] << " <base_test_dir>" << std::endl;
+    }
+    MPI_Finalize();
+    return -1;
+  }
+
+  std::string base_test_dir(argv[1]);
+  std::string blocks_directory_path = base_test_dir + "/blocks";
+  std::string version_metadata_path = base_test_dir + "/distributed_version";
+  std::string snapshot_metadata_path = base_test_dir + "/distributed_snapshot";
+  size_t region_capacity = 256*1024*1024;
+  if (world_rank == 0){
+    utility::create_directory(base_test_dir.c_str());
+  }
+  MPI_Barrier(MPI_COMM_WORLD);
+
+  {
+    DistributedRegion region(blocks_directory_path.c_str(), version_metadata_path.c_str(), region_capacity, MPI_COMM_WORLD);
+    size_t* data = (size_t*) region.data();
+    // Each rank fills its own partition
+    size_t first = region.local_offset() / sizeof(size_t);
+    size_t count = region.local_size() / sizeof(size_t);
+    for (size_t i = first; i < first + count; i++){
+      data[i] = i;
+    }
+    double start = MPI_Wtime();
+    bool committed = region.msync();
+    if (world_rank == 0){
+      std::cout << "Distributed msync: " << (committed ? "done" : "failed") << " in " << MPI_Wtime() - start << " s" << std::endl;
+    }
+    assert(committed);
+    // Blocks of the other ranks are read from the store on demand
+    size_t num_values = region.size() / sizeof(size_t);
+    for (size_t i = 0; i < num_values; i += 4096){
+      assert(data[i] == i);
+    }
+    // Update one value per partition and snapshot
+    data[first] = 0;
+    assert(region.snapshot(snapshot_metadata_path.c_str()));
+  }
+
+  if (world_rank == 0){
+    Privateer privateer(snapshot_metadata_path.c_str(), true);
+    size_t* data = (size_t*) privateer.data();
+    size_t num_values = privateer.current_size() / sizeof(size_t);
+    for (size_t i = 1; i < num_values; i++){
+      assert(data[i] == i || data[i] == 0);
+    }
+    std::cout << "Validated distributed snapshot of " << world_size << " ranks" << std::endl;
+  }
+
+  MPI_Finalize();
+  return 0;
+}
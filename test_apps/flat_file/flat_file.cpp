@@ -0,0 +1,105 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../../include/privateer/privateer.hpp"
+#include "../../include/privateer/flat_file.hpp"
+
+// Flat file round trip: an 8 MB file with a partial last block and a zero block is imported,
+// read through a region, and exported back byte for byte
+
+static const size_t BLOCK_SIZE = 1024*1024;
+static const size_t FILE_SIZE = 8*BLOCK_SIZE + 12345;
+
+static bool write_file(std::string file_path, const std::vector<char> &content){
+  int fd = ::open(file_path.c_str(), O_WRONLY | O_CREAT | O_EXCL, (mode_t) 0666);
+  bool written = fd != -1 && ::pwrite(fd, content.data(), content.size(), 0) == (ssize_t) content.size();
+  ::close(fd);
+  return written;
+}
+
+static std::vector<char> read_file(std::string file_path){
+  std::vector<char> content;
+  int fd = ::open(file_path.c_str(), O_RDONLY);
+  struct stat file_stat;
+  if (fd != -1 && fstat(fd, &file_stat) == 0){
+    content.resize(file_stat.st_size);
+    if (::pread(fd, content.data(), content.size(), 0) != (ssize_t) content.size()){
+      content.clear();
+    }
+  }
+  ::close(fd);
+  return content;
+}
+
+static size_t count_blocks(std::string blocks_path){
+  size_t num_blocks = 0;
+  BlockStorage(blocks_path).for_each_block([&](size_t, const std::string &){ num_blocks++; });
+  return num_blocks;
+}
+
+int main(int argc, char** argv){
+  if (argc != 2){
+    std::cerr << "Usage: " << argv[0] << " <base_test_dir>" << std::endl;
+    return -1;
+  }
+  std::string base_test_dir(argv[1]);
+  int mkdir_stat = mkdir(base_test_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  if (mkdir_stat != 0){
+    std::cerr << "Error creating directory at: " << base_test_dir << std::endl;
+    return -1;
+  }
+  setenv("PRIVATEER_FILE_GRANULARITY", std::to_string(BLOCK_SIZE).c_str(), 1);
+  std::string file_path = base_test_dir + "/input_file";
+  std::string blocks_path = base_test_dir + "/flat_file_blocks";
+  std::string version = base_test_dir + "/flat_file_version";
+
+  // Block 2 is zero
+  std::vector<char> content(FILE_SIZE);
+  for (size_t i = 0; i < FILE_SIZE; i++){
+    content[i] = (char) ((i * 2654435761u) >> 13);
+  }
+  memset(content.data() + 2*BLOCK_SIZE, 0, BLOCK_SIZE);
+  assert(write_file(file_path, content));
+
+  assert(FlatFile::import_file(file_path.c_str(), blocks_path.c_str(), version.c_str(), 16*BLOCK_SIZE));
+  // 9 blocks, the zero block is not stored
+  assert(count_blocks(blocks_path) == 8);
+  {
+    Privateer privateer(version.c_str(), true);
+    assert(privateer.current_size() == 9*BLOCK_SIZE && privateer.max_size() == 16*BLOCK_SIZE);
+    char* data = (char*) privateer.data();
+    assert(memcmp(data, content.data(), FILE_SIZE) == 0);
+    for (size_t i = FILE_SIZE; i < 9*BLOCK_SIZE; i++){
+      assert(data[i] == 0);
+    }
+  }
+
+  // Exported with the file's length, then whole
+  std::string exported_path = base_test_dir + "/exported_file";
+  assert(FlatFile::export_file(version.c_str(), exported_path.c_str(), FILE_SIZE));
+  assert(read_file(exported_path) == content);
+  std::string padded_path = base_test_dir + "/padded_file";
+  assert(FlatFile::export_file(version.c_str(), padded_path.c_str()));
+  std::vector<char> padded_content = content;
+  padded_content.resize(9*BLOCK_SIZE, 0);
+  assert(read_file(padded_path) == padded_content);
+  assert(!FlatFile::export_file(version.c_str(), exported_path.c_str()));
+
+  // Importing the exported file again stores no new block
+  assert(FlatFile::import_file(exported_path.c_str(), blocks_path.c_str(), (base_test_dir + "/reimported_version").c_str()));
+  assert(count_blocks(blocks_path) == 8);
+  assert(Privateer::diff(version, base_test_dir + "/reimported_version").empty());
+  std::cout << "Flat file round trip verified" << std::endl;
+  return 0;
+}
@@ -0,0 +1,126 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cassert>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include "../../include/privateer/privateer.hpp"
+#include "../../include/privateer/garbage_collector.hpp"
+
+// Garbage collection never removes a block of a live version and reclaims blocks only dropped
+// versions referred to; on a store whose versions registry is incomplete nothing is swept until
+// its versions are adopted
+
+static const size_t BLOCK_SIZE = 1024*1024;
+static const size_t NUM_BLOCKS = 16;
+
+static size_t count_blocks(std::string blocks_path){
+  BlockStorage block_storage(blocks_path);
+  size_t num_blocks = 0;
+  block_storage.for_each_block([&num_blocks](size_t, const std::string &){ num_blocks++; });
+  return num_blocks;
+}
+
+// Writes value into the first num_blocks blocks of a new version derived from version_path
+static void write_version(std::string version_path, std::string new_version_path, size_t num_blocks, size_t value){
+  Privateer privateer(version_path.c_str(), new_version_path.c_str());
+  size_t* data = (size_t*) privateer.data();
+  for (size_t i = 0; i < num_blocks*BLOCK_SIZE / sizeof(size_t); i++){
+    data[i] = value + i;
+  }
+  privateer.msync();
+}
+
+static void verify_version(std::string version_path, size_t num_changed_blocks, size_t value){
+  Privateer privateer(version_path.c_str(), true);
+  size_t* data = (size_t*) privateer.data();
+  for (size_t i = 0; i < NUM_BLOCKS*BLOCK_SIZE / sizeof(size_t); i++){
+    size_t expected = (i < num_changed_blocks*BLOCK_SIZE / sizeof(size_t)) ? value + i : i;
+    assert(data[i] == expected);
+  }
+}
+
+static size_t collect(std::string blocks_path){
+  // Blocks stored by the test are older than the (zero) grace period
+  sleep(1);
+  GarbageCollector gc(blocks_path);
+  gc.set_grace_period(0);
+  gc.mark();
+  size_t reclaimed = 0;
+  while (!gc.sweep_done()){
+    reclaimed += gc.sweep(4, 0);
+  }
+  return reclaimed;
+}
+
+int main(int argc, char** argv){
+  if (argc != 2){
+    std::cerr << "Usage: " << argv[0] << " <base_test_dir>" << std::endl;
+    return -1;
+  }
+  std::string base_test_dir(argv[1]);
+  int mkdir_stat = mkdir(base_test_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  if (mkdir_stat != 0){
+    std::cerr << "Error creating directory at: " << base_test_dir << std::endl;
+    return -1;
+  }
+  setenv("PRIVATEER_FILE_GRANULARITY", std::to_string(BLOCK_SIZE).c_str(), 1);
+  std::string blocks_path = base_test_dir + "/gc_blocks";
+  std::string version_0 = base_test_dir + "/gc_version_0";
+  std::string version_1 = base_test_dir + "/gc_version_1";
+  std::string version_2 = base_test_dir + "/gc_version_2";
+  {
+    Privateer privateer(blocks_path.c_str(), version_0.c_str(), NUM_BLOCKS*BLOCK_SIZE);
+    privateer.resize(NUM_BLOCKS*BLOCK_SIZE);
+    size_t* data = (size_t*) privateer.data();
+    for (size_t i = 0; i < NUM_BLOCKS*BLOCK_SIZE / sizeof(size_t); i++){
+      data[i] = i;
+    }
+    privateer.msync();
+  }
+  // Version 1 shares all but its first 4 blocks with version 0
+  write_version(version_0, version_1, 4, 1000);
+  assert(count_blocks(blocks_path) == NUM_BLOCKS + 4);
+
+  // Nothing to collect while both versions are live
+  assert(collect(blocks_path) == 0);
+  assert(count_blocks(blocks_path) == NUM_BLOCKS + 4);
+
+  // Dropping version 0 leaves its first 4 blocks unreferenced
+  std::filesystem::remove_all(version_0);
+  assert(collect(blocks_path) == 4*BLOCK_SIZE);
+  assert(count_blocks(blocks_path) == NUM_BLOCKS);
+  verify_version(version_1, 4, 1000);
+
+  // A store older than the registry: version 2 is not registered and the registry is incomplete
+  write_version(version_1, version_2, 2, 2000);
+  std::filesystem::remove(blocks_path + "/_versions_complete");
+  std::filesystem::remove(blocks_path + "/_versions");
+  std::filesystem::remove_all(version_1);
+  assert(collect(blocks_path) == 0);
+  assert(count_blocks(blocks_path) == NUM_BLOCKS + 2);
+
+  // Once adopted, blocks only version 1 referred to are collected, version 2 stays intact
+  {
+    GarbageCollector gc(blocks_path);
+    assert(gc.adopt_versions({base_test_dir}));
+  }
+  assert(collect(blocks_path) == 2*BLOCK_SIZE);
+  assert(count_blocks(blocks_path) == NUM_BLOCKS);
+  {
+    Privateer privateer(version_2.c_str(), true);
+    size_t* data = (size_t*) privateer.data();
+    for (size_t i = 0; i < NUM_BLOCKS*BLOCK_SIZE / sizeof(size_t); i++){
+      size_t expected = (i < 2*BLOCK_SIZE / sizeof(size_t)) ? 2000 + i : ((i < 4*BLOCK_SIZE / sizeof(size_t)) ? 1000 + i : i);
+      assert(data[i] == expected);
+    }
+  }
+  std::cout << "Garbage collection verified" << std::endl;
+  return 0;
+}
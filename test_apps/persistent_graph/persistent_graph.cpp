@@ -0,0 +1,88 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#include <sys/stat.h>
+#include <cassert>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <boost/container/vector.hpp>
+#include "../../include/privateer/persistent_heap.hpp"
+
+// Adjacency lists kept in a persistent heap: built and committed as a first version, then
+// opened (at whatever address) and extended into a second version
+using EdgeList = boost::container::vector<uint64_t, PersistentAllocator<uint64_t>>;
+using Graph = boost::container::vector<EdgeList, PersistentAllocator<EdgeList>>;
+
+static void add_edges(Graph* graph, size_t num_edges, unsigned seed){
+  std::mt19937_64 generator(seed);
+  for (size_t i = 0; i < num_edges; i++){
+    uint64_t source = generator() % graph->size();
+    uint64_t target = generator() % graph->size();
+    (*graph)[source].push_back(target);
+  }
+}
+
+static size_t count_edges(Graph* graph){
+  size_t num_edges = 0;
+  for (const EdgeList &edges : *graph){
+    num_edges += edges.size();
+  }
+  return num_edges;
+}
+
+int main(int argc, char** argv){
+  if (argc != 4){
+    std::cerr << "Usage: " << argv[0] << " <base_test_dir> <num_vertices> <num_edges>" << std::endl;
+    return -1;
+  }
+  std::string base_test_dir(argv[1]);
+  size_t num_vertices = std::stoull(argv[2]);
+  size_t num_edges = std::stoull(argv[3]);
+  size_t capacity = 16*1024*1024*1024LLU;
+
+  int mkdir_stat = mkdir(base_test_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  if (mkdir_stat != 0){
+    std::cerr << "Error creating directory at: " << base_test_dir << std::endl;
+    return -1;
+  }
+  std::string blocks_path = base_test_dir + "/graph_blocks";
+  std::string version_0 = base_test_dir + "/graph_version_0";
+  std::string version_1 = base_test_dir + "/graph_version_1";
+  {
+    PersistentHeap heap(blocks_path.c_str(), version_0.c_str(), capacity);
+    Graph* graph = heap.construct<Graph>("graph", heap.get_allocator<Graph>());
+    graph->resize(num_vertices, EdgeList(heap.get_allocator<uint64_t>()));
+    add_edges(graph, num_edges, 0);
+    heap.msync();
+  }
+  {
+    PersistentHeap heap(version_0.c_str(), version_1.c_str());
+    Graph* graph = heap.find<Graph>("graph");
+    assert(graph != nullptr && count_edges(graph) == num_edges);
+    add_edges(graph, num_edges, 1);
+    heap.msync();
+  }
+  {
+    bool read_only = true;
+    PersistentHeap heap_0(version_0.c_str(), read_only);
+    PersistentHeap heap_1(version_1.c_str(), read_only);
+    assert(count_edges(heap_0.find<Graph>("graph")) == num_edges);
+    assert(count_edges(heap_1.find<Graph>("graph")) == 2*num_edges);
+    // Containers of a read-only heap cannot grow, and leave the heap unchanged
+    Graph* graph = heap_0.find<Graph>("graph");
+    bool grown = true;
+    try{
+      (*graph)[0].resize((*graph)[0].capacity() + 1);
+    }
+    catch (const std::bad_alloc &){
+      grown = false;
+    }
+    assert(!grown && count_edges(graph) == num_edges);
+  }
+  std::cout << "Graph versions verified" << std::endl;
+  return 0;
+}
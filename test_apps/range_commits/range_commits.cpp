@@ -0,0 +1,111 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../../include/privateer/privateer.hpp"
+
+// Range commits: threads commit disjoint ranges at the same time, including ranges sharing a
+// block at their bounds and a range within a single block; the rest of the region keeps its
+// last committed state, in the version and in range snapshots
+
+static const size_t BLOCK_SIZE = 1024*1024;
+static const size_t NUM_BLOCKS = 8;
+
+struct Range
+{
+  size_t offset;
+  size_t length;
+  char value;
+};
+
+static bool check_range(const char* data, size_t offset, size_t length, char value){
+  for (size_t i = offset; i < offset + length; i++){
+    if (data[i] != value){
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char** argv){
+  if (argc != 2){
+    std::cerr << "Usage: " << argv[0] << " <base_test_dir>" << std::endl;
+    return -1;
+  }
+  std::string base_test_dir(argv[1]);
+  int mkdir_stat = mkdir(base_test_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  if (mkdir_stat != 0){
+    std::cerr << "Error creating directory at: " << base_test_dir << std::endl;
+    return -1;
+  }
+  setenv("PRIVATEER_FILE_GRANULARITY", std::to_string(BLOCK_SIZE).c_str(), 1);
+  std::string blocks_path = base_test_dir + "/range_blocks";
+  std::string version_0 = base_test_dir + "/range_v0";
+  std::string range_snapshot = base_test_dir + "/range_snapshot";
+
+  // Block 2 is shared by the first two ranges, the third lies within block 5
+  std::vector<Range> ranges = {
+    {0, 2*BLOCK_SIZE + BLOCK_SIZE / 2, 'b'},
+    {2*BLOCK_SIZE + BLOCK_SIZE / 2, BLOCK_SIZE + BLOCK_SIZE / 2, 'c'},
+    {5*BLOCK_SIZE + 100, 5000, 'd'},
+    {6*BLOCK_SIZE, 2*BLOCK_SIZE, 'e'}
+  };
+  {
+    Privateer privateer(blocks_path.c_str(), version_0.c_str(), NUM_BLOCKS*BLOCK_SIZE);
+    privateer.resize(NUM_BLOCKS*BLOCK_SIZE);
+    char* data = (char*) privateer.data();
+    memset(data, 'a', NUM_BLOCKS*BLOCK_SIZE);
+    privateer.msync();
+
+    // All ranges are written before any is committed: a commit of a block shared with another
+    // range takes that range's pages as they are
+    for (Range &range : ranges){
+      memset(data + range.offset, range.value, range.length);
+    }
+    std::vector<char> committed(ranges.size(), false);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < ranges.size(); t++){
+      threads.emplace_back([&, t](){
+        committed[t] = privateer.msync_range(ranges[t].offset, ranges[t].length);
+      });
+    }
+    for (std::thread &thread : threads){
+      thread.join();
+    }
+    for (size_t t = 0; t < ranges.size(); t++){
+      assert(committed[t]);
+    }
+    assert(!privateer.msync_range((NUM_BLOCKS - 1)*BLOCK_SIZE, 2*BLOCK_SIZE));
+
+    // Uncommitted outside the snapshotted range, committed within it
+    memset(data + 4*BLOCK_SIZE, 'f', BLOCK_SIZE);
+    memset(data + 5*BLOCK_SIZE + 6000, 'g', 1000);
+    assert(privateer.snapshot_range(range_snapshot.c_str(), 5*BLOCK_SIZE + 6000, 1000));
+  }
+
+  for (std::string version : {version_0, range_snapshot}){
+    Privateer privateer(version.c_str(), true);
+    const char* data = (const char*) privateer.data();
+    for (Range &range : ranges){
+      assert(check_range(data, range.offset, range.length, range.value));
+    }
+    assert(check_range(data, 5*BLOCK_SIZE, 100, 'a'));
+    assert(check_range(data, 5*BLOCK_SIZE + 5100, 900, 'a'));
+    assert(check_range(data, 4*BLOCK_SIZE, BLOCK_SIZE, 'a'));
+    // Committed by the range snapshot, the version's recipe was not updated since
+    assert(check_range(data, 5*BLOCK_SIZE + 6000, 1000, version == range_snapshot ? 'g' : 'a'));
+    assert(check_range(data, 5*BLOCK_SIZE + 7000, BLOCK_SIZE - 7000, 'a'));
+  }
+  std::cout << "Range commits verified" << std::endl;
+  return 0;
+}
@@ -0,0 +1,138 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cassert>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../../include/privateer/privateer.hpp"
+
+// Binary recipes round-trip through Recipe and BlockTable and detect corrupted headers; legacy
+// text recipes are read and rewritten in the binary format by the next update
+
+static const size_t BLOCK_SIZE = 1024*1024;
+static const size_t NUM_BLOCKS = 8;
+
+static void verify_data(std::string version_path, size_t value){
+  Privateer privateer(version_path.c_str(), true);
+  size_t* data = (size_t*) privateer.data();
+  for (size_t i = 0; i < NUM_BLOCKS*BLOCK_SIZE / sizeof(size_t); i++){
+    assert(data[i] == value + i / (BLOCK_SIZE / sizeof(size_t)));
+  }
+}
+
+int main(int argc, char** argv){
+  if (argc != 2){
+    std::cerr << "Usage: " << argv[0] << " <base_test_dir>" << std::endl;
+    return -1;
+  }
+  std::string base_test_dir(argv[1]);
+  int mkdir_stat = mkdir(base_test_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  if (mkdir_stat != 0){
+    std::cerr << "Error creating directory at: " << base_test_dir << std::endl;
+    return -1;
+  }
+  setenv("PRIVATEER_FILE_GRANULARITY", std::to_string(BLOCK_SIZE).c_str(), 1);
+  std::string blocks_path = base_test_dir + "/recipe_blocks";
+  std::string version_0 = base_test_dir + "/recipe_version_0";
+  std::string legacy_version = base_test_dir + "/recipe_legacy_version";
+
+  // One distinct block per index, capacity for as many more
+  {
+    Privateer privateer(blocks_path.c_str(), version_0.c_str(), 2*NUM_BLOCKS*BLOCK_SIZE);
+    privateer.resize(NUM_BLOCKS*BLOCK_SIZE);
+    size_t* data = (size_t*) privateer.data();
+    for (size_t i = 0; i < NUM_BLOCKS*BLOCK_SIZE / sizeof(size_t); i++){
+      data[i] = 1 + i / (BLOCK_SIZE / sizeof(size_t));
+    }
+    privateer.msync();
+  }
+
+  // Header fields and digests, checked against the block files
+  Recipe recipe;
+  assert(recipe.load(version_0));
+  assert(recipe.size() == NUM_BLOCKS*BLOCK_SIZE);
+  assert(recipe.capacity() == 2*NUM_BLOCKS*BLOCK_SIZE);
+  assert(recipe.granularity() == BLOCK_SIZE);
+  assert(recipe.num_blocks() == NUM_BLOCKS);
+  assert(recipe.blocks_path() == blocks_path);
+  assert(Recipe::verify(version_0));
+  BlockStorage block_storage(blocks_path);
+  std::vector<char> block(BLOCK_SIZE);
+  for (size_t i = 0; i < NUM_BLOCKS; i++){
+    std::string block_hash = utility::digest_to_hex(recipe.digest(i));
+    int block_fd = block_storage.get_block_fd(block_hash.c_str(), i);
+    assert(block_fd != -1);
+    assert(::pread(block_fd, block.data(), BLOCK_SIZE, 0) == (ssize_t) BLOCK_SIZE);
+    assert(utility::compute_hash(block.data(), BLOCK_SIZE) == block_hash);
+    ::close(block_fd);
+  }
+
+  // Digests mapped by a block table match the recipe
+  {
+    int metadata_fd = ::open((version_0 + "/_metadata").c_str(), O_RDONLY);
+    RecipeHeader header;
+    assert(Recipe::read_header(metadata_fd, header));
+    BlockTable table(2*NUM_BLOCKS);
+    assert(table.map_base(metadata_fd, Recipe::HEADER_SIZE, header.num_blocks, header.digests_checksum));
+    for (size_t i = 0; i < NUM_BLOCKS; i++){
+      assert(memcmp(table.get(i), recipe.digest(i), utility::DIGEST_SIZE) == 0);
+    }
+    assert(table.is_empty(NUM_BLOCKS));
+    assert(table.recompute_checksum(NUM_BLOCKS) == header.digests_checksum);
+    ::close(metadata_fd);
+  }
+
+  // The same version as a legacy text recipe: hex digests, with size, capacity and blocks path in separate files
+  {
+    assert(mkdir(legacy_version.c_str(), S_IRWXU) == 0);
+    std::ofstream metadata_file(legacy_version + "/_metadata");
+    for (size_t i = 0; i < NUM_BLOCKS; i++){
+      metadata_file << utility::digest_to_hex(recipe.digest(i));
+    }
+    metadata_file.close();
+    std::ofstream(legacy_version + "/_size") << NUM_BLOCKS*BLOCK_SIZE;
+    std::ofstream(legacy_version + "/_capacity") << 2*NUM_BLOCKS*BLOCK_SIZE;
+    std::ofstream(legacy_version + "/_blocks_path") << blocks_path;
+  }
+  Recipe legacy_recipe;
+  assert(legacy_recipe.load(legacy_version));
+  assert(legacy_recipe.num_blocks() == NUM_BLOCKS && legacy_recipe.granularity() == BLOCK_SIZE);
+  verify_data(legacy_version, 1);
+
+  // Updating the legacy version rewrites it as a binary recipe
+  {
+    Privateer privateer(legacy_version.c_str(), false);
+    size_t* data = (size_t*) privateer.data();
+    for (size_t i = 0; i < NUM_BLOCKS*BLOCK_SIZE / sizeof(size_t); i++){
+      data[i] += 10;
+    }
+    privateer.msync();
+  }
+  int legacy_fd = ::open((legacy_version + "/_metadata").c_str(), O_RDONLY);
+  RecipeHeader legacy_header;
+  assert(Recipe::read_header(legacy_fd, legacy_header));
+  ::close(legacy_fd);
+  assert(Recipe::verify(legacy_version));
+  verify_data(legacy_version, 11);
+  verify_data(version_0, 1);
+
+  // A corrupted header is rejected
+  {
+    int metadata_fd = ::open((version_0 + "/_metadata").c_str(), O_RDWR);
+    uint64_t wrong_size = 3*BLOCK_SIZE;
+    assert(::pwrite(metadata_fd, &wrong_size, sizeof(wrong_size), offsetof(RecipeHeader, size)) == sizeof(wrong_size));
+    ::close(metadata_fd);
+    Recipe corrupted_recipe;
+    assert(!corrupted_recipe.load(version_0));
+  }
+  std::cout << "Recipe format verified" << std::endl;
+  return 0;
+}
@@ -0,0 +1,123 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cassert>
+#include <iostream>
+#include <string>
+#include "../../include/privateer/privateer.hpp"
+
+// Clones: a clone starts from the committed blocks and uncommitted pages of its source, writes to
+// either one do not show in the other, and a clone keeps the dirty tracking mode, marks and
+// volatile ranges of its source when snapshotted
+
+static const size_t BLOCK_SIZE = 1024*1024;
+static const size_t NUM_BLOCKS = 4;
+static const size_t VALUES_PER_BLOCK = BLOCK_SIZE / sizeof(size_t);
+
+static bool check_block(const size_t* data, size_t block_index, size_t value){
+  for (size_t i = 0; i < VALUES_PER_BLOCK; i++){
+    if (data[block_index*VALUES_PER_BLOCK + i] != value){
+      return false;
+    }
+  }
+  return true;
+}
+
+static void fill_block(size_t* data, size_t block_index, size_t value){
+  for (size_t i = 0; i < VALUES_PER_BLOCK; i++){
+    data[block_index*VALUES_PER_BLOCK + i] = value;
+  }
+}
+
+int main(int argc, char** argv){
+  if (argc != 2){
+    std::cerr << "Usage: " << argv[0] << " <base_test_dir>" << std::endl;
+    return -1;
+  }
+  std::string base_test_dir(argv[1]);
+  int mkdir_stat = mkdir(base_test_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  if (mkdir_stat != 0){
+    std::cerr << "Error creating directory at: " << base_test_dir << std::endl;
+    return -1;
+  }
+  setenv("PRIVATEER_FILE_GRANULARITY", std::to_string(BLOCK_SIZE).c_str(), 1);
+  size_t pagesize = sysconf(_SC_PAGE_SIZE);
+  std::string blocks_path = base_test_dir + "/clone_blocks";
+  std::string version_0 = base_test_dir + "/clone_v0";
+  std::string clone_version = base_test_dir + "/clone_snapshot";
+  std::string tracked_clone_version = base_test_dir + "/tracked_clone_snapshot";
+
+  {
+    Privateer privateer(blocks_path.c_str(), version_0.c_str(), NUM_BLOCKS*BLOCK_SIZE);
+    privateer.resize(NUM_BLOCKS*BLOCK_SIZE);
+    size_t* data = (size_t*) privateer.data();
+    for (size_t block_index = 0; block_index < NUM_BLOCKS; block_index++){
+      fill_block(data, block_index, block_index + 1);
+    }
+    privateer.msync();
+    // Uncommitted change, cloned along with the committed blocks
+    fill_block(data, 1, 100);
+
+    Privateer* clone = privateer.clone();
+    assert(clone != nullptr);
+    size_t* clone_data = (size_t*) clone->data();
+    assert(clone->current_size() == privateer.current_size());
+    assert(check_block(clone_data, 0, 1) && check_block(clone_data, 1, 100));
+
+    // Writes to the clone do not leak into the source, and the other way around
+    fill_block(clone_data, 2, 200);
+    assert(check_block(data, 2, 3));
+    fill_block(data, 3, 300);
+    assert(check_block(clone_data, 3, 4));
+
+    assert(clone->snapshot(clone_version.c_str()));
+    privateer.msync();
+    delete clone;
+  }
+  {
+    Privateer source(version_0.c_str(), true);
+    size_t* data = (size_t*) source.data();
+    assert(check_block(data, 0, 1) && check_block(data, 1, 100) && check_block(data, 2, 3) && check_block(data, 3, 300));
+  }
+  {
+    Privateer cloned(clone_version.c_str(), true);
+    size_t* data = (size_t*) cloned.data();
+    assert(check_block(data, 0, 1) && check_block(data, 1, 100) && check_block(data, 2, 200) && check_block(data, 3, 4));
+  }
+
+  // Explicit tracking: the clone commits pages marked in the source or in the clone only, and
+  // zeros its volatile pages
+  {
+    Privateer privateer(version_0.c_str(), false);
+    privateer.set_dirty_tracking(DirtyTracking::EXPLICIT);
+    privateer.set_volatile(3*BLOCK_SIZE, pagesize);
+    size_t* data = (size_t*) privateer.data();
+    data[0] = 7;
+    privateer.mark_dirty(0, sizeof(size_t));
+
+    Privateer* clone = privateer.clone();
+    assert(clone != nullptr);
+    size_t* clone_data = (size_t*) clone->data();
+    clone_data[VALUES_PER_BLOCK] = 8;
+    clone->mark_dirty(BLOCK_SIZE, sizeof(size_t));
+    // Not marked
+    clone_data[2*VALUES_PER_BLOCK] = 9;
+    assert(clone->snapshot(tracked_clone_version.c_str()));
+    delete clone;
+  }
+  {
+    Privateer cloned(tracked_clone_version.c_str(), true);
+    size_t* data = (size_t*) cloned.data();
+    assert(data[0] == 7 && data[1] == 1);
+    assert(data[VALUES_PER_BLOCK] == 8 && data[VALUES_PER_BLOCK + 1] == 100);
+    assert(check_block(data, 2, 3));
+    assert(data[3*VALUES_PER_BLOCK] == 0 && data[3*VALUES_PER_BLOCK + pagesize / sizeof(size_t)] == 300);
+  }
+  std::cout << "Region clone verified" << std::endl;
+  return 0;
+}
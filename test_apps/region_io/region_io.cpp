@@ -0,0 +1,106 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../../include/privateer/privateer.hpp"
+
+// Region I/O: write stores whole blocks directly and copies partial ranges into the region, read
+// returns uncommitted pages from memory and the others from the block files, before and after a
+// commit and after a reopen; partial writes are committed under explicit dirty tracking too
+
+static const size_t BLOCK_SIZE = 1024*1024;
+static const size_t NUM_BLOCKS = 4;
+
+static bool read_matches(Privateer &privateer, const std::vector<char> &expected, size_t offset, size_t length){
+  std::vector<char> buffer(length);
+  return privateer.read(offset, buffer.data(), length) && memcmp(buffer.data(), expected.data() + offset, length) == 0;
+}
+
+static void write_expected(Privateer &privateer, std::vector<char> &expected, size_t offset, size_t length, char value){
+  std::vector<char> buffer(length, value);
+  assert(privateer.write(offset, buffer.data(), length));
+  memset(expected.data() + offset, value, length);
+}
+
+int main(int argc, char** argv){
+  if (argc != 2){
+    std::cerr << "Usage: " << argv[0] << " <base_test_dir>" << std::endl;
+    return -1;
+  }
+  std::string base_test_dir(argv[1]);
+  int mkdir_stat = mkdir(base_test_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  if (mkdir_stat != 0){
+    std::cerr << "Error creating directory at: " << base_test_dir << std::endl;
+    return -1;
+  }
+  setenv("PRIVATEER_FILE_GRANULARITY", std::to_string(BLOCK_SIZE).c_str(), 1);
+  size_t region_size = NUM_BLOCKS*BLOCK_SIZE;
+  std::string blocks_path = base_test_dir + "/io_blocks";
+  std::string version_0 = base_test_dir + "/io_v0";
+  std::string version_1 = base_test_dir + "/io_v1";
+  std::vector<char> expected(region_size, 'a');
+  {
+    Privateer privateer(blocks_path.c_str(), version_0.c_str(), region_size);
+    privateer.resize(region_size);
+    memset(privateer.data(), 'a', region_size);
+    privateer.msync();
+  }
+
+  {
+    Privateer privateer(version_0.c_str(), false);
+    // The end of block 0, all of block 1 (stored whole) and the start of block 2
+    write_expected(privateer, expected, BLOCK_SIZE - 50, BLOCK_SIZE + 100, 'b');
+    // Within block 2, not page-aligned
+    write_expected(privateer, expected, 2*BLOCK_SIZE + 100, 3*sysconf(_SC_PAGE_SIZE), 'c');
+    // Across the bound of blocks 2 and 3
+    write_expected(privateer, expected, 3*BLOCK_SIZE - 1000, 6000, 'd');
+
+    // Uncommitted: pages changed by partial writes are read from memory, the rest from the block files
+    assert(memcmp(privateer.data(), expected.data(), region_size) == 0);
+    assert(read_matches(privateer, expected, 0, region_size));
+    assert(read_matches(privateer, expected, BLOCK_SIZE - 100, 200));
+    assert(read_matches(privateer, expected, 3*BLOCK_SIZE - 1500, 7000));
+
+    privateer.msync();
+    assert(memcmp(privateer.data(), expected.data(), region_size) == 0);
+    assert(read_matches(privateer, expected, 0, region_size));
+    assert(read_matches(privateer, expected, 2*BLOCK_SIZE + 50, 200));
+
+    std::vector<char> buffer(2*BLOCK_SIZE);
+    assert(!privateer.read(region_size - BLOCK_SIZE, buffer.data(), 2*BLOCK_SIZE));
+    assert(!privateer.write(region_size - BLOCK_SIZE, buffer.data(), 2*BLOCK_SIZE));
+  }
+  {
+    Privateer privateer(version_0.c_str(), true);
+    assert(memcmp(privateer.data(), expected.data(), region_size) == 0);
+    assert(read_matches(privateer, expected, 0, region_size));
+    char value = 'x';
+    assert(!privateer.write(0, &value, 1));
+  }
+
+  // Explicit tracking: partial writes mark the pages they change
+  {
+    Privateer privateer(version_0.c_str(), version_1.c_str());
+    privateer.set_dirty_tracking(DirtyTracking::EXPLICIT);
+    write_expected(privateer, expected, 3*BLOCK_SIZE + 10, 100, 'e');
+    write_expected(privateer, expected, 0, BLOCK_SIZE, 'f');
+    assert(read_matches(privateer, expected, 0, region_size));
+    privateer.msync();
+  }
+  {
+    Privateer privateer(version_1.c_str(), true);
+    assert(memcmp(privateer.data(), expected.data(), region_size) == 0);
+    assert(read_matches(privateer, expected, 0, region_size));
+  }
+  std::cout << "Region I/O verified" << std::endl;
+  return 0;
+}
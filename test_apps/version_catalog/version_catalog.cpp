@@ -0,0 +1,135 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <cassert>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include "../../include/privateer/privateer.hpp"
+
+// Catalog versions: snapshots stored as delta or checkpoint records read back as written, drops,
+// versions opened from the catalog into new catalog versions, and plain paths containing '@'
+
+static const size_t BLOCK_SIZE = 1024*1024;
+static const size_t NUM_BLOCKS = 8;
+static const size_t VALUES_PER_BLOCK = BLOCK_SIZE / sizeof(size_t);
+
+// The region's content is one value per block, expected[block]
+static void fill_block(size_t* data, size_t block_index, size_t value){
+  for (size_t i = 0; i < VALUES_PER_BLOCK; i++){
+    data[block_index*VALUES_PER_BLOCK + i] = value;
+  }
+}
+
+static void verify_version(std::string version, const std::vector<size_t> &expected){
+  Privateer privateer(version.c_str(), true);
+  size_t* data = (size_t*) privateer.data();
+  for (size_t block_index = 0; block_index < NUM_BLOCKS; block_index++){
+    for (size_t i = 0; i < VALUES_PER_BLOCK; i++){
+      assert(data[block_index*VALUES_PER_BLOCK + i] == expected[block_index]);
+    }
+  }
+}
+
+int main(int argc, char** argv){
+  if (argc != 2){
+    std::cerr << "Usage: " << argv[0] << " <base_test_dir>" << std::endl;
+    return -1;
+  }
+  std::string base_test_dir(argv[1]);
+  int mkdir_stat = mkdir(base_test_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  if (mkdir_stat != 0){
+    std::cerr << "Error creating directory at: " << base_test_dir << std::endl;
+    return -1;
+  }
+  setenv("PRIVATEER_FILE_GRANULARITY", std::to_string(BLOCK_SIZE).c_str(), 1);
+  setenv("PRIVATEER_CATALOG_CHECKPOINT_INTERVAL", "3", 1);
+  std::string blocks_path = base_test_dir + "/catalog_blocks";
+  std::string main_version = blocks_path + "@main";
+  std::map<std::string, std::vector<size_t>> expected;
+
+  {
+    Privateer privateer(blocks_path.c_str(), main_version.c_str(), NUM_BLOCKS*BLOCK_SIZE);
+    privateer.resize(NUM_BLOCKS*BLOCK_SIZE);
+    size_t* data = (size_t*) privateer.data();
+    std::vector<size_t> content(NUM_BLOCKS);
+    for (size_t block_index = 0; block_index < NUM_BLOCKS; block_index++){
+      content[block_index] = block_index + 1;
+      fill_block(data, block_index, content[block_index]);
+    }
+    privateer.msync();
+    // A chain of snapshots, each changing one block
+    for (size_t k = 1; k <= 6; k++){
+      content[k % NUM_BLOCKS] = 100*k;
+      fill_block(data, k % NUM_BLOCKS, content[k % NUM_BLOCKS]);
+      std::string snapshot_version = blocks_path + "@snapshot_" + std::to_string(k);
+      assert(privateer.snapshot(snapshot_version.c_str()));
+      expected[snapshot_version] = content;
+    }
+    // The region is still main, which keeps its own records
+    content[7] = 7000;
+    fill_block(data, 7, content[7]);
+    privateer.msync();
+    expected[main_version] = content;
+  }
+  for (auto &version : expected){
+    verify_version(version.first, version.second);
+  }
+
+  // Snapshots are stored as deltas, with a full record at least every checkpoint interval
+  VersionCatalog catalog(blocks_path);
+  size_t num_deltas = 0;
+  for (auto &version : expected){
+    std::string catalog_blocks_path, name;
+    assert(VersionCatalog::parse_reference(version.first, catalog_blocks_path, name));
+    CatalogRecord record;
+    uint64_t record_offset;
+    assert(catalog.find(name, record, record_offset));
+    assert(record.chain_depth < 3);
+    assert(record.type == VersionCatalog::RECORD_FULL || record.chain_depth > 0);
+    num_deltas += (record.type == VersionCatalog::RECORD_DELTA);
+  }
+  assert(num_deltas > 0);
+
+  // Dropped versions are gone, the others are unaffected
+  assert(catalog.drop("snapshot_2"));
+  CatalogRecord dropped_record;
+  uint64_t dropped_record_offset;
+  assert(!catalog.find("snapshot_2", dropped_record, dropped_record_offset));
+  std::map<std::string, uint64_t> live_versions = catalog.live_versions();
+  assert(live_versions.size() == expected.size() - 1 && live_versions.count("snapshot_2") == 0);
+  expected.erase(blocks_path + "@snapshot_2");
+
+  // A version opened from the catalog continues as a new catalog version
+  std::string branch_version = blocks_path + "@branch";
+  {
+    Privateer privateer((blocks_path + "@snapshot_3").c_str(), branch_version.c_str());
+    size_t* data = (size_t*) privateer.data();
+    std::vector<size_t> content = expected[blocks_path + "@snapshot_3"];
+    content[0] = 424242;
+    fill_block(data, 0, content[0]);
+    privateer.msync();
+    expected[branch_version] = content;
+  }
+
+  // A new metadata directory whose name contains '@' is not mistaken for a catalog reference
+  std::string plain_version = base_test_dir + "/run@1";
+  std::string plain_blocks_path, plain_name;
+  assert(!VersionCatalog::parse_reference(plain_version, plain_blocks_path, plain_name));
+  {
+    Privateer privateer(branch_version.c_str(), true);
+    assert(privateer.snapshot(plain_version.c_str()));
+  }
+  assert(utility::directory_exists(plain_version.c_str()));
+  expected[plain_version] = expected[branch_version];
+  for (auto &version : expected){
+    verify_version(version.first, version.second);
+  }
+  std::cout << "Version catalog verified" << std::endl;
+  return 0;
+}
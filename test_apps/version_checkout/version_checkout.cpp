@@ -0,0 +1,129 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <cassert>
+#include <iostream>
+#include <string>
+#include "../../include/privateer/privateer.hpp"
+
+// In-place checkout between versions of a store, discarding uncommitted changes, and read-only
+// regions following a version committed by another region, as a directory and as a catalog version
+
+static const size_t BLOCK_SIZE = 1024*1024;
+static const size_t NUM_BLOCKS = 8;
+static const size_t VALUES_PER_BLOCK = BLOCK_SIZE / sizeof(size_t);
+
+static void fill(size_t* data, size_t num_blocks, size_t value){
+  for (size_t i = 0; i < num_blocks*VALUES_PER_BLOCK; i++){
+    data[i] = value + i / VALUES_PER_BLOCK;
+  }
+}
+
+static bool check(size_t* data, size_t num_blocks, size_t value){
+  for (size_t i = 0; i < num_blocks*VALUES_PER_BLOCK; i++){
+    if (data[i] != value + i / VALUES_PER_BLOCK){
+      return false;
+    }
+  }
+  return true;
+}
+
+// A writable region commits new content while a read-only region of the same version refreshes
+static void follow_version(std::string blocks_path, std::string version){
+  Privateer writer(blocks_path.c_str(), version.c_str(), NUM_BLOCKS*BLOCK_SIZE);
+  writer.resize(NUM_BLOCKS*BLOCK_SIZE);
+  size_t* data = (size_t*) writer.data();
+  fill(data, NUM_BLOCKS, 10);
+  writer.msync();
+
+  Privateer reader(version.c_str(), true);
+  assert(check((size_t*) reader.data(), NUM_BLOCKS, 10));
+  assert(reader.refresh() && check((size_t*) reader.data(), NUM_BLOCKS, 10));
+  for (size_t round = 1; round <= 3; round++){
+    fill(data + (round % NUM_BLOCKS)*VALUES_PER_BLOCK, 1, 1000*round);
+    writer.msync();
+    assert(reader.refresh());
+    assert(check((size_t*) reader.data() + (round % NUM_BLOCKS)*VALUES_PER_BLOCK, 1, 1000*round));
+    assert(check((size_t*) reader.data(), 1, 10));
+  }
+  // Writable regions checkout instead
+  assert(!writer.refresh());
+}
+
+int main(int argc, char** argv){
+  if (argc != 2){
+    std::cerr << "Usage: " << argv[0] << " <base_test_dir>" << std::endl;
+    return -1;
+  }
+  std::string base_test_dir(argv[1]);
+  int mkdir_stat = mkdir(base_test_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  if (mkdir_stat != 0){
+    std::cerr << "Error creating directory at: " << base_test_dir << std::endl;
+    return -1;
+  }
+  setenv("PRIVATEER_FILE_GRANULARITY", std::to_string(BLOCK_SIZE).c_str(), 1);
+  std::string blocks_path = base_test_dir + "/checkout_blocks";
+  std::string version_a = base_test_dir + "/checkout_a";
+  std::string version_b = base_test_dir + "/checkout_b";
+
+  {
+    Privateer privateer(blocks_path.c_str(), version_a.c_str(), NUM_BLOCKS*BLOCK_SIZE);
+    privateer.resize(NUM_BLOCKS / 2 * BLOCK_SIZE);
+    size_t* data = (size_t*) privateer.data();
+    fill(data, NUM_BLOCKS / 2, 1);
+    privateer.msync();
+    // Version b is larger and differs in its first block
+    privateer.resize(NUM_BLOCKS*BLOCK_SIZE);
+    fill(data, NUM_BLOCKS, 1);
+    fill(data, 1, 100);
+    assert(privateer.snapshot(version_b.c_str()));
+
+    // Uncommitted changes are discarded, blocks beyond the version's size are unmapped
+    fill(data + VALUES_PER_BLOCK, 1, 5000);
+    assert(privateer.checkout(version_a.c_str()));
+    assert(privateer.current_size() == NUM_BLOCKS / 2 * BLOCK_SIZE);
+    assert(check(data, NUM_BLOCKS / 2, 1));
+    assert(privateer.checkout(version_b.c_str()));
+    assert(privateer.current_size() == NUM_BLOCKS*BLOCK_SIZE);
+    assert(check(data, 1, 100));
+    assert(check(data + VALUES_PER_BLOCK, NUM_BLOCKS - 1, 2));
+
+    // Commits continue as the checked out version
+    fill(data, 1, 7000);
+    privateer.msync();
+  }
+  {
+    Privateer privateer(version_b.c_str(), true);
+    assert(check((size_t*) privateer.data(), 1, 7000));
+    assert(check((size_t*) privateer.data() + VALUES_PER_BLOCK, NUM_BLOCKS - 1, 2));
+  }
+  {
+    Privateer privateer(version_a.c_str(), true);
+    assert(privateer.current_size() == NUM_BLOCKS / 2 * BLOCK_SIZE);
+    assert(check((size_t*) privateer.data(), NUM_BLOCKS / 2, 1));
+  }
+
+  // Versions of another store are refused and leave the region unchanged
+  std::string other_version = base_test_dir + "/other_version";
+  {
+    Privateer other((base_test_dir + "/other_blocks").c_str(), other_version.c_str(), NUM_BLOCKS*BLOCK_SIZE);
+    other.resize(NUM_BLOCKS*BLOCK_SIZE);
+    fill((size_t*) other.data(), NUM_BLOCKS, 3);
+    other.msync();
+  }
+  {
+    Privateer privateer(version_a.c_str(), true);
+    assert(!privateer.checkout(other_version.c_str()));
+    assert(check((size_t*) privateer.data(), NUM_BLOCKS / 2, 1));
+  }
+
+  follow_version(base_test_dir + "/live_blocks", base_test_dir + "/live_version");
+  std::string catalog_blocks_path = base_test_dir + "/live_catalog_blocks";
+  follow_version(catalog_blocks_path, catalog_blocks_path + "@live");
+  std::cout << "Version checkout verified" << std::endl;
+  return 0;
+}
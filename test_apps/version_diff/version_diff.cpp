@@ -0,0 +1,98 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../../include/privateer/privateer.hpp"
+
+// Version diffs: changed pages within blocks, ranges merged across block boundaries, growth,
+// blocks skipped by recipe, and missing blocks reported as errors
+
+static const size_t BLOCK_SIZE = 1024*1024;
+static const size_t NUM_BLOCKS = 8;
+
+int main(int argc, char** argv){
+  if (argc != 2){
+    std::cerr << "Usage: " << argv[0] << " <base_test_dir>" << std::endl;
+    return -1;
+  }
+  std::string base_test_dir(argv[1]);
+  int mkdir_stat = mkdir(base_test_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  if (mkdir_stat != 0){
+    std::cerr << "Error creating directory at: " << base_test_dir << std::endl;
+    return -1;
+  }
+  setenv("PRIVATEER_FILE_GRANULARITY", std::to_string(BLOCK_SIZE).c_str(), 1);
+  size_t pagesize = sysconf(_SC_PAGE_SIZE);
+  std::string blocks_path = base_test_dir + "/diff_blocks";
+  std::string version_0 = base_test_dir + "/diff_v0";
+  std::string version_1 = base_test_dir + "/diff_v1";
+
+  {
+    Privateer privateer(blocks_path.c_str(), version_0.c_str(), (NUM_BLOCKS + 1)*BLOCK_SIZE);
+    privateer.resize(NUM_BLOCKS*BLOCK_SIZE);
+    char* data = (char*) privateer.data();
+    for (size_t i = 0; i < NUM_BLOCKS*BLOCK_SIZE; i++){
+      data[i] = (char) (i % 251);
+    }
+    privateer.msync();
+
+    // One page inside block 1, the last page of block 2 with the first page of block 3,
+    // and one more block
+    data[BLOCK_SIZE + 3*pagesize + 17] ^= 1;
+    data[3*BLOCK_SIZE - 1] ^= 1;
+    data[3*BLOCK_SIZE] ^= 1;
+    privateer.resize((NUM_BLOCKS + 1)*BLOCK_SIZE);
+    memset(data + NUM_BLOCKS*BLOCK_SIZE, 1, BLOCK_SIZE);
+    assert(privateer.snapshot(version_1.c_str()));
+  }
+
+  std::vector<ChangedRange> expected = {
+    {BLOCK_SIZE + 3*pagesize, pagesize},
+    {3*BLOCK_SIZE - pagesize, 2*pagesize},
+    {NUM_BLOCKS*BLOCK_SIZE, BLOCK_SIZE}
+  };
+  std::vector<ChangedRange> ranges = Privateer::diff(version_0, version_1);
+  assert(ranges.size() == expected.size());
+  for (size_t i = 0; i < ranges.size(); i++){
+    assert(ranges[i].offset == expected[i].offset && ranges[i].length == expected[i].length);
+  }
+
+  // Blocks 0, 4, 5, 6 and 7 have equal digests and are never read
+  VersionDiff version_diff(version_0, version_1);
+  assert(version_diff.valid());
+  ChangedRange range;
+  size_t num_ranges = 0;
+  while (version_diff.next(range)){
+    num_ranges++;
+  }
+  assert(num_ranges == expected.size());
+  assert(version_diff.unchanged_by_recipe() == 5*BLOCK_SIZE);
+
+  assert(Privateer::diff(version_1, version_1).empty());
+  VersionDiff missing_diff(version_0, base_test_dir + "/missing_version");
+  assert(!missing_diff.valid() && !missing_diff.next(range));
+
+  // A missing block is a read error, not a change
+  {
+    VersionLayout layout;
+    BlockTable* table = load_version_digests(version_1, layout);
+    assert(table != nullptr);
+    BlockStorage block_storage(blocks_path);
+    std::string block_path = block_storage.get_block_path(1, utility::digest_to_hex(table->get(1)));
+    delete table;
+    assert(remove(block_path.c_str()) == 0);
+  }
+  VersionDiff broken_diff(version_0, version_1);
+  assert(broken_diff.valid() && !broken_diff.next(range) && broken_diff.failed());
+  std::cout << "Version diff verified" << std::endl;
+  return 0;
+}
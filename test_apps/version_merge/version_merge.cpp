@@ -0,0 +1,153 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include "../../include/privateer/privateer.hpp"
+
+// Three-way merges: blocks changed on one side, blocks changed on both sides in different pages,
+// pages changed on both sides under each conflict policy, and a size changed on one side
+
+// Larger than the chunks conflicting blocks are merged in
+static const size_t BLOCK_SIZE = 4*1024*1024;
+static const size_t NUM_BLOCKS = 8;
+static const size_t MAX_BLOCKS = 10;
+
+struct Edit
+{
+  size_t offset;
+  size_t length;
+  char value;
+};
+
+static std::map<std::string, std::vector<char>> expected;
+
+// Creates version to from version from with the edits applied, grown to size if larger
+static void derive(std::string from, std::string to, const std::vector<Edit> &edits, size_t size){
+  std::vector<char> content = expected[from];
+  Privateer privateer(from.c_str(), to.c_str());
+  if (size > content.size()){
+    privateer.resize(size);
+    content.resize(size, 0);
+  }
+  char* data = (char*) privateer.data();
+  for (const Edit &edit : edits){
+    memset(data + edit.offset, edit.value, edit.length);
+    memset(content.data() + edit.offset, edit.value, edit.length);
+  }
+  privateer.msync();
+  expected[to] = content;
+}
+
+static bool matches(std::string version, const std::vector<char> &content){
+  Privateer privateer(version.c_str(), true);
+  return privateer.current_size() == content.size() && memcmp(privateer.data(), content.data(), content.size()) == 0;
+}
+
+int main(int argc, char** argv){
+  if (argc != 2){
+    std::cerr << "Usage: " << argv[0] << " <base_test_dir>" << std::endl;
+    return -1;
+  }
+  std::string base_test_dir(argv[1]);
+  int mkdir_stat = mkdir(base_test_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  if (mkdir_stat != 0){
+    std::cerr << "Error creating directory at: " << base_test_dir << std::endl;
+    return -1;
+  }
+  setenv("PRIVATEER_FILE_GRANULARITY", std::to_string(BLOCK_SIZE).c_str(), 1);
+  size_t pagesize = sysconf(_SC_PAGE_SIZE);
+  std::string blocks_path = base_test_dir + "/merge_blocks";
+  std::string base = base_test_dir + "/merge_base";
+  std::string version_a = base_test_dir + "/merge_a";
+  std::string version_b = base_test_dir + "/merge_b";
+
+  {
+    Privateer privateer(blocks_path.c_str(), base.c_str(), MAX_BLOCKS*BLOCK_SIZE);
+    privateer.resize(NUM_BLOCKS*BLOCK_SIZE);
+    char* data = (char*) privateer.data();
+    std::vector<char> content(NUM_BLOCKS*BLOCK_SIZE);
+    for (size_t i = 0; i < content.size(); i++){
+      content[i] = data[i] = (char) (i % 251);
+    }
+    privateer.msync();
+    expected[base] = content;
+  }
+  // a changes block 1, b changes block 2 and grows; both change block 3 in different pages and
+  // block 5 identically
+  derive(base, version_a, {{BLOCK_SIZE, pagesize, 'a'}, {3*BLOCK_SIZE, pagesize, 'a'}, {5*BLOCK_SIZE, BLOCK_SIZE, 's'}}, 0);
+  derive(base, version_b, {{2*BLOCK_SIZE, pagesize, 'b'}, {3*BLOCK_SIZE + BLOCK_SIZE / 2, pagesize, 'b'},
+                           {5*BLOCK_SIZE, BLOCK_SIZE, 's'}, {NUM_BLOCKS*BLOCK_SIZE, BLOCK_SIZE, 'g'}}, (NUM_BLOCKS + 1)*BLOCK_SIZE);
+
+  // Clean merge: only block 3 is merged page by page, no policy is needed
+  std::vector<char> clean = expected[version_b];
+  memset(clean.data() + BLOCK_SIZE, 'a', pagesize);
+  memset(clean.data() + 3*BLOCK_SIZE, 'a', pagesize);
+  std::string clean_merge = base_test_dir + "/merge_clean";
+  {
+    VersionMerge version_merge(base, version_a, version_b);
+    assert(version_merge.valid());
+    assert(version_merge.merge(clean_merge, VersionMerge::fail));
+    assert(version_merge.num_page_merged_blocks() == 1 && version_merge.num_conflicts() == 0);
+  }
+  assert(matches(clean_merge, clean));
+  assert(Privateer::merge(base, version_a, version_b, blocks_path + "@merged", VersionMerge::fail));
+  assert(matches(blocks_path + "@merged", clean));
+
+  // Changes on one side only are taken without reading any block
+  std::string one_sided_merge = base_test_dir + "/merge_one_sided";
+  {
+    VersionMerge version_merge(base, base, version_a);
+    assert(version_merge.merge(one_sided_merge, VersionMerge::fail));
+    assert(version_merge.num_page_merged_blocks() == 0);
+  }
+  assert(matches(one_sided_merge, expected[version_a]));
+
+  // The same page of block 6 changed on both sides
+  std::string conflict_a = base_test_dir + "/merge_conflict_a";
+  std::string conflict_b = base_test_dir + "/merge_conflict_b";
+  derive(version_a, conflict_a, {{6*BLOCK_SIZE + BLOCK_SIZE / 2 + pagesize, pagesize, 'x'}}, 0);
+  derive(version_b, conflict_b, {{6*BLOCK_SIZE + BLOCK_SIZE / 2 + pagesize, pagesize, 'y'}}, 0);
+  std::string failed_merge = base_test_dir + "/merge_failed";
+  {
+    VersionMerge version_merge(base, conflict_a, conflict_b);
+    assert(!version_merge.merge(failed_merge, VersionMerge::fail));
+    // The conflicting block does not count as merged
+    assert(version_merge.num_conflicts() == 1 && version_merge.num_page_merged_blocks() < 2);
+  }
+  assert(!utility::directory_exists(failed_merge.c_str()));
+  for (auto &entry : std::filesystem::recursive_directory_iterator(blocks_path)){
+    assert(entry.path().filename().string().find("_temp_") == std::string::npos);
+  }
+  for (char side : {'x', 'y'}){
+    std::string resolved_merge = base_test_dir + "/merge_prefer_" + side;
+    VersionMerge version_merge(base, conflict_a, conflict_b);
+    assert(version_merge.merge(resolved_merge, side == 'x' ? VersionMerge::prefer_a : VersionMerge::prefer_b));
+    assert(version_merge.num_page_merged_blocks() == 2 && version_merge.num_conflicts() == 1);
+    std::vector<char> resolved = clean;
+    memset(resolved.data() + 6*BLOCK_SIZE + BLOCK_SIZE / 2 + pagesize, side, pagesize);
+    assert(matches(resolved_merge, resolved));
+  }
+
+  // Versions of another store are not merged
+  std::string other_version = base_test_dir + "/other_version";
+  {
+    Privateer other((base_test_dir + "/other_blocks").c_str(), other_version.c_str(), NUM_BLOCKS*BLOCK_SIZE);
+    other.resize(NUM_BLOCKS*BLOCK_SIZE);
+    other.msync();
+  }
+  VersionMerge invalid_merge(base, version_a, other_version);
+  assert(!invalid_merge.valid() && !invalid_merge.merge(base_test_dir + "/merge_invalid", VersionMerge::prefer_a));
+  std::cout << "Version merge verified" << std::endl;
+  return 0;
+}
@@ -0,0 +1,134 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../../include/privateer/privateer.hpp"
+#include "../../include/privateer/version_reader.hpp"
+
+// Version reader: non-empty blocks are returned in order and empty ones skipped, blocks with the
+// same content within the read-ahead window are read once into the same buffer, caller buffers
+// replace pooled ones, and a missing block file stops the pass and is reported by failed()
+
+static const size_t BLOCK_SIZE = 1024*1024;
+static const size_t NUM_BLOCKS = 8;
+// Blocks 2 and 7 are never written, blocks 0, 1 and 5 and blocks 3 and 6 share their content
+static const char BLOCK_VALUES[NUM_BLOCKS] = {'a', 'a', 0, 'b', 'c', 'a', 'b', 0};
+
+static bool check_block(const VersionBlock &block){
+  if (block.offset != block.block_index*BLOCK_SIZE || block.length != BLOCK_SIZE){
+    return false;
+  }
+  for (size_t i = 0; i < block.length; i++){
+    if (block.data[i] != BLOCK_VALUES[block.block_index]){
+      return false;
+    }
+  }
+  return true;
+}
+
+// Reads a whole version, returns the blocks in the order they were returned
+static std::vector<VersionBlock> read_version(VersionReader &reader){
+  std::vector<VersionBlock> blocks;
+  VersionBlock block;
+  while (reader.next(block)){
+    assert(check_block(block));
+    blocks.push_back(block);
+  }
+  return blocks;
+}
+
+int main(int argc, char** argv){
+  if (argc != 2){
+    std::cerr << "Usage: " << argv[0] << " <base_test_dir>" << std::endl;
+    return -1;
+  }
+  std::string base_test_dir(argv[1]);
+  int mkdir_stat = mkdir(base_test_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  if (mkdir_stat != 0){
+    std::cerr << "Error creating directory at: " << base_test_dir << std::endl;
+    return -1;
+  }
+  setenv("PRIVATEER_FILE_GRANULARITY", std::to_string(BLOCK_SIZE).c_str(), 1);
+  std::string blocks_path = base_test_dir + "/reader_blocks";
+  std::string version_0 = base_test_dir + "/reader_v0";
+  {
+    Privateer privateer(blocks_path.c_str(), version_0.c_str(), NUM_BLOCKS*BLOCK_SIZE);
+    privateer.resize(NUM_BLOCKS*BLOCK_SIZE);
+    char* data = (char*) privateer.data();
+    for (size_t block_index = 0; block_index < NUM_BLOCKS; block_index++){
+      if (BLOCK_VALUES[block_index] != 0){
+        memset(data + block_index*BLOCK_SIZE, BLOCK_VALUES[block_index], BLOCK_SIZE);
+      }
+    }
+    privateer.msync();
+  }
+  std::vector<size_t> non_empty_blocks = {0, 1, 3, 4, 5, 6};
+
+  // Pooled buffers: the window holds all blocks, blocks sharing their content share one buffer
+  {
+    VersionReader reader(version_0, 4);
+    assert(reader.valid());
+    assert(reader.size() == NUM_BLOCKS*BLOCK_SIZE && reader.block_granularity() == BLOCK_SIZE);
+    std::vector<VersionBlock> blocks = read_version(reader);
+    assert(!reader.failed() && blocks.size() == non_empty_blocks.size());
+    for (size_t i = 0; i < blocks.size(); i++){
+      assert(blocks[i].block_index == non_empty_blocks[i]);
+    }
+    assert(blocks[1].data == blocks[0].data && blocks[4].data == blocks[0].data);
+    assert(blocks[5].data == blocks[2].data);
+    assert(blocks[2].data != blocks[0].data && blocks[3].data != blocks[0].data && blocks[3].data != blocks[2].data);
+  }
+
+  // Caller buffers: two buffers, the window holds blocks 0 to 3 at first
+  {
+    size_t pagesize = sysconf(_SC_PAGE_SIZE);
+    std::vector<char*> buffers = {(char*) aligned_alloc(pagesize, BLOCK_SIZE), (char*) aligned_alloc(pagesize, BLOCK_SIZE)};
+    {
+      VersionReader reader(version_0, 4);
+      assert(reader.set_buffers(buffers));
+      std::vector<VersionBlock> blocks = read_version(reader);
+      assert(!reader.failed() && blocks.size() == non_empty_blocks.size());
+      for (size_t i = 0; i < blocks.size(); i++){
+        assert(blocks[i].block_index == non_empty_blocks[i]);
+        assert(blocks[i].data == buffers[0] || blocks[i].data == buffers[1]);
+      }
+      assert(blocks[1].data == blocks[0].data);
+      // Too late once reading started
+      assert(!reader.set_buffers(buffers));
+    }
+    free(buffers[0]);
+    free(buffers[1]);
+  }
+
+  // Missing block file: blocks before it are returned, then the pass stops
+  {
+    VersionLayout layout;
+    BlockTable* table = load_version_digests(version_0, layout);
+    assert(table != nullptr);
+    BlockStorage block_storage(blocks_path);
+    std::string hash = utility::digest_to_hex(table->get(4));
+    delete table;
+    assert(unlink((block_storage.get_blocks_subdirectory(4) + "/" + hash).c_str()) == 0);
+
+    VersionReader reader(version_0, 4);
+    std::vector<VersionBlock> blocks = read_version(reader);
+    assert(reader.failed() && blocks.size() == 3 && blocks.back().block_index == 3);
+    VersionBlock block;
+    assert(!reader.next(block));
+  }
+
+  VersionReader missing(base_test_dir + "/missing_version");
+  VersionBlock block;
+  assert(!missing.valid() && !missing.next(block));
+  std::cout << "Version reader verified" << std::endl;
+  return 0;
+}
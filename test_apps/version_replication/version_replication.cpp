@@ -0,0 +1,107 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include "../../include/privateer/privateer.hpp"
+#include "../../include/privateer/version_replication.hpp"
+
+// Replication to another store: only missing blocks are copied, replicated versions read as the
+// originals, and statistics count the blocks actually published, also when replication fails
+
+static const size_t BLOCK_SIZE = 1024*1024;
+static const size_t NUM_BLOCKS = 8;
+
+static size_t count_blocks(std::string blocks_path){
+  size_t num_blocks = 0;
+  BlockStorage(blocks_path).for_each_block([&](size_t, const std::string &){ num_blocks++; });
+  return num_blocks;
+}
+
+static bool same_data(std::string version, std::string replica){
+  Privateer original(version.c_str(), true);
+  Privateer replicated(replica.c_str(), true);
+  return original.current_size() == replicated.current_size()
+         && memcmp(original.data(), replicated.data(), original.current_size()) == 0;
+}
+
+// Derives version to from version from, changing the first byte of the given blocks
+static void derive(std::string from, std::string to, std::initializer_list<size_t> changed_blocks){
+  Privateer privateer(from.c_str(), to.c_str());
+  char* data = (char*) privateer.data();
+  for (size_t block_index : changed_blocks){
+    data[block_index*BLOCK_SIZE] += 1;
+  }
+  privateer.msync();
+}
+
+int main(int argc, char** argv){
+  if (argc != 2){
+    std::cerr << "Usage: " << argv[0] << " <base_test_dir>" << std::endl;
+    return -1;
+  }
+  std::string base_test_dir(argv[1]);
+  int mkdir_stat = mkdir(base_test_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  if (mkdir_stat != 0){
+    std::cerr << "Error creating directory at: " << base_test_dir << std::endl;
+    return -1;
+  }
+  setenv("PRIVATEER_FILE_GRANULARITY", std::to_string(BLOCK_SIZE).c_str(), 1);
+  std::string blocks_path = base_test_dir + "/source_blocks";
+  std::string target_blocks_path = base_test_dir + "/target_blocks";
+  std::string version_0 = base_test_dir + "/version_0";
+  std::string version_1 = base_test_dir + "/version_1";
+  std::string version_2 = base_test_dir + "/version_2";
+
+  // Block 7 stays empty
+  {
+    Privateer privateer(blocks_path.c_str(), version_0.c_str(), NUM_BLOCKS*BLOCK_SIZE);
+    privateer.resize(NUM_BLOCKS*BLOCK_SIZE);
+    char* data = (char*) privateer.data();
+    for (size_t i = 0; i < (NUM_BLOCKS - 1)*BLOCK_SIZE; i++){
+      data[i] = (char) (i % 253 + 1);
+    }
+    privateer.msync();
+  }
+  derive(version_0, version_1, {1, 2});
+
+  ReplicationStats stats;
+  std::string replica_0 = base_test_dir + "/replica_0";
+  assert(VersionReplication::replicate(version_0, target_blocks_path, replica_0, 4, &stats));
+  assert(stats.num_blocks == 7 && stats.num_blocks_present == 0 && stats.num_blocks_copied == 7);
+  assert(stats.bytes_copied == 7*BLOCK_SIZE && count_blocks(target_blocks_path) == 7);
+  assert(same_data(version_0, replica_0));
+
+  // Only the changed blocks of the next version move, into the target's catalog
+  std::string replica_1 = target_blocks_path + "@replica_1";
+  assert(VersionReplication::replicate(version_1, target_blocks_path, replica_1, 4, &stats));
+  assert(stats.num_blocks == 7 && stats.num_blocks_present == 5 && stats.num_blocks_copied == 2);
+  assert(same_data(version_1, replica_1));
+  assert(VersionReplication::replicate(version_1, target_blocks_path, base_test_dir + "/replica_1_again", 4, &stats));
+  assert(stats.num_blocks_copied == 0 && stats.bytes_copied == 0);
+
+  // A block missing from the source fails the replication, which publishes no version and
+  // counts only the blocks it did copy
+  derive(version_1, version_2, {3, 4, 5});
+  VersionLayout layout;
+  BlockTable* table = load_version_digests(version_2, layout);
+  assert(table != nullptr);
+  BlockStorage block_storage(blocks_path);
+  std::string block_path = block_storage.get_blocks_subdirectory(4) + "/" + utility::digest_to_hex(table->get(4));
+  delete table;
+  assert(remove(block_path.c_str()) == 0);
+  std::string replica_2 = base_test_dir + "/replica_2";
+  size_t num_target_blocks = count_blocks(target_blocks_path);
+  assert(!VersionReplication::replicate(version_2, target_blocks_path, replica_2, 1, &stats));
+  assert(stats.num_blocks_copied < 3 && stats.bytes_copied == stats.num_blocks_copied*BLOCK_SIZE);
+  assert(count_blocks(target_blocks_path) == num_target_blocks + stats.num_blocks_copied);
+  assert(!utility::directory_exists(replica_2.c_str()));
+  std::cout << "Version replication verified" << std::endl;
+  return 0;
+}
@@ -0,0 +1,143 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cassert>
+#include <cerrno>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../../include/privateer/privateer.hpp"
+#include "../../include/privateer/version_set.hpp"
+
+// Version sets: blocks shared by versions are opened once, partial maps leave the other blocks
+// inaccessible, and versions are added and mapped from many threads at once
+
+static const size_t BLOCK_SIZE = 1024*1024;
+static const size_t NUM_BLOCKS = 8;
+static const size_t NUM_VERSIONS = 4;
+static const size_t NUM_THREADS = 8;
+
+// Version v changes block v, every block holds a distinct value
+static size_t block_value(size_t version, size_t block_index){
+  return (block_index != 0 && block_index == version) ? 1000*version + block_index : block_index + 1;
+}
+
+static bool check_version(const size_t* data, size_t version){
+  for (size_t block_index = 0; block_index < NUM_BLOCKS; block_index++){
+    for (size_t i = 0; i < BLOCK_SIZE / sizeof(size_t); i += 512){
+      if (data[block_index*BLOCK_SIZE / sizeof(size_t) + i] != block_value(version, block_index)){
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Whether a byte can be read, without faulting: the kernel copies it into a pipe or fails with EFAULT
+static bool is_readable(const void* addr){
+  int pipe_fds[2];
+  assert(pipe(pipe_fds) == 0);
+  bool readable = ::write(pipe_fds[1], addr, 1) == 1;
+  assert(readable || errno == EFAULT);
+  ::close(pipe_fds[0]);
+  ::close(pipe_fds[1]);
+  return readable;
+}
+
+int main(int argc, char** argv){
+  if (argc != 2){
+    std::cerr << "Usage: " << argv[0] << " <base_test_dir>" << std::endl;
+    return -1;
+  }
+  std::string base_test_dir(argv[1]);
+  int mkdir_stat = mkdir(base_test_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  if (mkdir_stat != 0){
+    std::cerr << "Error creating directory at: " << base_test_dir << std::endl;
+    return -1;
+  }
+  setenv("PRIVATEER_FILE_GRANULARITY", std::to_string(BLOCK_SIZE).c_str(), 1);
+  std::string blocks_path = base_test_dir + "/set_blocks";
+  std::vector<std::string> version_paths;
+  for (size_t v = 0; v < NUM_VERSIONS; v++){
+    version_paths.push_back(base_test_dir + "/set_version_" + std::to_string(v));
+  }
+  {
+    Privateer privateer(blocks_path.c_str(), version_paths[0].c_str(), NUM_BLOCKS*BLOCK_SIZE);
+    privateer.resize(NUM_BLOCKS*BLOCK_SIZE);
+    size_t* data = (size_t*) privateer.data();
+    for (size_t v = 0; v < NUM_VERSIONS; v++){
+      for (size_t i = 0; i < NUM_BLOCKS*BLOCK_SIZE / sizeof(size_t); i++){
+        data[i] = block_value(v, i / (BLOCK_SIZE / sizeof(size_t)));
+      }
+      if (v == 0){
+        privateer.msync();
+      }
+      else{
+        assert(privateer.snapshot(version_paths[v].c_str()));
+      }
+    }
+  }
+
+  // Each version adds one block to those of version 0, shared blocks are opened once
+  {
+    VersionSet version_set(blocks_path);
+    for (size_t v = 0; v < NUM_VERSIONS; v++){
+      assert(version_set.add(version_paths[v]) == (int) v);
+    }
+    assert(version_set.size() == NUM_VERSIONS && version_set.num_opened_blocks() == 0);
+    for (size_t v = 0; v < NUM_VERSIONS; v++){
+      assert(check_version((size_t*) version_set.data(v), v));
+    }
+    assert(version_set.num_opened_blocks() == NUM_BLOCKS + NUM_VERSIONS - 1);
+    assert(version_set.add(base_test_dir + "/missing_version") == -1);
+  }
+
+  // Mapping a range maps only the blocks it overlaps
+  {
+    VersionSet version_set(blocks_path);
+    int v = version_set.add(version_paths[1]);
+    char* data = (char*) version_set.map(v, 2*BLOCK_SIZE + 100, BLOCK_SIZE);
+    assert(data != nullptr && version_set.num_opened_blocks() == 2);
+    for (size_t block_index = 0; block_index < NUM_BLOCKS; block_index++){
+      assert(is_readable(data + block_index*BLOCK_SIZE) == (block_index == 2 || block_index == 3));
+    }
+    assert(((size_t*) data)[2*BLOCK_SIZE / sizeof(size_t)] == block_value(1, 2));
+    assert(check_version((size_t*) version_set.data(v), 1));
+  }
+
+  // Threads add versions and map them (the same versions from several threads) concurrently
+  {
+    VersionSet version_set(blocks_path);
+    std::vector<char> checked(NUM_THREADS, false);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < NUM_THREADS; t++){
+      threads.emplace_back([&, t](){
+        size_t v = t % NUM_VERSIONS;
+        int index = version_set.add(version_paths[v]);
+        bool correct = index != -1 && check_version((size_t*) version_set.data(index), v);
+        // Versions added by the other threads, possibly still being mapped by them
+        for (size_t k = 0; k < version_set.size(); k++){
+          size_t other = std::stoul(version_set.version_path(k).substr(version_set.version_path(k).rfind('_') + 1));
+          correct = correct && check_version((size_t*) version_set.data(k), other);
+        }
+        checked[t] = correct;
+      });
+    }
+    for (std::thread &thread : threads){
+      thread.join();
+    }
+    for (size_t t = 0; t < NUM_THREADS; t++){
+      assert(checked[t]);
+    }
+    assert(version_set.size() == NUM_THREADS);
+    assert(version_set.num_opened_blocks() == NUM_BLOCKS + NUM_VERSIONS - 1);
+  }
+  std::cout << "Version set verified" << std::endl;
+  return 0;
+}
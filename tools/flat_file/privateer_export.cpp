@@ -0,0 +1,24 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#include <omp.h>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include "../../include/privateer/flat_file.hpp"
+
+int main(int argc, char** argv){
+  if (argc < 3 || argc > 4){
+    std::cerr << "Usage: " << argv[0] << " <version_metadata_path> <file> [length bytes, e.g. the imported file's size]" << std::endl;
+    return -1;
+  }
+  size_t length = (argc == 4) ? std::stoull(argv[3]) : 0;
+  double start = omp_get_wtime();
+  if (!FlatFile::export_file(argv[1], argv[2], length)){
+    return -1;
+  }
+  std::cout << "Exported " << argv[1] << " to " << argv[2] << " in " << omp_get_wtime() - start << " s" << std::endl;
+  return 0;
+}
@@ -0,0 +1,24 @@
+// Copyright 2021 Lawrence Livermore National Security, LLC and other Privateer Project Developers.
+// See the top-level LICENSE file for details.
+//
+// SPDX-License-Identifier: MIT
+
+#include <omp.h>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include "../../include/privateer/flat_file.hpp"
+
+int main(int argc, char** argv){
+  if (argc < 4 || argc > 5){
+    std::cerr << "Usage: " << argv[0] << " <file> <blocks_dir_path> <version_metadata_path> [capacity bytes]" << std::endl;
+    return -1;
+  }
+  size_t capacity = (argc == 5) ? std::stoull(argv[4]) : 0;
+  double start = omp_get_wtime();
+  if (!FlatFile::import_file(argv[1], argv[2], argv[3], capacity)){
+    return -1;
+  }
+  std::cout << "Imported " << argv[1] << " as " << argv[3] << " in " << omp_get_wtime() - start << " s" << std::endl;
+  return 0;
+}